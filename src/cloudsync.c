@@ -23,6 +23,7 @@
 #include "vtab.h"
 #include "utils.h"
 #include "dbutils.h"
+#include "khash.h"
 
 #ifndef CLOUDSYNC_OMIT_NETWORK
 #include "network.h"
@@ -67,11 +68,30 @@ SQLITE_EXTENSION_INIT1
 
 #define CLOUDSYNC_DEFAULT_ALGO                  "cls"
 #define CLOUDSYNC_INIT_NTABLES                  128
+#define CLOUDSYNC_TABLES_SCAN_MAX               8       // up to this many tables a linear scan is cheaper than hashing the name
 #define CLOUDSYNC_VALUE_NOTSET                  -1
 #define CLOUDSYNC_MIN_DB_VERSION                0
+#define CLOUDSYNC_GOS_MAX_COLUMNS               255     // grow-only set rows are encoded like a primary key (at most 255 values)
 
 #define CLOUDSYNC_PAYLOAD_MINBUF_SIZE           512*1024
-#define CLOUDSYNC_PAYLOAD_VERSION               1
+#define CLOUDSYNC_PAYLOAD_VERSION_1             1
+#define CLOUDSYNC_PAYLOAD_VERSION_2             2
+#define CLOUDSYNC_PAYLOAD_VERSION               CLOUDSYNC_PAYLOAD_VERSION_1    // v2 is opt-in (payload_version), peers without it cannot decode it
+#define CLOUDSYNC_PAYLOAD_NCOLS                 9
+#define CLOUDSYNC_PAYLOAD_ROW_NEWPK             0x01    // v2 row flag: table and primary key follow
+#define CLOUDSYNC_PAYLOAD_ROW_SAMESITE          0x02    // v2 row flag: site_id is the same as the previous row
+#define CLOUDSYNC_PAYLOAD_CODEC_LZ4             0       // LZ4 block (also used by payloads created before the codec byte existed)
+#define CLOUDSYNC_PAYLOAD_CODEC_NONE            1       // rows are stored uncompressed
+#define CLOUDSYNC_PAYLOAD_CODEC_LZ4_BLOCKS      2       // block table followed by independently compressed LZ4 blocks
+#define CLOUDSYNC_PAYLOAD_BLOCK_SIZE            1024*1024   // uncompressed size of each block of a large payload
+#define CLOUDSYNC_PAYLOAD_THREADS               4       // default number of threads used to (de)compress blocks
+#define CLOUDSYNC_PAYLOAD_STREAM_SIZE           16*1024*1024    // block payloads larger than this are decompressed while applied
+#define CLOUDSYNC_PAYLOAD_PARALLEL_MIN_ROWS     1024    // smaller payloads are not worth the read-only connections of the parallel apply
+#define CLOUDSYNC_PAYLOAD_CHECKPOINT_ROWS       4096    // minimum number of rows between two apply checkpoints (smaller payloads have none)
+#define CLOUDSYNC_APPLY_STATS_MAX_ERRORS        16      // errors kept by the apply statistics (the following ones are only counted)
+#define CLOUDSYNC_PAYLOAD_SAMPLE_WINDOWS        8       // compressibility check: number of sampled windows
+#define CLOUDSYNC_PAYLOAD_SAMPLE_SIZE           4096    // compressibility check: size of each window
+#define CLOUDSYNC_PAYLOAD_SAMPLE_RATIO          0.97    // compressibility check: skip compression above this ratio
 #define CLOUDSYNC_PAYLOAD_SIGNATURE             'CLSY'
 #define CLOUDSYNC_PAYLOAD_APPLY_CALLBACK_KEY    "cloudsync_payload_apply_callback"
 
@@ -93,6 +113,23 @@ typedef enum {
     CLOUDSYNC_PK_INDEX_SEQ          = 8
 } CLOUDSYNC_PK_INDEX;
 
+typedef enum {
+    CLOUDSYNC_APPLY_BATCH_VERSION   = 0,        // one savepoint for each db_version (default)
+    CLOUDSYNC_APPLY_BATCH_ROWS      = 1,        // release the savepoint at the first db_version boundary after N rows
+    CLOUDSYNC_APPLY_BATCH_MS        = 2,        // release the savepoint at the first db_version boundary after N ms
+    CLOUDSYNC_APPLY_BATCH_PAYLOAD   = 3         // one savepoint for the whole payload
+} CLOUDSYNC_APPLY_BATCH;
+
+typedef enum {
+    CLOUDSYNC_MERGE_SKIP            = 0,        // the local state wins on the clocks (or on the value)
+    CLOUDSYNC_MERGE_EQUAL           = 1,        // the local state already contains the change
+    CLOUDSYNC_MERGE_DELETE          = 2,        // delete the row
+    CLOUDSYNC_MERGE_SENTINEL        = 3,        // sentinel-only insert (new or resurrected row without a column update)
+    CLOUDSYNC_MERGE_RESURRECT       = 4,        // sentinel insert followed by the column update
+    CLOUDSYNC_MERGE_INSERT          = 5,        // column insert or update
+    CLOUDSYNC_MERGE_DEFER           = 6         // parallel apply: not resolved by the workers, merged by the writer
+} CLOUDSYNC_MERGE_ACTION;
+
 typedef enum {
     CLOUDSYNC_STMT_VALUE_ERROR      = -1,
     CLOUDSYNC_STMT_VALUE_UNCHANGED  = 0,
@@ -110,6 +147,35 @@ typedef struct {
 
 // MARK: -
 
+// table and column names are compared case-insensitively (like SQLite does), so the hash must fold ASCII case too
+static inline khint_t cloudsync_name_hash (const char *s) {
+    khint_t h = 2166136261u;
+    for (; *s; ++s) {
+        unsigned char c = (unsigned char)*s;
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        h = (h ^ c) * 16777619u;
+    }
+    return h;
+}
+
+#define cloudsync_name_equal(a, b)       (strcasecmp((a), (b)) == 0)
+KHASH_INIT(COLUMN_INDEX, kh_cstr_t, int, 1, cloudsync_name_hash, cloudsync_name_equal)
+
+// binary keys (site_ids, column bitmasks)
+typedef struct {
+    const char      *data;
+    int             len;
+} cloudsync_blob_key;
+
+static inline khint_t cloudsync_blob_hash (cloudsync_blob_key key) {
+    khint_t h = 2166136261u;
+    for (int i=0; i<key.len; ++i) h = (h ^ (unsigned char)key.data[i]) * 16777619u;
+    return h;
+}
+
+#define cloudsync_blob_equal(a, b)       ((a).len == (b).len && memcmp((a).data, (b).data, (size_t)(a).len) == 0)
+KHASH_INIT(MERGE_STMTS, cloudsync_blob_key, sqlite3_stmt *, 1, cloudsync_blob_hash, cloudsync_blob_equal)
+
 typedef struct {
     table_algo      algo;                           // CRDT algoritm associated to the table
     char            *name;                          // table name
@@ -117,14 +183,20 @@ typedef struct {
     sqlite3_stmt    **col_merge_stmt;               // array of merge insert stmt (indexed by col_name)
     sqlite3_stmt    **col_value_stmt;               // array of column value stmt (indexed by col_name)
     int             *col_id;                        // array of column id
+    char            *col_affinity;                  // array of column affinity (allocated only with value_digest)
+    khash_t(COLUMN_INDEX) *col_index;               // column name -> index in col_name (case-insensitive)
+    khash_t(MERGE_STMTS) *merge_stmts;              // multi-column merge UPSERTs, prepared on demand (keyed by column bitmask)
     int             ncols;                          // number of non primary key cols
     int             npks;                           // number of primary key cols
     bool            enabled;                        // flag to check if a table is enabled or disabled
+    bool            value_digest;                   // the meta table stores a digest of the merged values (see merge_did_cid_win)
+    bool            capture_hook;                   // local changes are captured by cloudsync_preupdate_hook instead of the AFTER triggers
     #if !CLOUDSYNC_DISABLE_ROWIDONLY_TABLES
     bool            rowid_only;                     // a table with no primary keys other than the implicit rowid
     #endif
     
     char            **pk_name;                      // array of primary key names
+    int             *pk_id;                         // array of primary key cids, in the order of the encoded pk (only with capture_hook)
     
     // precompiled statements
     sqlite3_stmt    *meta_pkexists_stmt;            // check if a primary key already exist in the augmented table
@@ -139,10 +211,13 @@ typedef struct {
     sqlite3_stmt    *meta_zero_clock_stmt;
     sqlite3_stmt    *meta_col_version_stmt;
     sqlite3_stmt    *meta_site_id_stmt;
+    sqlite3_stmt    *meta_clock_stmt;               // load the clocks of all the columns of a pk
+    sqlite3_stmt    *meta_digest_stmt;              // digest of the last merged value of a column (only with value_digest)
     
     sqlite3_stmt    *real_col_values_stmt;          // retrieve all column values based on pk
     sqlite3_stmt    *real_merge_delete_stmt;
     sqlite3_stmt    *real_merge_sentinel_stmt;
+    sqlite3_stmt    *real_merge_gos_stmt;           // insert a whole grow-only set row (NULL if its columns are tracked one by one)
     
 } cloudsync_table_context;
 
@@ -160,8 +235,44 @@ struct cloudsync_pk_decode_bind_context {
     int64_t         site_id_len;
     int64_t         cl;
     int64_t         seq;
+    int             col_value_type;
+    int64_t         col_value_ival;
+    double          col_value_dval;
+    char            *col_value_pval;
 };
 
+// statistics of the last payload apply, returned by cloudsync_last_apply_stats()
+typedef struct {
+    char            *name;
+    int64_t         name_len;
+    int64_t         counters[CLOUDSYNC_APPLY_STATS_FAILED + 1];     // indexed by CLOUDSYNC_APPLY_STATS_COLUMN
+} cloudsync_apply_table_stats;
+
+typedef struct {
+    cloudsync_apply_table_stats *tables;
+    int             ntables;
+    int             nalloc;
+    int             last;                       // index of the last table found (consecutive changes usually share it)
+    int64_t         totals[CLOUDSYNC_APPLY_STATS_FAILED + 1];
+    uint64_t        decompress_us;
+    uint64_t        decode_us;
+    uint64_t        merge_us;
+    int64_t         savepoints;
+    int64_t         nerrors;
+    char            *errors[CLOUDSYNC_APPLY_STATS_MAX_ERRORS];
+} cloudsync_apply_stats;
+
+KHASH_INIT(TABLE_REGISTRY, kh_cstr_t, cloudsync_table_context *, 1, cloudsync_name_hash, cloudsync_name_equal)
+
+// site_id -> ordinal in cloudsync_site_id, used by merge_set_winner_clock
+typedef struct {
+    sqlite3_int64   ord;
+    sqlite3_int64   txn;                        // transaction that learned the ordinal (CLOUDSYNC_SITEID_CONFIRMED once it is known to be committed)
+} cloudsync_siteid_entry;
+
+#define CLOUDSYNC_SITEID_CONFIRMED              -1
+KHASH_INIT(SITEID_CACHE, cloudsync_blob_key, cloudsync_siteid_entry, 1, cloudsync_blob_hash, cloudsync_blob_equal)
+
 struct cloudsync_context {
     sqlite3_context *sqlite_ctx;
     
@@ -170,6 +281,16 @@ struct cloudsync_context {
     int             insync;
     int             debug;
     bool            merge_equal_values;
+    int             payload_version;            // payload format used by the encoder
+    int             payload_codec;              // payload compression codec used by the encoder
+    int             payload_acceleration;       // LZ4 acceleration factor (1 is the default, higher is faster with a lower ratio)
+    bool            payload_sample_check;       // skip compression when a sample of the payload does not compress
+    int             payload_threads;            // max number of threads used to (de)compress large payloads
+    bool            payload_locality;           // decode the whole payload first and apply it in a single savepoint
+    bool            payload_parallel;           // resolve the conflicts of large payloads on read-only connections (two-phase apply)
+    int             payload_batch;              // transaction batching policy used by the apply (CLOUDSYNC_APPLY_BATCH)
+    int             payload_batch_size;         // rows or milliseconds, for the ROWS and MS policies
+    cloudsync_apply_stats apply_stats;          // statistics of the last apply
     bool            temp_bool;                  // temporary value used in callback
     void            *aux_data;
     
@@ -179,6 +300,7 @@ struct cloudsync_context {
     sqlite3_stmt    *data_version_stmt;
     sqlite3_stmt    *db_version_stmt;
     sqlite3_stmt    *getset_siteid_stmt;
+    sqlite3_stmt    *get_siteid_stmt;
     int             data_version;
     int             schema_version;
     uint64_t        schema_hash;
@@ -194,19 +316,104 @@ struct cloudsync_context {
     
     // augmented tables are stored in-memory so we do not need to retrieve information about col names and cid
     // from the disk each time a write statement is performed
-    // we do also not need to use an hash map here because for few tables the direct in-memory comparison with table name is faster
+    // lookups by name go through a case-insensitive hash index (with a one-entry cache for the last hit)
+    // so that the cost does not grow with the number of synced tables
     cloudsync_table_context **tables;
     int tables_count;
     int tables_alloc;
+    khash_t(TABLE_REGISTRY) *tables_index;
+    cloudsync_table_context *tables_last;
+    int             capture_hook_tables;        // number of tables captured by the pre-update hook (the hook returns at once if 0)
+    bool            capture_failed;             // the pre-update hook could not write the metadata of a change, the commit is refused
+    sqlite3         *capture_db;                // connection where the pre-update hook has been installed (NULL until a table opts in)
+    
+    // ordinals of the remote site_ids, so that the winner clocks do not need to write cloudsync_site_id for each change
+    // an ordinal learned inside a transaction could be undone by a ROLLBACK TO (which has no hook), so it is trusted
+    // without a read only after the transaction that learned it is over
+    khash_t(SITEID_CACHE) *siteid_cache;
+    sqlite3_int64   siteid_txn;                 // incremented at each commit and rollback
+    
+    // columns already marked by local writes in the current transaction, so that touching them again does not rewrite the metadata
 };
 
 typedef struct {
+    char        **keys;                         // entries (owned copies in the encoder, pointers inside the payload in the decoder)
+    int64_t     *lens;
+    int         count;
+    int         alloc;
+    int         *slots;                         // open addressing hash (entry index + 1), used only by the encoder
+    int         nslots;
+    bool        owned;
+    bool        copy;                           // decoder only: keep a copy of the keys (streamed payloads)
+} cloudsync_payload_dict;
+
+typedef struct {
+    size_t      bused;
+    uint64_t    nrows;
+    int64_t     last_tbl;
+    size_t      last_pk_offset;
+    size_t      last_pk_len;
+    int64_t     last_site;
+    int64_t     last_db_version;
+    int64_t     last_seq;
+    int         ntbl;
+    int         ncol;
+    int         nsite;
+} cloudsync_payload_encoder_mark;
+
+struct cloudsync_data_payload {
     char        *buffer;
     size_t      balloc;
     size_t      bused;
     uint64_t    nrows;
     uint16_t    ncols;
-} cloudsync_data_payload;
+    uint8_t     version;
+    uint8_t     codec;
+    int         acceleration;
+    bool        sample_check;
+    int         threads;
+    
+    // v2 encoder state (per-payload dictionaries and values of the previous row)
+    cloudsync_payload_dict  tbl_dict;
+    cloudsync_payload_dict  col_dict;
+    cloudsync_payload_dict  site_dict;
+    int64_t     last_tbl;
+    size_t      last_pk_offset;
+    size_t      last_pk_len;
+    int64_t     last_site;
+    int64_t     last_db_version;
+    int64_t     last_seq;
+    
+    // chunked payloads: state of the frame before the first row of the current db_version
+    cloudsync_payload_encoder_mark  chunk_mark;
+    int64_t     chunk_db_version;
+};
+
+typedef struct {
+    cloudsync_payload_dict  tbl_dict;
+    cloudsync_payload_dict  col_dict;
+    cloudsync_payload_dict  site_dict;
+    int64_t     tbl;
+    char        *pk;
+    int64_t     pk_len;
+    int64_t     site;
+    int64_t     db_version;
+    int64_t     seq;
+    char        *pk_copy;                       // streamed payloads: copy of the last pk (the window moves)
+    size_t      pk_alloc;
+} cloudsync_payload_decoder;
+
+typedef struct {
+    int64_t     tbl;
+    char        *pk;
+    int64_t     pk_len;
+    int64_t     site;
+    int64_t     db_version;
+    int64_t     seq;
+    int         ntbl;
+    int         ncol;
+    int         nsite;
+} cloudsync_payload_decoder_mark;
 
 #ifdef _MSC_VER
     #pragma pack(push, 1) // For MSVC: pack struct with 1-byte alignment
@@ -223,7 +430,8 @@ typedef struct PACKED {
     uint16_t    ncols;
     uint32_t    nrows;
     uint64_t    schema_hash;
-    uint8_t     unused[6];        // padding to ensure the struct is exactly 32 bytes
+    uint8_t     codec;             // compression codec (meaningful only if expanded_size is not 0)
+    uint8_t     unused[5];         // padding to ensure the struct is exactly 32 bytes
 } cloudsync_payload_header;
 
 typedef struct {
@@ -240,14 +448,30 @@ typedef struct {
 
 #if CLOUDSYNC_UNITTEST
 bool force_uncompressed_blob = false;
+bool force_vtab_apply = false;
+bool force_stream_apply = false;
+uint32_t force_apply_interrupt_row = 0;
 #define CHECK_FORCE_UNCOMPRESSED_BUFFER()   if (force_uncompressed_blob) use_uncompressed_buffer = true
+#define CHECK_FORCE_VTAB_APPLY()            if (force_vtab_apply) use_vtab = true
+#define CHECK_FORCE_STREAM_APPLY()          if (force_stream_apply) streamed = true
+#define CHECK_FORCE_APPLY_INTERRUPT()       if (force_apply_interrupt_row && i == force_apply_interrupt_row) {rc = SQLITE_INTERRUPT; decode_error = true; break;}
 #else
 #define CHECK_FORCE_UNCOMPRESSED_BUFFER()
+#define CHECK_FORCE_VTAB_APPLY()
+#define CHECK_FORCE_STREAM_APPLY()
+#define CHECK_FORCE_APPLY_INTERRUPT()
 #endif
 
 int db_version_rebuild_stmt (sqlite3 *db, cloudsync_context *data);
 int cloudsync_load_siteid (sqlite3 *db, cloudsync_context *data);
 int local_mark_insert_or_update_meta (sqlite3 *db, cloudsync_table_context *table, const char *pk, size_t pklen, const char *col_name, sqlite3_int64 db_version, int seq);
+int local_mark_insert (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen);
+int local_mark_delete (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen);
+int local_mark_update (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table, sqlite3_value **new_values, sqlite3_value **old_values);
+#if CLOUDSYNC_PREUPDATE_CAPTURE
+void cloudsync_preupdate_hook (void *ctx, sqlite3 *db, int op, const char *zdb, const char *zname, sqlite3_int64 key1, sqlite3_int64 key2);
+void cloudsync_preupdate_hook_install (sqlite3 *db, cloudsync_context *data);
+#endif
 
 // MARK: - STMT Utils -
 
@@ -343,6 +567,14 @@ int stmts_add_tocontext (sqlite3 *db, cloudsync_context *data) {
         DEBUG_SQL("getset_siteid_stmt: %s", sql);
     }
     
+    if (data->get_siteid_stmt == NULL) {
+        const char *sql = "SELECT rowid FROM cloudsync_site_id WHERE site_id=?;";
+        int rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &data->get_siteid_stmt, NULL);
+        DEBUG_STMT("get_siteid_stmt %p", data->get_siteid_stmt);
+        if (rc != SQLITE_OK) return rc;
+        DEBUG_SQL("get_siteid_stmt: %s", sql);
+    }
+    
     return db_version_rebuild_stmt(db, data);
 }
 
@@ -590,6 +822,89 @@ char *table_build_mergeinsert_sql (sqlite3 *db, cloudsync_table_context *table,
     return query;
 }
 
+char *table_build_mergeinsert_multi_sql (sqlite3 *db, cloudsync_table_context *table, const uint64_t *mask) {
+    // INSERT INTO customers (pk1, pk2, age, name) VALUES (?, ?, ?, ?) ON CONFLICT DO UPDATE SET age=excluded.age, name=excluded.name;
+    // the columns are listed in the order of their index in col_name
+    char *pk_clause = NULL;
+    char *pk_binding = NULL;
+    char *col_clause = NULL;
+    char *val_clause = NULL;
+    char *set_clause = NULL;
+    char *sql = NULL;
+    
+    #if !CLOUDSYNC_DISABLE_ROWIDONLY_TABLES
+    if (table->rowid_only) {
+        pk_clause = cloudsync_string_dup("rowid", false);
+        pk_binding = cloudsync_string_dup("?", false);
+    } else
+    #endif
+    {
+        sql = cloudsync_memory_mprintf("SELECT group_concat('\"' || format('%%w', name) || '\"') FROM (SELECT name FROM pragma_table_info('%q') WHERE pk>0 ORDER BY pk);", table->name);
+        if (!sql) return NULL;
+        pk_clause = dbutils_text_select(db, sql);
+        cloudsync_memory_free(sql);
+        pk_binding = cloudsync_memory_mprintf("%s", "?");
+        for (int i=1; pk_binding && i<table->npks; ++i) {
+            char *tmp = cloudsync_memory_mprintf("%s,?", pk_binding);
+            cloudsync_memory_free(pk_binding);
+            pk_binding = tmp;
+        }
+    }
+    sql = NULL;
+    if (!pk_clause || !pk_binding) goto cleanup;
+    
+    for (int i=0; i<table->ncols; ++i) {
+        if ((mask[i / 64] & (1ULL << (i % 64))) == 0) continue;
+        
+        const char *name = table->col_name[i];
+        char *col = (col_clause) ? cloudsync_memory_mprintf("%s,\"%w\"", col_clause, name) : cloudsync_memory_mprintf("\"%w\"", name);
+        char *val = (val_clause) ? cloudsync_memory_mprintf("%s,?", val_clause) : cloudsync_memory_mprintf("?");
+        char *set = (set_clause) ? cloudsync_memory_mprintf("%s,\"%w\"=excluded.\"%w\"", set_clause, name, name) : cloudsync_memory_mprintf("\"%w\"=excluded.\"%w\"", name, name);
+        if (col_clause) cloudsync_memory_free(col_clause);
+        if (val_clause) cloudsync_memory_free(val_clause);
+        if (set_clause) cloudsync_memory_free(set_clause);
+        col_clause = col;
+        val_clause = val;
+        set_clause = set;
+        if (!col_clause || !val_clause || !set_clause) goto cleanup;
+    }
+    if (!col_clause) goto cleanup;
+    
+    sql = cloudsync_memory_mprintf("INSERT INTO \"%w\" (%s,%s) VALUES (%s,%s) ON CONFLICT DO UPDATE SET %s;", table->name, pk_clause, col_clause, pk_binding, val_clause, set_clause);
+    
+cleanup:
+    if (pk_clause) cloudsync_memory_free(pk_clause);
+    if (pk_binding) cloudsync_memory_free(pk_binding);
+    if (col_clause) cloudsync_memory_free(col_clause);
+    if (val_clause) cloudsync_memory_free(val_clause);
+    if (set_clause) cloudsync_memory_free(set_clause);
+    return sql;
+}
+
+char *table_build_mergeinsert_gos_sql (sqlite3 *db, cloudsync_table_context *table) {
+    // INSERT OR IGNORE INTO events (pk1, pk2, col1, col2) VALUES (?, ?, ?, ?);
+    // primary keys first, then the other columns in cid order (the order of col_name)
+    char *singlequote_escaped_table_name = cloudsync_memory_mprintf("%q", table->name);
+    char *sql = NULL;
+    
+    #if !CLOUDSYNC_DISABLE_ROWIDONLY_TABLES
+    if (table->rowid_only) {
+        sql = cloudsync_memory_mprintf("SELECT 'INSERT OR IGNORE INTO \"%w\" (rowid,' || group_concat('\"' || format('%%w', name) || '\"') || ') VALUES (?,' || group_concat('?') || ');' FROM (SELECT name FROM pragma_table_info('%q') WHERE pk=0 ORDER BY cid);", singlequote_escaped_table_name, table->name);
+    } else
+    #endif
+    {
+        sql = cloudsync_memory_mprintf("SELECT 'INSERT OR IGNORE INTO \"%w\" (' || group_concat('\"' || format('%%w', name) || '\"') || ') VALUES (' || group_concat('?') || ');' FROM (SELECT name FROM pragma_table_info('%q') ORDER BY pk=0, pk, cid);", singlequote_escaped_table_name, table->name);
+    }
+    
+    cloudsync_memory_free(singlequote_escaped_table_name);
+    if (!sql) return NULL;
+    
+    char *query = dbutils_text_select(db, sql);
+    cloudsync_memory_free(sql);
+    
+    return query;
+}
+
 char *table_build_value_sql (sqlite3 *db, cloudsync_table_context *table, const char *colname) {
     char *colnamequote = dbutils_is_star_table(colname) ? "" : "\"";
 
@@ -635,6 +950,15 @@ void table_free (cloudsync_table_context *table) {
     DEBUG_DBFUNCTION("table_free %s", (table) ? (table->name) : "NULL");
     if (!table) return;
     
+    if (table->col_index) kh_destroy(COLUMN_INDEX, table->col_index);
+    if (table->merge_stmts) {
+        for (khiter_t k = kh_begin(table->merge_stmts); k != kh_end(table->merge_stmts); ++k) {
+            if (!kh_exist(table->merge_stmts, k)) continue;
+            cloudsync_memory_free((void *)kh_key(table->merge_stmts, k).data);
+            sqlite3_finalize(kh_value(table->merge_stmts, k));
+        }
+        kh_destroy(MERGE_STMTS, table->merge_stmts);
+    }
     if (table->ncols > 0) {
         if (table->col_name) {
             for (int i=0; i<table->ncols; ++i) {
@@ -657,9 +981,13 @@ void table_free (cloudsync_table_context *table) {
         if (table->col_id) {
             cloudsync_memory_free(table->col_id);
         }
+        if (table->col_affinity) {
+            cloudsync_memory_free(table->col_affinity);
+        }
     }
     
     if (table->pk_name) sqlite3_free_table(table->pk_name);
+    if (table->pk_id) cloudsync_memory_free(table->pk_id);
     if (table->name) cloudsync_memory_free(table->name);
     if (table->meta_pkexists_stmt) sqlite3_finalize(table->meta_pkexists_stmt);
     if (table->meta_sentinel_update_stmt) sqlite3_finalize(table->meta_sentinel_update_stmt);
@@ -673,10 +1001,13 @@ void table_free (cloudsync_table_context *table) {
     if (table->meta_zero_clock_stmt) sqlite3_finalize(table->meta_zero_clock_stmt);
     if (table->meta_col_version_stmt) sqlite3_finalize(table->meta_col_version_stmt);
     if (table->meta_site_id_stmt) sqlite3_finalize(table->meta_site_id_stmt);
+    if (table->meta_clock_stmt) sqlite3_finalize(table->meta_clock_stmt);
+    if (table->meta_digest_stmt) sqlite3_finalize(table->meta_digest_stmt);
     
     if (table->real_col_values_stmt) sqlite3_finalize(table->real_col_values_stmt);
     if (table->real_merge_delete_stmt) sqlite3_finalize(table->real_merge_delete_stmt);
     if (table->real_merge_sentinel_stmt) sqlite3_finalize(table->real_merge_sentinel_stmt);
+    if (table->real_merge_gos_stmt) sqlite3_finalize(table->real_merge_gos_stmt);
     
     cloudsync_memory_free(table);
 }
@@ -720,7 +1051,7 @@ int table_add_stmts (sqlite3 *db, cloudsync_table_context *table, int ncols) {
     if (rc != SQLITE_OK) goto cleanup;
 
     // precompile the insert/update local row statement
-    sql = cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, col_name, col_version, db_version, seq, site_id ) SELECT ?, ?, ?, ?, ?, 0 WHERE 1 ON CONFLICT DO UPDATE SET col_version = col_version + 1, db_version = ?, seq = ?, site_id = 0;", table->name);
+    sql = cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, col_name, col_version, db_version, seq, site_id ) SELECT ?, ?, ?, ?, ?, 0 WHERE 1 ON CONFLICT DO UPDATE SET col_version = col_version + 1, db_version = ?, seq = ?, site_id = 0%s;", table->name, (table->value_digest) ? ", value_digest = NULL" : "");
     if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
     DEBUG_SQL("meta_row_insert_update_stmt: %s", sql);
     
@@ -739,7 +1070,7 @@ int table_add_stmts (sqlite3 *db, cloudsync_table_context *table, int ncols) {
     
     // precompile the update rows from meta when pk changes
     // see https://github.com/sqliteai/sqlite-sync/blob/main/docs/PriKey.md for more details
-    sql = cloudsync_memory_mprintf("UPDATE OR REPLACE \"%w_cloudsync\" SET pk=?, db_version=?, col_version=1, seq=cloudsync_seq(), site_id=0 WHERE (pk=? AND col_name!='%s');", table->name, CLOUDSYNC_TOMBSTONE_VALUE);
+    sql = cloudsync_memory_mprintf("UPDATE OR REPLACE \"%w_cloudsync\" SET pk=?, db_version=?, col_version=1, seq=cloudsync_seq(), site_id=0%s WHERE (pk=? AND col_name!='%s');", table->name, (table->value_digest) ? ", value_digest=NULL" : "", CLOUDSYNC_TOMBSTONE_VALUE);
     if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
     DEBUG_SQL("meta_update_move_stmt: %s", sql);
     
@@ -757,7 +1088,10 @@ int table_add_stmts (sqlite3 *db, cloudsync_table_context *table, int ncols) {
     if (rc != SQLITE_OK) goto cleanup;
     
     // rowid of the last inserted/updated row in the meta table
-    sql = cloudsync_memory_mprintf("INSERT OR REPLACE INTO \"%w_cloudsync\" (pk, col_name, col_version, db_version, seq, site_id) VALUES (?, ?, ?, cloudsync_db_version_next(?), ?, ?) RETURNING ((db_version << 30) | seq);", table->name);
+    // an UPSERT updates the existing clock in place (INSERT OR REPLACE would delete and re-insert it)
+    // with value_digest the digest of the winning value is the 7th parameter
+    if (table->value_digest) sql = cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, col_name, col_version, db_version, seq, site_id, value_digest) VALUES (?, ?, ?, cloudsync_db_version_next(?), ?, ?, ?) ON CONFLICT DO UPDATE SET col_version=excluded.col_version, db_version=excluded.db_version, seq=excluded.seq, site_id=excluded.site_id, value_digest=excluded.value_digest RETURNING ((db_version << 30) | seq);", table->name);
+    else sql = cloudsync_memory_mprintf("INSERT INTO \"%w_cloudsync\" (pk, col_name, col_version, db_version, seq, site_id) VALUES (?, ?, ?, cloudsync_db_version_next(?), ?, ?) ON CONFLICT DO UPDATE SET col_version=excluded.col_version, db_version=excluded.db_version, seq=excluded.seq, site_id=excluded.site_id RETURNING ((db_version << 30) | seq);", table->name);
     if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
     DEBUG_SQL("meta_winner_clock_stmt: %s", sql);
     
@@ -774,7 +1108,7 @@ int table_add_stmts (sqlite3 *db, cloudsync_table_context *table, int ncols) {
     if (rc != SQLITE_OK) goto cleanup;
     
     // zero clock
-    sql = cloudsync_memory_mprintf("UPDATE \"%w_cloudsync\" SET col_version = 0, db_version = cloudsync_db_version_next(?) WHERE pk=? AND col_name!='%s';", table->name, CLOUDSYNC_TOMBSTONE_VALUE);
+    sql = cloudsync_memory_mprintf("UPDATE \"%w_cloudsync\" SET col_version = 0, db_version = cloudsync_db_version_next(?)%s WHERE pk=? AND col_name!='%s';", table->name, (table->value_digest) ? ", value_digest = NULL" : "", CLOUDSYNC_TOMBSTONE_VALUE);
     if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
     DEBUG_SQL("meta_zero_clock_stmt: %s", sql);
     
@@ -800,6 +1134,26 @@ int table_add_stmts (sqlite3 *db, cloudsync_table_context *table, int ncols) {
     cloudsync_memory_free(sql);
     if (rc != SQLITE_OK) goto cleanup;
     
+    // clocks of a pk (range scan on the primary key of the meta table)
+    sql = cloudsync_memory_mprintf("SELECT col_name, col_version FROM \"%w_cloudsync\" WHERE pk=?;", table->name);
+    if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+    DEBUG_SQL("meta_clock_stmt: %s", sql);
+    
+    rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_clock_stmt, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    // digest of the last merged value
+    if (table->value_digest) {
+        sql = cloudsync_memory_mprintf("SELECT value_digest FROM \"%w_cloudsync\" WHERE pk=? AND col_name=?;", table->name);
+        if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+        DEBUG_SQL("meta_digest_stmt: %s", sql);
+        
+        rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->meta_digest_stmt, NULL);
+        cloudsync_memory_free(sql);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
     // REAL TABLE statements
     
     // precompile the get column value statement
@@ -829,44 +1183,79 @@ int table_add_stmts (sqlite3 *db, cloudsync_table_context *table, int ncols) {
     cloudsync_memory_free(sql);
     if (rc != SQLITE_OK) goto cleanup;
     
+    // grow-only set rows are tracked by their sentinel only and merged as a whole
+    if (table->algo == table_algo_crdt_gos && ncols > 0 && ncols <= CLOUDSYNC_GOS_MAX_COLUMNS) {
+        sql = table_build_mergeinsert_gos_sql(db, table);
+        if (!sql) {rc = SQLITE_NOMEM; goto cleanup;}
+        DEBUG_SQL("real_merge_gos: %s", sql);
+        
+        rc = sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &table->real_merge_gos_stmt, NULL);
+        cloudsync_memory_free(sql);
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
 cleanup:
     if (rc != SQLITE_OK) printf("table_add_stmts error: %s\n", sqlite3_errmsg(db));
     return rc;
 }
 
-cloudsync_table_context *table_lookup (cloudsync_context *data, const char *table_name) {
-    DEBUG_DBFUNCTION("table_lookup %s", table_name);
+cloudsync_table_context *table_lookup_readonly (cloudsync_context *data, const char *table_name) {
+    DEBUG_DBFUNCTION("table_lookup_readonly %s", table_name);
     
-    for (int i=0; i<data->tables_count; ++i) {
-        const char *name = (data->tables[i]) ? data->tables[i]->name : NULL;
-        if ((name) && (strcasecmp(name, table_name) == 0)) {
-            return data->tables[i];
+    // it does not touch the context, so it can run on the payload resolver threads
+    // with a few tables the names are compared directly, the hash index pays off only with many of them
+    if (data->tables_count <= CLOUDSYNC_TABLES_SCAN_MAX || !data->tables_index) {
+        for (int i=0; i<data->tables_count; ++i) {
+            const char *name = (data->tables[i]) ? data->tables[i]->name : NULL;
+            if ((name) && (strcasecmp(name, table_name) == 0)) return data->tables[i];
         }
+        return NULL;
     }
     
-    return NULL;
+    khiter_t k = kh_get(TABLE_REGISTRY, data->tables_index, table_name);
+    return (k == kh_end(data->tables_index)) ? NULL : kh_value(data->tables_index, k);
+}
+
+cloudsync_table_context *table_lookup (cloudsync_context *data, const char *table_name) {
+    DEBUG_DBFUNCTION("table_lookup %s", table_name);
+    
+    // consecutive lookups usually target the same table (often by the name owned by the table context)
+    cloudsync_table_context *table = data->tables_last;
+    if ((table) && ((table->name == table_name) || (strcasecmp(table->name, table_name) == 0))) return table;
+    
+    table = table_lookup_readonly(data, table_name);
+    if (table) data->tables_last = table;
+    return table;
 }
 
 sqlite3_stmt *table_column_lookup (cloudsync_table_context *table, const char *col_name, bool is_merge, int *index) {
     DEBUG_DBFUNCTION("table_column_lookup %s", col_name);
     
-    for (int i=0; i<table->ncols; ++i) {
-        if (strcasecmp(table->col_name[i], col_name) == 0) {
-            if (index) *index = i;
-            return (is_merge) ? table->col_merge_stmt[i] : table->col_value_stmt[i];
-        }
+    khiter_t k = (table->col_index) ? kh_get(COLUMN_INDEX, table->col_index, col_name) : 0;
+    if (!table->col_index || k == kh_end(table->col_index)) {
+        if (index) *index = -1;
+        return NULL;
     }
     
-    if (index) *index = -1;
-    return NULL;
+    int i = kh_value(table->col_index, k);
+    if (index) *index = i;
+    return (is_merge) ? table->col_merge_stmt[i] : table->col_value_stmt[i];
 }
 
 int table_remove (cloudsync_context *data, const char *table_name) {
     DEBUG_DBFUNCTION("table_remove %s", table_name);
     
+    // the key is owned by the table context, so it must leave the index before the table is freed
+    if (data->tables_index) {
+        khiter_t k = kh_get(TABLE_REGISTRY, data->tables_index, table_name);
+        if (k != kh_end(data->tables_index)) kh_del(TABLE_REGISTRY, data->tables_index, k);
+    }
+    
     for (int i=0; i<data->tables_count; ++i) {
         const char *name = (data->tables[i]) ? data->tables[i]->name : NULL;
         if ((name) && (strcasecmp(name, table_name) == 0)) {
+            if (data->tables_last == data->tables[i]) data->tables_last = NULL;
+            if (data->tables[i]->capture_hook) data->capture_hook_tables -= 1;
             data->tables[i] = NULL;
             return i;
         }
@@ -874,6 +1263,16 @@ int table_remove (cloudsync_context *data, const char *table_name) {
     return -1;
 }
 
+// column affinity from the declared type, same rules of https://www.sqlite.org/datatype3.html#determination_of_column_affinity
+char table_column_affinity (const char *type) {
+    if (!type || !type[0]) return 'B';
+    if (sqlite3_strlike("%INT%", type, 0) == 0) return 'I';
+    if (sqlite3_strlike("%CHAR%", type, 0) == 0 || sqlite3_strlike("%CLOB%", type, 0) == 0 || sqlite3_strlike("%TEXT%", type, 0) == 0) return 'T';
+    if (sqlite3_strlike("%BLOB%", type, 0) == 0) return 'B';
+    if (sqlite3_strlike("%REAL%", type, 0) == 0 || sqlite3_strlike("%FLOA%", type, 0) == 0 || sqlite3_strlike("%DOUB%", type, 0) == 0) return 'R';
+    return 'N';
+}
+
 int table_add_to_context_cb (void *xdata, int ncols, char **values, char **names) {
     cloudsync_table_context *table = (cloudsync_table_context *)xdata;
     
@@ -881,11 +1280,12 @@ int table_add_to_context_cb (void *xdata, int ncols, char **values, char **names
     if (!db) return SQLITE_ERROR;
     
     int index = table->ncols;
-    for (int i=0; i<ncols; i+=2) {
+    for (int i=0; i<ncols; i+=3) {
         const char *name = values[i];
         int cid = (int)strtol(values[i+1], NULL, 0);
         
         table->col_id[index] = cid;
+        if (table->col_affinity) table->col_affinity[index] = table_column_affinity(values[i+2]);
         table->col_name[index] = cloudsync_string_dup(name, true);
         if (!table->col_name[index]) return 1;
         
@@ -912,6 +1312,29 @@ int table_add_to_context_cb (void *xdata, int ncols, char **values, char **names
     return 0;
 }
 
+void table_value_digest_setup (sqlite3 *db, cloudsync_table_context *table) {
+    char buffer[32] = {0};
+    char *value = dbutils_table_settings_get_value(db, table->name, "*", CLOUDSYNC_KEY_VALUE_DIGEST, buffer, sizeof(buffer));
+    bool enabled = (value && strtol(value, NULL, 0) != 0);
+    if (value && value != buffer) cloudsync_memory_free(value);
+    
+    char *sql = cloudsync_memory_mprintf("SELECT count(*) FROM pragma_table_info('%q_cloudsync') WHERE name='value_digest';", table->name);
+    if (!sql) return;
+    bool exists = (dbutils_int_select(db, sql) > 0);
+    cloudsync_memory_free(sql);
+    
+    // the column is dropped when the setting is disabled, so that enabling it again never finds outdated digests
+    if (enabled != exists) {
+        if (enabled) sql = cloudsync_memory_mprintf("ALTER TABLE \"%w_cloudsync\" ADD COLUMN value_digest BLOB;", table->name);
+        else sql = cloudsync_memory_mprintf("ALTER TABLE \"%w_cloudsync\" DROP COLUMN value_digest;", table->name);
+        if (sql && sqlite3_exec(db, sql, NULL, NULL, NULL) == SQLITE_OK) exists = enabled;
+        cloudsync_memory_free(sql);
+    }
+    
+    // the meta statements must keep an existing column up to date even if it could not be dropped
+    table->value_digest = exists;
+}
+
 bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo, const char *table_name) {
     DEBUG_DBFUNCTION("cloudsync_context_add_table %s", table_name);
     
@@ -922,7 +1345,7 @@ bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo
     // is there any space available?
     if (data->tables_alloc <= data->tables_count + 1) {
         // realloc tables
-        cloudsync_table_context **clone = (cloudsync_table_context **)cloudsync_memory_realloc(data->tables, sizeof(cloudsync_table_context) * data->tables_alloc + CLOUDSYNC_INIT_NTABLES);
+        cloudsync_table_context **clone = (cloudsync_table_context **)cloudsync_memory_realloc(data->tables, (uint64_t)(sizeof(cloudsync_table_context *) * (data->tables_alloc + CLOUDSYNC_INIT_NTABLES)));
         if (!clone) goto abort_add_table;
         
         // reset new entries
@@ -967,6 +1390,27 @@ bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo
         goto abort_add_table;
     }
     
+    // the meta statements depend on the value_digest column
+    table_value_digest_setup(db, table);
+    
+    // the pre-update hook reads the primary key values by column index
+    // in the same order of the group_concat of the triggers (the ORDER BY of an aggregate does not sort its input, so it is cid order)
+    if (dbutils_table_capture_hook(db, table_name)) {
+        table->pk_id = (int *)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(int) * table->npks));
+        if (!table->pk_id) goto abort_add_table;
+        
+        sql = cloudsync_memory_mprintf("SELECT cid FROM pragma_table_info('%q') WHERE pk>0 ORDER BY cid;", table_name);
+        if (!sql) goto abort_add_table;
+        sqlite3_stmt *vm = NULL;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &vm, NULL);
+        cloudsync_memory_free(sql);
+        int count = 0;
+        while (rc == SQLITE_OK && count < table->npks && sqlite3_step(vm) == SQLITE_ROW) table->pk_id[count++] = sqlite3_column_int(vm, 0);
+        sqlite3_finalize(vm);
+        if (count != table->npks) goto abort_add_table;
+        table->capture_hook = true;
+    }
+    
     int rc = table_add_stmts(db, table, (int)ncols);
     if (rc != SQLITE_OK) goto abort_add_table;
     
@@ -984,13 +1428,38 @@ bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo
         table->col_value_stmt = (sqlite3_stmt **)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(sqlite3_stmt *) * ncols));
         if (!table->col_value_stmt) goto abort_add_table;
         
-        sql = cloudsync_memory_mprintf("SELECT name, cid FROM pragma_table_info('%q') WHERE pk=0 ORDER BY cid;", table_name);
+        if (table->value_digest) {
+            table->col_affinity = (char *)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(char) * ncols));
+            if (!table->col_affinity) goto abort_add_table;
+        }
+        
+        sql = cloudsync_memory_mprintf("SELECT name, cid, type FROM pragma_table_info('%q') WHERE pk=0 ORDER BY cid;", table_name);
         if (!sql) goto abort_add_table;
         int rc = sqlite3_exec(db, sql, table_add_to_context_cb, (void *)table, NULL);
         cloudsync_memory_free(sql);
         if (rc == SQLITE_ABORT) goto abort_add_table;
+        
+        // index column names so that merge does not need to scan col_name for each change
+        table->col_index = kh_init(COLUMN_INDEX);
+        if (!table->col_index) goto abort_add_table;
+        for (int i=0; i<table->ncols; ++i) {
+            int absent = 0;
+            khiter_t k = kh_put(COLUMN_INDEX, table->col_index, table->col_name[i], &absent);
+            if (absent < 0) goto abort_add_table;
+            kh_value(table->col_index, k) = i;
+        }
     }
     
+    // register the table name in the lookup index
+    int absent = 0;
+    khiter_t k = kh_put(TABLE_REGISTRY, data->tables_index, table->name, &absent);
+    if (absent < 0) goto abort_add_table;
+    kh_value(data->tables_index, k) = table;
+    if (table->capture_hook) data->capture_hook_tables += 1;
+    #if CLOUDSYNC_PREUPDATE_CAPTURE
+    if (table->capture_hook) cloudsync_preupdate_hook_install(db, data);
+    #endif
+    
     // lookup the first free slot
     for (int i=0; i<data->tables_alloc; ++i) {
         if (data->tables[i] == NULL) {
@@ -1076,85 +1545,495 @@ cleanup:
     return rc;
 }
 
-int merge_set_winner_clock (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pk_len, const char *colname, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
+// MARK: - Merge Reader -
+
+// statements of a table prepared on a read-only connection with the SQL of the writer statements,
+// the parallel apply uses them to resolve conflicts from worker threads
+typedef struct {
+    cloudsync_table_context *table;
+    sqlite3_stmt            *clock_stmt;
+    sqlite3_stmt            *site_id_stmt;
+    sqlite3_stmt            **value_stmt;       // indexed like table->col_name, prepared on first use
+} cloudsync_merge_reader;
+
+void merge_reader_free (cloudsync_merge_reader *reader) {
+    if (reader->clock_stmt) sqlite3_finalize(reader->clock_stmt);
+    if (reader->site_id_stmt) sqlite3_finalize(reader->site_id_stmt);
+    if (reader->value_stmt) {
+        for (int i=0; i<reader->table->ncols; ++i) {
+            if (reader->value_stmt[i]) sqlite3_finalize(reader->value_stmt[i]);
+        }
+        cloudsync_memory_free(reader->value_stmt);
+    }
+    memset(reader, 0, sizeof(cloudsync_merge_reader));
+}
+
+int merge_reader_init (cloudsync_merge_reader *reader, sqlite3 *db, cloudsync_table_context *table) {
+    memset(reader, 0, sizeof(cloudsync_merge_reader));
+    reader->table = table;
+    
+    if (table->ncols > 0) {
+        reader->value_stmt = (sqlite3_stmt **)cloudsync_memory_zeroalloc((uint64_t)(table->ncols * sizeof(sqlite3_stmt *)));
+        if (!reader->value_stmt) return SQLITE_NOMEM;
+    }
+    
+    int rc = sqlite3_prepare_v2(db, sqlite3_sql(table->meta_clock_stmt), -1, &reader->clock_stmt, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, sqlite3_sql(table->meta_site_id_stmt), -1, &reader->site_id_stmt, NULL);
+    return rc;
+}
+
+sqlite3_stmt *merge_reader_value_stmt (cloudsync_merge_reader *reader, int index) {
+    if (index < 0 || index >= reader->table->ncols) return NULL;
     
-    // get/set site_id
-    sqlite3_stmt *vm = data->getset_siteid_stmt;
-    int rc = sqlite3_bind_blob(vm, 1, (const void *)site_id, site_len, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    if (!reader->value_stmt[index]) {
+        sqlite3 *db = sqlite3_db_handle(reader->clock_stmt);
+        sqlite3_prepare_v2(db, sqlite3_sql(reader->table->col_value_stmt[index]), -1, &reader->value_stmt[index], NULL);
+    }
+    return reader->value_stmt[index];
+}
+
+// MARK: - Merge Clock -
+
+// snapshot of the local clocks of a row (causal length and version of every tracked column) loaded
+// with a single range scan on pk, the merge keeps it in sync with the clocks it writes so consecutive
+// changes of the same row skip the point queries
+#define CLOUDSYNC_CLOCK_MISSING     INT64_MIN
+
+typedef struct {
+    cloudsync_table_context *table;
+    char                    *pk;                // copy of the pk of the snapshot (the pk of a change can live in a buffer that is refilled)
+    int                     pk_len;
+    int                     pk_alloc;
+    sqlite3_int64           cl;
+    sqlite3_int64           *col_version;       // indexed like table->col_name (CLOUDSYNC_CLOCK_MISSING if not tracked)
+    int                     nalloc;
+    bool                    valid;
+    
+    // parallel apply: the snapshot is loaded from a read-only connection and it tracks the writes that the changes
+    // already resolved for the row would perform (the values read from the connection are outdated after them)
+    cloudsync_merge_reader  *reader;
+    uint8_t                 *written;           // indexed like col_version
+    bool                    row_written;
+} cloudsync_merge_clock;
+
+void merge_clock_free (cloudsync_merge_clock *clock) {
+    if (clock->pk) cloudsync_memory_free(clock->pk);
+    if (clock->col_version) cloudsync_memory_free(clock->col_version);
+    if (clock->written) cloudsync_memory_free(clock->written);
+    memset(clock, 0, sizeof(cloudsync_merge_clock));
+}
+
+int merge_clock_load (cloudsync_merge_clock *clock, cloudsync_table_context *table, const char *pk, int pklen, const char **err) {
+    if (clock->valid && clock->table == table && clock->pk_len == pklen && memcmp(clock->pk, pk, (size_t)pklen) == 0) return SQLITE_OK;
     
-    rc = sqlite3_step(vm);
-    if (rc != SQLITE_ROW) goto cleanup_merge;
+    clock->valid = false;
+    if (pklen > clock->pk_alloc) {
+        char *copy = (char *)cloudsync_memory_realloc(clock->pk, (uint64_t)pklen);
+        if (!copy) {
+            *err = "Not enough memory to load the local clocks.";
+            return SQLITE_NOMEM;
+        }
+        clock->pk = copy;
+        clock->pk_alloc = pklen;
+    }
+    if (table->ncols > clock->nalloc) {
+        sqlite3_int64 *col_version = (sqlite3_int64 *)cloudsync_memory_realloc(clock->col_version, (uint64_t)(table->ncols * sizeof(sqlite3_int64)));
+        if (!col_version) {
+            *err = "Not enough memory to load the local clocks.";
+            return SQLITE_NOMEM;
+        }
+        clock->col_version = col_version;
+        
+        uint8_t *written = (uint8_t *)cloudsync_memory_realloc(clock->written, (uint64_t)table->ncols);
+        if (!written) {
+            *err = "Not enough memory to load the local clocks.";
+            return SQLITE_NOMEM;
+        }
+        clock->written = written;
+        clock->nalloc = table->ncols;
+    }
+    for (int i=0; i<table->ncols; ++i) clock->col_version[i] = CLOUDSYNC_CLOCK_MISSING;
+    if (table->ncols > 0) memset(clock->written, 0, (size_t)table->ncols);
+    clock->row_written = false;
+    
+    // SELECT col_name, col_version FROM table_cloudsync WHERE pk=?;
+    sqlite3_stmt *vm = (clock->reader) ? clock->reader->clock_stmt : table->meta_clock_stmt;
+    sqlite3_int64 cl = 0;
+    bool has_sentinel = false;
+    int rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pklen, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    while ((rc = sqlite3_step(vm)) == SQLITE_ROW) {
+        const char *col_name = (const char *)sqlite3_column_text(vm, 0);
+        if (!col_name) continue;
+        
+        // same semantic of meta_local_cl_stmt: sentinel version, or 1 if the row is tracked without a sentinel
+        if (strcmp(col_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0) {
+            if (sqlite3_column_type(vm, 1) == SQLITE_NULL) continue;
+            cl = sqlite3_column_int64(vm, 1);
+            has_sentinel = true;
+            continue;
+        }
+        if (!has_sentinel) cl = 1;
+        
+        int index;
+        table_column_lookup(table, col_name, false, &index);
+        if (index >= 0) clock->col_version[index] = sqlite3_column_int64(vm, 1);
+    }
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
     
-    int64_t ord = sqlite3_column_int64(vm, 0);
+cleanup:
+    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
     stmt_reset(vm);
+    if (rc != SQLITE_OK) return rc;
     
-    vm = table->meta_winner_clock_stmt;
-    rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pk_len, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    clock->table = table;
+    if (pklen > 0) memcpy(clock->pk, pk, (size_t)pklen);
+    clock->pk_len = pklen;
+    clock->cl = cl;
+    clock->valid = true;
+    return SQLITE_OK;
+}
+
+int merge_clock_col_version (cloudsync_merge_clock *clock, cloudsync_table_context *table, const char *col_name, const char *pk, int pklen, sqlite3_int64 *version, const char **err) {
+    // same result codes of merge_get_col_version (SQLITE_DONE if the column is not tracked)
+    int index = -1;
+    if (clock && clock->valid) table_column_lookup(table, col_name, false, &index);
+    if (index < 0 && clock && clock->reader) {
+        *err = "Unable to find the column in the local clocks.";
+        return SQLITE_ERROR;
+    }
+    if (index < 0) return merge_get_col_version(table, col_name, pk, pklen, version, err);
     
-    rc = sqlite3_bind_text(vm, 2, (colname) ? colname : CLOUDSYNC_TOMBSTONE_VALUE, -1, SQLITE_STATIC);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    if (clock->col_version[index] == CLOUDSYNC_CLOCK_MISSING) return SQLITE_DONE;
+    *version = clock->col_version[index];
+    return SQLITE_OK;
+}
+
+void merge_clock_set_col_version (cloudsync_merge_clock *clock, cloudsync_table_context *table, const char *col_name, sqlite3_int64 version) {
+    if (!clock || !clock->valid) return;
     
-    rc = sqlite3_bind_int64(vm, 3, col_version);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    int index;
+    table_column_lookup(table, col_name, false, &index);
+    if (index < 0) {clock->valid = false; return;}
     
-    rc = sqlite3_bind_int64(vm, 4, db_version);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    clock->col_version[index] = version;
+    clock->written[index] = 1;
+    if (clock->cl == 0) clock->cl = 1;
+}
+
+void merge_clock_set_sentinel (cloudsync_merge_clock *clock, sqlite3_int64 cl, bool drop_columns) {
+    // merge_delete drops the column clocks, merge_sentinel_only_insert zeroes them
+    if (!clock || !clock->valid) return;
     
-    rc = sqlite3_bind_int64(vm, 5, seq);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    for (int i=0; i<clock->table->ncols; ++i) {
+        if (clock->col_version[i] == CLOUDSYNC_CLOCK_MISSING) continue;
+        clock->col_version[i] = (drop_columns) ? CLOUDSYNC_CLOCK_MISSING : 0;
+    }
+    clock->cl = cl;
+    clock->row_written = true;
+}
+
+void merge_clock_update (cloudsync_merge_clock *clock, cloudsync_table_context *table, int action, const char *col_name, sqlite3_int64 col_version, sqlite3_int64 cl) {
+    // clocks written by a merge action (see merge_change_apply)
+    switch (action) {
+        case CLOUDSYNC_MERGE_DELETE: merge_clock_set_sentinel(clock, col_version, true); break;
+        case CLOUDSYNC_MERGE_SENTINEL: merge_clock_set_sentinel(clock, col_version, false); break;
+        case CLOUDSYNC_MERGE_RESURRECT:
+            merge_clock_set_sentinel(clock, cl, false);
+            merge_clock_set_col_version(clock, table, col_name, col_version);
+            break;
+        case CLOUDSYNC_MERGE_INSERT: merge_clock_set_col_version(clock, table, col_name, col_version); break;
+    }
+}
+
+// MARK: - Merge Values -
+
+// col_value of a change, either extracted from a sqlite3_value (INSERT INTO cloudsync_changes)
+// or decoded directly from a payload buffer (TEXT values are not zero-terminated)
+typedef struct {
+    int         type;
+    int64_t     ival;               // INTEGER value or size of TEXT/BLOB values
+    double      dval;
+    const char  *pval;
+} cloudsync_merge_value;
+
+void merge_value_from_sqlite (cloudsync_merge_value *value, sqlite3_value *v) {
+    memset(value, 0, sizeof(cloudsync_merge_value));
+    value->type = sqlite3_value_type(v);
+    switch (value->type) {
+        case SQLITE_INTEGER: value->ival = sqlite3_value_int64(v); break;
+        case SQLITE_FLOAT: value->dval = sqlite3_value_double(v); break;
+        case SQLITE_TEXT: value->pval = (const char *)sqlite3_value_text(v); value->ival = sqlite3_value_bytes(v); break;
+        case SQLITE_BLOB: value->pval = (const char *)sqlite3_value_blob(v); value->ival = sqlite3_value_bytes(v); break;
+    }
+}
+
+// digest of a merged value, stored with its clock when value_digest is enabled on the table
+// values that the column affinity would convert are not digested (the stored value would not be the merged one)
+bool merge_value_digest (cloudsync_table_context *table, int index, const cloudsync_merge_value *value, uint8_t digest[CLOUDSYNC_SHA256_LEN]) {
+    if (!table->col_affinity || !value || index < 0) return false;
     
-    rc = sqlite3_bind_int64(vm, 6, ord);
-    if (rc != SQLITE_OK) goto cleanup_merge;
+    char affinity = table->col_affinity[index];
+    const unsigned char *bytes = NULL;
+    size_t len = 0;
+    switch (value->type) {
+        case SQLITE_INTEGER:
+            if (affinity != 'I' && affinity != 'N' && affinity != 'B') return false;
+            bytes = (const unsigned char *)&value->ival; len = sizeof(value->ival);
+            break;
+        case SQLITE_FLOAT:
+            if (affinity != 'R' && affinity != 'B') return false;
+            bytes = (const unsigned char *)&value->dval; len = sizeof(value->dval);
+            break;
+        case SQLITE_TEXT:
+            if (affinity != 'T' && affinity != 'B') return false;
+            bytes = (const unsigned char *)value->pval; len = (size_t)value->ival;
+            break;
+        case SQLITE_BLOB:
+            bytes = (const unsigned char *)value->pval; len = (size_t)value->ival;
+            break;
+    }
     
-    rc = sqlite3_step(vm);
+    // SHA-256 of the type followed by the value
+    uint8_t type = (uint8_t)value->type;
+    cloudsync_sha256_ctx ctx;
+    cloudsync_sha256_init(&ctx);
+    cloudsync_sha256_update(&ctx, &type, sizeof(type));
+    if (len > 0) cloudsync_sha256_update(&ctx, bytes, len);
+    cloudsync_sha256_final(&ctx, digest);
+    return true;
+}
+
+// SHA-256 is collision resistant, so equal digests prove that the values are equal
+// (different digests only prove that they differ, the values are still compared to pick the winner)
+int merge_digest_match (cloudsync_table_context *table, const char *pk, int pklen, const char *col_name, const cloudsync_merge_value *value, bool *match, const char **err) {
+    *match = false;
+    if (!table->value_digest) return SQLITE_OK;
+    
+    int index;
+    uint8_t digest[CLOUDSYNC_SHA256_LEN];
+    table_column_lookup(table, col_name, false, &index);
+    if (!merge_value_digest(table, index, value, digest)) return SQLITE_OK;
+    
+    sqlite3_stmt *vm = table->meta_digest_stmt;
+    int rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pklen, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_bind_text(vm, 2, col_name, -1, SQLITE_STATIC);
+    if (rc == SQLITE_OK) rc = sqlite3_step(vm);
     if (rc == SQLITE_ROW) {
-        *rowid = sqlite3_column_int64(vm, 0);
+        // digests written by older versions (64-bit integers) never match
+        *match = (sqlite3_column_type(vm, 0) == SQLITE_BLOB && sqlite3_column_bytes(vm, 0) == CLOUDSYNC_SHA256_LEN &&
+                  memcmp(sqlite3_column_blob(vm, 0), digest, CLOUDSYNC_SHA256_LEN) == 0);
+        rc = SQLITE_OK;
+    } else if (rc == SQLITE_DONE) {
         rc = SQLITE_OK;
     }
     
-cleanup_merge:
     if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
     stmt_reset(vm);
     return rc;
 }
 
-int merge_insert_col (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const char *col_name, sqlite3_value *col_value, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
-    int index;
-    sqlite3_stmt *vm = table_column_lookup(table, col_name, true, &index);
-    if (vm == NULL) {
-        *err = "Unable to retrieve column merge precompiled statement in merge_insert_col.";
-        return SQLITE_MISUSE;
-    }
-    
-    // INSERT INTO table (pk1, pk2, col_name) VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET col_name=?;"
+int merge_value_compare (const cloudsync_merge_value *lvalue, sqlite3_value *rvalue) {
+    // same semantic of dbutils_value_compare
+    if (!lvalue) return -1;
+    if (!rvalue) return 1;
     
-    // bind primary key(s)
-    int rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
-    if (rc < 0) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        rc = sqlite3_errcode(sqlite3_db_handle(vm));
-        stmt_reset(vm);
-        return rc;
-    }
+    int l_type = lvalue->type;
+    int r_type = sqlite3_value_type(rvalue);
+    if (l_type != r_type) return (r_type - l_type);
     
-    // bind value
-    if (col_value) {
-        rc = sqlite3_bind_value(vm, table->npks+1, col_value);
-        if (rc == SQLITE_OK) rc = sqlite3_bind_value(vm, table->npks+2, col_value);
-        if (rc != SQLITE_OK) {
-            *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-            stmt_reset(vm);
-            return rc;
+    switch (l_type) {
+        case SQLITE_INTEGER: {
+            sqlite3_int64 r_int = sqlite3_value_int64(rvalue);
+            return (lvalue->ival < r_int) ? -1 : (lvalue->ival > r_int);
+        }
+            
+        case SQLITE_FLOAT: {
+            double r_double = sqlite3_value_double(rvalue);
+            return (lvalue->dval < r_double) ? -1 : (lvalue->dval > r_double);
+        }
+            
+        case SQLITE_TEXT:
+        case SQLITE_BLOB: {
+            const void *r_data = (l_type == SQLITE_TEXT) ? (const void *)sqlite3_value_text(rvalue) : sqlite3_value_blob(rvalue);
+            int64_t l_size = lvalue->ival;
+            int64_t r_size = sqlite3_value_bytes(rvalue);
+            int cmp = (l_size && r_size) ? memcmp(lvalue->pval, r_data, (size_t)((l_size < r_size) ? l_size : r_size)) : 0;
+            return (cmp != 0) ? cmp : (int)(l_size - r_size);
         }
-        
     }
     
-    // perform real operation and disable triggers
-    
-    // in case of GOS we reused the table->col_merge_stmt statement
-    // which looks like: INSERT INTO table (pk1, pk2, col_name) VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET col_name=?;"
+    return 0;
+}
+
+// MARK: - Merge -
+
+void siteid_cache_clear (cloudsync_context *data) {
+    if (!data->siteid_cache) return;
+    
+    for (khiter_t k = kh_begin(data->siteid_cache); k != kh_end(data->siteid_cache); ++k) {
+        if (kh_exist(data->siteid_cache, k)) cloudsync_memory_free((void *)kh_key(data->siteid_cache, k).data);
+    }
+    kh_clear(SITEID_CACHE, data->siteid_cache);
+}
+
+void siteid_cache_free (cloudsync_context *data) {
+    siteid_cache_clear(data);
+    if (data->siteid_cache) kh_destroy(SITEID_CACHE, data->siteid_cache);
+    data->siteid_cache = NULL;
+}
+
+void siteid_cache_set (cloudsync_context *data, const char *site_id, int site_len, sqlite3_int64 ord, sqlite3_int64 txn) {
+    // the cache is an optimization, so any allocation failure just leaves the site_id out of it
+    if (!data->siteid_cache) data->siteid_cache = kh_init(SITEID_CACHE);
+    if (!data->siteid_cache) return;
+    
+    cloudsync_blob_key key = {site_id, site_len};
+    khiter_t k = kh_get(SITEID_CACHE, data->siteid_cache, key);
+    if (k == kh_end(data->siteid_cache)) {
+        char *copy = (char *)cloudsync_memory_alloc((sqlite3_uint64)site_len);
+        if (!copy) return;
+        memcpy(copy, site_id, (size_t)site_len);
+        key.data = copy;
+        
+        int absent = 0;
+        k = kh_put(SITEID_CACHE, data->siteid_cache, key, &absent);
+        if (absent < 0) {cloudsync_memory_free(copy); return;}
+    }
+    
+    cloudsync_siteid_entry entry = {ord, txn};
+    kh_value(data->siteid_cache, k) = entry;
+}
+
+int siteid_ordinal (cloudsync_context *data, const char *site_id, int site_len, sqlite3_int64 *ord) {
+    // probe the cache first, the site table is read only if the ordinal is not confirmed yet
+    // and it is written only when a new site_id appears
+    bool verified = false;
+    if (data->siteid_cache) {
+        cloudsync_blob_key key = {site_id, site_len};
+        khiter_t k = kh_get(SITEID_CACHE, data->siteid_cache, key);
+        if (k != kh_end(data->siteid_cache)) {
+            cloudsync_siteid_entry entry = kh_value(data->siteid_cache, k);
+            if (entry.txn == CLOUDSYNC_SITEID_CONFIRMED) {*ord = entry.ord; return SQLITE_OK;}
+            // the transaction that learned the ordinal committed (a rollback clears the cache), so a match confirms it
+            verified = (entry.txn != data->siteid_txn);
+        }
+    }
+    
+    sqlite3_stmt *vm = data->get_siteid_stmt;
+    int rc = sqlite3_bind_blob(vm, 1, (const void *)site_id, site_len, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_ROW) {
+        *ord = sqlite3_column_int64(vm, 0);
+        rc = SQLITE_OK;
+    } else if (rc == SQLITE_DONE) {
+        stmt_reset(vm);
+        verified = false;
+        
+        // a new site_id
+        vm = data->getset_siteid_stmt;
+        rc = sqlite3_bind_blob(vm, 1, (const void *)site_id, site_len, SQLITE_STATIC);
+        if (rc != SQLITE_OK) goto cleanup;
+        
+        rc = sqlite3_step(vm);
+        if (rc != SQLITE_ROW) goto cleanup;
+        *ord = sqlite3_column_int64(vm, 0);
+        rc = SQLITE_OK;
+    }
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    siteid_cache_set(data, site_id, site_len, *ord, (verified) ? CLOUDSYNC_SITEID_CONFIRMED : data->siteid_txn);
+    
+cleanup:
+    stmt_reset(vm);
+    return rc;
+}
+
+int merge_set_winner_clock (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pk_len, const char *colname, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, const uint8_t *digest, sqlite3_int64 *rowid, const char **err) {
+    
+    // get/set site_id
+    sqlite3_int64 ord = 0;
+    sqlite3_stmt *vm = data->get_siteid_stmt;
+    int rc = siteid_ordinal(data, site_id, site_len, &ord);
+    if (rc != SQLITE_OK) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        return rc;
+    }
+    
+    vm = table->meta_winner_clock_stmt;
+    rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pk_len, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto cleanup_merge;
+    
+    rc = sqlite3_bind_text(vm, 2, (colname) ? colname : CLOUDSYNC_TOMBSTONE_VALUE, -1, SQLITE_STATIC);
+    if (rc != SQLITE_OK) goto cleanup_merge;
+    
+    rc = sqlite3_bind_int64(vm, 3, col_version);
+    if (rc != SQLITE_OK) goto cleanup_merge;
+    
+    rc = sqlite3_bind_int64(vm, 4, db_version);
+    if (rc != SQLITE_OK) goto cleanup_merge;
+    
+    rc = sqlite3_bind_int64(vm, 5, seq);
+    if (rc != SQLITE_OK) goto cleanup_merge;
+    
+    rc = sqlite3_bind_int64(vm, 6, ord);
+    if (rc != SQLITE_OK) goto cleanup_merge;
+    
+    if (table->value_digest) {
+        rc = (digest) ? sqlite3_bind_blob(vm, 7, (const void *)digest, CLOUDSYNC_SHA256_LEN, SQLITE_STATIC) : sqlite3_bind_null(vm, 7);
+        if (rc != SQLITE_OK) goto cleanup_merge;
+    }
+    
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_ROW) {
+        *rowid = sqlite3_column_int64(vm, 0);
+        rc = SQLITE_OK;
+    }
+    
+cleanup_merge:
+    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+    stmt_reset(vm);
+    return rc;
+}
+
+int merge_insert_col (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const char *col_name, const cloudsync_merge_value *col_value, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
+    int index;
+    sqlite3_stmt *vm = table_column_lookup(table, col_name, true, &index);
+    if (vm == NULL) {
+        *err = "Unable to retrieve column merge precompiled statement in merge_insert_col.";
+        return SQLITE_MISUSE;
+    }
+    
+    // INSERT INTO table (pk1, pk2, col_name) VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET col_name=?;"
+    
+    // bind primary key(s)
+    int rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
+    if (rc < 0) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        rc = sqlite3_errcode(sqlite3_db_handle(vm));
+        stmt_reset(vm);
+        return rc;
+    }
+    
+    // bind value
+    if (col_value) {
+        rc = pk_decode_bind_callback(vm, table->npks, col_value->type, col_value->ival, col_value->dval, (char *)col_value->pval);
+        if (rc == SQLITE_OK) rc = pk_decode_bind_callback(vm, table->npks+1, col_value->type, col_value->ival, col_value->dval, (char *)col_value->pval);
+        if (rc != SQLITE_OK) {
+            *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+            stmt_reset(vm);
+            return rc;
+        }
+        
+    }
+    
+    // perform real operation and disable triggers
+    
+    // in case of GOS we reused the table->col_merge_stmt statement
+    // which looks like: INSERT INTO table (pk1, pk2, col_name) VALUES (?, ?, ?) ON CONFLICT DO UPDATE SET col_name=?;"
     // but the UPDATE in the CONFLICT statement would return SQLITE_CONSTRAINT because the trigger raises the error
     // the trick is to disable that trigger before executing the statement
     if (table->algo == table_algo_crdt_gos) table->enabled = 0;
@@ -1170,7 +2049,9 @@ int merge_insert_col (cloudsync_context *data, cloudsync_table_context *table, c
         return rc;
     }
     
-    return merge_set_winner_clock(data, table, pk, pklen, col_name, col_version, db_version, site_id, site_len, seq, rowid, err);
+    uint8_t digest[CLOUDSYNC_SHA256_LEN];
+    bool has_digest = (table->value_digest && merge_value_digest(table, index, col_value, digest));
+    return merge_set_winner_clock(data, table, pk, pklen, col_name, col_version, db_version, site_id, site_len, seq, (has_digest) ? digest : NULL, rowid, err);
 }
 
 int merge_delete (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const char *colname, sqlite3_int64 cl, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
@@ -1201,7 +2082,7 @@ int merge_delete (cloudsync_context *data, cloudsync_table_context *table, const
         return rc;
     }
     
-    rc = merge_set_winner_clock(data, table, pk, pklen, colname, cl, db_version, site_id, site_len, seq, rowid, err);
+    rc = merge_set_winner_clock(data, table, pk, pklen, colname, cl, db_version, site_id, site_len, seq, NULL, rowid, err);
     if (rc != SQLITE_OK) return rc;
     
     // drop clocks _after_ setting the winner clock so we don't lose track of the max db_version!!
@@ -1237,12 +2118,13 @@ cleanup:
 }
 
 // executed only if insert_cl == local_cl
-int merge_did_cid_win (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, sqlite3_value *insert_value, const char *site_id, int site_len, const char *col_name, sqlite3_int64 col_version, bool *didwin_flag, const char **err) {
+int merge_did_cid_win (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const cloudsync_merge_value *insert_value, const char *site_id, int site_len, const char *col_name, sqlite3_int64 col_version, cloudsync_merge_clock *clock, bool *didwin_flag, bool *equal_flag, const char **err) {
     
     if (col_name == NULL) col_name = CLOUDSYNC_TOMBSTONE_VALUE;
+    *equal_flag = false;
     
     sqlite3_int64 local_version;
-    int rc = merge_get_col_version(table, col_name, pk, pklen, &local_version, err);
+    int rc = merge_clock_col_version(clock, table, col_name, pk, pklen, &local_version, err);
     if (rc == SQLITE_DONE) {
         // no rows returned, the incoming change wins if there's nothing there locally
         *didwin_flag = true;
@@ -1258,42 +2140,66 @@ int merge_did_cid_win (cloudsync_context *data, cloudsync_table_context *table,
     
     // rc == SQLITE_ROW and col_version == local_version, need to compare values
     
-    // retrieve col_value precompiled statement
-    sqlite3_stmt *vm = table_column_lookup(table, col_name, false, NULL);
-    if (!vm) {
-        *err = "Unable to retrieve column value precompiled statement in merge_did_cid_win.";
-        return SQLITE_ERROR;
+    // with value_digest an equal value is detected without reading the base table
+    // (the parallel apply readers only have the base table statements)
+    bool digest_match = false;
+    if (!(clock && clock->reader)) {
+        rc = merge_digest_match(table, pk, pklen, col_name, insert_value, &digest_match, err);
+        if (rc != SQLITE_OK) return rc;
     }
     
-    // bind primary key values
-    rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, (void *)vm);
-    if (rc < 0) {
-        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
-        rc = sqlite3_errcode(sqlite3_db_handle(vm));
-        stmt_reset(vm);
-        return rc;
-    }
+    int ret = 0;
+    sqlite3_stmt *vm = NULL;
+    if (!digest_match) {
+        // retrieve col_value precompiled statement
+        if (clock && clock->reader) {
+            // the value read from the snapshot is outdated if a previous change of the same row already wrote it
+            int index;
+            table_column_lookup(table, col_name, false, &index);
+            if (index < 0 || clock->row_written || clock->written[index]) {
+                *err = "The local value has been changed by a previous change of the payload.";
+                return SQLITE_ABORT;
+            }
+            vm = merge_reader_value_stmt(clock->reader, index);
+        } else {
+            vm = table_column_lookup(table, col_name, false, NULL);
+        }
+        if (!vm) {
+            *err = "Unable to retrieve column value precompiled statement in merge_did_cid_win.";
+            return SQLITE_ERROR;
+        }
         
-    // execute vm
-    sqlite3_value *local_value;
-    rc = sqlite3_step(vm);
-    if (rc == SQLITE_DONE) {
-        // meta entry exists but the actual value is missing
-        // we should allow the value_compare function to make a decision
-        // value_compare has been modified to handle the case where lvalue is NULL
-        local_value = NULL;
-        rc = SQLITE_OK;
-    } else if (rc == SQLITE_ROW) {
-        local_value = sqlite3_column_value(vm, 0);
-        rc = SQLITE_OK;
-    } else {
-        goto cleanup;
+        // bind primary key values
+        rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, (void *)vm);
+        if (rc < 0) {
+            *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+            rc = sqlite3_errcode(sqlite3_db_handle(vm));
+            stmt_reset(vm);
+            return rc;
+        }
+        
+        // execute vm
+        sqlite3_value *local_value;
+        rc = sqlite3_step(vm);
+        if (rc == SQLITE_DONE) {
+            // meta entry exists but the actual value is missing
+            // we should allow the value_compare function to make a decision
+            // value_compare has been modified to handle the case where lvalue is NULL
+            local_value = NULL;
+            rc = SQLITE_OK;
+        } else if (rc == SQLITE_ROW) {
+            local_value = sqlite3_column_value(vm, 0);
+            rc = SQLITE_OK;
+        } else {
+            goto cleanup;
+        }
+        
+        // compare values
+        ret = merge_value_compare(insert_value, local_value);
+        // reset after compare, otherwise local value would be deallocated
+        vm = stmt_reset(vm);
     }
-    
-    // compare values
-    int ret = dbutils_value_compare(insert_value, local_value);
-    // reset after compare, otherwise local value would be deallocated
-    vm = stmt_reset(vm);
+    *equal_flag = (ret == 0);
     
     bool compare_site_id = (ret == 0 && data->merge_equal_values == true);
     if (!compare_site_id) {
@@ -1302,7 +2208,7 @@ int merge_did_cid_win (cloudsync_context *data, cloudsync_table_context *table,
     }
     
     // values are the same and merge_equal_values is true
-    vm = table->meta_site_id_stmt;
+    vm = (clock && clock->reader) ? clock->reader->site_id_stmt : table->meta_site_id_stmt;
     rc = sqlite3_bind_blob(vm, 1, (const void *)pk, pklen, SQLITE_STATIC);
     if (rc != SQLITE_OK) goto cleanup;
     
@@ -1358,69 +2264,103 @@ int merge_sentinel_only_insert (cloudsync_context *data, cloudsync_table_context
     rc = merge_zeroclock_on_resurrect(table, db_version, pk, pklen, err);
     if (rc != SQLITE_OK) return rc;
     
-    return merge_set_winner_clock(data, table, pk, pklen, NULL, cl, db_version, site_id, site_len, seq, rowid, err);
+    return merge_set_winner_clock(data, table, pk, pklen, NULL, cl, db_version, site_id, site_len, seq, NULL, rowid, err);
+}
+
+typedef struct {
+    sqlite3_stmt    *vm;
+    int             offset;
+} cloudsync_gos_bind_context;
+
+int merge_gos_bind_callback (void *xdata, int index, int type, int64_t ival, double dval, char *pval) {
+    // the values of a grow-only set row are bound after its primary key(s)
+    cloudsync_gos_bind_context *bind = (cloudsync_gos_bind_context *)xdata;
+    return pk_decode_bind_callback(bind->vm, bind->offset + index, type, ival, dval, pval);
+}
+
+int merge_insert_row_gos (cloudsync_context *data, cloudsync_table_context *table, const char *pk, int pklen, const cloudsync_merge_value *row, sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq, sqlite3_int64 *rowid, const char **err) {
+    // the sentinel of a grow-only set row carries all its values (see cloudsync_col_value)
+    // a sentinel without values only inserts the primary key(s), like a table without other columns
+    
+    // reset return value
+    *rowid = 0;
+    
+    bool has_values = (table->real_merge_gos_stmt && row && row->type == SQLITE_BLOB);
+    sqlite3_stmt *vm = (has_values) ? table->real_merge_gos_stmt : table->real_merge_sentinel_stmt;
+    int rc = pk_decode_prikey((char *)pk, (size_t)pklen, pk_decode_bind_callback, vm);
+    if (rc < 0) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        rc = sqlite3_errcode(sqlite3_db_handle(vm));
+        stmt_reset(vm);
+        return rc;
+    }
+    
+    if (has_values) {
+        cloudsync_gos_bind_context bind = {vm, table->npks};
+        rc = pk_decode_prikey((char *)row->pval, (size_t)row->ival, merge_gos_bind_callback, &bind);
+        if (rc != table->ncols) {
+            *err = "The values of the grow-only set row do not match the columns of the table.";
+            stmt_reset(vm);
+            return SQLITE_MISMATCH;
+        }
+    }
+    
+    // perform real operation and disable triggers
+    SYNCBIT_SET(data);
+    rc = sqlite3_step(vm);
+    DEBUG_MERGE("merge_insert_row_gos(%02x%02x): %s (%d)", data->site_id[UUID_LEN-2], data->site_id[UUID_LEN-1], sqlite3_expanded_sql(vm), rc);
+    stmt_reset(vm);
+    SYNCBIT_RESET(data);
+    if (rc != SQLITE_DONE) {
+        *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+        return rc;
+    }
+    
+    // a row that already exists is never modified, its sentinel is left as it is
+    if (sqlite3_changes(sqlite3_db_handle(vm)) == 0) return SQLITE_OK;
+    
+    return merge_set_winner_clock(data, table, pk, pklen, NULL, col_version, db_version, site_id, site_len, seq, NULL, rowid, err);
 }
 
-int cloudsync_merge_insert_gos (sqlite3_vtab *vtab, cloudsync_context *data, cloudsync_table_context *table, const char *insert_pk, int insert_pk_len, const char *insert_name, sqlite3_value *insert_value, sqlite3_int64 insert_col_version, sqlite3_int64 insert_db_version, const char *insert_site_id, int insert_site_id_len, sqlite3_int64 insert_seq, sqlite3_int64 *rowid) {
+int cloudsync_merge_insert_gos (cloudsync_context *data, cloudsync_table_context *table, const char *insert_pk, int insert_pk_len, const char *insert_name, const cloudsync_merge_value *insert_value, sqlite3_int64 insert_col_version, sqlite3_int64 insert_db_version, const char *insert_site_id, int insert_site_id_len, sqlite3_int64 insert_seq, sqlite3_int64 *rowid, char **errmsg) {
     // Grow-Only Set (GOS) Algorithm: Only insertions are allowed, deletions and updates are prevented from a trigger.
     
     const char *err = NULL;
-    int rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version,
-                              insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+    int rc = SQLITE_OK;
+    if (strcmp(insert_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0) {
+        rc = merge_insert_row_gos(data, table, insert_pk, insert_pk_len, insert_value, insert_col_version, insert_db_version,
+                                  insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+        if (rc != SQLITE_OK) *errmsg = cloudsync_memory_mprintf("Unable to perform GOS merge_insert_row: %s", err);
+        return rc;
+    }
+    
+    // a single column (rows of tables with too many columns, or tracked before the sentinel carried the row)
+    rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version,
+                          insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
     if (rc != SQLITE_OK) {
-        cloudsync_vtab_set_error(vtab, "Unable to perform GOS merge_insert_col: %s", err);
+        *errmsg = cloudsync_memory_mprintf("Unable to perform GOS merge_insert_col: %s", err);
     }
     
     return rc;
 }
 
-int cloudsync_merge_insert (sqlite3_vtab *vtab, int argc, sqlite3_value **argv, sqlite3_int64 *rowid) {
-    // this function performs the merging logic for an insert in a cloud-synchronized table. It handles
-    // different scenarios including conflicts, causal lengths, delete operations, and resurrecting rows
-    // based on the incoming data (from remote nodes or clients) and the local database state
-
-    // this function handles different CRDT algorithms (GOS, DWS, AWS, and CLS).
-    // the merging strategy is determined based on the table->algo value.
-    
-    // meta table declaration:
-    // tbl TEXT NOT NULL, pk BLOB NOT NULL, col_name TEXT NOT NULL,"
-    // "col_value ANY, col_version INTEGER NOT NULL, db_version INTEGER NOT NULL,"
-    // "site_id BLOB NOT NULL, cl INTEGER NOT NULL, seq INTEGER NOT NULL
-    
-    // meta information to retrieve from arguments:
-    // argv[0] -> table name (TEXT)
-    // argv[1] -> primary key (BLOB)
-    // argv[2] -> column name (TEXT or NULL if sentinel)
-    // argv[3] -> column value (ANY)
-    // argv[4] -> column version (INTEGER)
-    // argv[5] -> database version (INTEGER)
-    // argv[6] -> site ID (BLOB, identifies the origin of the update)
-    // argv[7] -> causal length (INTEGER, tracks the order of operations)
-    // argv[8] -> sequence number (INTEGER, unique per operation)
-    
-    // extract table name
-    const char *insert_tbl = (const char *)sqlite3_value_text(argv[0]);
-    
-    // lookup table
-    cloudsync_context *data = cloudsync_vtab_get_context(vtab);
-    cloudsync_table_context *table = table_lookup(data, insert_tbl);
-    if (!table) return cloudsync_vtab_set_error(vtab, "Unable to find table %s,", insert_tbl);
+int merge_change_resolve (cloudsync_context *data, cloudsync_table_context *table, const char *insert_pk, int insert_pk_len, const char *insert_name, const cloudsync_merge_value *insert_value, sqlite3_int64 insert_col_version, const char *insert_site_id, int insert_site_id_len, sqlite3_int64 insert_cl, cloudsync_merge_clock *clock, int *action, char **errmsg) {
+    // decide how an incoming change must be merged (CLOUDSYNC_MERGE_ACTION) without writing anything,
+    // with a clock bound to a reader it runs on a read-only connection
     
-    // extract the remaining fields from the input values
-    const char *insert_pk = (const char *)sqlite3_value_blob(argv[1]);
-    int insert_pk_len = sqlite3_value_bytes(argv[1]);
-    const char *insert_name = (sqlite3_value_type(argv[2]) == SQLITE_NULL) ? CLOUDSYNC_TOMBSTONE_VALUE : (const char *)sqlite3_value_text(argv[2]);
-    sqlite3_value *insert_value = argv[3];
-    sqlite3_int64 insert_col_version = sqlite3_value_int64(argv[4]);
-    sqlite3_int64 insert_db_version = sqlite3_value_int64(argv[5]);
-    const char *insert_site_id = (const char *)sqlite3_value_blob(argv[6]);
-    int insert_site_id_len = sqlite3_value_bytes(argv[6]);
-    sqlite3_int64 insert_cl = sqlite3_value_int64(argv[7]);
-    sqlite3_int64 insert_seq = sqlite3_value_int64(argv[8]);
     const char *err = NULL;
+    *action = CLOUDSYNC_MERGE_SKIP;
     
     // perform different logic for each different table algorithm
-    if (table->algo == table_algo_crdt_gos) return cloudsync_merge_insert_gos(vtab, data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid);
+    // Grow-Only Set (GOS) Algorithm: Only insertions are allowed, deletions and updates are prevented from a trigger.
+    if (table->algo == table_algo_crdt_gos) {
+        // rows are never modified once inserted, so the sentinel of a row already tracked locally is already merged
+        // (the readers of the parallel apply leave the check to the writer)
+        bool is_sentinel = (strcmp(insert_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0);
+        bool row_exists = (is_sentinel && !(clock && clock->reader) && stmt_count(table->meta_pkexists_stmt, insert_pk, (size_t)insert_pk_len, SQLITE_BLOB) > 0);
+        *action = (row_exists) ? CLOUDSYNC_MERGE_EQUAL : CLOUDSYNC_MERGE_INSERT;
+        return SQLITE_OK;
+    }
     
     // Handle DWS and AWS algorithms here
     // Delete-Wins Set (DWS): table_algo_crdt_dws
@@ -1430,9 +2370,15 @@ int cloudsync_merge_insert (sqlite3_vtab *vtab, int argc, sqlite3_value **argv,
     
     // compute the local causal length for the row based on the primary key
     // the causal length is used to determine the order of operations and resolve conflicts.
-    sqlite3_int64 local_cl = merge_get_local_cl(table, insert_pk, insert_pk_len, &err);
+    sqlite3_int64 local_cl = -1;
+    if (clock) {
+        if (merge_clock_load(clock, table, insert_pk, insert_pk_len, &err) == SQLITE_OK) local_cl = clock->cl;
+    } else {
+        local_cl = merge_get_local_cl(table, insert_pk, insert_pk_len, &err);
+    }
     if (local_cl < 0) {
-        return cloudsync_vtab_set_error(vtab, "Unable to compute local causal length: %s", err);
+        *errmsg = cloudsync_memory_mprintf("Unable to compute local causal length: %s", err);
+        return SQLITE_ERROR;
     }
     
     // if the incoming causal length is older than the local causal length, we can safely ignore it
@@ -1445,25 +2391,16 @@ int cloudsync_merge_insert (sqlite3_vtab *vtab, int argc, sqlite3_value **argv,
     if (is_delete) {
         // if it's a delete, check if the local state is at the same causal length
         // if it is, no further action is needed
-        if (local_cl == insert_cl) return SQLITE_OK;
-        
-        // perform a delete merge if the causal length is newer than the local one
-        int rc = merge_delete(data, table, insert_pk, insert_pk_len, insert_name, insert_col_version,
-                              insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-        if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_delete: %s", err);
-        return rc;
+        // otherwise perform a delete merge because the causal length is newer than the local one
+        *action = (local_cl == insert_cl) ? CLOUDSYNC_MERGE_EQUAL : CLOUDSYNC_MERGE_DELETE;
+        return SQLITE_OK;
     }
     
     // if the operation is a sentinel-only insert (indicating a new row or resurrected row with no column update), handle it separately.
     bool is_sentinel_only = (strcmp(insert_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0);
     if (is_sentinel_only) {
-        if (local_cl == insert_cl) return SQLITE_OK;
-        
-        // perform a sentinel-only insert to track the existence of the row
-        int rc = merge_sentinel_only_insert(data, table, insert_pk, insert_pk_len, insert_col_version,
-                                            insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-        if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_sentinel_only_insert: %s", err);
-        return rc;
+        *action = (local_cl == insert_cl) ? CLOUDSYNC_MERGE_EQUAL : CLOUDSYNC_MERGE_SENTINEL;
+        return SQLITE_OK;
     }
     
     // from this point I can be sure that insert_name is not sentinel
@@ -1475,35 +2412,586 @@ int cloudsync_merge_insert (sqlite3_vtab *vtab, int argc, sqlite3_value **argv,
    
     // if a resurrection is needed, insert a sentinel to mark the row as alive
     // this handles out-of-order deliveries where the row was deleted and is now being re-inserted
+    // (the column update always wins after a resurrection)
     if (needs_resurrect && (row_exists_locally || (!row_exists_locally && insert_cl > 1))) {
-        int rc = merge_sentinel_only_insert(data, table, insert_pk, insert_pk_len, insert_cl,
-                                            insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-        if (rc != SQLITE_OK) {
-            cloudsync_vtab_set_error(vtab, "Unable to perform merge_sentinel_only_insert: %s", err);
-            return rc;
-        }
+        *action = CLOUDSYNC_MERGE_RESURRECT;
+        return SQLITE_OK;
     }
     
     // at this point, we determine whether the incoming change wins based on causal length
     // this can be due to a resurrection, a non-existent local row, or a conflict resolution
+    if ((needs_resurrect) || (!row_exists_locally)) {
+        *action = CLOUDSYNC_MERGE_INSERT;
+        return SQLITE_OK;
+    }
+    
     bool flag = false;
-    int rc = merge_did_cid_win(data, table, insert_pk, insert_pk_len, insert_value, insert_site_id, insert_site_id_len, insert_name, insert_col_version, &flag, &err);
+    bool equal = false;
+    int rc = merge_did_cid_win(data, table, insert_pk, insert_pk_len, insert_value, insert_site_id, insert_site_id_len, insert_name, insert_col_version, clock, &flag, &equal, &err);
     if (rc != SQLITE_OK) {
-        cloudsync_vtab_set_error(vtab, "Unable to perform merge_did_cid_win: %s", err);
+        *errmsg = cloudsync_memory_mprintf("Unable to perform merge_did_cid_win: %s", err);
         return rc;
     }
     
     // check if the incoming change wins and should be applied
-    bool does_cid_win = ((needs_resurrect) || (!row_exists_locally) || (flag));
-    if (!does_cid_win) return SQLITE_OK;
+    if (flag) *action = CLOUDSYNC_MERGE_INSERT;
+    else if (equal) *action = CLOUDSYNC_MERGE_EQUAL;
+    return SQLITE_OK;
+}
+
+int merge_change_apply (cloudsync_context *data, cloudsync_table_context *table, int action, const char *insert_pk, int insert_pk_len, const char *insert_name, const cloudsync_merge_value *insert_value, sqlite3_int64 insert_col_version, sqlite3_int64 insert_db_version, const char *insert_site_id, int insert_site_id_len, sqlite3_int64 insert_cl, sqlite3_int64 insert_seq, sqlite3_int64 *rowid, cloudsync_merge_clock *clock, char **errmsg) {
+    // perform the writes of an action returned by merge_change_resolve
+    if (action == CLOUDSYNC_MERGE_SKIP || action == CLOUDSYNC_MERGE_EQUAL) return SQLITE_OK;
+    if (table->algo == table_algo_crdt_gos) return cloudsync_merge_insert_gos(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, errmsg);
+    
+    const char *err = NULL;
+    int rc = SQLITE_MISUSE;
+    switch (action) {
+        case CLOUDSYNC_MERGE_DELETE:
+            rc = merge_delete(data, table, insert_pk, insert_pk_len, insert_name, insert_col_version,
+                              insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+            if (rc != SQLITE_OK) *errmsg = cloudsync_memory_mprintf("Unable to perform merge_delete: %s", err);
+            break;
+            
+        case CLOUDSYNC_MERGE_SENTINEL:
+        case CLOUDSYNC_MERGE_RESURRECT:
+            // a resurrection tracks the row with the incoming causal length, a sentinel-only insert with its col_version
+            rc = merge_sentinel_only_insert(data, table, insert_pk, insert_pk_len, (action == CLOUDSYNC_MERGE_RESURRECT) ? insert_cl : insert_col_version,
+                                            insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+            if (rc != SQLITE_OK) *errmsg = cloudsync_memory_mprintf("Unable to perform merge_sentinel_only_insert: %s", err);
+            if (rc != SQLITE_OK || action == CLOUDSYNC_MERGE_SENTINEL) break;
+            
+            // perform the final column insert or update
+            rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+            if (rc != SQLITE_OK) *errmsg = cloudsync_memory_mprintf("Unable to perform merge_insert_col: %s", err);
+            break;
+            
+        case CLOUDSYNC_MERGE_INSERT:
+            // perform the final column insert or update if the incoming change wins
+            rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
+            if (rc != SQLITE_OK) *errmsg = cloudsync_memory_mprintf("Unable to perform merge_insert_col: %s", err);
+            break;
+            
+        default:
+            *errmsg = cloudsync_memory_mprintf("Unknown merge action %d.", action);
+            break;
+    }
     
-    // perform the final column insert or update if the incoming change wins
-    rc = merge_insert_col(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_seq, rowid, &err);
-    if (rc != SQLITE_OK) cloudsync_vtab_set_error(vtab, "Unable to perform merge_insert_col: %s", err);
+    if (clock && rc == SQLITE_OK) merge_clock_update(clock, table, action, insert_name, insert_col_version, insert_cl);
+    else if (clock) clock->valid = false;
     return rc;
 }
 
-// MARK: - Private -
+int cloudsync_merge_change (cloudsync_context *data, cloudsync_table_context *table, const char *insert_pk, int insert_pk_len, const char *insert_name, const cloudsync_merge_value *insert_value, sqlite3_int64 insert_col_version, sqlite3_int64 insert_db_version, const char *insert_site_id, int insert_site_id_len, sqlite3_int64 insert_cl, sqlite3_int64 insert_seq, sqlite3_int64 *rowid, cloudsync_merge_clock *clock, char **errmsg) {
+    // this function performs the merging logic for an insert in a cloud-synchronized table. It handles
+    // different scenarios including conflicts, causal lengths, delete operations, and resurrecting rows
+    // based on the incoming data (from remote nodes or clients) and the local database state
+
+    // this function handles different CRDT algorithms (GOS, DWS, AWS, and CLS).
+    // the merging strategy is determined based on the table->algo value.
+    
+    // it is called by INSERT INTO cloudsync_changes and directly by cloudsync_payload_apply,
+    // in case of error errmsg is set and must be freed by the caller
+    // clock is an optional snapshot of the local clocks, it must be used only while this function is the only writer of the meta tables
+    
+    int action = CLOUDSYNC_MERGE_SKIP;
+    int rc = merge_change_resolve(data, table, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_site_id, insert_site_id_len, insert_cl, clock, &action, errmsg);
+    if (rc != SQLITE_OK) return rc;
+    
+    return merge_change_apply(data, table, action, insert_pk, insert_pk_len, insert_name, insert_value, insert_col_version, insert_db_version, insert_site_id, insert_site_id_len, insert_cl, insert_seq, rowid, clock, errmsg);
+}
+
+int cloudsync_merge_insert (sqlite3_vtab *vtab, int argc, sqlite3_value **argv, sqlite3_int64 *rowid) {
+    // entry point used by INSERT INTO cloudsync_changes
+    
+    // meta table declaration:
+    // tbl TEXT NOT NULL, pk BLOB NOT NULL, col_name TEXT NOT NULL,"
+    // "col_value ANY, col_version INTEGER NOT NULL, db_version INTEGER NOT NULL,"
+    // "site_id BLOB NOT NULL, cl INTEGER NOT NULL, seq INTEGER NOT NULL
+    
+    // meta information to retrieve from arguments:
+    // argv[0] -> table name (TEXT)
+    // argv[1] -> primary key (BLOB)
+    // argv[2] -> column name (TEXT or NULL if sentinel)
+    // argv[3] -> column value (ANY)
+    // argv[4] -> column version (INTEGER)
+    // argv[5] -> database version (INTEGER)
+    // argv[6] -> site ID (BLOB, identifies the origin of the update)
+    // argv[7] -> causal length (INTEGER, tracks the order of operations)
+    // argv[8] -> sequence number (INTEGER, unique per operation)
+    
+    // extract table name
+    const char *insert_tbl = (const char *)sqlite3_value_text(argv[0]);
+    
+    // lookup table
+    cloudsync_context *data = cloudsync_vtab_get_context(vtab);
+    cloudsync_table_context *table = table_lookup(data, insert_tbl);
+    if (!table) return cloudsync_vtab_set_error(vtab, "Unable to find table %s,", insert_tbl);
+    
+    // extract the remaining fields from the input values
+    cloudsync_merge_value insert_value;
+    merge_value_from_sqlite(&insert_value, argv[3]);
+    const char *insert_name = (sqlite3_value_type(argv[2]) == SQLITE_NULL) ? CLOUDSYNC_TOMBSTONE_VALUE : (const char *)sqlite3_value_text(argv[2]);
+    
+    char *errmsg = NULL;
+    int rc = cloudsync_merge_change(data, table, (const char *)sqlite3_value_blob(argv[1]), sqlite3_value_bytes(argv[1]), insert_name, &insert_value,
+                                    sqlite3_value_int64(argv[4]), sqlite3_value_int64(argv[5]), (const char *)sqlite3_value_blob(argv[6]), sqlite3_value_bytes(argv[6]),
+                                    sqlite3_value_int64(argv[7]), sqlite3_value_int64(argv[8]), rowid, NULL, &errmsg);
+    if (errmsg) {
+        cloudsync_vtab_set_error(vtab, "%s", errmsg);
+        cloudsync_memory_free(errmsg);
+    }
+    return rc;
+}
+
+// MARK: - Apply Stats -
+
+void cloudsync_apply_stats_reset (cloudsync_apply_stats *stats) {
+    for (int i=0; i<stats->ntables; ++i) cloudsync_memory_free(stats->tables[i].name);
+    if (stats->tables) cloudsync_memory_free(stats->tables);
+    for (int i=0; i<CLOUDSYNC_APPLY_STATS_MAX_ERRORS; ++i) {
+        if (stats->errors[i]) cloudsync_memory_free(stats->errors[i]);
+    }
+    memset(stats, 0, sizeof(cloudsync_apply_stats));
+}
+
+cloudsync_apply_table_stats *cloudsync_apply_stats_table (cloudsync_apply_stats *stats, const char *name, int64_t len) {
+    // decoded table names are not zero-terminated
+    if (!name) return NULL;
+    
+    if (stats->last < stats->ntables) {
+        cloudsync_apply_table_stats *table = &stats->tables[stats->last];
+        if (table->name_len == len && memcmp(table->name, name, (size_t)len) == 0) return table;
+    }
+    
+    for (int i=0; i<stats->ntables; ++i) {
+        cloudsync_apply_table_stats *table = &stats->tables[i];
+        if (table->name_len == len && memcmp(table->name, name, (size_t)len) == 0) {
+            stats->last = i;
+            return table;
+        }
+    }
+    
+    if (stats->ntables == stats->nalloc) {
+        int nalloc = (stats->nalloc) ? stats->nalloc * 2 : 8;
+        cloudsync_apply_table_stats *tables = (cloudsync_apply_table_stats *)cloudsync_memory_realloc(stats->tables, (uint64_t)(nalloc * sizeof(cloudsync_apply_table_stats)));
+        if (!tables) return NULL;
+        stats->tables = tables;
+        stats->nalloc = nalloc;
+    }
+    
+    char *copy = cloudsync_string_ndup(name, (size_t)len, false);
+    if (!copy) return NULL;
+    
+    cloudsync_apply_table_stats *table = &stats->tables[stats->ntables];
+    memset(table, 0, sizeof(cloudsync_apply_table_stats));
+    table->name = copy;
+    table->name_len = len;
+    stats->last = stats->ntables++;
+    return table;
+}
+
+void cloudsync_apply_stats_add (cloudsync_apply_stats *stats, cloudsync_pk_decode_bind_context *d, int action, bool approved, int rc, const char *errmsg) {
+    // record the outcome of a change, action is -1 if it is not known (INSERT INTO cloudsync_changes)
+    cloudsync_apply_table_stats *table = cloudsync_apply_stats_table(stats, d->tbl, d->tbl_len);
+    int64_t counters[CLOUDSYNC_APPLY_STATS_FAILED + 1] = {0};
+    
+    counters[CLOUDSYNC_APPLY_STATS_SEEN] = 1;
+    if (!approved) {
+        counters[CLOUDSYNC_APPLY_STATS_REJECTED] = 1;
+    } else if (rc != SQLITE_OK && rc != SQLITE_DONE) {
+        counters[CLOUDSYNC_APPLY_STATS_FAILED] = 1;
+        if (stats->nerrors < CLOUDSYNC_APPLY_STATS_MAX_ERRORS) {
+            stats->errors[stats->nerrors] = cloudsync_memory_mprintf("db_version %lld/%lld: (%d) %s", d->db_version, d->seq, rc, (errmsg) ? errmsg : "");
+        }
+        stats->nerrors++;
+    } else {
+        switch (action) {
+            case CLOUDSYNC_MERGE_SKIP: counters[CLOUDSYNC_APPLY_STATS_LOST] = 1; break;
+            case CLOUDSYNC_MERGE_EQUAL: counters[CLOUDSYNC_APPLY_STATS_EQUAL] = 1; break;
+            case CLOUDSYNC_MERGE_DELETE: counters[CLOUDSYNC_APPLY_STATS_DELETED] = 1; break;
+            case CLOUDSYNC_MERGE_RESURRECT: counters[CLOUDSYNC_APPLY_STATS_RESURRECTED] = 1; break;
+        }
+        if (action >= CLOUDSYNC_MERGE_DELETE && action <= CLOUDSYNC_MERGE_INSERT) counters[CLOUDSYNC_APPLY_STATS_APPLIED] = 1;
+    }
+    
+    for (int i=CLOUDSYNC_APPLY_STATS_SEEN; i<=CLOUDSYNC_APPLY_STATS_FAILED; ++i) {
+        stats->totals[i] += counters[i];
+        if (table) table->counters[i] += counters[i];
+    }
+}
+
+void cloudsync_apply_stats_fail (cloudsync_apply_stats *stats, const char *tbl, sqlite3_int64 db_version, sqlite3_int64 seq, int rc, const char *errmsg) {
+    // a change already counted as applied failed when its write was performed (see merge_writer_flush)
+    cloudsync_apply_table_stats *table = cloudsync_apply_stats_table(stats, tbl, (int64_t)strlen(tbl));
+    if (stats->nerrors < CLOUDSYNC_APPLY_STATS_MAX_ERRORS) {
+        stats->errors[stats->nerrors] = cloudsync_memory_mprintf("db_version %lld/%lld: (%d) %s", db_version, seq, rc, (errmsg) ? errmsg : "");
+    }
+    stats->nerrors++;
+    
+    stats->totals[CLOUDSYNC_APPLY_STATS_APPLIED] -= 1;
+    stats->totals[CLOUDSYNC_APPLY_STATS_FAILED] += 1;
+    if (table) {
+        table->counters[CLOUDSYNC_APPLY_STATS_APPLIED] -= 1;
+        table->counters[CLOUDSYNC_APPLY_STATS_FAILED] += 1;
+    }
+}
+
+int cloudsync_apply_stats_count (cloudsync_context *data) {
+    // the totals row followed by a row for each table
+    return data->apply_stats.ntables + 1;
+}
+
+void cloudsync_apply_stats_result (cloudsync_context *data, int index, int col, sqlite3_context *ctx) {
+    cloudsync_apply_stats *stats = &data->apply_stats;
+    cloudsync_apply_table_stats *table = (index > 0 && index <= stats->ntables) ? &stats->tables[index-1] : NULL;
+    
+    switch (col) {
+        case CLOUDSYNC_APPLY_STATS_TBL:
+            if (table) sqlite3_result_text(ctx, table->name, (int)table->name_len, SQLITE_TRANSIENT);
+            else sqlite3_result_null(ctx);
+            return;
+            
+        case CLOUDSYNC_APPLY_STATS_DECOMPRESS_US:
+        case CLOUDSYNC_APPLY_STATS_DECODE_US:
+        case CLOUDSYNC_APPLY_STATS_MERGE_US:
+        case CLOUDSYNC_APPLY_STATS_SAVEPOINTS: {
+            if (table) {sqlite3_result_null(ctx); return;}
+            uint64_t values[] = {stats->decompress_us, stats->decode_us, stats->merge_us, (uint64_t)stats->savepoints};
+            sqlite3_result_int64(ctx, (sqlite3_int64)values[col - CLOUDSYNC_APPLY_STATS_DECOMPRESS_US]);
+            return;
+        }
+            
+        case CLOUDSYNC_APPLY_STATS_ERRORS: {
+            // one error for each line
+            if (table || stats->nerrors == 0) {sqlite3_result_null(ctx); return;}
+            
+            int n = (stats->nerrors < CLOUDSYNC_APPLY_STATS_MAX_ERRORS) ? (int)stats->nerrors : CLOUDSYNC_APPLY_STATS_MAX_ERRORS;
+            size_t len = 0;
+            for (int i=0; i<n; ++i) len += (stats->errors[i]) ? strlen(stats->errors[i]) + 1 : 1;
+            
+            char *buffer = (char *)cloudsync_memory_alloc((uint64_t)len);
+            if (!buffer) {sqlite3_result_error_nomem(ctx); return;}
+            
+            size_t offset = 0;
+            for (int i=0; i<n; ++i) {
+                size_t size = (stats->errors[i]) ? strlen(stats->errors[i]) : 0;
+                if (size) memcpy(buffer + offset, stats->errors[i], size);
+                offset += size;
+                buffer[offset++] = '\n';
+            }
+            sqlite3_result_text(ctx, buffer, (int)(offset - 1), SQLITE_TRANSIENT);
+            cloudsync_memory_free(buffer);
+            return;
+        }
+    }
+    
+    if (col < CLOUDSYNC_APPLY_STATS_SEEN || col > CLOUDSYNC_APPLY_STATS_FAILED) {sqlite3_result_null(ctx); return;}
+    sqlite3_result_int64(ctx, (table) ? table->counters[col] : stats->totals[col]);
+}
+
+// MARK: - Merge Writer -
+
+// the direct apply path collects the winning columns of consecutive changes of the same row and writes them with a single
+// multi-column UPSERT (a new row becomes a single INSERT), the winner clocks are written right after it
+// the pending row is flushed before any change that could observe it: another row, a column already pending,
+// a sentinel, a delete or a resurrection of the same row, and before each savepoint release
+
+#define CLOUDSYNC_MERGE_WRITER_MAX_STMTS        64          // multi-column UPSERTs cached for each table
+
+typedef struct {
+    cloudsync_merge_value   value;                  // TEXT and BLOB values point inside buffer
+    sqlite3_int64           col_version;
+    sqlite3_int64           db_version;
+    sqlite3_int64           seq;
+    char                    *buffer;                // site_id followed by the TEXT/BLOB value
+    int                     site_len;
+} cloudsync_merge_writer_col;
+
+typedef struct {
+    bool                        enabled;
+    cloudsync_table_context     *table;
+    char                        *tbl;               // table name as written in the payload (for the apply statistics)
+    char                        *pk;
+    int                         pk_len;
+    int                         pk_alloc;
+    cloudsync_merge_writer_col  *cols;              // indexed by column index
+    uint64_t                    *mask;              // pending columns
+    int                         nalloc;             // allocated columns
+    int                         npending;
+    sqlite3_stmt                *savepoint[3];      // nested savepoint of each write, see merge_writer_savepoint
+} cloudsync_merge_writer;
+
+typedef enum {
+    CLOUDSYNC_WRITE_SAVEPOINT   = 0,
+    CLOUDSYNC_WRITE_RELEASE     = 1,
+    CLOUDSYNC_WRITE_ROLLBACK    = 2
+} CLOUDSYNC_WRITE_OP;
+
+int merge_writer_savepoint (cloudsync_merge_writer *writer, sqlite3 *db, CLOUDSYNC_WRITE_OP op) {
+    // the writes of a change go to the base table and to its metadata, a nested savepoint makes them atomic
+    // so that a failing change (a constraint, a RLS policy...) leaves neither a row without clock nor the reverse
+    static const char *sql[] = {"SAVEPOINT cloudsync_change;", "RELEASE cloudsync_change;", "ROLLBACK TO cloudsync_change; RELEASE cloudsync_change;"};
+    
+    // ROLLBACK TO is followed by a RELEASE, so it runs through sqlite3_exec (it happens only on errors)
+    if (op == CLOUDSYNC_WRITE_ROLLBACK) return sqlite3_exec(db, sql[op], NULL, NULL, NULL);
+    
+    int rc = SQLITE_OK;
+    if (!writer->savepoint[op]) rc = sqlite3_prepare_v3(db, sql[op], -1, SQLITE_PREPARE_PERSISTENT, &writer->savepoint[op], NULL);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = sqlite3_step(writer->savepoint[op]);
+    stmt_reset(writer->savepoint[op]);
+    return (rc == SQLITE_DONE) ? SQLITE_OK : rc;
+}
+
+void merge_writer_reset (cloudsync_merge_writer *writer) {
+    for (int i=0; writer->npending > 0 && i<writer->table->ncols; ++i) {
+        if ((writer->mask[i / 64] & (1ULL << (i % 64))) == 0) continue;
+        cloudsync_memory_free(writer->cols[i].buffer);
+        writer->cols[i].buffer = NULL;
+    }
+    if (writer->mask) memset(writer->mask, 0, (size_t)((writer->nalloc + 63) / 64) * sizeof(uint64_t));
+    writer->npending = 0;
+}
+
+void merge_writer_free (cloudsync_merge_writer *writer) {
+    if (writer->table) merge_writer_reset(writer);
+    if (writer->tbl) cloudsync_memory_free(writer->tbl);
+    if (writer->pk) cloudsync_memory_free(writer->pk);
+    if (writer->cols) cloudsync_memory_free(writer->cols);
+    if (writer->mask) cloudsync_memory_free(writer->mask);
+    for (int i=0; i<3; ++i) {
+        if (writer->savepoint[i]) sqlite3_finalize(writer->savepoint[i]);
+    }
+    memset(writer, 0, sizeof(cloudsync_merge_writer));
+}
+
+bool merge_writer_can_join (cloudsync_merge_writer *writer, cloudsync_table_context *table, const char *pk, int pk_len, const char *col_name, sqlite3_int64 cl, int *index) {
+    // true if a change can be resolved (and then collected) while the pending row has not been written yet
+    *index = -1;
+    if (!writer->enabled || table->algo == table_algo_crdt_gos || cl % 2 == 0) return false;
+    if (strcmp(col_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0) return false;
+    
+    table_column_lookup(table, col_name, false, index);
+    if (*index < 0) return false;
+    if (writer->npending == 0) return true;
+    
+    if (writer->table != table || writer->pk_len != pk_len || memcmp(writer->pk, pk, (size_t)pk_len) != 0) return false;
+    return ((writer->mask[*index / 64] & (1ULL << (*index % 64))) == 0);
+}
+
+int merge_writer_add (cloudsync_merge_writer *writer, cloudsync_table_context *table, const char *tbl, int index, const char *pk, int pk_len, const cloudsync_merge_value *value,
+                      sqlite3_int64 col_version, sqlite3_int64 db_version, const char *site_id, int site_len, sqlite3_int64 seq) {
+    // the caller checked merge_writer_can_join, so the row is either empty or the same
+    if (writer->npending == 0) {
+        if (writer->nalloc < table->ncols) {
+            int nalloc = table->ncols;
+            cloudsync_merge_writer_col *cols = (cloudsync_merge_writer_col *)cloudsync_memory_zeroalloc((uint64_t)nalloc * sizeof(cloudsync_merge_writer_col));
+            uint64_t *mask = (uint64_t *)cloudsync_memory_zeroalloc((uint64_t)((nalloc + 63) / 64) * sizeof(uint64_t));
+            if (!cols || !mask) {
+                if (cols) cloudsync_memory_free(cols);
+                if (mask) cloudsync_memory_free(mask);
+                return SQLITE_NOMEM;
+            }
+            if (writer->cols) cloudsync_memory_free(writer->cols);
+            if (writer->mask) cloudsync_memory_free(writer->mask);
+            writer->cols = cols;
+            writer->mask = mask;
+            writer->nalloc = nalloc;
+        }
+        
+        if (writer->pk_alloc < pk_len) {
+            char *buffer = (char *)cloudsync_memory_alloc((uint64_t)pk_len);
+            if (!buffer) return SQLITE_NOMEM;
+            if (writer->pk) cloudsync_memory_free(writer->pk);
+            writer->pk = buffer;
+            writer->pk_alloc = pk_len;
+        }
+        memcpy(writer->pk, pk, (size_t)pk_len);
+        writer->pk_len = pk_len;
+        
+        if (!writer->tbl || strcmp(writer->tbl, tbl) != 0) {
+            char *copy = cloudsync_string_dup(tbl, false);
+            if (!copy) return SQLITE_NOMEM;
+            if (writer->tbl) cloudsync_memory_free(writer->tbl);
+            writer->tbl = copy;
+        }
+        writer->table = table;
+    }
+    
+    // decoded values can point inside a streamed payload, so they are copied
+    bool has_data = (value->type == SQLITE_TEXT || value->type == SQLITE_BLOB);
+    int64_t value_len = (has_data) ? value->ival : 0;
+    char *buffer = (char *)cloudsync_memory_alloc((uint64_t)(site_len + value_len + 1));
+    if (!buffer) return SQLITE_NOMEM;
+    memcpy(buffer, site_id, (size_t)site_len);
+    if (value_len > 0) memcpy(buffer + site_len, value->pval, (size_t)value_len);
+    
+    cloudsync_merge_writer_col *col = &writer->cols[index];
+    col->value = *value;
+    if (has_data) col->value.pval = buffer + site_len;
+    col->col_version = col_version;
+    col->db_version = db_version;
+    col->seq = seq;
+    col->buffer = buffer;
+    col->site_len = site_len;
+    
+    writer->mask[index / 64] |= (1ULL << (index % 64));
+    writer->npending++;
+    return SQLITE_OK;
+}
+
+sqlite3_stmt *merge_writer_stmt (cloudsync_merge_writer *writer, bool *persistent) {
+    // multi-column UPSERT for the pending columns, cached by column bitmask in the table context
+    cloudsync_table_context *table = writer->table;
+    sqlite3 *db = sqlite3_db_handle(table->meta_pkexists_stmt);
+    cloudsync_blob_key key = {(const char *)writer->mask, ((table->ncols + 63) / 64) * (int)sizeof(uint64_t)};
+    
+    if (!table->merge_stmts) table->merge_stmts = kh_init(MERGE_STMTS);
+    if (table->merge_stmts) {
+        khiter_t k = kh_get(MERGE_STMTS, table->merge_stmts, key);
+        if (k != kh_end(table->merge_stmts)) {
+            *persistent = true;
+            return kh_value(table->merge_stmts, k);
+        }
+    }
+    
+    char *sql = table_build_mergeinsert_multi_sql(db, table, writer->mask);
+    if (!sql) return NULL;
+    DEBUG_SQL("merge_writer_stmt: %s", sql);
+    
+    // once the cache is full the statement is used only once
+    *persistent = (table->merge_stmts && kh_size(table->merge_stmts) < CLOUDSYNC_MERGE_WRITER_MAX_STMTS);
+    sqlite3_stmt *vm = NULL;
+    int rc = sqlite3_prepare_v3(db, sql, -1, (*persistent) ? SQLITE_PREPARE_PERSISTENT : 0, &vm, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) return NULL;
+    if (!*persistent) return vm;
+    
+    char *copy = (char *)cloudsync_memory_alloc((uint64_t)key.len);
+    int absent = -1;
+    if (copy) {
+        memcpy(copy, key.data, (size_t)key.len);
+        key.data = copy;
+        khiter_t k = kh_put(MERGE_STMTS, table->merge_stmts, key, &absent);
+        if (absent >= 0) kh_value(table->merge_stmts, k) = vm;
+    }
+    if (absent < 0) {
+        if (copy) cloudsync_memory_free(copy);
+        *persistent = false;
+    }
+    return vm;
+}
+
+int merge_writer_write_row (cloudsync_context *data, cloudsync_merge_writer *writer, const char **err) {
+    // a single UPSERT for all the pending columns, followed by their winner clocks
+    cloudsync_table_context *table = writer->table;
+    bool persistent = false;
+    sqlite3_stmt *vm = merge_writer_stmt(writer, &persistent);
+    if (!vm) {
+        *err = "Unable to prepare the multi-column merge statement.";
+        return SQLITE_ERROR;
+    }
+    
+    int rc = pk_decode_prikey(writer->pk, (size_t)writer->pk_len, pk_decode_bind_callback, vm);
+    if (rc < 0) rc = sqlite3_errcode(sqlite3_db_handle(vm));
+    else rc = SQLITE_OK;
+    
+    int bind_index = table->npks;
+    for (int i=0; rc == SQLITE_OK && i<table->ncols; ++i) {
+        if ((writer->mask[i / 64] & (1ULL << (i % 64))) == 0) continue;
+        cloudsync_merge_value *value = &writer->cols[i].value;
+        rc = pk_decode_bind_callback(vm, bind_index++, value->type, value->ival, value->dval, (char *)value->pval);
+    }
+    
+    if (rc == SQLITE_OK) {
+        SYNCBIT_SET(data);
+        rc = sqlite3_step(vm);
+        DEBUG_MERGE("merge_writer(%02x%02x): %s (%d)", data->site_id[UUID_LEN-2], data->site_id[UUID_LEN-1], sqlite3_expanded_sql(vm), rc);
+        SYNCBIT_RESET(data);
+        if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    }
+    if (rc != SQLITE_OK) *err = sqlite3_errmsg(sqlite3_db_handle(vm));
+    
+    if (persistent) stmt_reset(vm);
+    else sqlite3_finalize(vm);
+    if (rc != SQLITE_OK) return rc;
+    
+    for (int i=0; i<table->ncols; ++i) {
+        if ((writer->mask[i / 64] & (1ULL << (i % 64))) == 0) continue;
+        cloudsync_merge_writer_col *col = &writer->cols[i];
+        sqlite3_int64 rowid = 0;
+        uint8_t digest[CLOUDSYNC_SHA256_LEN];
+        bool has_digest = (table->value_digest && merge_value_digest(table, i, &col->value, digest));
+        rc = merge_set_winner_clock(data, table, writer->pk, writer->pk_len, table->col_name[i], col->col_version, col->db_version, col->buffer, col->site_len, col->seq, (has_digest) ? digest : NULL, &rowid, err);
+        if (rc != SQLITE_OK) return rc;
+    }
+    return SQLITE_OK;
+}
+
+int merge_writer_flush (cloudsync_context *data, cloudsync_merge_writer *writer, cloudsync_merge_clock *clock, char **errmsg) {
+    // write the pending row, the changes it contains were already counted as applied by the apply statistics
+    if (writer->npending == 0) return SQLITE_OK;
+    
+    cloudsync_table_context *table = writer->table;
+    sqlite3 *db = sqlite3_db_handle(table->meta_pkexists_stmt);
+    const char *err = NULL;
+    bool in_savepoint = false;
+    int rc = SQLITE_OK;
+    if (writer->npending > 1) {
+        // the UPSERT and its winner clocks are written in a nested savepoint, so a failure here has not written anything
+        rc = merge_writer_savepoint(writer, db, CLOUDSYNC_WRITE_SAVEPOINT);
+        if (rc != SQLITE_OK) goto cleanup;
+        in_savepoint = true;
+        
+        rc = merge_writer_write_row(data, writer, &err);
+        if (rc == SQLITE_OK) {
+            rc = merge_writer_savepoint(writer, db, CLOUDSYNC_WRITE_RELEASE);
+            in_savepoint = (rc != SQLITE_OK);
+        }
+        if (rc == SQLITE_OK || (rc != SQLITE_CONSTRAINT && rc != SQLITE_ERROR && rc != SQLITE_MISMATCH)) goto cleanup;
+        
+        merge_writer_savepoint(writer, db, CLOUDSYNC_WRITE_ROLLBACK);
+        in_savepoint = false;
+    }
+    
+    // one column at a time (or the UPSERT failed): the error of a column must not prevent the others from being merged
+    rc = SQLITE_OK;
+    for (int i=0; i<table->ncols; ++i) {
+        if ((writer->mask[i / 64] & (1ULL << (i % 64))) == 0) continue;
+        cloudsync_merge_writer_col *col = &writer->cols[i];
+        sqlite3_int64 rowid = 0;
+        int rc1 = merge_writer_savepoint(writer, db, CLOUDSYNC_WRITE_SAVEPOINT);
+        if (rc1 == SQLITE_OK) {
+            rc1 = merge_insert_col(data, table, writer->pk, writer->pk_len, table->col_name[i], &col->value, col->col_version, col->db_version, col->buffer, col->site_len, col->seq, &rowid, &err);
+            if (rc1 == SQLITE_OK) rc1 = merge_writer_savepoint(writer, db, CLOUDSYNC_WRITE_RELEASE);
+            if (rc1 == SQLITE_OK) continue;
+        }
+        if (!err) err = sqlite3_errmsg(db);
+        
+        if (clock) clock->valid = false;
+        cloudsync_apply_stats_fail(&data->apply_stats, writer->tbl, col->db_version, col->seq, rc1, err);
+        DEBUG_MERGE("merge_writer_flush error on db_version %lld/%lld: (%d) %s", col->db_version, col->seq, rc1, err);
+        merge_writer_savepoint(writer, db, CLOUDSYNC_WRITE_ROLLBACK);
+        err = NULL;
+    }
+    
+cleanup:
+    if (rc != SQLITE_OK) {
+        if (clock) clock->valid = false;
+        *errmsg = cloudsync_memory_mprintf("Unable to write the merged columns of %s: %s", table->name, (err) ? err : sqlite3_errmsg(db));
+        for (int i=0; i<table->ncols; ++i) {
+            if ((writer->mask[i / 64] & (1ULL << (i % 64))) == 0) continue;
+            cloudsync_apply_stats_fail(&data->apply_stats, writer->tbl, writer->cols[i].db_version, writer->cols[i].seq, rc, *errmsg);
+        }
+        if (in_savepoint) merge_writer_savepoint(writer, db, CLOUDSYNC_WRITE_ROLLBACK);
+    }
+    merge_writer_reset(writer);
+    return rc;
+}
+
+// MARK: - Private -
 
 bool cloudsync_config_exists (sqlite3 *db) {
     return dbutils_table_exists(db, CLOUDSYNC_SITEID_NAME) == true;
@@ -1515,6 +3003,11 @@ void *cloudsync_context_create (void) {
     
     data->libversion = CLOUDSYNC_VERSION;
     data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
+    data->payload_version = CLOUDSYNC_PAYLOAD_VERSION;
+    data->payload_codec = CLOUDSYNC_PAYLOAD_CODEC_LZ4;
+    data->payload_acceleration = 1;
+    data->payload_sample_check = true;
+    data->payload_threads = CLOUDSYNC_PAYLOAD_THREADS;
     #if CLOUDSYNC_DEBUG
     data->debug = 1;
     #endif
@@ -1527,6 +3020,13 @@ void *cloudsync_context_create (void) {
     }
     data->tables_alloc = CLOUDSYNC_INIT_NTABLES;
     data->tables_count = 0;
+    
+    data->tables_index = kh_init(TABLE_REGISTRY);
+    if (!data->tables_index) {
+        cloudsync_memory_free(data->tables);
+        cloudsync_memory_free(data);
+        return NULL;
+    }
         
     return data;
 }
@@ -1536,6 +3036,9 @@ void cloudsync_context_free (void *ptr) {
     if (!ptr) return;
         
     cloudsync_context *data = (cloudsync_context*)ptr;
+    cloudsync_apply_stats_reset(&data->apply_stats);
+    if (data->tables_index) kh_destroy(TABLE_REGISTRY, data->tables_index);
+    siteid_cache_free(data);
     cloudsync_memory_free(data->tables);
     cloudsync_memory_free(data);
 }
@@ -1559,6 +3062,19 @@ const char *cloudsync_context_init (sqlite3 *db, cloudsync_context *data, sqlite
     return (const char *)data->site_id;
 }
 
+void cloudsync_payload_codec_parse (const char *value, int *codec, int *acceleration) {
+    // "lz4" (default), "lz4:<acceleration>" or "none"
+    // (the acceleration trades ratio for speed: 1 gives the best LZ4 ratio, higher values are faster and compress less)
+    *codec = CLOUDSYNC_PAYLOAD_CODEC_LZ4;
+    *acceleration = 1;
+    if (value && strcasecmp(value, "none") == 0) {
+        *codec = CLOUDSYNC_PAYLOAD_CODEC_NONE;
+    } else if (value && strncasecmp(value, "lz4:", 4) == 0) {
+        int n = (int)strtol(value + 4, NULL, 0);
+        *acceleration = (n > 0) ? n : 1;
+    }
+}
+
 void cloudsync_sync_key(cloudsync_context *data, const char *key, const char *value) {
     DEBUG_SETTINGS("cloudsync_sync_key key: %s value: %s", key, value);
     
@@ -1573,6 +3089,56 @@ void cloudsync_sync_key(cloudsync_context *data, const char *key, const char *va
         if (value && (value[0] != 0) && (value[0] != '0')) data->debug = 1;
         return;
     }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_PAYLOAD_VERSION) == 0) {
+        int version = (value) ? (int)strtol(value, NULL, 0) : 0;
+        data->payload_version = (version == CLOUDSYNC_PAYLOAD_VERSION_2) ? CLOUDSYNC_PAYLOAD_VERSION_2 : CLOUDSYNC_PAYLOAD_VERSION;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_PAYLOAD_CODEC) == 0) {
+        cloudsync_payload_codec_parse(value, &data->payload_codec, &data->payload_acceleration);
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_PAYLOAD_SAMPLE_CHECK) == 0) {
+        data->payload_sample_check = !(value && value[0] == '0');
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_PAYLOAD_THREADS) == 0) {
+        int threads = (value) ? (int)strtol(value, NULL, 0) : 0;
+        if (threads < 1) threads = 1;
+        data->payload_threads = (threads > CLOUDSYNC_MAX_THREADS) ? CLOUDSYNC_MAX_THREADS : threads;
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_PAYLOAD_LOCALITY) == 0) {
+        data->payload_locality = (value && value[0] != 0 && value[0] != '0');
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_PAYLOAD_PARALLEL) == 0) {
+        data->payload_parallel = (value && value[0] != 0 && value[0] != '0');
+        return;
+    }
+    
+    if (strcmp(key, CLOUDSYNC_KEY_PAYLOAD_BATCH) == 0) {
+        // "version" (default), "rows:<n>", "ms:<n>" or "payload"
+        data->payload_batch = CLOUDSYNC_APPLY_BATCH_VERSION;
+        data->payload_batch_size = 0;
+        if (value && strcasecmp(value, "payload") == 0) {
+            data->payload_batch = CLOUDSYNC_APPLY_BATCH_PAYLOAD;
+        } else if (value && (strncasecmp(value, "rows:", 5) == 0 || strncasecmp(value, "ms:", 3) == 0)) {
+            bool rows = (strncasecmp(value, "rows:", 5) == 0);
+            int size = (int)strtol(value + ((rows) ? 5 : 3), NULL, 0);
+            if (size > 0) {
+                data->payload_batch = (rows) ? CLOUDSYNC_APPLY_BATCH_ROWS : CLOUDSYNC_APPLY_BATCH_MS;
+                data->payload_batch_size = size;
+            }
+        }
+        return;
+    }
 }
 
 #if 0
@@ -1586,9 +3152,22 @@ void cloudsync_sync_table_key(cloudsync_context *data, const char *table, const
 int cloudsync_commit_hook (void *ctx) {
     cloudsync_context *data = (cloudsync_context *)ctx;
     
+    #if CLOUDSYNC_PREUPDATE_CAPTURE
+    // the changes of the captured tables have no metadata if the application replaced the pre-update hook,
+    // ours is installed again (the returned argument tells whether it was still in place)
+    if (data->capture_db && data->capture_hook_tables > 0 && sqlite3_preupdate_hook(data->capture_db, cloudsync_preupdate_hook, data) != data) {
+        DEBUG_ALWAYS("cloudsync_commit_hook: the pre-update hook has been replaced, the transaction is rolled back");
+        data->capture_failed = true;
+    }
+    #endif
+    
+    // a change without metadata would never be sent, so the transaction is turned into a rollback
+    if (data->capture_failed) return 1;
+    
     data->db_version = data->pending_db_version;
     data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
     data->seq = 0;
+    data->siteid_txn += 1;
     
     return SQLITE_OK;
 }
@@ -1596,9 +3175,83 @@ int cloudsync_commit_hook (void *ctx) {
 void cloudsync_rollback_hook (void *ctx) {
     cloudsync_context *data = (cloudsync_context *)ctx;
     
+    data->capture_failed = false;
     data->pending_db_version = CLOUDSYNC_VALUE_NOTSET;
     data->seq = 0;
+    data->siteid_txn += 1;
+    
+    // ordinals learned in the transaction could refer to rows that no longer exist
+    siteid_cache_clear(data);
+}
+
+#if CLOUDSYNC_PREUPDATE_CAPTURE
+void cloudsync_preupdate_hook (void *ctx, sqlite3 *db, int op, const char *zdb, const char *zname, sqlite3_int64 key1, sqlite3_int64 key2) {
+    cloudsync_context *data = (cloudsync_context *)ctx;
+    
+    // same conditions of the WHEN clause of the triggers (the metadata written below comes here too, as an unknown table)
+    // deletes are left to the AFTER DELETE trigger, which is not fired by the delete of a REPLACE (unless recursive_triggers
+    // is enabled): the following insert of the same primary key is then recorded as an update of the existing row
+    if (op == SQLITE_DELETE || data->capture_hook_tables == 0 || data->insync || strcmp(zdb, "main") != 0) return;
+    cloudsync_table_context *table = table_lookup(data, zname);
+    if (!table || !table->capture_hook || !table->enabled || table->pk_name) return;
+    
+    // the values must be read before any write: a nested write resets the pre-update state of the connection
+    // new_values and old_values contain the primary keys (in pk_id order) followed by the columns (in cid order)
+    sqlite3_value *stack[64];
+    int nvalues = table->npks + ((op == SQLITE_UPDATE) ? table->ncols : 0);
+    sqlite3_value **values = (nvalues * 2 <= (int)(sizeof(stack) / sizeof(stack[0]))) ? stack : (sqlite3_value **)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(sqlite3_value *) * nvalues * 2));
+    if (!values) {
+        data->capture_failed = true;
+        return;
+    }
+    sqlite3_value **new_values = values;
+    sqlite3_value **old_values = values + nvalues;
+    
+    int rc = SQLITE_OK;
+    for (int i=0; i<nvalues && rc == SQLITE_OK; ++i) {
+        int cid = (i < table->npks) ? table->pk_id[i] : table->col_id[i - table->npks];
+        rc = sqlite3_preupdate_new(db, cid, &new_values[i]);
+        if (op == SQLITE_UPDATE && rc == SQLITE_OK) rc = sqlite3_preupdate_old(db, cid, &old_values[i]);
+    }
+    if (rc != SQLITE_OK) goto cleanup;
+    
+    if (op == SQLITE_UPDATE) {
+        rc = local_mark_update(db, data, table, new_values, old_values);
+        goto cleanup;
+    }
+    
+    char buffer[1024];
+    size_t pklen = sizeof(buffer);
+    char *pk = pk_encode_prikey(new_values, table->npks, buffer, &pklen);
+    if (!pk) {
+        rc = SQLITE_NOMEM;
+        goto cleanup;
+    }
+    
+    // the triggers run after the write and the hook before it, but the metadata does not depend on the row
+    rc = local_mark_insert(db, data, table, pk, pklen);
+    if (pk != buffer) cloudsync_memory_free(pk);
+    
+cleanup:
+    // the hook cannot fail the statement, the error is reported by the commit
+    if (rc != SQLITE_OK) {
+        DEBUG_ALWAYS("cloudsync_preupdate_hook error on table %s: %s (%d)", zname, sqlite3_errmsg(db), rc);
+        data->capture_failed = true;
+    }
+    if (values != stack) cloudsync_memory_free(values);
+}
+
+void cloudsync_preupdate_hook_install (sqlite3 *db, cloudsync_context *data) {
+    // installed when the first table opts in to the hook capture, so the pre-update hook of an application that never
+    // opts in is left alone (it stays installed afterwards, it returns at once when no table is captured)
+    // sqlite3_preupdate_hook returns only the argument of the previous hook, so a previous callback cannot be chained:
+    // the connection must not use another pre-update hook while a table is captured by ours
+    if (data->capture_db == db) return;
+    void *prev = sqlite3_preupdate_hook(db, cloudsync_preupdate_hook, data);
+    if (prev && prev != data) DEBUG_ALWAYS("cloudsync_preupdate_hook_install: a pre-update hook of the application has been replaced");
+    data->capture_db = db;
 }
+#endif
 
 int cloudsync_finalize_alter (sqlite3_context *context, cloudsync_context *data, cloudsync_table_context *table) {
     int rc = SQLITE_OK;
@@ -1717,6 +3370,9 @@ int cloudsync_refill_metatable (sqlite3 *db, cloudsync_context *data, const char
     cloudsync_memory_free(sql);
     if (rc != SQLITE_OK) goto finalize;
     
+    // grow-only set rows are tracked by their sentinel only
+    if (table->real_merge_gos_stmt) goto finalize;
+    
     // fill missing colums
     // for each non-pk column:
     // The new query does 1 encode per source row and one indexed NOT-EXISTS probe.
@@ -1915,11 +3571,260 @@ cleanup:
     return rc;
 }
 
-// MARK: - Payload Encode / Decode -
+// the metadata of a local write, shared by the triggers (cloudsync_insert, cloudsync_update and cloudsync_delete)
+// and by cloudsync_preupdate_hook
+// each write of a column is marked at once and increments its col_version, also when a transaction writes the same
+// column many times: the marks cannot be buffered until the commit (a commit hook must not write, and cloudsync_changes,
+// payload encode and merges must see them inside the transaction), and counting a single write per transaction
+// would change the winner of col_version ties against peers that count every write
 
-bool cloudsync_buffer_free (cloudsync_data_payload *payload) {
+int local_mark_insert (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen) {
+    // compute the next database version for tracking changes
+    sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
+    
+    if (table->ncols == 0) {
+        // if there are no columns other than primary keys, insert a sentinel record
+        return local_mark_insert_sentinel_meta(db, table, pk, pklen, db_version, BUMP_SEQ(data));
+    }
+    
+    if (table->real_merge_gos_stmt) {
+        // grow-only set rows are never updated, their sentinel stands for all the columns and
+        // reserves a seq for each of them (it can be exported one column at a time, see cloudsync_gos_expand)
+        int seq = BUMP_SEQ(data);
+        data->seq += table->ncols - 1;
+        return local_mark_insert_sentinel_meta(db, table, pk, pklen, db_version, seq);
+    }
+    
+    // check if a row with the same primary key already exists
+    // if so, this means the row might have been previously deleted (sentinel)
+    bool pk_exists = (bool)stmt_count(table->meta_pkexists_stmt, pk, pklen, SQLITE_BLOB);
+    if (pk_exists) {
+        // if a row with the same primary key already exists, update the sentinel record
+        int rc = local_update_sentinel(db, table, pk, pklen, db_version, BUMP_SEQ(data));
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    // process each non-primary key column for insert or update
+    for (int i=0; i<table->ncols; ++i) {
+        // mark the column as inserted or updated in the metadata
+        int rc = local_mark_insert_or_update_meta(db, table, pk, pklen, table->col_name[i], db_version, BUMP_SEQ(data));
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    return SQLITE_OK;
+}
+
+int local_mark_delete (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table, const char *pk, size_t pklen) {
+    // compute the next database version for tracking changes
+    sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
+    
+    // mark the row as deleted by inserting a delete sentinel into the metadata
+    int rc = local_mark_delete_meta(db, table, pk, pklen, db_version, BUMP_SEQ(data));
+    if (rc != SQLITE_OK) return rc;
+    
+    // remove any metadata related to the old rows associated with this primary key
+    return local_drop_meta(db, table, pk, pklen);
+}
+
+int local_mark_update (sqlite3 *db, cloudsync_context *data, cloudsync_table_context *table, sqlite3_value **new_values, sqlite3_value **old_values) {
+    // new_values and old_values contain the primary keys followed by the columns (in cid order)
+    
+    // compute the next database version for tracking changes
+    sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
+    int rc = SQLITE_OK;
+    
+    // Check if the primary key(s) have changed
+    bool prikey_changed = false;
+    for (int i=0; i<table->npks; ++i) {
+        if (dbutils_value_compare(old_values[i], new_values[i]) != 0) {
+            prikey_changed = true;
+            break;
+        }
+    }
+
+    // encode the NEW primary key values into a buffer (used later for indexing)
+    char buffer[1024];
+    char buffer2[1024];
+    size_t pklen = sizeof(buffer);
+    size_t oldpklen = sizeof(buffer2);
+    char *oldpk = NULL;
+    
+    char *pk = pk_encode_prikey(new_values, table->npks, buffer, &pklen);
+    if (!pk) return SQLITE_NOMEM;
+    
+    if (prikey_changed) {
+        // if the primary key has changed, we need to handle the row differently:
+        // 1. mark the old row (OLD primary key) as deleted
+        // 2. create a new row (NEW primary key)
+        
+        // encode the OLD primary key into a buffer
+        oldpk = pk_encode_prikey(old_values, table->npks, buffer2, &oldpklen);
+        if (!oldpk) {
+            rc = SQLITE_NOMEM;
+            goto cleanup;
+        }
+        
+        // mark the rows with the old primary key as deleted in the metadata (old row handling)
+        rc = local_mark_delete_meta(db, table, oldpk, oldpklen, db_version, BUMP_SEQ(data));
+        if (rc != SQLITE_OK) goto cleanup;
+        
+        // move non-sentinel metadata entries from OLD primary key to NEW primary key
+        // handles the case where some metadata is retained across primary key change
+        // see https://github.com/sqliteai/sqlite-sync/blob/main/docs/PriKey.md for more details
+        rc = local_update_move_meta(db, table, pk, pklen, oldpk, oldpklen, db_version);
+        if (rc != SQLITE_OK) goto cleanup;
+        
+        // mark a new sentinel row with the new primary key in the metadata
+        rc = local_mark_insert_sentinel_meta(db, table, pk, pklen, db_version, BUMP_SEQ(data));
+        if (rc != SQLITE_OK) goto cleanup;
+    }
+    
+    // compare NEW and OLD values (excluding primary keys) to handle column updates
+    for (int i=0; i<table->ncols; i++) {
+        int col_index = table->npks + i;  // Regular columns start after primary keys
+
+        if (dbutils_value_compare(old_values[col_index], new_values[col_index]) != 0) {
+            // if a column value has changed, mark it as updated in the metadata
+            // columns are in cid order
+            rc = local_mark_insert_or_update_meta(db, table, pk, pklen, table->col_name[i], db_version, BUMP_SEQ(data));
+            if (rc != SQLITE_OK) goto cleanup;
+        }
+    }
+    
+cleanup:
+    if (pk != buffer) cloudsync_memory_free(pk);
+    if (oldpk && (oldpk != buffer2)) cloudsync_memory_free(oldpk);
+    return rc;
+}
+
+// MARK: - Payload Dictionaries -
+
+// Payload v2 replaces repeated table names, column names and site_ids with a reference to a per-payload dictionary.
+// A reference is a varint: 0 means that a new entry follows (varint length + bytes) and it is appended to the dictionary,
+// any other value N refers to the entry N-1 already defined in the same payload.
+
+uint64_t cloudsync_payload_dict_hash (const char *key, int64_t len) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ULL;
+    for (int64_t i=0; i<len; ++i) {
+        h ^= (uint8_t)key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+void cloudsync_payload_dict_free (cloudsync_payload_dict *dict) {
+    if (dict->owned || dict->copy) {
+        for (int i=0; i<dict->count; ++i) cloudsync_memory_free(dict->keys[i]);
+    }
+    if (dict->keys) cloudsync_memory_free(dict->keys);
+    if (dict->lens) cloudsync_memory_free(dict->lens);
+    if (dict->slots) cloudsync_memory_free(dict->slots);
+    
+    bool owned = dict->owned;
+    bool copy = dict->copy;
+    memset(dict, 0, sizeof(cloudsync_payload_dict));
+    dict->owned = owned;
+    dict->copy = copy;
+}
+
+int cloudsync_payload_dict_find (cloudsync_payload_dict *dict, const char *key, int64_t len) {
+    if (dict->nslots == 0) return -1;
+    
+    int mask = dict->nslots - 1;
+    for (int i = (int)(cloudsync_payload_dict_hash(key, len) & mask); ; i = (i + 1) & mask) {
+        int index = dict->slots[i] - 1;
+        if (index < 0) return -1;
+        if ((dict->lens[index] == len) && (len == 0 || memcmp(dict->keys[index], key, (size_t)len) == 0)) return index;
+    }
+}
+
+void cloudsync_payload_dict_slot_set (cloudsync_payload_dict *dict, int index) {
+    int mask = dict->nslots - 1;
+    int i = (int)(cloudsync_payload_dict_hash(dict->keys[index], dict->lens[index]) & mask);
+    while (dict->slots[i] != 0) i = (i + 1) & mask;
+    dict->slots[i] = index + 1;
+}
+
+void cloudsync_payload_dict_truncate (cloudsync_payload_dict *dict, int count) {
+    // undo the entries added by a partially decoded row (decoder) or by the rows removed from a frame (encoder)
+    if (count >= dict->count) return;
+    if (dict->owned || dict->copy) {
+        for (int i=count; i<dict->count; ++i) cloudsync_memory_free(dict->keys[i]);
+    }
+    dict->count = count;
+    
+    // entries cannot be removed from the open addressing index, so it is rebuilt
+    if (dict->slots) {
+        memset(dict->slots, 0, (size_t)dict->nslots * sizeof(int));
+        for (int i=0; i<count; ++i) cloudsync_payload_dict_slot_set(dict, i);
+    }
+}
+
+int cloudsync_payload_dict_add (cloudsync_payload_dict *dict, char *key, int64_t len) {
+    // returns the index of the new entry or -1 in case of OOM
+    if (dict->count == dict->alloc) {
+        int alloc = (dict->alloc) ? dict->alloc * 2 : 16;
+        char **keys = cloudsync_memory_realloc(dict->keys, (sqlite3_uint64)(alloc * sizeof(char *)));
+        if (!keys) return -1;
+        dict->keys = keys;
+        
+        int64_t *lens = cloudsync_memory_realloc(dict->lens, (sqlite3_uint64)(alloc * sizeof(int64_t)));
+        if (!lens) return -1;
+        dict->lens = lens;
+        dict->alloc = alloc;
+    }
+    
+    // the decoder simply points inside the payload buffer (unless it is streamed)
+    if (dict->owned || dict->copy) {
+        char *copy = cloudsync_memory_alloc((sqlite3_uint64)(len + 1));
+        if (!copy) return -1;
+        if (len) memcpy(copy, key, (size_t)len);
+        key = copy;
+    }
+    
+    int index = dict->count++;
+    dict->keys[index] = key;
+    dict->lens[index] = len;
+    if (!dict->owned) return index;
+    
+    // keep the load factor of the hash index below 0.5
+    if (dict->count * 2 > dict->nslots) {
+        int nslots = (dict->nslots) ? dict->nslots * 2 : 32;
+        int *slots = cloudsync_memory_zeroalloc((uint64_t)(nslots * sizeof(int)));
+        if (!slots) return -1;
+        
+        if (dict->slots) cloudsync_memory_free(dict->slots);
+        dict->slots = slots;
+        dict->nslots = nslots;
+        for (int i=0; i<dict->count; ++i) cloudsync_payload_dict_slot_set(dict, i);
+    } else {
+        cloudsync_payload_dict_slot_set(dict, index);
+    }
+    
+    return index;
+}
+
+// MARK: - Payload Encode / Decode -
+
+void cloudsync_buffer_state_reset (cloudsync_data_payload *payload) {
+    cloudsync_payload_dict_free(&payload->tbl_dict);
+    cloudsync_payload_dict_free(&payload->col_dict);
+    cloudsync_payload_dict_free(&payload->site_dict);
+    payload->tbl_dict.owned = payload->col_dict.owned = payload->site_dict.owned = true;
+    
+    payload->last_tbl = -1;
+    payload->last_pk_offset = 0;
+    payload->last_pk_len = 0;
+    payload->last_site = -1;
+    payload->last_db_version = 0;
+    payload->last_seq = 0;
+}
+
+bool cloudsync_buffer_free (cloudsync_data_payload *payload) {
     if (payload) {
         if (payload->buffer) cloudsync_memory_free(payload->buffer);
+        cloudsync_buffer_state_reset(payload);
         memset(payload, 0, sizeof(cloudsync_data_payload));
     }
         
@@ -1945,7 +3850,7 @@ bool cloudsync_buffer_check (cloudsync_data_payload *payload, size_t needed) {
     return true;
 }
 
-void cloudsync_payload_header_init (cloudsync_payload_header *header, uint32_t expanded_size, uint16_t ncols, uint32_t nrows, uint64_t hash) {
+void cloudsync_payload_header_init (cloudsync_payload_header *header, uint8_t version, uint8_t codec, uint32_t expanded_size, uint16_t ncols, uint32_t nrows, uint64_t hash) {
     memset(header, 0, sizeof(cloudsync_payload_header));
     assert(sizeof(cloudsync_payload_header)==32);
     
@@ -1953,7 +3858,7 @@ void cloudsync_payload_header_init (cloudsync_payload_header *header, uint32_t e
     sscanf(CLOUDSYNC_VERSION, "%d.%d.%d", &major, &minor, &patch);
     
     header->signature = htonl(CLOUDSYNC_PAYLOAD_SIGNATURE);
-    header->version = CLOUDSYNC_PAYLOAD_VERSION;
+    header->version = version;
     header->libversion[0] = major;
     header->libversion[1] = minor;
     header->libversion[2] = patch;
@@ -1961,6 +3866,460 @@ void cloudsync_payload_header_init (cloudsync_payload_header *header, uint32_t e
     header->ncols = htons(ncols);
     header->nrows = htonl(nrows);
     header->schema_hash = htonll(hash);
+    header->codec = codec;
+}
+
+void cloudsync_buffer_save (cloudsync_data_payload *payload, cloudsync_payload_encoder_mark *mark) {
+    *mark = (cloudsync_payload_encoder_mark){.bused = payload->bused, .nrows = payload->nrows, .last_tbl = payload->last_tbl, .last_pk_offset = payload->last_pk_offset,
+                                             .last_pk_len = payload->last_pk_len, .last_site = payload->last_site, .last_db_version = payload->last_db_version,
+                                             .last_seq = payload->last_seq, .ntbl = payload->tbl_dict.count, .ncol = payload->col_dict.count, .nsite = payload->site_dict.count};
+}
+
+void cloudsync_buffer_rewind (cloudsync_data_payload *payload, cloudsync_payload_encoder_mark *mark) {
+    // removes the rows appended after the mark (which must not be taken on an empty payload)
+    payload->bused = mark->bused;
+    payload->nrows = mark->nrows;
+    payload->last_tbl = mark->last_tbl;
+    payload->last_pk_offset = mark->last_pk_offset;
+    payload->last_pk_len = mark->last_pk_len;
+    payload->last_site = mark->last_site;
+    payload->last_db_version = mark->last_db_version;
+    payload->last_seq = mark->last_seq;
+    cloudsync_payload_dict_truncate(&payload->tbl_dict, mark->ntbl);
+    cloudsync_payload_dict_truncate(&payload->col_dict, mark->ncol);
+    cloudsync_payload_dict_truncate(&payload->site_dict, mark->nsite);
+}
+
+void cloudsync_buffer_reset (cloudsync_data_payload *payload) {
+    // keep the allocated buffer around so it can be reused for the next frame
+    payload->nrows = 0;
+    payload->ncols = 0;
+    payload->bused = (payload->buffer) ? sizeof(cloudsync_payload_header) : 0;
+    cloudsync_buffer_state_reset(payload);
+}
+
+static inline uint64_t cloudsync_zigzag_encode (int64_t value) {
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t cloudsync_zigzag_decode (uint64_t value) {
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+bool cloudsync_buffer_append_ref (cloudsync_data_payload *payload, cloudsync_payload_dict *dict, sqlite3_value *value, size_t *bseek, int64_t *index) {
+    const char *key = (const char *)sqlite3_value_blob(value);
+    int64_t len = (int64_t)sqlite3_value_bytes(value);
+    
+    int i = cloudsync_payload_dict_find(dict, key, len);
+    if (i >= 0) {
+        *bseek = pk_encode_varint(payload->buffer, *bseek, (uint64_t)i + 1);
+    } else {
+        i = cloudsync_payload_dict_add(dict, (char *)key, len);
+        if (i < 0) return false;
+        
+        *bseek = pk_encode_varint(payload->buffer, *bseek, 0);
+        *bseek = pk_encode_varint(payload->buffer, *bseek, (uint64_t)len);
+        if (len) memcpy(payload->buffer + *bseek, key, (size_t)len);
+        *bseek += (size_t)len;
+    }
+    
+    if (index) *index = i;
+    return true;
+}
+
+bool cloudsync_buffer_append_v2 (cloudsync_data_payload *payload, sqlite3_value **argv) {
+    // row layout: flags, [tbl ref, pk], col_name ref, col_value, col_version, db_version delta, [site_id ref], cl, seq delta
+    // consecutive changes of the same (tbl, pk) share the table reference and the primary key
+    size_t tbl_len = (size_t)sqlite3_value_bytes(argv[CLOUDSYNC_PK_INDEX_TBL]);
+    size_t pk_len = (size_t)sqlite3_value_bytes(argv[CLOUDSYNC_PK_INDEX_PK]);
+    size_t col_len = (size_t)sqlite3_value_bytes(argv[CLOUDSYNC_PK_INDEX_COLNAME]);
+    size_t site_len = (size_t)sqlite3_value_bytes(argv[CLOUDSYNC_PK_INDEX_SITEID]);
+    size_t breq = 1 + (20 + tbl_len) + (10 + pk_len) + (20 + col_len) + (20 + site_len) + (4 * 10);
+    breq += pk_encode_size(&argv[CLOUDSYNC_PK_INDEX_COLVALUE], 1, 0);
+    if (cloudsync_buffer_check(payload, breq) == false) return false;
+    
+    const char *pk = (const char *)sqlite3_value_blob(argv[CLOUDSYNC_PK_INDEX_PK]);
+    const char *tbl = (const char *)sqlite3_value_blob(argv[CLOUDSYNC_PK_INDEX_TBL]);
+    const char *site_id = (const char *)sqlite3_value_blob(argv[CLOUDSYNC_PK_INDEX_SITEID]);
+    int tbl_index = cloudsync_payload_dict_find(&payload->tbl_dict, tbl, (int64_t)tbl_len);
+    int site_index = cloudsync_payload_dict_find(&payload->site_dict, site_id, (int64_t)site_len);
+    
+    uint8_t flags = 0;
+    bool same_pk = (payload->nrows > 0) && (tbl_index >= 0) && (tbl_index == payload->last_tbl) && (pk_len == payload->last_pk_len) &&
+                   (pk_len == 0 || memcmp(payload->buffer + payload->last_pk_offset, pk, pk_len) == 0);
+    if (!same_pk) flags |= CLOUDSYNC_PAYLOAD_ROW_NEWPK;
+    if (site_index >= 0 && site_index == payload->last_site) flags |= CLOUDSYNC_PAYLOAD_ROW_SAMESITE;
+    
+    size_t bseek = payload->bused;
+    bseek = pk_encode_varint(payload->buffer, bseek, flags);
+    
+    if (flags & CLOUDSYNC_PAYLOAD_ROW_NEWPK) {
+        if (!cloudsync_buffer_append_ref(payload, &payload->tbl_dict, argv[CLOUDSYNC_PK_INDEX_TBL], &bseek, &payload->last_tbl)) return false;
+        bseek = pk_encode_varint(payload->buffer, bseek, (uint64_t)pk_len);
+        if (pk_len) memcpy(payload->buffer + bseek, pk, pk_len);
+        payload->last_pk_offset = bseek;
+        payload->last_pk_len = pk_len;
+        bseek += pk_len;
+    }
+    
+    if (!cloudsync_buffer_append_ref(payload, &payload->col_dict, argv[CLOUDSYNC_PK_INDEX_COLNAME], &bseek, NULL)) return false;
+    
+    pk_encode(&argv[CLOUDSYNC_PK_INDEX_COLVALUE], 1, payload->buffer + bseek, false, NULL);
+    bseek += pk_encode_size(&argv[CLOUDSYNC_PK_INDEX_COLVALUE], 1, 0);
+    
+    int64_t db_version = sqlite3_value_int64(argv[CLOUDSYNC_PK_INDEX_DBVERSION]);
+    int64_t seq = sqlite3_value_int64(argv[CLOUDSYNC_PK_INDEX_SEQ]);
+    bseek = pk_encode_varint(payload->buffer, bseek, cloudsync_zigzag_encode(sqlite3_value_int64(argv[CLOUDSYNC_PK_INDEX_COLVERSION])));
+    bseek = pk_encode_varint(payload->buffer, bseek, cloudsync_zigzag_encode(db_version - payload->last_db_version));
+    
+    if ((flags & CLOUDSYNC_PAYLOAD_ROW_SAMESITE) == 0) {
+        if (!cloudsync_buffer_append_ref(payload, &payload->site_dict, argv[CLOUDSYNC_PK_INDEX_SITEID], &bseek, &payload->last_site)) return false;
+    }
+    
+    bseek = pk_encode_varint(payload->buffer, bseek, cloudsync_zigzag_encode(sqlite3_value_int64(argv[CLOUDSYNC_PK_INDEX_CL])));
+    bseek = pk_encode_varint(payload->buffer, bseek, cloudsync_zigzag_encode(seq - payload->last_seq));
+    
+    payload->last_db_version = db_version;
+    payload->last_seq = seq;
+    payload->bused = bseek;
+    return true;
+}
+
+bool cloudsync_buffer_append (cloudsync_data_payload *payload, cloudsync_context *data, int argc, sqlite3_value **argv) {
+    // check if the function is called for the first time
+    if (payload->nrows == 0) {
+        payload->ncols = argc;
+        
+        // v2 requires the exact layout of the cloudsync_changes table
+        bool use_v2 = (data->payload_version >= CLOUDSYNC_PAYLOAD_VERSION_2 && argc == CLOUDSYNC_PAYLOAD_NCOLS);
+        payload->version = (use_v2) ? CLOUDSYNC_PAYLOAD_VERSION_2 : CLOUDSYNC_PAYLOAD_VERSION_1;
+        payload->codec = (uint8_t)data->payload_codec;
+        payload->acceleration = data->payload_acceleration;
+        payload->sample_check = data->payload_sample_check;
+        payload->threads = data->payload_threads;
+        cloudsync_buffer_state_reset(payload);
+    }
+    
+    if (payload->version == CLOUDSYNC_PAYLOAD_VERSION_2) {
+        if (cloudsync_buffer_append_v2(payload, argv) == false) return false;
+    } else {
+        size_t breq = pk_encode_size(argv, argc, 0);
+        if (cloudsync_buffer_check(payload, breq) == false) return false;
+        
+        char *buffer = payload->buffer + payload->bused;
+        char *ptr = pk_encode(argv, argc, buffer, false, NULL);
+        assert(buffer == ptr);
+        
+        // update buffer
+        payload->bused += breq;
+    }
+    
+    // increment row counter
+    ++payload->nrows;
+    return true;
+}
+
+bool cloudsync_buffer_is_compressible (cloudsync_data_payload *payload, const char *src, int size) {
+    // sample a few windows spread across the rows and try to compress them:
+    // BLOB-heavy payloads (images, already compressed data) would only waste CPU time in LZ4
+    int window = CLOUDSYNC_PAYLOAD_SAMPLE_SIZE;
+    int nwindows = CLOUDSYNC_PAYLOAD_SAMPLE_WINDOWS;
+    if (!payload->sample_check || size < (window * nwindows * 2)) return true;
+    
+    int sample_size = window * nwindows;
+    int zbound = LZ4_compressBound(sample_size);
+    char *sample = cloudsync_memory_alloc(sample_size + zbound);
+    if (!sample) return true;
+    
+    int step = size / nwindows;
+    for (int i=0; i<nwindows; ++i) {
+        memcpy(sample + (i * window), src + (i * step), window);
+    }
+    
+    int zused = LZ4_compress_fast(sample, sample + sample_size, sample_size, zbound, payload->acceleration);
+    cloudsync_memory_free(sample);
+    
+    return (zused > 0 && zused < (int)(sample_size * CLOUDSYNC_PAYLOAD_SAMPLE_RATIO));
+}
+
+// MARK: - Payload Blocks -
+
+// large payloads are split into blocks compressed independently so that both the sender and the receiver
+// can use more than one core; the compressed body starts with a block table:
+// nblocks (uint32), block_size (uint32) and the compressed size of each block (uint32), all in network order
+
+typedef struct {
+    const char  *src;
+    char        *dst;
+    int         src_size;
+    int         dst_size;
+    int         block_size;
+    int         slot_size;          // compressor only: space reserved in dst for each block
+    int         acceleration;
+    int         *zsize;             // compressed size of each block
+    int         *zoffset;           // decompressor only: offset of each block in src
+    int         *result;            // result of each LZ4 call
+} cloudsync_payload_blocks;
+
+static void cloudsync_payload_block_compress (void *ctx, int index) {
+    cloudsync_payload_blocks *blocks = (cloudsync_payload_blocks *)ctx;
+    int offset = index * blocks->block_size;
+    int size = (blocks->src_size - offset < blocks->block_size) ? blocks->src_size - offset : blocks->block_size;
+    blocks->result[index] = LZ4_compress_fast(blocks->src + offset, blocks->dst + ((size_t)index * blocks->slot_size), size, blocks->slot_size, blocks->acceleration);
+}
+
+static void cloudsync_payload_block_decompress (void *ctx, int index) {
+    cloudsync_payload_blocks *blocks = (cloudsync_payload_blocks *)ctx;
+    int offset = index * blocks->block_size;
+    int size = (blocks->dst_size - offset < blocks->block_size) ? blocks->dst_size - offset : blocks->block_size;
+    int rc = LZ4_decompress_safe(blocks->src + blocks->zoffset[index], blocks->dst + offset, blocks->zsize[index], size);
+    blocks->result[index] = (rc == size) ? rc : -1;
+}
+
+char *cloudsync_payload_blocks_compress (const char *src, int size, int header_size, int acceleration, int nthreads, int *zused) {
+    // returns a buffer with header_size reserved bytes followed by the block table and the compressed blocks
+    int block_size = CLOUDSYNC_PAYLOAD_BLOCK_SIZE;
+    int nblocks = (size + block_size - 1) / block_size;
+    int table_size = (2 + nblocks) * (int)sizeof(uint32_t);
+    int slot_size = LZ4_compressBound(block_size);
+    
+    char *buffer = cloudsync_memory_alloc((uint64_t)header_size + table_size + ((uint64_t)nblocks * slot_size));
+    int *result = cloudsync_memory_alloc((uint64_t)nblocks * sizeof(int));
+    if (!buffer || !result) goto abort_compress;
+    
+    char *dst = buffer + header_size + table_size;
+    cloudsync_payload_blocks blocks = {.src = src, .dst = dst, .src_size = size, .block_size = block_size, .slot_size = slot_size, .acceleration = acceleration, .result = result};
+    cloudsync_parallel_run(nthreads, nblocks, cloudsync_payload_block_compress, &blocks);
+    
+    // compact the blocks (each one was compressed into its own slot) and write the block table
+    uint32_t *table = (uint32_t *)(buffer + header_size);
+    table[0] = htonl((uint32_t)nblocks);
+    table[1] = htonl((uint32_t)block_size);
+    int offset = 0;
+    for (int i=0; i<nblocks; ++i) {
+        if (result[i] <= 0) goto abort_compress;
+        memmove(dst + offset, dst + ((size_t)i * slot_size), result[i]);
+        table[2 + i] = htonl((uint32_t)result[i]);
+        offset += result[i];
+    }
+    
+    cloudsync_memory_free(result);
+    *zused = table_size + offset;
+    return buffer;
+    
+abort_compress:
+    if (buffer) cloudsync_memory_free(buffer);
+    if (result) cloudsync_memory_free(result);
+    return NULL;
+}
+
+int *cloudsync_payload_blocks_table (const char *src, int size, uint32_t expanded_size, int64_t *nblocks, int64_t *block_size) {
+    // validate the block table before touching the blocks
+    // returns an array with the compressed size, the offset and room for the result of each block
+    if (size < (int)(2 * sizeof(uint32_t))) return NULL;
+    
+    uint32_t header[2];
+    memcpy(header, src, sizeof(header));
+    *nblocks = ntohl(header[0]);
+    *block_size = ntohl(header[1]);
+    if (*block_size == 0 || *block_size > INT_MAX || *nblocks != ((int64_t)expanded_size + *block_size - 1) / *block_size) return NULL;
+    
+    int64_t table_size = (2 + *nblocks) * (int64_t)sizeof(uint32_t);
+    if (table_size > size) return NULL;
+    
+    int *values = cloudsync_memory_alloc((uint64_t)*nblocks * 3 * sizeof(int));
+    if (!values) return NULL;
+    
+    int *zsize = values;
+    int *zoffset = values + *nblocks;
+    int64_t offset = table_size;
+    for (int64_t i=0; i<*nblocks; ++i) {
+        uint32_t value;
+        memcpy(&value, src + ((2 + i) * sizeof(uint32_t)), sizeof(uint32_t));
+        zsize[i] = (int)ntohl(value);
+        zoffset[i] = (int)offset;
+        if (zsize[i] <= 0) goto abort_table;
+        offset += zsize[i];
+        if (offset > size) goto abort_table;
+    }
+    if (offset != size) goto abort_table;
+    
+    return values;
+    
+abort_table:
+    cloudsync_memory_free(values);
+    return NULL;
+}
+
+char *cloudsync_payload_blocks_decompress (const char *src, int size, uint32_t expanded_size, int nthreads) {
+    int64_t nblocks = 0;
+    int64_t block_size = 0;
+    int *values = cloudsync_payload_blocks_table(src, size, expanded_size, &nblocks, &block_size);
+    if (!values) return NULL;
+    
+    char *buffer = cloudsync_memory_alloc(expanded_size);
+    if (!buffer) goto abort_decompress;
+    
+    int *result = values + (2 * nblocks);
+    cloudsync_payload_blocks blocks = {.src = src, .dst = buffer, .dst_size = (int)expanded_size, .block_size = (int)block_size, .zsize = values, .zoffset = values + nblocks, .result = result};
+    cloudsync_parallel_run(nthreads, (int)nblocks, cloudsync_payload_block_decompress, &blocks);
+    
+    for (int64_t i=0; i<nblocks; ++i) {
+        if (result[i] < 0) goto abort_decompress;
+    }
+    
+    cloudsync_memory_free(values);
+    return buffer;
+    
+abort_decompress:
+    if (buffer) cloudsync_memory_free(buffer);
+    if (values) cloudsync_memory_free(values);
+    return NULL;
+}
+
+// MARK: - Payload Stream -
+
+// rows of large block payloads are decoded from a window that holds only the blocks not yet consumed
+// (nthreads blocks are decompressed at a time), so the memory used by the apply does not depend on the payload size
+
+typedef struct {
+    const char  *src;                   // block table followed by the compressed blocks
+    int64_t     nblocks;
+    int64_t     block_size;
+    int64_t     next;                   // first block not yet decompressed
+    uint32_t    expanded_size;
+    int         *values;                // compressed size, offset and result of each block
+    int         nthreads;
+    char        *window;                // decompressed bytes not yet decoded are in [wstart, wend)
+    size_t      wstart;
+    size_t      wend;
+    size_t      walloc;
+    uint64_t    elapsed_us;             // time spent decompressing the blocks
+} cloudsync_payload_stream;
+
+static void cloudsync_payload_stream_block (void *ctx, int index) {
+    cloudsync_payload_stream *stream = (cloudsync_payload_stream *)ctx;
+    int64_t block = stream->next + index;
+    int64_t size = stream->expanded_size - (block * stream->block_size);
+    if (size > stream->block_size) size = stream->block_size;
+    
+    int *result = stream->values + (2 * stream->nblocks);
+    char *dst = stream->window + stream->wend + (index * stream->block_size);
+    int rc = LZ4_decompress_safe(stream->src + stream->values[stream->nblocks + block], dst, stream->values[block], (int)size);
+    result[block] = (rc == size) ? rc : -1;
+}
+
+bool cloudsync_payload_stream_init (cloudsync_payload_stream *stream, const char *src, int size, uint32_t expanded_size, int nthreads) {
+    memset(stream, 0, sizeof(cloudsync_payload_stream));
+    stream->values = cloudsync_payload_blocks_table(src, size, expanded_size, &stream->nblocks, &stream->block_size);
+    if (!stream->values) return false;
+    
+    stream->src = src;
+    stream->expanded_size = expanded_size;
+    stream->nthreads = (nthreads > 0) ? nthreads : 1;
+    return true;
+}
+
+void cloudsync_payload_stream_free (cloudsync_payload_stream *stream) {
+    if (stream->values) cloudsync_memory_free(stream->values);
+    if (stream->window) cloudsync_memory_free(stream->window);
+    memset(stream, 0, sizeof(cloudsync_payload_stream));
+}
+
+int cloudsync_payload_stream_refill (cloudsync_payload_stream *stream) {
+    // append the next blocks to the bytes not yet decoded
+    int64_t n = stream->nblocks - stream->next;
+    if (n <= 0) return SQLITE_CORRUPT;
+    if (n > stream->nthreads) n = stream->nthreads;
+    
+    size_t pending = stream->wend - stream->wstart;
+    if (pending && stream->wstart) memmove(stream->window, stream->window + stream->wstart, pending);
+    stream->wstart = 0;
+    stream->wend = pending;
+    
+    size_t needed = pending + (size_t)(n * stream->block_size);
+    if (needed > stream->walloc) {
+        char *window = cloudsync_memory_realloc(stream->window, (uint64_t)needed);
+        if (!window) return SQLITE_NOMEM;
+        stream->window = window;
+        stream->walloc = needed;
+    }
+    
+    uint64_t start = 0, end = 0;
+    cloudsync_time_us(&start);
+    cloudsync_parallel_run(stream->nthreads, (int)n, cloudsync_payload_stream_block, stream);
+    if (cloudsync_time_us(&end) == 0 && end > start) stream->elapsed_us += end - start;
+    
+    int *result = stream->values + (2 * stream->nblocks);
+    for (int64_t i=0; i<n; ++i) {
+        if (result[stream->next + i] < 0) return SQLITE_CORRUPT;
+        stream->wend += result[stream->next + i];
+    }
+    stream->next += n;
+    return SQLITE_OK;
+}
+
+uint64_t cloudsync_payload_stream_offset (cloudsync_payload_stream *stream) {
+    // offset in the decompressed rows of the first byte not yet decoded (only the last block can be smaller than block_size)
+    uint64_t end = (uint64_t)(stream->next * stream->block_size);
+    if (end > stream->expanded_size) end = stream->expanded_size;
+    return end - (uint64_t)(stream->wend - stream->wstart);
+}
+
+// MARK: -
+
+int cloudsync_buffer_encode (cloudsync_data_payload *payload, uint64_t schema_hash, char **blob, int *blob_size) {
+    // on success blob contains header and (compressed) rows and must be freed with cloudsync_memory_free
+    *blob = NULL;
+    *blob_size = 0;
+    
+    int header_size = (int)sizeof(cloudsync_payload_header);
+    int real_buffer_size = (int)(payload->bused - header_size);
+    char *src_buffer = payload->buffer + sizeof(cloudsync_payload_header);
+    char *buffer = NULL;
+    int zused = 0;
+    uint8_t codec = payload->codec;
+    
+    bool use_uncompressed_buffer = (payload->codec == CLOUDSYNC_PAYLOAD_CODEC_NONE) || !cloudsync_buffer_is_compressible(payload, src_buffer, real_buffer_size);
+    CHECK_FORCE_UNCOMPRESSED_BUFFER();
+    
+    // compressed blocks are part of the v2 opt-in, peers limited to v1 can only decompress a single LZ4 block
+    if (!use_uncompressed_buffer && payload->version >= CLOUDSYNC_PAYLOAD_VERSION_2 && real_buffer_size > 2 * CLOUDSYNC_PAYLOAD_BLOCK_SIZE) {
+        buffer = cloudsync_payload_blocks_compress(src_buffer, real_buffer_size, header_size, payload->acceleration, payload->threads, &zused);
+        if (!buffer) return SQLITE_NOMEM;
+        
+        codec = CLOUDSYNC_PAYLOAD_CODEC_LZ4_BLOCKS;
+        use_uncompressed_buffer = (zused > real_buffer_size);
+    } else if (!use_uncompressed_buffer) {
+        int zbound = LZ4_compressBound(real_buffer_size);
+        buffer = cloudsync_memory_alloc(zbound + header_size);
+        if (!buffer) return SQLITE_NOMEM;
+        
+        // adjust buffer to compress to skip the reserved header
+        zused = LZ4_compress_fast(src_buffer, buffer+header_size, real_buffer_size, zbound, payload->acceleration);
+        
+        // if compression fails or if compressed size is bigger than original buffer, then use the uncompressed buffer
+        use_uncompressed_buffer = (!zused || zused > real_buffer_size);
+    }
+    
+    // setup payload header
+    cloudsync_payload_header header;
+    if (use_uncompressed_buffer) codec = CLOUDSYNC_PAYLOAD_CODEC_NONE;
+    cloudsync_payload_header_init(&header, payload->version, codec, (use_uncompressed_buffer) ? 0 : real_buffer_size, payload->ncols, (uint32_t)payload->nrows, schema_hash);
+    
+    // ownership of the uncompressed buffer is transferred to the caller
+    if (use_uncompressed_buffer) {
+        if (buffer) cloudsync_memory_free(buffer);
+        buffer = payload->buffer;
+        zused = real_buffer_size;
+        payload->buffer = NULL;
+        payload->balloc = 0;
+    }
+    
+    memcpy(buffer, &header, sizeof(cloudsync_payload_header));
+    *blob = buffer;
+    *blob_size = zused + header_size;
+    return SQLITE_OK;
 }
 
 void cloudsync_payload_encode_step (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -1971,21 +4330,29 @@ void cloudsync_payload_encode_step (sqlite3_context *context, int argc, sqlite3_
     cloudsync_data_payload *payload = (cloudsync_data_payload *)sqlite3_aggregate_context(context, sizeof(cloudsync_data_payload));
     if (!payload) return;
     
-    // check if the step function is called for the first time
-    if (payload->nrows == 0) payload->ncols = argc;
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    cloudsync_buffer_append(payload, data, argc, argv);
+}
+
+void cloudsync_payload_encode_with_step (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_payload_encode_with_step");
     
-    size_t breq = pk_encode_size(argv, argc, 0);
-    if (cloudsync_buffer_check(payload, breq) == false) return;
+    // cloudsync_payload_encode_with(codec, tbl, pk, ...) selects the codec of this payload only
+    if (argc < 2) {
+        sqlite3_result_error(context, "cloudsync_payload_encode_with requires the codec followed by the columns to encode.", -1);
+        return;
+    }
     
-    char *buffer = payload->buffer + payload->bused;
-    char *ptr = pk_encode(argv, argc, buffer, false, NULL);
-    assert(buffer == ptr);
+    cloudsync_data_payload *payload = (cloudsync_data_payload *)sqlite3_aggregate_context(context, sizeof(cloudsync_data_payload));
+    if (!payload) return;
     
-    // update buffer
-    payload->bused += breq;
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    bool first = (payload->nrows == 0);
+    if (cloudsync_buffer_append(payload, data, argc - 1, argv + 1) == false || !first) return;
     
-    // increment row counter
-    ++payload->nrows;
+    int codec = payload->codec;
+    cloudsync_payload_codec_parse((const char *)sqlite3_value_text(argv[0]), &codec, &payload->acceleration);
+    payload->codec = (uint8_t)codec;
 }
 
 void cloudsync_payload_encode_final (sqlite3_context *context) {
@@ -2001,42 +4368,78 @@ void cloudsync_payload_encode_final (sqlite3_context *context) {
     }
     
     // encode payload
-    int header_size = (int)sizeof(cloudsync_payload_header);
-    int real_buffer_size = (int)(payload->bused - header_size);
-    int zbound = LZ4_compressBound(real_buffer_size);
-    char *buffer = cloudsync_memory_alloc(zbound + header_size);
-    if (!buffer) {
-        cloudsync_buffer_free(payload);
-        sqlite3_result_error_code(context, SQLITE_NOMEM);
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    char *blob = NULL;
+    int blob_size = 0;
+    int rc = cloudsync_buffer_encode(payload, data->schema_hash, &blob, &blob_size);
+    cloudsync_buffer_free(payload);
+    if (rc != SQLITE_OK) {
+        sqlite3_result_error_code(context, rc);
         return;
     }
     
-    // adjust buffer to compress to skip the reserved header
-    char *src_buffer = payload->buffer + sizeof(cloudsync_payload_header);
-    int zused = LZ4_compress_default(src_buffer, buffer+header_size, real_buffer_size, zbound);
-    bool use_uncompressed_buffer = (!zused || zused > real_buffer_size);
-    CHECK_FORCE_UNCOMPRESSED_BUFFER();
-    
-    // setup payload header
-    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
-    cloudsync_payload_header header;
-    cloudsync_payload_header_init(&header, (use_uncompressed_buffer) ? 0 : real_buffer_size, payload->ncols, (uint32_t)payload->nrows, data->schema_hash);
-    
-    // if compression fails or if compressed size is bigger than original buffer, then use the uncompressed buffer
-    if (use_uncompressed_buffer) {
-        cloudsync_memory_free(buffer);
-        buffer = payload->buffer;
-        zused = real_buffer_size;
+    // copy header and data to SQLite BLOB
+    sqlite3_result_blob(context, blob, blob_size, SQLITE_TRANSIENT);
+    cloudsync_memory_free(blob);
+}
+
+// MARK: - Payload Chunks -
+
+// A chunked payload is a sequence of frames, each one a complete payload (header and rows)
+// that can be decoded and applied on its own, so memory usage is bounded by the frame size
+// and not by the size of the whole changeset. Frames end at db_version boundaries, so a frame
+// carries whole transactions unless a single db_version is bigger than the frame size.
+
+cloudsync_data_payload *cloudsync_payload_chunk_create (void) {
+    return (cloudsync_data_payload *)cloudsync_memory_zeroalloc(sizeof(cloudsync_data_payload));
+}
+
+void cloudsync_payload_chunk_free (cloudsync_data_payload *payload) {
+    if (!payload) return;
+    cloudsync_buffer_free(payload);
+    cloudsync_memory_free(payload);
+}
+
+int cloudsync_payload_chunk_append (cloudsync_data_payload *payload, cloudsync_context *data, int argc, sqlite3_value **argv, size_t max_bytes, bool *rewound) {
+    // returns 1 if the row has been added, 0 if the frame is full and must be flushed first, -1 on OOM
+    // argv has the columns of cloudsync_changes and the rows are in db_version order: a frame ends only at a db_version
+    // boundary, so when the row does not fit the rows of its db_version already in the frame are removed from it
+    // (*rewound is set, they must be appended again to the next frame);
+    // a db_version that alone exceeds max_bytes is split, each part in a frame with only its rows
+    // (a single row bigger than max_bytes is always accepted in an empty frame)
+    int64_t db_version = sqlite3_value_int64(argv[CLOUDSYNC_PK_INDEX_DBVERSION]);
+    bool boundary = (payload->nrows == 0 || db_version != payload->chunk_db_version);
+    *rewound = false;
+    
+    if (payload->nrows > 0) {
+        size_t bused = (payload->bused) ? payload->bused - sizeof(cloudsync_payload_header) : 0;
+        if (bused + pk_encode_size(argv, argc, 0) > max_bytes) {
+            if (!boundary && payload->chunk_mark.nrows > 0) {
+                cloudsync_buffer_rewind(payload, &payload->chunk_mark);
+                *rewound = true;
+            }
+            return 0;
+        }
     }
     
-    // copy header and data to SQLite BLOB
-    memcpy(buffer, &header, sizeof(cloudsync_payload_header));
-    int blob_size = zused+sizeof(cloudsync_payload_header);
-    sqlite3_result_blob(context, buffer, blob_size, SQLITE_TRANSIENT);
+    if (boundary) {
+        cloudsync_buffer_save(payload, &payload->chunk_mark);
+        payload->chunk_db_version = db_version;
+    }
+    return (cloudsync_buffer_append(payload, data, argc, argv)) ? 1 : -1;
+}
+
+int cloudsync_payload_chunk_flush (cloudsync_data_payload *payload, cloudsync_context *data, char **blob, int *blob_size, int *nrows) {
+    *nrows = (int)payload->nrows;
+    if (payload->nrows == 0) {
+        *blob = NULL;
+        *blob_size = 0;
+        return SQLITE_OK;
+    }
     
-    // cleanup memory
-    cloudsync_buffer_free(payload);
-    if (!use_uncompressed_buffer) cloudsync_memory_free(buffer);
+    int rc = cloudsync_buffer_encode(payload, data->schema_hash, blob, blob_size);
+    cloudsync_buffer_reset(payload);
+    return rc;
 }
 
 cloudsync_payload_apply_callback_t cloudsync_get_payload_apply_callback(sqlite3 *db) {
@@ -2051,7 +4454,9 @@ void cloudsync_set_payload_apply_callback(sqlite3 *db, cloudsync_payload_apply_c
 
 int cloudsync_pk_decode_bind_callback (void *xdata, int index, int type, int64_t ival, double dval, char *pval) {
     cloudsync_pk_decode_bind_context *decode_context = (cloudsync_pk_decode_bind_context*)xdata;
-    int rc = pk_decode_bind_callback(decode_context->vm, index, type, ival, dval, pval);
+    
+    // vm is NULL when the payload is applied directly (without INSERT INTO cloudsync_changes)
+    int rc = (decode_context->vm) ? pk_decode_bind_callback(decode_context->vm, index, type, ival, dval, pval) : SQLITE_OK;
     
     if (rc == SQLITE_OK) {
         // the dbversion index is smaller than seq index, so it is processed first
@@ -2071,10 +4476,14 @@ int cloudsync_pk_decode_bind_callback (void *xdata, int index, int type, int64_t
                 }
                 break;
             case CLOUDSYNC_PK_INDEX_COLNAME:
-                if (type == SQLITE_TEXT) {
-                    decode_context->col_name = pval;
-                    decode_context->col_name_len = ival;
-                }
+                decode_context->col_name = (type == SQLITE_TEXT) ? pval : NULL;
+                decode_context->col_name_len = (type == SQLITE_TEXT) ? ival : 0;
+                break;
+            case CLOUDSYNC_PK_INDEX_COLVALUE:
+                decode_context->col_value_type = type;
+                decode_context->col_value_ival = ival;
+                decode_context->col_value_dval = dval;
+                decode_context->col_value_pval = pval;
                 break;
             case CLOUDSYNC_PK_INDEX_COLVERSION:
                 if (type == SQLITE_INTEGER) decode_context->col_version = ival;
@@ -2097,68 +4506,672 @@ int cloudsync_pk_decode_bind_callback (void *xdata, int index, int type, int64_t
         }
     }
         
-    return rc;
+    return rc;
+}
+
+int cloudsync_pk_decode_colvalue_callback (void *xdata, int index, int type, int64_t ival, double dval, char *pval) {
+    // col_value is decoded alone in v2 payloads, so its index must be remapped
+    return cloudsync_pk_decode_bind_callback(xdata, CLOUDSYNC_PK_INDEX_COLVALUE, type, ival, dval, pval);
+}
+
+void cloudsync_payload_decoder_init (cloudsync_payload_decoder *decoder) {
+    memset(decoder, 0, sizeof(cloudsync_payload_decoder));
+    decoder->tbl = -1;
+    decoder->site = -1;
+}
+
+void cloudsync_payload_decoder_free (cloudsync_payload_decoder *decoder) {
+    cloudsync_payload_dict_free(&decoder->tbl_dict);
+    cloudsync_payload_dict_free(&decoder->col_dict);
+    cloudsync_payload_dict_free(&decoder->site_dict);
+    if (decoder->pk_copy) cloudsync_memory_free(decoder->pk_copy);
+}
+
+bool cloudsync_payload_decode_ref (cloudsync_payload_dict *dict, char *buffer, size_t blen, size_t *bseek, int64_t *index) {
+    bool error = false;
+    uint64_t ref = pk_decode_varint(buffer, blen, bseek, &error);
+    if (error) return false;
+    
+    if (ref > 0) {
+        if (ref > (uint64_t)dict->count) return false;
+        *index = (int64_t)ref - 1;
+        return true;
+    }
+    
+    uint64_t len = pk_decode_varint(buffer, blen, bseek, &error);
+    if (error || len > blen - *bseek) return false;
+    
+    int i = cloudsync_payload_dict_add(dict, buffer + *bseek, (int64_t)len);
+    if (i < 0) return false;
+    
+    *bseek += (size_t)len;
+    *index = i;
+    return true;
+}
+
+int cloudsync_payload_decode_row_v2 (cloudsync_payload_decoder *decoder, char *buffer, size_t blen, size_t *seek, cloudsync_pk_decode_bind_context *decode_context) {
+    // decode a v2 row (see cloudsync_buffer_append_v2) and bind its values in the same order used by pk_decode in v1
+    size_t bseek = 0;
+    bool error = false;
+    int64_t index = 0;
+    
+    uint64_t flags = pk_decode_varint(buffer, blen, &bseek, &error);
+    if (error) return SQLITE_CORRUPT;
+    
+    if (flags & CLOUDSYNC_PAYLOAD_ROW_NEWPK) {
+        if (!cloudsync_payload_decode_ref(&decoder->tbl_dict, buffer, blen, &bseek, &decoder->tbl)) return SQLITE_CORRUPT;
+        uint64_t pk_len = pk_decode_varint(buffer, blen, &bseek, &error);
+        if (error || pk_len > blen - bseek) return SQLITE_CORRUPT;
+        decoder->pk = buffer + bseek;
+        decoder->pk_len = (int64_t)pk_len;
+        bseek += (size_t)pk_len;
+    }
+    if (decoder->tbl < 0) return SQLITE_CORRUPT;
+    
+    if (!cloudsync_payload_decode_ref(&decoder->col_dict, buffer, blen, &bseek, &index)) return SQLITE_CORRUPT;
+    
+    int rc = cloudsync_pk_decode_bind_callback(decode_context, CLOUDSYNC_PK_INDEX_TBL, SQLITE_TEXT, decoder->tbl_dict.lens[decoder->tbl], 0.0, decoder->tbl_dict.keys[decoder->tbl]);
+    if (rc == SQLITE_OK) rc = cloudsync_pk_decode_bind_callback(decode_context, CLOUDSYNC_PK_INDEX_PK, SQLITE_BLOB, decoder->pk_len, 0.0, decoder->pk);
+    if (rc == SQLITE_OK) rc = cloudsync_pk_decode_bind_callback(decode_context, CLOUDSYNC_PK_INDEX_COLNAME, SQLITE_TEXT, decoder->col_dict.lens[index], 0.0, decoder->col_dict.keys[index]);
+    if (rc != SQLITE_OK) return rc;
+    
+    if (bseek >= blen) return SQLITE_CORRUPT;
+    if (pk_decode(buffer, blen, 1, &bseek, cloudsync_pk_decode_colvalue_callback, decode_context) != 1) return SQLITE_CORRUPT;
+    
+    int64_t col_version = cloudsync_zigzag_decode(pk_decode_varint(buffer, blen, &bseek, &error));
+    decoder->db_version += cloudsync_zigzag_decode(pk_decode_varint(buffer, blen, &bseek, &error));
+    if ((flags & CLOUDSYNC_PAYLOAD_ROW_SAMESITE) == 0) {
+        if (!cloudsync_payload_decode_ref(&decoder->site_dict, buffer, blen, &bseek, &decoder->site)) return SQLITE_CORRUPT;
+    }
+    int64_t cl = cloudsync_zigzag_decode(pk_decode_varint(buffer, blen, &bseek, &error));
+    decoder->seq += cloudsync_zigzag_decode(pk_decode_varint(buffer, blen, &bseek, &error));
+    if (error || decoder->site < 0) return SQLITE_CORRUPT;
+    
+    rc = cloudsync_pk_decode_bind_callback(decode_context, CLOUDSYNC_PK_INDEX_COLVERSION, SQLITE_INTEGER, col_version, 0.0, NULL);
+    if (rc == SQLITE_OK) rc = cloudsync_pk_decode_bind_callback(decode_context, CLOUDSYNC_PK_INDEX_DBVERSION, SQLITE_INTEGER, decoder->db_version, 0.0, NULL);
+    if (rc == SQLITE_OK) rc = cloudsync_pk_decode_bind_callback(decode_context, CLOUDSYNC_PK_INDEX_SITEID, SQLITE_BLOB, decoder->site_dict.lens[decoder->site], 0.0, decoder->site_dict.keys[decoder->site]);
+    if (rc == SQLITE_OK) rc = cloudsync_pk_decode_bind_callback(decode_context, CLOUDSYNC_PK_INDEX_CL, SQLITE_INTEGER, cl, 0.0, NULL);
+    if (rc == SQLITE_OK) rc = cloudsync_pk_decode_bind_callback(decode_context, CLOUDSYNC_PK_INDEX_SEQ, SQLITE_INTEGER, decoder->seq, 0.0, NULL);
+    
+    *seek = bseek;
+    return rc;
+}
+
+void cloudsync_payload_decoder_save (cloudsync_payload_decoder *decoder, cloudsync_payload_decoder_mark *mark) {
+    *mark = (cloudsync_payload_decoder_mark){.tbl = decoder->tbl, .pk = decoder->pk, .pk_len = decoder->pk_len, .site = decoder->site, .db_version = decoder->db_version,
+                                             .seq = decoder->seq, .ntbl = decoder->tbl_dict.count, .ncol = decoder->col_dict.count, .nsite = decoder->site_dict.count};
+}
+
+void cloudsync_payload_decoder_rewind (cloudsync_payload_decoder *decoder, cloudsync_payload_decoder_mark *mark) {
+    decoder->tbl = mark->tbl;
+    decoder->pk = mark->pk;
+    decoder->pk_len = mark->pk_len;
+    decoder->site = mark->site;
+    decoder->db_version = mark->db_version;
+    decoder->seq = mark->seq;
+    cloudsync_payload_dict_truncate(&decoder->tbl_dict, mark->ntbl);
+    cloudsync_payload_dict_truncate(&decoder->col_dict, mark->ncol);
+    cloudsync_payload_dict_truncate(&decoder->site_dict, mark->nsite);
+}
+
+int cloudsync_payload_stream_decode_row (cloudsync_payload_stream *stream, cloudsync_payload_decoder *decoder, cloudsync_pk_decode_bind_context *decode_context) {
+    // a row can cross the end of the window: in that case the decoder state is restored
+    // and the row is decoded again once the next blocks are in the window
+    while (1) {
+        cloudsync_payload_decoder_mark mark;
+        cloudsync_payload_decoder_save(decoder, &mark);
+        
+        size_t seek = 0;
+        char *row = stream->window + stream->wstart;
+        int rc = (stream->window) ? cloudsync_payload_decode_row_v2(decoder, row, stream->wend - stream->wstart, &seek, decode_context) : SQLITE_CORRUPT;
+        if (rc == SQLITE_OK) {
+            // the pk is used by the following rows too, but the window moves
+            if (decoder->pk >= row && decoder->pk < row + seek) {
+                if ((size_t)decoder->pk_len > decoder->pk_alloc) {
+                    char *pk = cloudsync_memory_realloc(decoder->pk_copy, (uint64_t)decoder->pk_len);
+                    if (!pk) return SQLITE_NOMEM;
+                    decoder->pk_copy = pk;
+                    decoder->pk_alloc = (size_t)decoder->pk_len;
+                }
+                if (decoder->pk_len) memcpy(decoder->pk_copy, decoder->pk, (size_t)decoder->pk_len);
+                decoder->pk = decoder->pk_copy;
+            }
+            stream->wstart += seek;
+            return SQLITE_OK;
+        }
+        
+        if (rc != SQLITE_CORRUPT || stream->next >= stream->nblocks) return rc;
+        cloudsync_payload_decoder_rewind(decoder, &mark);
+        
+        rc = cloudsync_payload_stream_refill(stream);
+        if (rc != SQLITE_OK) return rc;
+    }
+}
+
+// #ifndef CLOUDSYNC_OMIT_RLS_VALIDATION
+
+// decoded names are not zero-terminated and consecutive rows usually share table and column,
+// so the direct apply path keeps a terminated copy of the last ones (and the last looked up table)
+typedef struct {
+    char                    *tbl;
+    int64_t                 tbl_len;
+    cloudsync_table_context *table;
+    char                    *col_name;
+    int64_t                 col_name_len;
+    bool                    readonly;       // set on the resolver threads, the shared last table hit is not updated
+    cloudsync_merge_clock   clock;
+    cloudsync_merge_writer  writer;
+} cloudsync_payload_apply_cache;
+
+bool cloudsync_payload_apply_cache_name (char **name, int64_t *name_len, const char *value, int64_t len) {
+    if (*name && *name_len == len && memcmp(*name, value, (size_t)len) == 0) return true;
+    
+    char *copy = cloudsync_string_ndup(value, (size_t)len, false);
+    if (!copy) return false;
+    
+    if (*name) cloudsync_memory_free(*name);
+    *name = copy;
+    *name_len = len;
+    return true;
+}
+
+void cloudsync_payload_apply_cache_free (cloudsync_payload_apply_cache *cache) {
+    if (cache->tbl) cloudsync_memory_free(cache->tbl);
+    if (cache->col_name) cloudsync_memory_free(cache->col_name);
+    merge_clock_free(&cache->clock);
+    merge_writer_free(&cache->writer);
+}
+
+int cloudsync_payload_apply_lookup (cloudsync_context *data, cloudsync_payload_apply_cache *cache, cloudsync_pk_decode_bind_context *d, const char **insert_name, char **errmsg) {
+    // resolve the table and the (zero-terminated) column name of a decoded change
+    if (!d->tbl || !d->pk || !d->site_id) {
+        *errmsg = cloudsync_string_dup("Unable to apply a change with missing table, primary key or site_id.", false);
+        return SQLITE_MISUSE;
+    }
+    
+    char *tbl = cache->tbl;
+    if (!cloudsync_payload_apply_cache_name(&cache->tbl, &cache->tbl_len, d->tbl, d->tbl_len)) return SQLITE_NOMEM;
+    if (cache->tbl != tbl || !cache->table) cache->table = (cache->readonly) ? table_lookup_readonly(data, cache->tbl) : table_lookup(data, cache->tbl);
+    if (!cache->table) {
+        *errmsg = cloudsync_memory_mprintf("Unable to find table %s,", cache->tbl);
+        return SQLITE_ERROR;
+    }
+    
+    *insert_name = CLOUDSYNC_TOMBSTONE_VALUE;
+    if (d->col_name) {
+        if (!cloudsync_payload_apply_cache_name(&cache->col_name, &cache->col_name_len, d->col_name, d->col_name_len)) return SQLITE_NOMEM;
+        *insert_name = cache->col_name;
+    }
+    return SQLITE_OK;
+}
+
+int cloudsync_payload_apply_write (cloudsync_context *data, cloudsync_payload_apply_cache *cache, cloudsync_pk_decode_bind_context *d, int action, int index, bool join,
+                                   const char *insert_name, const cloudsync_merge_value *insert_value, cloudsync_merge_clock *clock, char **errmsg) {
+    // a winning column of the pending row is collected by the merge writer, any other write is performed now
+    int rc = SQLITE_OK;
+    if (join && action == CLOUDSYNC_MERGE_INSERT) {
+        rc = merge_writer_add(&cache->writer, cache->table, cache->tbl, index, (const char *)d->pk, (int)d->pk_len, insert_value, d->col_version, d->db_version,
+                              (const char *)d->site_id, (int)d->site_id_len, d->seq);
+        if (rc == SQLITE_OK) {
+            if (clock) merge_clock_update(clock, cache->table, action, insert_name, d->col_version, d->cl);
+            return SQLITE_OK;
+        }
+        if (rc != SQLITE_NOMEM) return rc;
+    }
+    
+    if (action != CLOUDSYNC_MERGE_SKIP && action != CLOUDSYNC_MERGE_EQUAL) {
+        rc = merge_writer_flush(data, &cache->writer, clock, errmsg);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
+    if (action == CLOUDSYNC_MERGE_SKIP || action == CLOUDSYNC_MERGE_EQUAL) return SQLITE_OK;
+    
+    // each change is atomic, a failing change is rolled back as a whole and the following ones are still applied
+    sqlite3 *db = sqlite3_db_handle(cache->table->meta_pkexists_stmt);
+    rc = merge_writer_savepoint(&cache->writer, db, CLOUDSYNC_WRITE_SAVEPOINT);
+    if (rc != SQLITE_OK) {
+        *errmsg = cloudsync_memory_mprintf("Unable to start the savepoint of a change: %s", sqlite3_errmsg(db));
+        return rc;
+    }
+    
+    sqlite3_int64 rowid = 0;
+    rc = merge_change_apply(data, cache->table, action, (const char *)d->pk, (int)d->pk_len, insert_name, insert_value, d->col_version, d->db_version,
+                            (const char *)d->site_id, (int)d->site_id_len, d->cl, d->seq, &rowid, clock, errmsg);
+    if (rc == SQLITE_OK) {
+        rc = merge_writer_savepoint(&cache->writer, db, CLOUDSYNC_WRITE_RELEASE);
+        if (rc == SQLITE_OK) return SQLITE_OK;
+        *errmsg = cloudsync_memory_mprintf("Unable to release the savepoint of a change: %s", sqlite3_errmsg(db));
+        if (clock) clock->valid = false;
+    }
+    merge_writer_savepoint(&cache->writer, db, CLOUDSYNC_WRITE_ROLLBACK);
+    return rc;
+}
+
+void cloudsync_payload_apply_flush (cloudsync_context *data, cloudsync_payload_apply_cache *cache, int *rc, char **apply_err) {
+    // the pending row must be written inside the savepoint of its changes
+    char *errmsg = NULL;
+    int rc1 = merge_writer_flush(data, &cache->writer, &cache->clock, &errmsg);
+    if (rc1 == SQLITE_OK) return;
+    
+    if (*apply_err) cloudsync_memory_free(*apply_err);
+    *apply_err = errmsg;
+    *rc = rc1;
+}
+
+int cloudsync_payload_apply_change (cloudsync_context *data, cloudsync_payload_apply_cache *cache, cloudsync_pk_decode_bind_context *d, int *action, char **errmsg) {
+    // merge a decoded change without going through INSERT INTO cloudsync_changes (same logic of cloudsync_merge_change)
+    const char *insert_name = NULL;
+    int rc = cloudsync_payload_apply_lookup(data, cache, d, &insert_name, errmsg);
+    if (rc != SQLITE_OK) return rc;
+    
+    // the pending row is written first if this change could observe it
+    int index = -1;
+    bool join = merge_writer_can_join(&cache->writer, cache->table, (const char *)d->pk, (int)d->pk_len, insert_name, d->cl, &index);
+    if (!join && cache->writer.npending > 0) {
+        rc = merge_writer_flush(data, &cache->writer, &cache->clock, errmsg);
+        if (rc != SQLITE_OK) return rc;
+        join = merge_writer_can_join(&cache->writer, cache->table, (const char *)d->pk, (int)d->pk_len, insert_name, d->cl, &index);
+    }
+    
+    cloudsync_merge_value insert_value = {.type = d->col_value_type, .ival = d->col_value_ival, .dval = d->col_value_dval, .pval = d->col_value_pval};
+    rc = merge_change_resolve(data, cache->table, (const char *)d->pk, (int)d->pk_len, insert_name, &insert_value, d->col_version,
+                              (const char *)d->site_id, (int)d->site_id_len, d->cl, &cache->clock, action, errmsg);
+    if (rc != SQLITE_OK) return rc;
+    
+    return cloudsync_payload_apply_write(data, cache, d, *action, index, join, insert_name, &insert_value, &cache->clock, errmsg);
+}
+
+int cloudsync_payload_apply_action (cloudsync_context *data, cloudsync_payload_apply_cache *cache, cloudsync_pk_decode_bind_context *d, int action, char **errmsg) {
+    // apply a change already resolved by the parallel apply (the writes do not go through the clock snapshot)
+    const char *insert_name = NULL;
+    int rc = cloudsync_payload_apply_lookup(data, cache, d, &insert_name, errmsg);
+    if (rc != SQLITE_OK) return rc;
+    
+    // resolved on a snapshot, so only the writes of the same row need to be ordered
+    int index = -1;
+    bool join = (action == CLOUDSYNC_MERGE_INSERT) && merge_writer_can_join(&cache->writer, cache->table, (const char *)d->pk, (int)d->pk_len, insert_name, d->cl, &index);
+    if (action == CLOUDSYNC_MERGE_INSERT && !join && cache->writer.npending > 0) {
+        rc = merge_writer_flush(data, &cache->writer, NULL, errmsg);
+        if (rc != SQLITE_OK) return rc;
+        join = merge_writer_can_join(&cache->writer, cache->table, (const char *)d->pk, (int)d->pk_len, insert_name, d->cl, &index);
+    }
+    
+    cloudsync_merge_value insert_value = {.type = d->col_value_type, .ival = d->col_value_ival, .dval = d->col_value_dval, .pval = d->col_value_pval};
+    return cloudsync_payload_apply_write(data, cache, d, action, index, join, insert_name, &insert_value, NULL, errmsg);
+}
+
+bool cloudsync_payload_apply_batch_full (cloudsync_context *data, uint32_t batch_rows, uint64_t batch_start) {
+    // checked at each db_version boundary, true if the current savepoint must be released
+    if (!data) return true;
+    
+    switch (data->payload_batch) {
+        case CLOUDSYNC_APPLY_BATCH_ROWS:
+            return (batch_rows >= (uint32_t)data->payload_batch_size);
+            
+        case CLOUDSYNC_APPLY_BATCH_MS: {
+            uint64_t now;
+            if (cloudsync_time_ms(&now) != 0) return true;
+            return (now - batch_start >= (uint64_t)data->payload_batch_size);
+        }
+            
+        case CLOUDSYNC_APPLY_BATCH_PAYLOAD:
+            return false;
+    }
+    
+    return true;
+}
+
+void cloudsync_payload_apply_set_check (sqlite3 *db, sqlite3_context *context, cloudsync_pk_decode_bind_context *decoded_context, int dbversion, int seq) {
+    char buf[256];
+    if (decoded_context->db_version >= dbversion) {
+        snprintf(buf, sizeof(buf), "%lld", decoded_context->db_version);
+        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_DBVERSION, buf);
+        
+        if (decoded_context->seq != seq) {
+            snprintf(buf, sizeof(buf), "%lld", decoded_context->seq);
+            dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_SEQ, buf);
+        }
+    }
+}
+
+int cloudsync_payload_table_compare (const cloudsync_pk_decode_bind_context *r1, const cloudsync_pk_decode_bind_context *r2) {
+    int64_t len = (r1->tbl_len < r2->tbl_len) ? r1->tbl_len : r2->tbl_len;
+    int cmp = (len > 0) ? memcmp(r1->tbl, r2->tbl, (size_t)len) : 0;
+    if (cmp == 0 && r1->tbl_len != r2->tbl_len) cmp = (r1->tbl_len < r2->tbl_len) ? -1 : 1;
+    return cmp;
+}
+
+int cloudsync_payload_row_compare (const cloudsync_pk_decode_bind_context *r1, const cloudsync_pk_decode_bind_context *r2) {
+    // order by table, then by primary key
+    int cmp = cloudsync_payload_table_compare(r1, r2);
+    if (cmp != 0) return cmp;
+    
+    int64_t len = (r1->pk_len < r2->pk_len) ? r1->pk_len : r2->pk_len;
+    cmp = (len > 0) ? memcmp(r1->pk, r2->pk, (size_t)len) : 0;
+    if (cmp == 0 && r1->pk_len != r2->pk_len) cmp = (r1->pk_len < r2->pk_len) ? -1 : 1;
+    return cmp;
+}
+
+int cloudsync_payload_apply_compare (const void *a, const void *b) {
+    // order by table, then by primary key, then by position in the payload (qsort is not stable)
+    const cloudsync_pk_decode_bind_context *r1 = *(const cloudsync_pk_decode_bind_context **)a;
+    const cloudsync_pk_decode_bind_context *r2 = *(const cloudsync_pk_decode_bind_context **)b;
+    
+    int cmp = cloudsync_payload_row_compare(r1, r2);
+    if (cmp != 0) return cmp;
+    
+    return (r1 < r2) ? -1 : (r1 > r2);
+}
+
+// MARK: - Payload Checkpoints -
+
+// large payloads are applied in several savepoints: every CLOUDSYNC_PAYLOAD_CHECKPOINT_ROWS rows the payload identity
+// and the number of rows already applied are written inside the savepoint that is going to be released, so that they
+// are committed together with the data and an interrupted apply of the same payload restarts from the first row not yet applied
+
+uint64_t cloudsync_payload_identity (const char *payload, int size) {
+    // FNV-1a over 8-byte words (0 means no identity)
+    uint64_t h = 14695981039346656037ULL;
+    int i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, payload + i, sizeof(word));
+        h = (h ^ word) * 1099511628211ULL;
+    }
+    for (; i < size; ++i) h = (h ^ (uint8_t)payload[i]) * 1099511628211ULL;
+    return (h) ? h : 1;
+}
+
+uint32_t cloudsync_payload_checkpoint_get (sqlite3 *db, uint64_t payload_id, bool *found) {
+    // returns the number of rows of the payload already applied
+    char buffer[256] = {0};
+    *found = false;
+    if (payload_id == 0 || dbutils_settings_get_value(db, CLOUDSYNC_KEY_APPLY_CHECKPOINT, buffer, sizeof(buffer)) == NULL) return 0;
+    
+    unsigned long long id = 0;
+    unsigned int row = 0;
+    if (sscanf(buffer, "%llu:%u", &id, &row) != 2 || (uint64_t)id != payload_id) return 0;
+    
+    *found = true;
+    return (uint32_t)row;
+}
+
+int cloudsync_payload_checkpoint_set (sqlite3 *db, sqlite3_context *context, uint64_t payload_id, uint32_t row) {
+    // row 0 removes the checkpoint
+    if (row == 0) return dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_APPLY_CHECKPOINT, NULL);
+    
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%llu:%u", (unsigned long long)payload_id, row);
+    return dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_APPLY_CHECKPOINT, buffer);
+}
+
+// a time-sliced apply (cloudsync_payload_apply_step) stops at the first savepoint boundary after its budget runs out,
+// the next step continues from the checkpoint written in the last released savepoint
+typedef struct {
+    uint64_t    start_ms;
+    int64_t     budget_ms;              // 0 means no time limit
+    int64_t     budget_rows;            // 0 means no rows limit
+    uint32_t    next_row;               // first row not yet applied (0 if the whole payload has been applied)
+} cloudsync_payload_budget;
+
+bool cloudsync_payload_budget_exhausted (cloudsync_payload_budget *budget, uint32_t nrows) {
+    if (budget->budget_rows > 0 && (int64_t)nrows >= budget->budget_rows) return true;
+    
+    uint64_t now = 0;
+    if (budget->budget_ms > 0 && cloudsync_time_ms(&now) == 0) return (now - budget->start_ms >= (uint64_t)budget->budget_ms);
+    return false;
+}
+
+// MARK: - Payload Parallel Apply -
+
+// two-phase apply of decoded payloads: worker threads resolve disjoint ranges of changes grouped by row (all the changes of a row
+// belong to the same range) on read-only connections, then the writer performs only the resulting actions;
+// the writer takes the write lock before the workers start, so they read exactly the state the actions are applied to
+
+typedef struct {
+    cloudsync_context                   *data;
+    const char                          *path;
+    const char                          *vfs;           // VFS of the main connection (NULL for the default one)
+    cloudsync_pk_decode_bind_context    *rows;          // decoded changes in payload order
+    cloudsync_pk_decode_bind_context    **grouped;      // the same changes sorted by table and primary key
+    uint8_t                             *actions;       // CLOUDSYNC_MERGE_ACTION of each change, in payload order
+    uint32_t                            start;
+    uint32_t                            end;
+    cloudsync_merge_reader              *readers;       // one for each table found in the range
+    int                                 nreaders;
+} cloudsync_payload_resolver;
+
+cloudsync_merge_reader *cloudsync_payload_resolver_reader (cloudsync_payload_resolver *resolver, sqlite3 *db, cloudsync_table_context *table) {
+    for (int i=0; i<resolver->nreaders; ++i) {
+        if (resolver->readers[i].table == table) return &resolver->readers[i];
+    }
+    
+    cloudsync_merge_reader *readers = (cloudsync_merge_reader *)cloudsync_memory_realloc(resolver->readers, (uint64_t)((resolver->nreaders + 1) * sizeof(cloudsync_merge_reader)));
+    if (!readers) return NULL;
+    resolver->readers = readers;
+    
+    cloudsync_merge_reader *reader = &readers[resolver->nreaders++];
+    if (merge_reader_init(reader, db, table) != SQLITE_OK) {
+        merge_reader_free(reader);
+        --resolver->nreaders;
+        return NULL;
+    }
+    return reader;
+}
+
+void cloudsync_payload_resolver_run (cloudsync_payload_resolver *resolver) {
+    // actions are CLOUDSYNC_MERGE_DEFER on entry: any change that cannot be resolved here is merged by the writer,
+    // together with the following changes of the same row (the simulated clocks are no longer reliable)
+    sqlite3 *db = NULL;
+    if (sqlite3_open_v2(resolver->path, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI, resolver->vfs) != SQLITE_OK) goto cleanup;
+    
+    // a single read transaction for the whole range
+    if (sqlite3_exec(db, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK) goto cleanup;
+    
+    cloudsync_payload_apply_cache cache = {.readonly = true};
+    bool deferred = false;
+    for (uint32_t i=resolver->start; i<resolver->end; ++i) {
+        cloudsync_pk_decode_bind_context *d = resolver->grouped[i];
+        if (i == resolver->start || cloudsync_payload_row_compare(resolver->grouped[i-1], d) != 0) deferred = false;
+        if (deferred) continue;
+        
+        const char *insert_name = NULL;
+        char *errmsg = NULL;
+        int action = CLOUDSYNC_MERGE_DEFER;
+        int rc = cloudsync_payload_apply_lookup(resolver->data, &cache, d, &insert_name, &errmsg);
+        if (rc == SQLITE_OK) {
+            cache.clock.reader = cloudsync_payload_resolver_reader(resolver, db, cache.table);
+            if (!cache.clock.reader) rc = SQLITE_ERROR;
+        }
+        if (rc == SQLITE_OK) {
+            cloudsync_merge_value insert_value = {.type = d->col_value_type, .ival = d->col_value_ival, .dval = d->col_value_dval, .pval = d->col_value_pval};
+            rc = merge_change_resolve(resolver->data, cache.table, (const char *)d->pk, (int)d->pk_len, insert_name, &insert_value, d->col_version,
+                                      (const char *)d->site_id, (int)d->site_id_len, d->cl, &cache.clock, &action, &errmsg);
+        }
+        if (errmsg) cloudsync_memory_free(errmsg);
+        
+        if (rc != SQLITE_OK) {
+            cache.clock.valid = false;
+            deferred = true;
+            continue;
+        }
+        
+        // keep the snapshot in sync with the writes the writer will perform
+        if (cache.table->algo != table_algo_crdt_gos) merge_clock_update(&cache.clock, cache.table, action, insert_name, d->col_version, d->cl);
+        resolver->actions[d - resolver->rows] = (uint8_t)action;
+    }
+    
+    cache.clock.reader = NULL;
+    cloudsync_payload_apply_cache_free(&cache);
+    sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+    
+cleanup:
+    for (int i=0; i<resolver->nreaders; ++i) merge_reader_free(&resolver->readers[i]);
+    if (resolver->readers) cloudsync_memory_free(resolver->readers);
+    resolver->readers = NULL;
+    resolver->nreaders = 0;
+    if (db) sqlite3_close(db);
 }
 
-// #ifndef CLOUDSYNC_OMIT_RLS_VALIDATION
+static void cloudsync_payload_resolver_task (void *ctx, int index) {
+    cloudsync_payload_resolver *resolvers = (cloudsync_payload_resolver *)ctx;
+    cloudsync_payload_resolver_run(&resolvers[index]);
+}
 
-int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int blen) {
-    // decode header
-    cloudsync_payload_header header;
-    memcpy(&header, payload, sizeof(cloudsync_payload_header));
+uint8_t *cloudsync_payload_resolve (sqlite3 *db, cloudsync_context *data, cloudsync_pk_decode_bind_context *rows, uint32_t nrows) {
+    // first phase of the parallel apply, the caller must hold the write lock (NULL if the payload cannot be resolved in parallel)
+    // the writer applies the actions in payload order: the outcome of a change depends only on the previous changes
+    // of its row, while a parent row must still be written before the rows whose foreign keys reference it
+    // an in-memory or temporary database has no file the workers could open, it is applied serially
+    const char *path = sqlite3_db_filename(db, "main");
+    if (!path || path[0] == 0) return NULL;
+    
+    // the workers must read the file through the same VFS of the main connection
+    sqlite3_vfs *vfs = NULL;
+    if (sqlite3_file_control(db, "main", SQLITE_FCNTL_VFS_POINTER, &vfs) != SQLITE_OK) vfs = NULL;
+    
+    int nthreads = (data->payload_threads > CLOUDSYNC_MAX_THREADS) ? CLOUDSYNC_MAX_THREADS : data->payload_threads;
+    uint8_t *actions = (uint8_t *)cloudsync_memory_alloc((uint64_t)nrows);
+    cloudsync_pk_decode_bind_context **grouped = (cloudsync_pk_decode_bind_context **)cloudsync_memory_alloc((uint64_t)nrows * sizeof(cloudsync_pk_decode_bind_context *));
+    if (!actions || !grouped) {
+        if (actions) cloudsync_memory_free(actions);
+        if (grouped) cloudsync_memory_free(grouped);
+        return NULL;
+    }
+    memset(actions, CLOUDSYNC_MERGE_DEFER, (size_t)nrows);
+    for (uint32_t i=0; i<nrows; ++i) grouped[i] = &rows[i];
+    qsort(grouped, nrows, sizeof(cloudsync_pk_decode_bind_context *), cloudsync_payload_apply_compare);
+    
+    // split the grouped changes in ranges of similar size without splitting the changes of a row
+    cloudsync_payload_resolver resolvers[CLOUDSYNC_MAX_THREADS];
+    uint32_t start = 0;
+    for (int i=0; i<nthreads; ++i) {
+        uint32_t end = (i == nthreads-1) ? nrows : (uint32_t)(((uint64_t)nrows * (uint64_t)(i+1)) / (uint64_t)nthreads);
+        if (end < start) end = start;
+        while (end > start && end < nrows && cloudsync_payload_row_compare(grouped[end-1], grouped[end]) == 0) ++end;
+        resolvers[i] = (cloudsync_payload_resolver){.data = data, .path = path, .vfs = (vfs) ? vfs->zName : NULL, .rows = rows, .grouped = grouped, .actions = actions, .start = start, .end = end};
+        start = end;
+    }
+    
+    cloudsync_parallel_run(nthreads, nthreads, cloudsync_payload_resolver_task, resolvers);
+    cloudsync_memory_free(grouped);
+    return actions;
+}
 
-    header.signature = ntohl(header.signature);
-    header.expanded_size = ntohl(header.expanded_size);
-    header.ncols = ntohs(header.ncols);
-    header.nrows = ntohl(header.nrows);
-    header.schema_hash = ntohll(header.schema_hash);
+void cloudsync_payload_header_decode (const char *payload, cloudsync_payload_header *header) {
+    memcpy(header, payload, sizeof(cloudsync_payload_header));
     
-    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
-    if (!data || header.schema_hash != data->schema_hash) {
+    header->signature = ntohl(header->signature);
+    header->expanded_size = ntohl(header->expanded_size);
+    header->ncols = ntohs(header->ncols);
+    header->nrows = ntohl(header->nrows);
+    header->schema_hash = ntohll(header->schema_hash);
+}
+
+bool cloudsync_payload_check_schema (sqlite3_context *context, cloudsync_context *data, cloudsync_payload_header *header) {
+    if (!data || header->schema_hash != data->schema_hash) {
         sqlite3 *db = sqlite3_context_db_handle(context);
-        if (!dbutils_check_schema_hash(db, header.schema_hash)) {
-            dbutils_context_result_error(context, "Cannot apply the received payload because the schema hash is unknown %llu.", header.schema_hash);
+        if (!dbutils_check_schema_hash(db, header->schema_hash)) {
+            dbutils_context_result_error(context, "Cannot apply the received payload because the schema hash is unknown %llu.", header->schema_hash);
             sqlite3_result_error_code(context, SQLITE_MISMATCH);
-            return -1;
+            return false;
         }
     }
+    return true;
+}
+
+bool cloudsync_payload_is_streamed (cloudsync_payload_header *header) {
+    // only v2 rows can be decoded again after crossing the end of the window
+    if (header->version != CLOUDSYNC_PAYLOAD_VERSION_2 || header->codec != CLOUDSYNC_PAYLOAD_CODEC_LZ4_BLOCKS || header->expanded_size == 0) return false;
+    
+    bool streamed = (header->expanded_size > CLOUDSYNC_PAYLOAD_STREAM_SIZE);
+    CHECK_FORCE_STREAM_APPLY();
+    return streamed;
+}
+
+int cloudsync_payload_expand (cloudsync_payload_header *header, const char *payload, int blen, int nthreads, const char **buffer, int *buffer_len, char **clone, char **errmsg) {
+    // sanity check the header and decompress the rows, it does not touch the database so it can run in any thread
+    // on success buffer points to the rows (inside payload or inside clone, which must be freed by the caller)
+    *clone = NULL;
+    *errmsg = NULL;
     
     // sanity check header
-    if ((header.signature != CLOUDSYNC_PAYLOAD_SIGNATURE) || (header.ncols == 0)) {
-        dbutils_context_result_error(context, "Error on cloudsync_payload_apply: invalid signature or column size.");
-        sqlite3_result_error_code(context, SQLITE_MISUSE);
-        return -1;
+    if ((header->signature != CLOUDSYNC_PAYLOAD_SIGNATURE) || (header->ncols == 0)) {
+        *errmsg = cloudsync_string_dup("Error on cloudsync_payload_apply: invalid signature or column size.", false);
+        return SQLITE_MISUSE;
+    }
+    
+    if (header->version > CLOUDSYNC_PAYLOAD_VERSION_2 || (header->version == CLOUDSYNC_PAYLOAD_VERSION_2 && header->ncols != CLOUDSYNC_PAYLOAD_NCOLS)) {
+        *errmsg = cloudsync_memory_mprintf("Error on cloudsync_payload_apply: unsupported payload version %d.", header->version);
+        return SQLITE_MISUSE;
     }
     
-    const char *buffer = payload + sizeof(cloudsync_payload_header);
-    blen -= sizeof(cloudsync_payload_header);
+    *buffer = payload + sizeof(cloudsync_payload_header);
+    *buffer_len = blen - (int)sizeof(cloudsync_payload_header);
     
     // check if payload is compressed
-    char *clone = NULL;
-    if (header.expanded_size != 0) {
-        clone = (char *)cloudsync_memory_alloc(header.expanded_size);
-        if (!clone) {sqlite3_result_error_code(context, SQLITE_NOMEM); return -1;}
-        
-        uint32_t rc = LZ4_decompress_safe(buffer, clone, blen, header.expanded_size);
-        if (rc <= 0 || rc != header.expanded_size) {
-            dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to decompress BLOB (%d).", rc);
-            sqlite3_result_error_code(context, SQLITE_MISUSE);
-            return -1;
+    if (header->expanded_size != 0 && header->codec != CLOUDSYNC_PAYLOAD_CODEC_LZ4 && header->codec != CLOUDSYNC_PAYLOAD_CODEC_LZ4_BLOCKS) {
+        *errmsg = cloudsync_memory_mprintf("Error on cloudsync_payload_apply: unsupported compression codec %d.", header->codec);
+        return SQLITE_MISUSE;
+    }
+    
+    // large block payloads are decompressed by cloudsync_payload_apply_rows
+    if (cloudsync_payload_is_streamed(header)) return SQLITE_OK;
+    
+    if (header->expanded_size != 0 && header->codec == CLOUDSYNC_PAYLOAD_CODEC_LZ4_BLOCKS) {
+        *clone = cloudsync_payload_blocks_decompress(*buffer, *buffer_len, header->expanded_size, nthreads);
+        if (!*clone) {
+            *errmsg = cloudsync_string_dup("Error on cloudsync_payload_apply: unable to decompress BLOB blocks.", false);
+            return SQLITE_MISUSE;
         }
+    } else if (header->expanded_size != 0) {
+        *clone = (char *)cloudsync_memory_alloc(header->expanded_size);
+        if (!*clone) return SQLITE_NOMEM;
         
-        buffer = (const char *)clone;
+        uint32_t rc = LZ4_decompress_safe(*buffer, *clone, *buffer_len, header->expanded_size);
+        if (rc <= 0 || rc != header->expanded_size) {
+            *errmsg = cloudsync_memory_mprintf("Error on cloudsync_payload_apply: unable to decompress BLOB (%d).", rc);
+            cloudsync_memory_free(*clone);
+            *clone = NULL;
+            return SQLITE_MISUSE;
+        }
     }
     
+    if (*clone) {
+        *buffer = (const char *)*clone;
+        *buffer_len = (int)header->expanded_size;
+    }
+    return SQLITE_OK;
+}
+
+void cloudsync_payload_expand_error (sqlite3_context *context, int rc, char *errmsg) {
+    if (errmsg) {
+        dbutils_context_result_error(context, "%s", errmsg);
+        cloudsync_memory_free(errmsg);
+    }
+    sqlite3_result_error_code(context, rc);
+}
+
+int cloudsync_payload_apply_rows (sqlite3_context *context, cloudsync_context *data, cloudsync_payload_header *hdr, const char *buffer, int blen, uint64_t payload_id, cloudsync_payload_budget *budget) {
+    // apply the (already decompressed) rows of a payload, payload_id is used by the apply checkpoints (0 disables them)
+    // and budget (if not NULL) limits the rows applied by this call
+    cloudsync_payload_header header = *hdr;
     sqlite3 *db = sqlite3_context_db_handle(context);
     
-    // precompile the insert statement
+    // changes are merged directly from the decoded buffer,
+    // INSERT INTO cloudsync_changes is used only if the context is not available
     sqlite3_stmt *vm = NULL;
-    const char *sql = "INSERT INTO cloudsync_changes(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) VALUES (?,?,?,?,?,?,?,?,?);";
-    int rc = sqlite3_prepare(db, sql, -1, &vm, NULL);
-    if (rc != SQLITE_OK) {
-        dbutils_context_result_error(context, "Error on cloudsync_payload_apply: error while compiling SQL statement (%s).", sqlite3_errmsg(db));
-        if (clone) cloudsync_memory_free(clone);
-        return -1;
+    const char *sql = NULL;
+    int rc = SQLITE_OK;
+    bool use_vtab = (data == NULL);
+    CHECK_FORCE_VTAB_APPLY();
+    if (use_vtab) {
+        sql = "INSERT INTO cloudsync_changes(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) VALUES (?,?,?,?,?,?,?,?,?);";
+        rc = sqlite3_prepare(db, sql, -1, &vm, NULL);
+        if (rc != SQLITE_OK) {
+            dbutils_context_result_error(context, "Error on cloudsync_payload_apply: error while compiling SQL statement (%s).", sqlite3_errmsg(db));
+            return -1;
+        }
     }
     
     // process buffer, one row at a time
@@ -2166,18 +5179,124 @@ int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int
     uint32_t nrows = header.nrows;
     int64_t last_payload_db_version = -1;
     bool in_savepoint = false;
+    uint32_t batch_rows = 0;
+    uint64_t batch_start = 0;
     int dbversion = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_CHECK_DBVERSION);
     int seq = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_CHECK_SEQ);
     cloudsync_pk_decode_bind_context decoded_context = {.vm = vm};
     void *payload_apply_xdata = NULL;
     cloudsync_payload_apply_callback_t payload_apply_callback = cloudsync_get_payload_apply_callback(db);
+    bool is_v2 = (header.version == CLOUDSYNC_PAYLOAD_VERSION_2);
+    bool decode_error = false;
+    cloudsync_payload_decoder decoder;
+    cloudsync_payload_decoder_init(&decoder);
+    
+    // large block payloads are decompressed while their rows are decoded (buffer contains the compressed blocks)
+    cloudsync_payload_stream stream = {0};
+    if (cloudsync_payload_is_streamed(&header)) {
+        if (!cloudsync_payload_stream_init(&stream, buffer, blen, header.expanded_size, (data) ? data->payload_threads : 1)) {
+            dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to decompress BLOB blocks.");
+            sqlite3_result_error_code(context, SQLITE_MISUSE);
+            if (vm) sqlite3_finalize(vm);
+            return -1;
+        }
+        decoder.tbl_dict.copy = true;
+        decoder.col_dict.copy = true;
+        decoder.site_dict.copy = true;
+    }
+    cloudsync_payload_apply_cache cache = {0};
+    // a payload_apply_callback must see the writes of each change when it is notified
+    cache.writer.enabled = (!vm && !payload_apply_callback);
+    char *apply_err = NULL;
+    char *lasterr = NULL;
+    bool aborted = false;
+    cloudsync_apply_stats *stats = (data) ? &data->apply_stats : NULL;
+    uint64_t tstart = 0, tnow = 0;
+    
+    // with payload_apply_locality the whole payload is decoded first and then applied in payload order inside a single
+    // savepoint (changes are never reordered: a parent row must be applied before the rows whose foreign keys reference it
+    // and deleted after them, also within the same table)
+    // (decoded values point inside the buffer, so they remain valid until the end of the apply)
+    cloudsync_pk_decode_bind_context *rows = NULL;
+    uint8_t *actions = NULL;
+    if (!vm && !stream.src && !budget && (data->payload_locality || data->payload_parallel) && nrows > 1 && nrows <= (uint32_t)blen) {
+        // fallback to the sequential apply if NULL
+        rows = (cloudsync_pk_decode_bind_context *)cloudsync_memory_zeroalloc((uint64_t)nrows * sizeof(cloudsync_pk_decode_bind_context));
+    }
+    
+    if (rows) {
+        if (stats) cloudsync_time_us(&tstart);
+        const char *p = buffer;
+        int plen = blen;
+        for (uint32_t i=0; i<nrows; ++i) {
+            size_t seek = 0;
+            if (is_v2) {
+                rc = cloudsync_payload_decode_row_v2(&decoder, (char *)p, plen, &seek, &rows[i]);
+                if (rc != SQLITE_OK) {
+                    decode_error = true;
+                    break;
+                }
+            } else {
+                pk_decode((char *)p, plen, ncols, &seek, cloudsync_pk_decode_bind_callback, &rows[i]);
+            }
+            p += seek;
+            plen -= seek;
+        }
+        
+        // nothing is applied from a payload that cannot be fully decoded
+        if (decode_error) nrows = 0;
+        if (stats && cloudsync_time_us(&tnow) == 0) stats->decode_us += tnow - tstart;
+        
+        // with payload_apply_parallel the conflicts are resolved by worker threads before the writes,
+        // the whole payload is then applied in the transaction that holds the write lock
+        // (it requires a database file and no pending changes, the workers must see the same state of this connection)
+        bool parallel = (data->payload_parallel && data->payload_threads > 1 && !payload_apply_callback && nrows >= CLOUDSYNC_PAYLOAD_PARALLEL_MIN_ROWS);
+        if (parallel && sqlite3_get_autocommit(db) && sqlite3_exec(db, "BEGIN IMMEDIATE;", NULL, NULL, NULL) == SQLITE_OK) {
+            cloudsync_time_us(&tstart);
+            actions = cloudsync_payload_resolve(db, data, rows, nrows);
+            if (!actions) sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+            else stats->savepoints++;
+            if (cloudsync_time_us(&tnow) == 0) stats->merge_us += tnow - tstart;
+        }
+    }
     
+    // rows committed by an interrupted apply of the same payload are decoded again but not merged
+    // (decoded changes are applied in a single transaction, so a checkpoint is only removed)
+    bool checkpointed = false;
+    uint32_t resume_row = cloudsync_payload_checkpoint_get(db, payload_id, &checkpointed);
+    if (rows) resume_row = 0;
+    uint32_t checkpoint_row = resume_row;
+    
+    if (stats) cloudsync_time_us(&tstart);
     for (uint32_t i=0; i<nrows; ++i) {
+        CHECK_FORCE_APPLY_INTERRUPT();
         size_t seek = 0;
-        pk_decode((char *)buffer, blen, ncols, &seek, cloudsync_pk_decode_bind_callback, &decoded_context);
-        // n is the pk_decode return value, I don't think I should assert here because in any case the next sqlite3_step would fail
-        // assert(n == ncols);
-                
+        if (rows) {
+            decoded_context = rows[i];
+        } else if (is_v2) {
+            // a malformed v2 row makes the rest of the payload unreadable (dictionaries and deltas depend on previous rows)
+            if (stream.src) rc = cloudsync_payload_stream_decode_row(&stream, &decoder, &decoded_context);
+            else rc = cloudsync_payload_decode_row_v2(&decoder, (char *)buffer, blen, &seek, &decoded_context);
+            if (rc != SQLITE_OK) {
+                decode_error = true;
+                break;
+            }
+        } else {
+            pk_decode((char *)buffer, blen, ncols, &seek, cloudsync_pk_decode_bind_callback, &decoded_context);
+            // n is the pk_decode return value, I don't think I should assert here because in any case the next sqlite3_step would fail
+            // assert(n == ncols);
+        }
+        if (stats && cloudsync_time_us(&tnow) == 0) {
+            stats->decode_us += tnow - tstart;
+            tstart = tnow;
+        }
+        
+        if (i < resume_row) {
+            buffer += seek;
+            blen -= seek;
+            continue;
+        }
+        
         bool approved = true;
         if (payload_apply_callback) approved = payload_apply_callback(&payload_apply_xdata, &decoded_context, db, data, CLOUDSYNC_PAYLOAD_APPLY_WILL_APPLY, SQLITE_OK);
         
@@ -2189,17 +5308,36 @@ int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int
         // This savepoint ensures that the db_version value remains consistent for all
         // rows with the same original db_version in the payload.
 
-        bool db_version_changed = (last_payload_db_version != decoded_context.db_version);
-
-        // Release existing savepoint if db_version changed
-        if (in_savepoint && db_version_changed) {
+        // decoded changes are all applied inside the same savepoint
+        bool db_version_changed = (rows) ? (i == 0) : (last_payload_db_version != decoded_context.db_version);
+
+        // Release existing savepoint if db_version changed (and the batching policy allows it),
+        // the budget of a time-sliced apply is checked at every db_version boundary and forces the release
+        bool stop = (in_savepoint && db_version_changed && budget && payload_id && cloudsync_payload_budget_exhausted(budget, i - resume_row));
+        if (in_savepoint && db_version_changed && (stop || cloudsync_payload_apply_batch_full(data, batch_rows, batch_start))) {
+            cloudsync_payload_apply_flush(data, &cache, &rc, &apply_err);
+            // the checkpoint is committed together with the rows before this one,
+            // a time-sliced apply can stop here only if its checkpoint has been written
+            if (payload_id && (stop || i - checkpoint_row >= CLOUDSYNC_PAYLOAD_CHECKPOINT_ROWS)) {
+                if (cloudsync_payload_checkpoint_set(db, context, payload_id, i) == SQLITE_OK) {
+                    checkpoint_row = i;
+                    checkpointed = true;
+                } else {
+                    stop = false;
+                }
+            }
             rc = sqlite3_exec(db, "RELEASE cloudsync_payload_apply;", NULL, NULL, NULL);
             if (rc != SQLITE_OK) {
                 dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to release a savepoint (%s).", sqlite3_errmsg(db));
-                if (clone) cloudsync_memory_free(clone);
-                return -1;
+                aborted = true;
+                goto abort_apply;
             }
             in_savepoint = false;
+            
+            if (stop) {
+                budget->next_row = i;
+                break;
+            }
         }
 
         // Start new savepoint if needed
@@ -2208,19 +5346,44 @@ int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int
             rc = sqlite3_exec(db, "SAVEPOINT cloudsync_payload_apply;", NULL, NULL, NULL);
             if (rc != SQLITE_OK) {
                 dbutils_context_result_error(context, "Error on cloudsync_payload_apply: unable to start a transaction (%s).", sqlite3_errmsg(db));
-                if (clone) cloudsync_memory_free(clone);
-                return -1;
+                aborted = true;
+                goto abort_apply;
             }
-            last_payload_db_version = decoded_context.db_version;
             in_savepoint = true;
+            if (stats) stats->savepoints++;
+            batch_rows = 0;
+            if (data && data->payload_batch == CLOUDSYNC_APPLY_BATCH_MS) cloudsync_time_ms(&batch_start);
         }
+        last_payload_db_version = decoded_context.db_version;
+        ++batch_rows;
         
+        int action = -1;
         if (approved) {
-            rc = sqlite3_step(vm);
-            if (rc != SQLITE_DONE) {
-                // don't "break;", the error can be due to a RLS policy.
-                // in case of error we try to apply the following changes
-                printf("cloudsync_payload_apply error on db_version %lld/%lld: (%d) %s\n", decoded_context.db_version, decoded_context.seq, rc, sqlite3_errmsg(db));
+            if (vm) {
+                rc = sqlite3_step(vm);
+            } else {
+                // same result codes of sqlite3_step (SQLITE_DONE on success)
+                if (apply_err) cloudsync_memory_free(apply_err);
+                apply_err = NULL;
+                if (actions && actions[i] != CLOUDSYNC_MERGE_DEFER) {
+                    action = actions[i];
+                    rc = cloudsync_payload_apply_action(data, &cache, &decoded_context, action, &apply_err);
+                } else {
+                    rc = cloudsync_payload_apply_change(data, &cache, &decoded_context, &action, &apply_err);
+                }
+                if (rc == SQLITE_OK) rc = SQLITE_DONE;
+            }
+            // don't "break;", the error can be due to a RLS policy.
+            // in case of error we try to apply the following changes
+        }
+        
+        // errors are collected by the apply statistics (cloudsync_last_apply_stats)
+        if (stats) {
+            const char *errmsg = (rc == SQLITE_DONE) ? NULL : ((apply_err) ? apply_err : sqlite3_errmsg(db));
+            cloudsync_apply_stats_add(stats, &decoded_context, action, approved, rc, errmsg);
+            if (cloudsync_time_us(&tnow) == 0) {
+                stats->merge_us += tnow - tstart;
+                tstart = tnow;
             }
         }
         
@@ -2228,41 +5391,90 @@ int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int
         
         buffer += seek;
         blen -= seek;
-        stmt_reset(vm);
+        if (vm) stmt_reset(vm);
+    }
+    
+    cloudsync_payload_apply_flush(data, &cache, &rc, &apply_err);
+    
+    // blocks of streamed payloads are decompressed while decoding
+    if (stats && stream.src) {
+        stats->decompress_us += stream.elapsed_us;
+        stats->decode_us = (stats->decode_us > stream.elapsed_us) ? stats->decode_us - stream.elapsed_us : 0;
+    }
+    
+    if (rows) {
+        // the check settings below refer to the last change of the payload
+        if (!decode_error) decoded_context = rows[header.nrows-1];
+        cloudsync_memory_free(rows);
+        rows = NULL;
+    }
+    
+    // every row has been processed, the checkpoint is removed together with the last changes
+    bool stopped = (budget && budget->next_row > 0);
+    if (checkpointed && !decode_error && !stopped) cloudsync_payload_checkpoint_set(db, context, payload_id, 0);
+    
+    // the parallel apply commits its own transaction, including the check position
+    bool check_updated = false;
+    if (actions) {
+        if (rc == SQLITE_OK || rc == SQLITE_DONE) {
+            cloudsync_payload_apply_set_check(db, context, &decoded_context, dbversion, seq);
+            check_updated = true;
+        }
+        int rc1 = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+        if (rc1 != SQLITE_OK) {
+            rc = rc1;
+            check_updated = false;
+            sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        }
+        cloudsync_memory_free(actions);
+        actions = NULL;
+    }
+    
+    // the check position is written inside the last savepoint, so that it does not need a commit of its own
+    if (in_savepoint && !decode_error && (rc == SQLITE_OK || rc == SQLITE_DONE)) {
+        cloudsync_payload_apply_set_check(db, context, &decoded_context, dbversion, seq);
+        check_updated = true;
     }
     
     if (in_savepoint) {
-        sql = "RELEASE cloudsync_payload_apply;";
+        // do not partially apply a db_version that cannot be fully decoded
+        sql = (decode_error) ? "ROLLBACK TO cloudsync_payload_apply; RELEASE cloudsync_payload_apply;" : "RELEASE cloudsync_payload_apply;";
         int rc1 = sqlite3_exec(db, sql, NULL, NULL, NULL);
         if (rc1 != SQLITE_OK) rc = rc1;
+        in_savepoint = false;
     }
 
-    char *lasterr = (rc != SQLITE_OK && rc != SQLITE_DONE) ? cloudsync_string_dup(sqlite3_errmsg(db), false) : NULL;
+    if (decode_error) lasterr = cloudsync_string_dup("Error on cloudsync_payload_apply: malformed payload row.", false);
+    else if (rc != SQLITE_OK && rc != SQLITE_DONE) lasterr = cloudsync_string_dup((apply_err) ? apply_err : sqlite3_errmsg(db), false);
+    
+abort_apply:
+    // an aborted apply (its error is already set) does not keep any of its changes
+    if (aborted && in_savepoint) sqlite3_exec(db, "ROLLBACK TO cloudsync_payload_apply; RELEASE cloudsync_payload_apply;", NULL, NULL, NULL);
+    if (actions) {
+        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+        cloudsync_memory_free(actions);
+    }
+    if (rows) cloudsync_memory_free(rows);
+    cloudsync_payload_decoder_free(&decoder);
+    cloudsync_payload_stream_free(&stream);
+    cloudsync_payload_apply_cache_free(&cache);
+    if (apply_err) cloudsync_memory_free(apply_err);
     
     if (payload_apply_callback) {
         payload_apply_callback(&payload_apply_xdata, &decoded_context, db, data, CLOUDSYNC_PAYLOAD_APPLY_CLEANUP, rc);
     }
+    
+    if (aborted) {
+        if (vm) sqlite3_finalize(vm);
+        return -1;
+    }
 
     if (rc == SQLITE_DONE) rc = SQLITE_OK;
-    if (rc == SQLITE_OK) {
-        char buf[256];
-        if (decoded_context.db_version >= dbversion) {
-            snprintf(buf, sizeof(buf), "%lld", decoded_context.db_version);
-            dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_DBVERSION, buf);
-            
-            if (decoded_context.seq != seq) {
-                snprintf(buf, sizeof(buf), "%lld", decoded_context.seq);
-                dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_CHECK_SEQ, buf);
-            }
-        }
-    }
+    if (rc == SQLITE_OK && !check_updated && !stopped) cloudsync_payload_apply_set_check(db, context, &decoded_context, dbversion, seq);
 
     // cleanup vm
     if (vm) sqlite3_finalize(vm);
     
-    // cleanup memory
-    if (clone) cloudsync_memory_free(clone);
-    
     if (rc != SQLITE_OK) {
         sqlite3_result_error(context, lasterr, -1);
         sqlite3_result_error_code(context, SQLITE_MISUSE);
@@ -2270,11 +5482,45 @@ int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int
         return -1;
     }
     
-    // return the number of processed rows
-    sqlite3_result_int(context, nrows);
+    // return the number of processed rows (a time-sliced apply returns its continuation token)
+    if (budget) sqlite3_result_int64(context, budget->next_row);
+    else sqlite3_result_int(context, nrows);
+    return nrows;
+}
+
+int cloudsync_payload_apply_budget (sqlite3_context *context, const char *payload, int blen, cloudsync_payload_budget *budget) {
+    // decode header
+    cloudsync_payload_header header;
+    cloudsync_payload_header_decode(payload, &header);
+    
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    if (data) cloudsync_apply_stats_reset(&data->apply_stats);
+    if (!cloudsync_payload_check_schema(context, data, &header)) return -1;
+    
+    // only large payloads are applied with checkpoints (time-sliced applies always need them)
+    uint64_t payload_id = (budget || header.nrows >= CLOUDSYNC_PAYLOAD_CHECKPOINT_ROWS) ? cloudsync_payload_identity(payload, blen) : 0;
+    
+    const char *buffer = NULL;
+    char *clone = NULL;
+    char *errmsg = NULL;
+    uint64_t tstart = 0, tnow = 0;
+    cloudsync_time_us(&tstart);
+    int rc = cloudsync_payload_expand(&header, payload, blen, (data) ? data->payload_threads : 1, &buffer, &blen, &clone, &errmsg);
+    if (data && cloudsync_time_us(&tnow) == 0) data->apply_stats.decompress_us += tnow - tstart;
+    if (rc != SQLITE_OK) {
+        cloudsync_payload_expand_error(context, rc, errmsg);
+        return -1;
+    }
+    
+    int nrows = cloudsync_payload_apply_rows(context, data, &header, buffer, blen, payload_id, budget);
+    if (clone) cloudsync_memory_free(clone);
     return nrows;
 }
 
+int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int blen) {
+    return cloudsync_payload_apply_budget(context, payload, blen, NULL);
+}
+
 void cloudsync_payload_decode (sqlite3_context *context, int argc, sqlite3_value **argv) {
     DEBUG_FUNCTION("cloudsync_payload_decode");
     //debug_values(argc, argv);
@@ -2286,46 +5532,416 @@ void cloudsync_payload_decode (sqlite3_context *context, int argc, sqlite3_value
         return;
     }
     
-    // sanity check payload size
-    int blen = sqlite3_value_bytes(argv[0]);
-    if (blen < (int)sizeof(cloudsync_payload_header)) {
-        dbutils_context_result_error(context, "Error on cloudsync_payload_decode: invalid input size.");
-        sqlite3_result_error_code(context, SQLITE_MISUSE);
+    // sanity check payload size
+    int blen = sqlite3_value_bytes(argv[0]);
+    if (blen < (int)sizeof(cloudsync_payload_header)) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_decode: invalid input size.");
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
+    
+    // obtain payload
+    const char *payload = (const char *)sqlite3_value_blob(argv[0]);
+    
+    // apply changes
+    cloudsync_payload_apply(context, payload, blen);
+}
+
+void cloudsync_payload_apply_step (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_payload_apply_step");
+    
+    // cloudsync_payload_apply_step(payload, budget_ms [, budget_rows])
+    // applies the payload until the budget runs out and returns 0 if the payload has been fully applied,
+    // otherwise a continuation token (the first row not yet applied): the same payload must be applied again to continue
+    if (argc < 2 || argc > 3) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_apply_step: wrong number of arguments.");
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
+    
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_apply_step: value must be a BLOB.");
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
+    
+    int blen = sqlite3_value_bytes(argv[0]);
+    if (blen < (int)sizeof(cloudsync_payload_header)) {
+        dbutils_context_result_error(context, "Error on cloudsync_payload_apply_step: invalid input size.");
+        sqlite3_result_error_code(context, SQLITE_MISUSE);
+        return;
+    }
+    
+    cloudsync_payload_budget budget = {0};
+    cloudsync_time_ms(&budget.start_ms);
+    budget.budget_ms = sqlite3_value_int64(argv[1]);
+    budget.budget_rows = (argc == 3) ? sqlite3_value_int64(argv[2]) : 0;
+    
+    const char *payload = (const char *)sqlite3_value_blob(argv[0]);
+    cloudsync_payload_apply_budget(context, payload, blen, &budget);
+}
+
+// MARK: - Payload Inspection -
+
+// payloads are decoded without touching the database, so that they can be inspected without applying them:
+// cloudsync_payload_rows returns the decoded changes and cloudsync_payload_info the header and the size of each table
+
+struct cloudsync_payload_reader {
+    cloudsync_payload_header            header;
+    char                                *payload;       // copy of the payload (the argument of the function is not retained)
+    int                                 size;
+    const char                          *buffer;        // decompressed rows (not used by streamed payloads)
+    int                                 blen;
+    char                                *clone;
+    size_t                              seek;
+    cloudsync_payload_stream            stream;
+    cloudsync_payload_decoder           decoder;
+    cloudsync_pk_decode_bind_context    row;
+    uint32_t                            index;          // number of rows decoded
+    int64_t                             row_size;       // size of the encoded (decompressed) row
+};
+
+typedef struct {
+    char            *name;
+    int64_t         name_len;
+    int64_t         nrows;
+    int64_t         nbytes;
+} cloudsync_payload_info_table;
+
+struct cloudsync_payload_info {
+    cloudsync_payload_header        header;
+    int                             size;
+    int64_t                         nrows;
+    int64_t                         nbytes;
+    cloudsync_payload_info_table    *tables;
+    int                             ntables;
+    int                             nalloc;
+};
+
+cloudsync_payload_reader *cloudsync_payload_reader_create (cloudsync_context *data, const char *payload, int size, char **errmsg) {
+    *errmsg = NULL;
+    if (size < (int)sizeof(cloudsync_payload_header)) {
+        *errmsg = cloudsync_string_dup("Error on cloudsync_payload_reader: invalid input size.", false);
+        return NULL;
+    }
+    
+    cloudsync_payload_reader *reader = cloudsync_memory_zeroalloc(sizeof(cloudsync_payload_reader));
+    if (!reader) return NULL;
+    
+    reader->payload = cloudsync_memory_alloc((uint64_t)size);
+    if (!reader->payload) goto abort_reader;
+    memcpy(reader->payload, payload, (size_t)size);
+    reader->size = size;
+    
+    cloudsync_payload_header_decode(reader->payload, &reader->header);
+    cloudsync_payload_decoder_init(&reader->decoder);
+    
+    int nthreads = (data) ? data->payload_threads : 1;
+    int rc = cloudsync_payload_expand(&reader->header, reader->payload, size, nthreads, &reader->buffer, &reader->blen, &reader->clone, errmsg);
+    if (rc != SQLITE_OK) goto abort_reader;
+    
+    if (cloudsync_payload_is_streamed(&reader->header)) {
+        if (!cloudsync_payload_stream_init(&reader->stream, reader->buffer, reader->blen, reader->header.expanded_size, nthreads)) {
+            *errmsg = cloudsync_string_dup("Error on cloudsync_payload_reader: unable to decompress BLOB blocks.", false);
+            goto abort_reader;
+        }
+        reader->decoder.tbl_dict.copy = true;
+        reader->decoder.col_dict.copy = true;
+        reader->decoder.site_dict.copy = true;
+    }
+    
+    return reader;
+    
+abort_reader:
+    cloudsync_payload_reader_free(reader);
+    return NULL;
+}
+
+void cloudsync_payload_reader_free (cloudsync_payload_reader *reader) {
+    if (!reader) return;
+    
+    cloudsync_payload_decoder_free(&reader->decoder);
+    cloudsync_payload_stream_free(&reader->stream);
+    if (reader->clone) cloudsync_memory_free(reader->clone);
+    if (reader->payload) cloudsync_memory_free(reader->payload);
+    cloudsync_memory_free(reader);
+}
+
+int cloudsync_payload_reader_next (cloudsync_payload_reader *reader) {
+    // returns SQLITE_ROW when a row has been decoded, SQLITE_DONE at the end of the payload
+    if (reader->index >= reader->header.nrows) return SQLITE_DONE;
+    
+    int rc = SQLITE_OK;
+    size_t seek = 0;
+    if (reader->stream.src) {
+        uint64_t offset = cloudsync_payload_stream_offset(&reader->stream);
+        rc = cloudsync_payload_stream_decode_row(&reader->stream, &reader->decoder, &reader->row);
+        seek = (size_t)(cloudsync_payload_stream_offset(&reader->stream) - offset);
+    } else {
+        if (reader->seek >= (size_t)reader->blen) return SQLITE_CORRUPT;
+        char *buffer = (char *)reader->buffer + reader->seek;
+        size_t blen = (size_t)reader->blen - reader->seek;
+        if (reader->header.version == CLOUDSYNC_PAYLOAD_VERSION_2) rc = cloudsync_payload_decode_row_v2(&reader->decoder, buffer, blen, &seek, &reader->row);
+        else if (pk_decode(buffer, blen, reader->header.ncols, &seek, cloudsync_pk_decode_bind_callback, &reader->row) != reader->header.ncols) rc = SQLITE_CORRUPT;
+        reader->seek += seek;
+    }
+    if (rc != SQLITE_OK) return rc;
+    
+    reader->row_size = (int64_t)seek;
+    reader->index++;
+    return SQLITE_ROW;
+}
+
+void cloudsync_payload_reader_result (cloudsync_payload_reader *reader, int col, sqlite3_context *ctx) {
+    cloudsync_pk_decode_bind_context *d = &reader->row;
+    switch (col) {
+        case CLOUDSYNC_PK_INDEX_TBL: sqlite3_result_text(ctx, d->tbl, (int)d->tbl_len, SQLITE_TRANSIENT); break;
+        case CLOUDSYNC_PK_INDEX_PK: sqlite3_result_blob(ctx, d->pk, (int)d->pk_len, SQLITE_TRANSIENT); break;
+        case CLOUDSYNC_PK_INDEX_COLNAME:
+            if (d->col_name) sqlite3_result_text(ctx, d->col_name, (int)d->col_name_len, SQLITE_TRANSIENT);
+            else sqlite3_result_null(ctx);
+            break;
+        case CLOUDSYNC_PK_INDEX_COLVALUE:
+            switch (d->col_value_type) {
+                case SQLITE_INTEGER: sqlite3_result_int64(ctx, d->col_value_ival); break;
+                case SQLITE_FLOAT: sqlite3_result_double(ctx, d->col_value_dval); break;
+                case SQLITE_TEXT: sqlite3_result_text(ctx, d->col_value_pval, (int)d->col_value_ival, SQLITE_TRANSIENT); break;
+                case SQLITE_BLOB: sqlite3_result_blob(ctx, d->col_value_pval, (int)d->col_value_ival, SQLITE_TRANSIENT); break;
+                default: sqlite3_result_null(ctx); break;
+            }
+            break;
+        case CLOUDSYNC_PK_INDEX_COLVERSION: sqlite3_result_int64(ctx, d->col_version); break;
+        case CLOUDSYNC_PK_INDEX_DBVERSION: sqlite3_result_int64(ctx, d->db_version); break;
+        case CLOUDSYNC_PK_INDEX_SITEID: sqlite3_result_blob(ctx, d->site_id, (int)d->site_id_len, SQLITE_TRANSIENT); break;
+        case CLOUDSYNC_PK_INDEX_CL: sqlite3_result_int64(ctx, d->cl); break;
+        case CLOUDSYNC_PK_INDEX_SEQ: sqlite3_result_int64(ctx, d->seq); break;
+        case CLOUDSYNC_PAYLOAD_ROWS_NBYTES: sqlite3_result_int64(ctx, reader->row_size); break;
+    }
+}
+
+int64_t cloudsync_payload_reader_rowid (cloudsync_payload_reader *reader) {
+    return (int64_t)reader->index;
+}
+
+bool cloudsync_payload_info_add (cloudsync_payload_info *info, cloudsync_pk_decode_bind_context *d, int64_t nbytes) {
+    // consecutive rows usually belong to the same table
+    cloudsync_payload_info_table *table = NULL;
+    for (int i=info->ntables-1; i>=0; --i) {
+        if (info->tables[i].name_len == d->tbl_len && memcmp(info->tables[i].name, d->tbl, (size_t)d->tbl_len) == 0) {
+            table = &info->tables[i];
+            break;
+        }
+    }
+    
+    if (!table) {
+        if (info->ntables == info->nalloc) {
+            int nalloc = (info->nalloc) ? info->nalloc * 2 : 8;
+            cloudsync_payload_info_table *tables = cloudsync_memory_realloc(info->tables, (uint64_t)nalloc * sizeof(cloudsync_payload_info_table));
+            if (!tables) return false;
+            info->tables = tables;
+            info->nalloc = nalloc;
+        }
+        
+        char *name = cloudsync_string_ndup(d->tbl, (size_t)d->tbl_len, false);
+        if (!name) return false;
+        table = &info->tables[info->ntables++];
+        *table = (cloudsync_payload_info_table){.name = name, .name_len = d->tbl_len};
+    }
+    
+    table->nrows++;
+    table->nbytes += nbytes;
+    info->nrows++;
+    info->nbytes += nbytes;
+    return true;
+}
+
+cloudsync_payload_info *cloudsync_payload_info_create (cloudsync_context *data, const char *payload, int size, char **errmsg) {
+    cloudsync_payload_reader *reader = cloudsync_payload_reader_create(data, payload, size, errmsg);
+    if (!reader) return NULL;
+    
+    cloudsync_payload_info *info = cloudsync_memory_zeroalloc(sizeof(cloudsync_payload_info));
+    if (!info) goto abort_info;
+    info->header = reader->header;
+    info->size = size;
+    
+    int rc;
+    while ((rc = cloudsync_payload_reader_next(reader)) == SQLITE_ROW) {
+        if (!cloudsync_payload_info_add(info, &reader->row, reader->row_size)) goto abort_info;
+    }
+    if (rc != SQLITE_DONE) {
+        *errmsg = cloudsync_memory_mprintf("Error on cloudsync_payload_info: unable to decode row %u (%d).", reader->index + 1, rc);
+        goto abort_info;
+    }
+    
+    cloudsync_payload_reader_free(reader);
+    return info;
+    
+abort_info:
+    cloudsync_payload_reader_free(reader);
+    cloudsync_payload_info_free(info);
+    return NULL;
+}
+
+void cloudsync_payload_info_free (cloudsync_payload_info *info) {
+    if (!info) return;
+    
+    for (int i=0; i<info->ntables; ++i) cloudsync_memory_free(info->tables[i].name);
+    if (info->tables) cloudsync_memory_free(info->tables);
+    cloudsync_memory_free(info);
+}
+
+int cloudsync_payload_info_count (cloudsync_payload_info *info) {
+    // the header row followed by a row for each table
+    return info->ntables + 1;
+}
+
+void cloudsync_payload_info_result (cloudsync_payload_info *info, int index, int col, sqlite3_context *ctx) {
+    cloudsync_payload_info_table *table = (index > 0 && index <= info->ntables) ? &info->tables[index-1] : NULL;
+    cloudsync_payload_header *header = &info->header;
+    
+    switch (col) {
+        case CLOUDSYNC_PAYLOAD_INFO_TBL:
+            if (table) sqlite3_result_text(ctx, table->name, (int)table->name_len, SQLITE_TRANSIENT);
+            else sqlite3_result_null(ctx);
+            return;
+        case CLOUDSYNC_PAYLOAD_INFO_NROWS: sqlite3_result_int64(ctx, (table) ? table->nrows : info->nrows); return;
+        case CLOUDSYNC_PAYLOAD_INFO_NBYTES: sqlite3_result_int64(ctx, (table) ? table->nbytes : info->nbytes); return;
+    }
+    
+    // header fields are returned only in the header row
+    if (table) {
+        sqlite3_result_null(ctx);
         return;
     }
     
-    // obtain payload
-    const char *payload = (const char *)sqlite3_value_blob(argv[0]);
-    
-    // apply changes
-    cloudsync_payload_apply(context, payload, blen);
+    switch (col) {
+        case CLOUDSYNC_PAYLOAD_INFO_VERSION: sqlite3_result_int(ctx, header->version); break;
+        case CLOUDSYNC_PAYLOAD_INFO_LIBVERSION: {
+            char libversion[32];
+            snprintf(libversion, sizeof(libversion), "%d.%d.%d", header->libversion[0], header->libversion[1], header->libversion[2]);
+            sqlite3_result_text(ctx, libversion, -1, SQLITE_TRANSIENT);
+            break;
+        }
+        case CLOUDSYNC_PAYLOAD_INFO_CODEC: sqlite3_result_int(ctx, (header->expanded_size) ? header->codec : CLOUDSYNC_PAYLOAD_CODEC_NONE); break;
+        case CLOUDSYNC_PAYLOAD_INFO_SIZE: sqlite3_result_int(ctx, info->size); break;
+        case CLOUDSYNC_PAYLOAD_INFO_EXPANDED_SIZE: sqlite3_result_int64(ctx, (header->expanded_size) ? (sqlite3_int64)header->expanded_size : (sqlite3_int64)(info->size - (int)sizeof(cloudsync_payload_header))); break;
+        case CLOUDSYNC_PAYLOAD_INFO_NCOLS: sqlite3_result_int(ctx, header->ncols); break;
+        case CLOUDSYNC_PAYLOAD_INFO_SCHEMA_HASH: sqlite3_result_int64(ctx, (sqlite3_int64)header->schema_hash); break;
+    }
 }
 
 // MARK: - Payload load/store -
 
-int cloudsync_payload_get (sqlite3_context *context, char **blob, int *blob_size, int *db_version, int *seq, sqlite3_int64 *new_db_version, sqlite3_int64 *new_seq) {
-    sqlite3 *db = sqlite3_context_db_handle(context);
+// encoded payloads are kept in the cloudsync_outbox table until send_dbversion/send_seq move past them:
+// a failed upload reuses the already encoded segment and each call only encodes the changes not yet in the outbox
+
+int cloudsync_outbox_refresh (sqlite3 *db, cloudsync_context *data, int db_version, int seq) {
+    sqlite3_stmt *vm = NULL;
+    uint64_t schema_hash = (data) ? data->schema_hash : dbutils_schema_hash(db);
+    
+    // drop acknowledged segments, segments encoded with an older schema and the whole outbox
+    // if the first segment does not start from the last sent position (i.e. after a reset of the sync version)
+    char *sql = cloudsync_memory_mprintf("DELETE FROM cloudsync_outbox WHERE to_db_version < %d OR (to_db_version = %d AND to_seq <= %d) OR schema_hash != %lld; "
+                                         "DELETE FROM cloudsync_outbox WHERE (SELECT from_db_version != %d OR from_seq != %d FROM cloudsync_outbox ORDER BY id LIMIT 1);",
+                                         db_version, db_version, seq, (sqlite3_int64)schema_hash, db_version, seq);
+    if (!sql) return SQLITE_NOMEM;
+    int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    cloudsync_memory_free(sql);
+    if (rc != SQLITE_OK) return rc;
+    
+    // new changes are encoded starting from the end of the last segment
+    rc = sqlite3_prepare_v2(db, "SELECT to_db_version, to_seq FROM cloudsync_outbox ORDER BY id DESC LIMIT 1;", -1, &vm, NULL);
+    if (rc != SQLITE_OK) return rc;
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_ROW) {
+        db_version = sqlite3_column_int(vm, 0);
+        seq = sqlite3_column_int(vm, 1);
+        rc = SQLITE_OK;
+    } else if (rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+    }
+    sqlite3_finalize(vm);
+    vm = NULL;
+    if (rc != SQLITE_OK) return rc;
+    
+    char *blob = NULL;
+    int blob_size = 0;
+    sqlite3_int64 new_db_version = 0, new_seq = 0;
+    
+    char query[1024];
+    snprintf(query, sizeof(query), "WITH max_db_version AS (SELECT MAX(db_version) AS max_db_version FROM cloudsync_changes) "
+                                   "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq), max_db_version AS max_db_version, MAX(IIF(db_version = max_db_version, seq, NULL)) FROM cloudsync_changes, max_db_version WHERE site_id=cloudsync_siteid() AND (db_version>%d OR (db_version=%d AND seq>%d))", db_version, db_version, seq);
+    
+    rc = dbutils_blob_int_int_select(db, query, &blob, &blob_size, &new_db_version, &new_seq);
+    if (rc != SQLITE_OK || blob == NULL || blob_size == 0) goto finalize;
+    
+    rc = sqlite3_prepare_v2(db, "INSERT INTO cloudsync_outbox (schema_hash, from_db_version, from_seq, to_db_version, to_seq, payload) VALUES (?, ?, ?, ?, ?, ?);", -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    sqlite3_bind_int64(vm, 1, (sqlite3_int64)schema_hash);
+    sqlite3_bind_int(vm, 2, db_version);
+    sqlite3_bind_int(vm, 3, seq);
+    sqlite3_bind_int64(vm, 4, new_db_version);
+    sqlite3_bind_int64(vm, 5, new_seq);
+    sqlite3_bind_blob(vm, 6, blob, blob_size, SQLITE_STATIC);
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_DONE) rc = SQLITE_OK;
+    
+finalize:
+    if (vm) sqlite3_finalize(vm);
+    if (blob) cloudsync_memory_free(blob);
+    return rc;
+}
 
+int cloudsync_payload_get (sqlite3_context *context, bool merge, char **blob, int *blob_size, int *db_version, int *seq, sqlite3_int64 *new_db_version, sqlite3_int64 *new_seq) {
+    // returns the oldest segment not yet sent (or a single segment with all the pending changes if merge is true)
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    
+    *blob = NULL;
+    *blob_size = 0;
+    
     *db_version = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_SEND_DBVERSION);
     if (*db_version < 0) {sqlite3_result_error(context, "Unable to retrieve db_version.", -1); return SQLITE_ERROR;}
 
     *seq = dbutils_settings_get_int_value(db, CLOUDSYNC_KEY_SEND_SEQ);
     if (*seq < 0) {sqlite3_result_error(context, "Unable to retrieve seq.", -1); return SQLITE_ERROR;}
     
+    int rc = cloudsync_outbox_refresh(db, data, *db_version, *seq);
+    if (rc == SQLITE_OK && merge && dbutils_int_select(db, "SELECT COUNT(*) FROM cloudsync_outbox;") > 1) {
+        rc = sqlite3_exec(db, "DELETE FROM cloudsync_outbox;", NULL, NULL, NULL);
+        if (rc == SQLITE_OK) rc = cloudsync_outbox_refresh(db, data, *db_version, *seq);
+    }
+    
     // retrieve BLOB
-    char sql[1024];
-    snprintf(sql, sizeof(sql), "WITH max_db_version AS (SELECT MAX(db_version) AS max_db_version FROM cloudsync_changes) "
-                               "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq), max_db_version AS max_db_version, MAX(IIF(db_version = max_db_version, seq, NULL)) FROM cloudsync_changes, max_db_version WHERE site_id=cloudsync_siteid() AND (db_version>%d OR (db_version=%d AND seq>%d))", *db_version, *db_version, *seq);
+    sqlite3_stmt *vm = NULL;
+    if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db, "SELECT payload, to_db_version, to_seq FROM cloudsync_outbox ORDER BY id LIMIT 1;", -1, &vm, NULL);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_step(vm);
+        if (rc == SQLITE_ROW) {
+            int size = sqlite3_column_bytes(vm, 0);
+            *blob = (size > 0) ? cloudsync_memory_alloc(size) : NULL;
+            if (*blob) {
+                memcpy(*blob, sqlite3_column_blob(vm, 0), size);
+                *blob_size = size;
+                *new_db_version = sqlite3_column_int64(vm, 1);
+                *new_seq = sqlite3_column_int64(vm, 2);
+                rc = SQLITE_OK;
+            } else {
+                rc = (size > 0) ? SQLITE_NOMEM : SQLITE_OK;
+            }
+        } else if (rc == SQLITE_DONE) {
+            rc = SQLITE_OK;
+        }
+    }
+    if (vm) sqlite3_finalize(vm);
     
-    int rc = dbutils_blob_int_int_select(db, sql, blob, blob_size, new_db_version, new_seq);
     if (rc != SQLITE_OK) {
         sqlite3_result_error(context, "cloudsync_network_send_changes unable to get changes", -1);
         sqlite3_result_error_code(context, rc);
         return rc;
     }
     
-    // exit if there is no data to send
-    if (blob == NULL || blob_size == 0) return SQLITE_OK;
     return rc;
 }
 
@@ -2348,7 +5964,7 @@ void cloudsync_payload_save (sqlite3_context *context, int argc, sqlite3_value *
     char *blob = NULL;
     int blob_size = 0, db_version = 0, seq = 0;
     sqlite3_int64 new_db_version = 0, new_seq = 0;
-    int rc = cloudsync_payload_get(context, &blob, &blob_size, &db_version, &seq, &new_db_version, &new_seq);
+    int rc = cloudsync_payload_get(context, true, &blob, &blob_size, &db_version, &seq, &new_db_version, &new_seq);
     if (rc != SQLITE_OK) return;
     
     // exit if there is no data to send
@@ -2356,7 +5972,7 @@ void cloudsync_payload_save (sqlite3_context *context, int argc, sqlite3_value *
     
     // write payload to file
     bool res = cloudsync_file_write(path, blob, (size_t)blob_size);
-    sqlite3_free(blob);
+    cloudsync_memory_free(blob);
     
     if (res == false) {
         sqlite3_result_error(context, "Unable to write payload to file path.", -1);
@@ -2379,31 +5995,125 @@ void cloudsync_payload_save (sqlite3_context *context, int argc, sqlite3_value *
     sqlite3_result_int64(context, (sqlite3_int64)blob_size);
 }
 
-void cloudsync_payload_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    DEBUG_FUNCTION("cloudsync_payload_load");
+// cloudsync_payload_load accepts several files: a worker thread reads and decompresses payload N+1
+// while the calling thread merges payload N (two stages are used as a bounded queue of one payload)
+typedef struct {
+    const char                  *path;
+    char                        *payload;
+    sqlite3_int64               size;
+    cloudsync_payload_header    header;
+    const char                  *buffer;            // decompressed rows (inside payload or clone)
+    int                         blen;
+    char                        *clone;
+    int                         rc;
+    char                        *errmsg;
+    uint64_t                    elapsed_us;         // time spent decompressing the payload
+    uint64_t                    payload_id;         // identity used by the apply checkpoints
+} cloudsync_payload_stage;
+
+typedef struct {
+    sqlite3_context             *context;
+    cloudsync_context           *data;
+    cloudsync_payload_stage     *apply;             // merged by the calling thread (task 0)
+    cloudsync_payload_stage     *load;              // read by the worker thread (task 1), NULL for the last payload
+    int                         nthreads;
+    int                         nrows;
+} cloudsync_payload_pipeline;
+
+void cloudsync_payload_stage_load (cloudsync_payload_stage *stage, int nthreads) {
+    // no database access here, it runs in the worker thread
+    stage->payload = cloudsync_file_read(stage->path, &stage->size);
+    if (!stage->payload) {
+        stage->rc = SQLITE_IOERR;
+        stage->errmsg = cloudsync_string_dup("Unable to read payload from file path.", false);
+        return;
+    }
+    if (stage->size == 0) return;
     
-    // sanity check argument
-    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT) {
-        sqlite3_result_error(context, "Unable to retrieve file path.", -1);
+    if (stage->size < (sqlite3_int64)sizeof(cloudsync_payload_header) || stage->size > INT_MAX) {
+        stage->rc = SQLITE_MISUSE;
+        stage->errmsg = cloudsync_string_dup("Error on cloudsync_payload_load: invalid payload size.", false);
         return;
     }
     
-    // retrieve full path to file
-    const char *path = (const char *)sqlite3_value_text(argv[0]);
+    cloudsync_payload_header_decode(stage->payload, &stage->header);
+    if (stage->header.nrows >= CLOUDSYNC_PAYLOAD_CHECKPOINT_ROWS) stage->payload_id = cloudsync_payload_identity(stage->payload, (int)stage->size);
+    uint64_t tstart = 0, tnow = 0;
+    cloudsync_time_us(&tstart);
+    stage->rc = cloudsync_payload_expand(&stage->header, stage->payload, (int)stage->size, nthreads, &stage->buffer, &stage->blen, &stage->clone, &stage->errmsg);
+    if (cloudsync_time_us(&tnow) == 0) stage->elapsed_us = tnow - tstart;
+}
+
+int cloudsync_payload_stage_apply (sqlite3_context *context, cloudsync_context *data, cloudsync_payload_stage *stage) {
+    if (stage->rc != SQLITE_OK) {
+        cloudsync_payload_expand_error(context, stage->rc, stage->errmsg);
+        stage->errmsg = NULL;
+        return -1;
+    }
+    if (stage->size == 0) return 0;
+    
+    if (data) data->apply_stats.decompress_us += stage->elapsed_us;
+    if (!cloudsync_payload_check_schema(context, data, &stage->header)) return -1;
+    return cloudsync_payload_apply_rows(context, data, &stage->header, stage->buffer, stage->blen, stage->payload_id, NULL);
+}
+
+void cloudsync_payload_stage_free (cloudsync_payload_stage *stage) {
+    if (stage->payload) cloudsync_memory_free(stage->payload);
+    if (stage->clone) cloudsync_memory_free(stage->clone);
+    if (stage->errmsg) cloudsync_memory_free(stage->errmsg);
+    memset(stage, 0, sizeof(cloudsync_payload_stage));
+}
+
+void cloudsync_payload_pipeline_task (void *ctx, int index) {
+    cloudsync_payload_pipeline *pipeline = (cloudsync_payload_pipeline *)ctx;
+    if (index == 0) pipeline->nrows = cloudsync_payload_stage_apply(pipeline->context, pipeline->data, pipeline->apply);
+    else cloudsync_payload_stage_load(pipeline->load, pipeline->nthreads);
+}
+
+void cloudsync_payload_load (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_payload_load");
     
-    sqlite3_int64 payload_size = 0;
-    char *payload = cloudsync_file_read(path, &payload_size);
-    if (!payload) {
-        if (payload_size == -1) sqlite3_result_error(context, "Unable to read payload from file path.", -1);
-        if (payload) cloudsync_memory_free(payload);
+    // sanity check arguments
+    for (int i=0; i<argc; ++i) {
+        if (sqlite3_value_type(argv[i]) != SQLITE_TEXT) {
+            sqlite3_result_error(context, "Unable to retrieve file path.", -1);
+            return;
+        }
+    }
+    if (argc == 0) {
+        sqlite3_result_error(context, "Unable to retrieve file path.", -1);
         return;
     }
     
-    int nrows = (payload_size) ? cloudsync_payload_apply (context, payload, (int)payload_size) : 0;
-    if (payload) cloudsync_memory_free(payload);
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    int nthreads = (data) ? data->payload_threads : 1;
+    if (data) cloudsync_apply_stats_reset(&data->apply_stats);
+    
+    cloudsync_payload_stage stages[2];
+    memset(stages, 0, sizeof(stages));
+    stages[0].path = (const char *)sqlite3_value_text(argv[0]);
+    cloudsync_payload_stage_load(&stages[0], nthreads);
+    
+    int nrows = 0;
+    for (int i=0; i<argc; ++i) {
+        cloudsync_payload_stage *next = (i+1 < argc) ? &stages[(i+1) % 2] : NULL;
+        if (next) next->path = (const char *)sqlite3_value_text(argv[i+1]);
+        
+        // the next payload is loaded in parallel only if more than one thread is allowed
+        cloudsync_payload_pipeline pipeline = {.context = context, .data = data, .apply = &stages[i % 2], .load = next, .nthreads = nthreads};
+        int ntasks = (next) ? 2 : 1;
+        cloudsync_parallel_run((nthreads > 1) ? ntasks : 1, ntasks, cloudsync_payload_pipeline_task, &pipeline);
+        
+        cloudsync_payload_stage_free(&stages[i % 2]);
+        if (pipeline.nrows < 0) {
+            if (next) cloudsync_payload_stage_free(next);
+            return;
+        }
+        nrows += pipeline.nrows;
+    }
     
     // returns number of applied rows
-    if (nrows != -1) sqlite3_result_int(context, nrows);
+    sqlite3_result_int(context, nrows);
 }
 
 #endif
@@ -2509,7 +6219,26 @@ void cloudsync_set_table (sqlite3_context *context, int argc, sqlite3_value **ar
     const char *tbl = (const char *)sqlite3_value_text(argv[0]);
     const char *key = (const char *)sqlite3_value_text(argv[1]);
     const char *value = (const char *)sqlite3_value_text(argv[2]);
-    dbutils_table_settings_set_key_value(NULL, context, tbl, "*", key, value);
+    int rc = dbutils_table_settings_set_key_value(NULL, context, tbl, "*", key, value);
+    
+    // value_digest changes the meta table and its statements, capture replaces the triggers with the pre-update hook (or back),
+    // so a table already in the context is reloaded
+    bool reload = (key && (strcasecmp(key, CLOUDSYNC_KEY_VALUE_DIGEST) == 0 || strcasecmp(key, CLOUDSYNC_KEY_CAPTURE) == 0));
+    if (rc == SQLITE_OK && tbl && reload) {
+        sqlite3 *db = sqlite3_context_db_handle(context);
+        cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+        cloudsync_table_context *table = table_lookup(data, tbl);
+        if (table) {
+            table_algo algo = table->algo;
+            table_remove(data, tbl);
+            table_free(table);
+            if (strcasecmp(key, CLOUDSYNC_KEY_CAPTURE) == 0 && dbutils_check_triggers(db, tbl, algo) != SQLITE_OK) {
+                dbutils_context_result_error(context, "An error occurred while creating triggers: %s", sqlite3_errmsg(db));
+            } else if (table_add_to_context(db, data, algo, tbl) == false) {
+                dbutils_context_result_error(context, "An error occurred while adding %s table information to global context", tbl);
+            }
+        }
+    }
 }
 
 void cloudsync_is_sync (sqlite3_context *context, int argc, sqlite3_value **argv) {
@@ -2526,6 +6255,54 @@ void cloudsync_is_sync (sqlite3_context *context, int argc, sqlite3_value **argv
     sqlite3_result_int(context, (table) ? (table->enabled == 0) : 0);
 }
 
+void cloudsync_col_value_gos (sqlite3_context *context, cloudsync_table_context *table, sqlite3_value *pk) {
+    // the values of a row are encoded like a primary key and merged by merge_insert_row_gos
+    sqlite3_stmt *vm = table->real_col_values_stmt;
+    
+    // bind primary key values
+    int rc = pk_decode_prikey((char *)sqlite3_value_blob(pk), (size_t)sqlite3_value_bytes(pk), pk_decode_bind_callback, (void *)vm);
+    if (rc < 0) goto cleanup;
+    
+    rc = sqlite3_step(vm);
+    if (rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+        sqlite3_result_text(context, CLOUDSYNC_RLS_RESTRICTED_VALUE, -1, SQLITE_STATIC);
+    } else if (rc == SQLITE_ROW) {
+        sqlite3_value *values[CLOUDSYNC_GOS_MAX_COLUMNS];
+        for (int i=0; i<table->ncols; ++i) values[i] = sqlite3_column_value(vm, i);
+        
+        char buffer[1024];
+        size_t blen = sizeof(buffer);
+        char *row = pk_encode_prikey(values, table->ncols, buffer, &blen);
+        if (row) {
+            rc = SQLITE_OK;
+            sqlite3_result_blob(context, row, (int)blen, SQLITE_TRANSIENT);
+            if (row != buffer) cloudsync_memory_free(row);
+        } else {
+            rc = SQLITE_NOMEM;
+        }
+    }
+    
+cleanup:
+    if (rc == SQLITE_NOMEM) {
+        sqlite3_result_error_nomem(context);
+    } else if (rc != SQLITE_OK) {
+        sqlite3 *db = sqlite3_context_db_handle(context);
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    }
+    stmt_reset(vm);
+}
+
+void cloudsync_gos_expand (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // DEBUG_FUNCTION("cloudsync_gos_expand");
+    
+    // 1 if the sentinels of a grow-only set table are exported as one change for each column:
+    // peers that do not know the v2 payload format cannot merge a sentinel that carries the whole row
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    cloudsync_table_context *table = table_lookup(data, (const char *)sqlite3_value_text(argv[0]));
+    sqlite3_result_int(context, (table && table->real_merge_gos_stmt && data->payload_version < CLOUDSYNC_PAYLOAD_VERSION_2));
+}
+
 void cloudsync_col_value (sqlite3_context *context, int argc, sqlite3_value **argv) {
     // DEBUG_FUNCTION("cloudsync_col_value");
     
@@ -2547,7 +6324,9 @@ void cloudsync_col_value (sqlite3_context *context, int argc, sqlite3_value **ar
     
     // check for special tombstone value
     if (strcmp(col_name, CLOUDSYNC_TOMBSTONE_VALUE) == 0) {
-        sqlite3_result_null(context);
+        // the sentinel of a grow-only set row carries all its values (v2 payloads only)
+        if (table->real_merge_gos_stmt && data->payload_version >= CLOUDSYNC_PAYLOAD_VERSION_2) cloudsync_col_value_gos(context, table, argv[2]);
+        else sqlite3_result_null(context);
         return;
     }
     
@@ -2672,32 +6451,7 @@ void cloudsync_insert (sqlite3_context *context, int argc, sqlite3_value **argv)
         return;
     }
     
-    // compute the next database version for tracking changes
-    sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
-    
-    // check if a row with the same primary key already exists
-    // if so, this means the row might have been previously deleted (sentinel)
-    bool pk_exists = (bool)stmt_count(table->meta_pkexists_stmt, pk, pklen, SQLITE_BLOB);
-    int rc = SQLITE_OK;
-    
-    if (table->ncols == 0) {
-        // if there are no columns other than primary keys, insert a sentinel record
-        rc = local_mark_insert_sentinel_meta(db, table, pk, pklen, db_version, BUMP_SEQ(data));
-        if (rc != SQLITE_OK) goto cleanup;
-    } else if (pk_exists){
-        // if a row with the same primary key already exists, update the sentinel record
-        rc = local_update_sentinel(db, table, pk, pklen, db_version, BUMP_SEQ(data));
-        if (rc != SQLITE_OK) goto cleanup;
-    }
-    
-    // process each non-primary key column for insert or update
-    for (int i=0; i<table->ncols; ++i) {
-        // mark the column as inserted or updated in the metadata
-        rc = local_mark_insert_or_update_meta(db, table, pk, pklen, table->col_name[i], db_version, BUMP_SEQ(data));
-        if (rc != SQLITE_OK) goto cleanup;
-    }
-    
-cleanup:
+    int rc = local_mark_insert(db, data, table, pk, pklen);
     if (rc != SQLITE_OK) sqlite3_result_error(context, sqlite3_errmsg(db), -1);
     // free memory if the primary key was dynamically allocated
     if (pk != buffer) cloudsync_memory_free(pk);
@@ -2719,10 +6473,6 @@ void cloudsync_delete (sqlite3_context *context, int argc, sqlite3_value **argv)
         return;
     }
     
-    // compute the next database version for tracking changes
-    sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
-    int rc = SQLITE_OK;
-    
     // encode the primary key values into a buffer
     char buffer[1024];
     size_t pklen = sizeof(buffer);
@@ -2732,15 +6482,7 @@ void cloudsync_delete (sqlite3_context *context, int argc, sqlite3_value **argv)
         return;
     }
     
-    // mark the row as deleted by inserting a delete sentinel into the metadata
-    rc = local_mark_delete_meta(db, table, pk, pklen, db_version, BUMP_SEQ(data));
-    if (rc != SQLITE_OK) goto cleanup;
-    
-    // remove any metadata related to the old rows associated with this primary key
-    rc = local_drop_meta(db, table, pk, pklen);
-    if (rc != SQLITE_OK) goto cleanup;
-    
-cleanup:
+    int rc = local_mark_delete(db, data, table, pk, pklen);
     if (rc != SQLITE_OK) sqlite3_result_error(context, sqlite3_errmsg(db), -1);
     // free memory if the primary key was dynamically allocated
     if (pk != buffer) cloudsync_memory_free(pk);
@@ -2826,83 +6568,56 @@ void cloudsync_update_final (sqlite3_context *context) {
         dbutils_context_result_error(context, "Unable to retrieve table name %s in cloudsync_update.", table_name);
         return;
     }
-
-    // compute the next database version for tracking changes
-    sqlite3_int64 db_version = db_version_next(db, data, CLOUDSYNC_VALUE_NOTSET);
-    int rc = SQLITE_OK;
     
-    // Check if the primary key(s) have changed
-    bool prikey_changed = false;
-    for (int i=0; i<table->npks; ++i) {
-        if (dbutils_value_compare(payload->old_values[i], payload->new_values[i]) != 0) {
-            prikey_changed = true;
-            break;
-        }
-    }
+    int rc = local_mark_update(db, data, table, payload->new_values, payload->old_values);
+    if (rc == SQLITE_NOMEM) sqlite3_result_error(context, "Not enough memory to encode the primary key(s).", -1);
+    else if (rc != SQLITE_OK) sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    
+    cloudsync_update_payload_free(payload);
+}
 
-    // encode the NEW primary key values into a buffer (used later for indexing)
-    char buffer[1024];
-    char buffer2[1024];
-    size_t pklen = sizeof(buffer);
-    size_t oldpklen = sizeof(buffer2);
-    char *oldpk = NULL;
+void cloudsync_update_row (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    // argv[0] => table_name
+    // argv[1..] => new_value, old_value of each primary key and then of each column (in cid order)
+    // the values are compared where they are, without the copies of the cloudsync_update aggregate
     
-    char *pk = pk_encode_prikey(payload->new_values, table->npks, buffer, &pklen);
-    if (!pk) {
-        sqlite3_result_error(context, "Not enough memory to encode the primary key(s).", -1);
+    // retrieve context
+    sqlite3 *db = sqlite3_context_db_handle(context);
+    cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
+    
+    // lookup table
+    const char *table_name = (const char *)sqlite3_value_text(argv[0]);
+    cloudsync_table_context *table = table_lookup(data, table_name);
+    if (!table) {
+        dbutils_context_result_error(context, "Unable to retrieve table name %s in cloudsync_update_row.", table_name);
         return;
     }
     
-    if (prikey_changed) {
-        // if the primary key has changed, we need to handle the row differently:
-        // 1. mark the old row (OLD primary key) as deleted
-        // 2. create a new row (NEW primary key)
-        
-        // encode the OLD primary key into a buffer
-        oldpk = pk_encode_prikey(payload->old_values, table->npks, buffer2, &oldpklen);
-        if (!oldpk) {
-            if (pk != buffer) cloudsync_memory_free(pk);
-            sqlite3_result_error(context, "Not enough memory to encode the primary key(s).", -1);
-            return;
-        }
-        
-        // mark the rows with the old primary key as deleted in the metadata (old row handling)
-        rc = local_mark_delete_meta(db, table, oldpk, oldpklen, db_version, BUMP_SEQ(data));
-        if (rc != SQLITE_OK) goto cleanup;
-        
-        // move non-sentinel metadata entries from OLD primary key to NEW primary key
-        // handles the case where some metadata is retained across primary key change
-        // see https://github.com/sqliteai/sqlite-sync/blob/main/docs/PriKey.md for more details
-        rc = local_update_move_meta(db, table, pk, pklen, oldpk, oldpklen, db_version);
-        if (rc != SQLITE_OK) goto cleanup;
-        
-        // mark a new sentinel row with the new primary key in the metadata
-        rc = local_mark_insert_sentinel_meta(db, table, pk, pklen, db_version, BUMP_SEQ(data));
-        if (rc != SQLITE_OK) goto cleanup;
-        
-        // free memory if the OLD primary key was dynamically allocated
-        if (oldpk != buffer2) cloudsync_memory_free(oldpk);
-        oldpk = NULL;
+    int nvalues = table->npks + table->ncols;
+    if (argc != 1 + nvalues * 2) {
+        dbutils_context_result_error(context, "Wrong number of values for table %s in cloudsync_update_row (%d instead of %d).", table_name, argc - 1, nvalues * 2);
+        return;
     }
     
-    // compare NEW and OLD values (excluding primary keys) to handle column updates
-    for (int i=0; i<table->ncols; i++) {
-        int col_index = table->npks + i;  // Regular columns start after primary keys
-
-        if (dbutils_value_compare(payload->old_values[col_index], payload->new_values[col_index]) != 0) {
-            // if a column value has changed, mark it as updated in the metadata
-            // columns are in cid order
-            rc = local_mark_insert_or_update_meta(db, table, pk, pklen, table->col_name[i], db_version, BUMP_SEQ(data));
-            if (rc != SQLITE_OK) goto cleanup;
-        }
+    // split the pairs into the NEW and OLD arrays expected by local_mark_update
+    sqlite3_value *stack[128];
+    sqlite3_value **values = (nvalues * 2 <= (int)(sizeof(stack) / sizeof(stack[0]))) ? stack : (sqlite3_value **)cloudsync_memory_alloc((sqlite3_uint64)(sizeof(sqlite3_value *) * nvalues * 2));
+    if (!values) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    sqlite3_value **new_values = values;
+    sqlite3_value **old_values = values + nvalues;
+    for (int i=0; i<nvalues; ++i) {
+        new_values[i] = argv[1 + i * 2];
+        old_values[i] = argv[2 + i * 2];
     }
     
-cleanup:
-    if (rc != SQLITE_OK) sqlite3_result_error(context, sqlite3_errmsg(db), -1);
-    if (pk != buffer) cloudsync_memory_free(pk);
-    if (oldpk && (oldpk != buffer2)) cloudsync_memory_free(oldpk);
+    int rc = local_mark_update(db, data, table, new_values, old_values);
+    if (rc == SQLITE_NOMEM) sqlite3_result_error(context, "Not enough memory to encode the primary key(s).", -1);
+    else if (rc != SQLITE_OK) sqlite3_result_error(context, sqlite3_errmsg(db), -1);
     
-    cloudsync_update_payload_free(payload);
+    if (values != stack) cloudsync_memory_free(values);
 }
 
 // MARK: -
@@ -2968,6 +6683,7 @@ void cloudsync_cleanup_all (sqlite3_context *context) {
     if (rc == SQLITE_OK) {
         cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
         data->site_id[0] = 0;
+        siteid_cache_clear(data);
         dbutils_settings_cleanup(db);
     }
     
@@ -3057,6 +6773,8 @@ void cloudsync_terminate (sqlite3_context *context, int argc, sqlite3_value **ar
     
     cloudsync_context *data = (cloudsync_context *)sqlite3_user_data(context);
     
+    if (data->tables_index) kh_clear(TABLE_REGISTRY, data->tables_index);
+    data->tables_last = NULL;
     for (int i=0; i<data->tables_count; ++i) {
         if (data->tables[i]) table_free(data->tables[i]);
         data->tables[i] = NULL;
@@ -3066,11 +6784,14 @@ void cloudsync_terminate (sqlite3_context *context, int argc, sqlite3_value **ar
     if (data->data_version_stmt) sqlite3_finalize(data->data_version_stmt);
     if (data->db_version_stmt) sqlite3_finalize(data->db_version_stmt);
     if (data->getset_siteid_stmt) sqlite3_finalize(data->getset_siteid_stmt);
+    if (data->get_siteid_stmt) sqlite3_finalize(data->get_siteid_stmt);
     
     data->schema_version_stmt = NULL;
     data->data_version_stmt = NULL;
     data->db_version_stmt = NULL;
     data->getset_siteid_stmt = NULL;
+    data->get_siteid_stmt = NULL;
+    siteid_cache_clear(data);
     
     // reset the site_id so the cloudsync_context_init will be executed again
     // if any other cloudsync function is called after terminate
@@ -3490,14 +7211,20 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     rc = dbutils_register_aggregate(db, "cloudsync_payload_encode", cloudsync_payload_encode_step, cloudsync_payload_encode_final, -1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
+    rc = dbutils_register_aggregate(db, "cloudsync_payload_encode_with", cloudsync_payload_encode_with_step, cloudsync_payload_encode_final, -1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
     rc = dbutils_register_function(db, "cloudsync_payload_decode", cloudsync_payload_decode, -1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
+    rc = dbutils_register_function(db, "cloudsync_payload_apply_step", cloudsync_payload_apply_step, -1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
     #ifdef CLOUDSYNC_DESKTOP_OS
     rc = dbutils_register_function(db, "cloudsync_payload_save", cloudsync_payload_save, 1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
-    rc = dbutils_register_function(db, "cloudsync_payload_load", cloudsync_payload_load, 1, pzErrMsg, ctx, NULL);
+    rc = dbutils_register_function(db, "cloudsync_payload_load", cloudsync_payload_load, -1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     #endif
     
@@ -3511,12 +7238,18 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     rc = dbutils_register_aggregate(db, "cloudsync_update", cloudsync_update_step, cloudsync_update_final, 3, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
+    rc = dbutils_register_function(db, "cloudsync_update_row", cloudsync_update_row, -1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
     rc = dbutils_register_function(db, "cloudsync_delete", cloudsync_delete, -1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
     rc = dbutils_register_function(db, "cloudsync_col_value", cloudsync_col_value, 3, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
+    rc = dbutils_register_function(db, "cloudsync_gos_expand", cloudsync_gos_expand, 1, pzErrMsg, ctx, NULL);
+    if (rc != SQLITE_OK) return rc;
+    
     rc = dbutils_register_function(db, "cloudsync_pk_encode", cloudsync_pk_encode, -1, pzErrMsg, ctx, NULL);
     if (rc != SQLITE_OK) return rc;
     
@@ -3540,6 +7273,21 @@ int cloudsync_register (sqlite3 *db, char **pzErrMsg) {
     rc = cloudsync_vtab_register_changes (db, data);
     if (rc != SQLITE_OK) return rc;
     
+    // register eponymous only payload chunks table-valued function
+    rc = cloudsync_vtab_register_payload_chunks (db, data);
+    if (rc != SQLITE_OK) return rc;
+    
+    // register eponymous only apply statistics table-valued function
+    rc = cloudsync_vtab_register_apply_stats (db, data);
+    if (rc != SQLITE_OK) return rc;
+    
+    // register eponymous only payload inspection table-valued functions
+    rc = cloudsync_vtab_register_payload_rows (db, data);
+    if (rc != SQLITE_OK) return rc;
+    
+    rc = cloudsync_vtab_register_payload_info (db, data);
+    if (rc != SQLITE_OK) return rc;
+    
     // load config, if exists
     if (cloudsync_config_exists(db)) {
         cloudsync_context_init(db, ctx, NULL);
@@ -26,8 +26,44 @@ typedef enum {
     CLOUDSYNC_PAYLOAD_APPLY_CLEANUP      = 3
 } CLOUDSYNC_PAYLOAD_APPLY_STEPS;
 
+typedef enum {
+    CLOUDSYNC_APPLY_STATS_TBL           = 0,    // NULL for the row with the totals of the payload
+    CLOUDSYNC_APPLY_STATS_SEEN          = 1,
+    CLOUDSYNC_APPLY_STATS_APPLIED       = 2,
+    CLOUDSYNC_APPLY_STATS_LOST          = 3,
+    CLOUDSYNC_APPLY_STATS_EQUAL         = 4,
+    CLOUDSYNC_APPLY_STATS_RESURRECTED   = 5,
+    CLOUDSYNC_APPLY_STATS_DELETED       = 6,
+    CLOUDSYNC_APPLY_STATS_REJECTED      = 7,
+    CLOUDSYNC_APPLY_STATS_FAILED        = 8,
+    CLOUDSYNC_APPLY_STATS_DECOMPRESS_US = 9,    // the following columns are set only in the totals row
+    CLOUDSYNC_APPLY_STATS_DECODE_US     = 10,
+    CLOUDSYNC_APPLY_STATS_MERGE_US      = 11,
+    CLOUDSYNC_APPLY_STATS_SAVEPOINTS    = 12,
+    CLOUDSYNC_APPLY_STATS_ERRORS        = 13
+} CLOUDSYNC_APPLY_STATS_COLUMN;
+
+typedef enum {
+    CLOUDSYNC_PAYLOAD_INFO_TBL          = 0,    // NULL for the row with the header of the payload
+    CLOUDSYNC_PAYLOAD_INFO_NROWS        = 1,
+    CLOUDSYNC_PAYLOAD_INFO_NBYTES       = 2,    // size of the encoded (decompressed) rows
+    CLOUDSYNC_PAYLOAD_INFO_VERSION      = 3,    // the following columns are set only in the header row
+    CLOUDSYNC_PAYLOAD_INFO_LIBVERSION   = 4,
+    CLOUDSYNC_PAYLOAD_INFO_CODEC        = 5,
+    CLOUDSYNC_PAYLOAD_INFO_SIZE         = 6,
+    CLOUDSYNC_PAYLOAD_INFO_EXPANDED_SIZE = 7,
+    CLOUDSYNC_PAYLOAD_INFO_NCOLS        = 8,
+    CLOUDSYNC_PAYLOAD_INFO_SCHEMA_HASH  = 9
+} CLOUDSYNC_PAYLOAD_INFO_COLUMN;
+
+// cloudsync_payload_rows columns are the cloudsync_changes columns followed by the size of the encoded row
+#define CLOUDSYNC_PAYLOAD_ROWS_NBYTES           9
+
 typedef struct cloudsync_context cloudsync_context;
 typedef struct cloudsync_pk_decode_bind_context cloudsync_pk_decode_bind_context;
+typedef struct cloudsync_data_payload cloudsync_data_payload;
+typedef struct cloudsync_payload_reader cloudsync_payload_reader;
+typedef struct cloudsync_payload_info cloudsync_payload_info;
 
 int cloudsync_merge_insert (sqlite3_vtab *vtab, int argc, sqlite3_value **argv, sqlite3_int64 *rowid);
 void cloudsync_sync_key (cloudsync_context *data, const char *key, const char *value);
@@ -37,7 +73,28 @@ const char *cloudsync_context_init (sqlite3 *db, cloudsync_context *data, sqlite
 void *cloudsync_get_auxdata (sqlite3_context *context);
 void cloudsync_set_auxdata (sqlite3_context *context, void *xdata);
 int cloudsync_payload_apply (sqlite3_context *context, const char *payload, int blen);
-int cloudsync_payload_get (sqlite3_context *context, char **blob, int *blob_size, int *db_version, int *seq, sqlite3_int64 *new_db_version, sqlite3_int64 *new_seq);
+int cloudsync_payload_get (sqlite3_context *context, bool merge, char **blob, int *blob_size, int *db_version, int *seq, sqlite3_int64 *new_db_version, sqlite3_int64 *new_seq);
+
+// used by payload chunks virtual table
+cloudsync_data_payload *cloudsync_payload_chunk_create (void);
+void cloudsync_payload_chunk_free (cloudsync_data_payload *payload);
+int cloudsync_payload_chunk_append (cloudsync_data_payload *payload, cloudsync_context *data, int argc, sqlite3_value **argv, size_t max_bytes, bool *rewound);
+int cloudsync_payload_chunk_flush (cloudsync_data_payload *payload, cloudsync_context *data, char **blob, int *blob_size, int *nrows);
+
+// used by apply stats virtual table
+int cloudsync_apply_stats_count (cloudsync_context *data);
+void cloudsync_apply_stats_result (cloudsync_context *data, int index, int col, sqlite3_context *ctx);
+
+// used by payload inspection virtual tables
+cloudsync_payload_reader *cloudsync_payload_reader_create (cloudsync_context *data, const char *payload, int size, char **errmsg);
+void cloudsync_payload_reader_free (cloudsync_payload_reader *reader);
+int cloudsync_payload_reader_next (cloudsync_payload_reader *reader);
+void cloudsync_payload_reader_result (cloudsync_payload_reader *reader, int col, sqlite3_context *ctx);
+int64_t cloudsync_payload_reader_rowid (cloudsync_payload_reader *reader);
+cloudsync_payload_info *cloudsync_payload_info_create (cloudsync_context *data, const char *payload, int size, char **errmsg);
+void cloudsync_payload_info_free (cloudsync_payload_info *info);
+int cloudsync_payload_info_count (cloudsync_payload_info *info);
+void cloudsync_payload_info_result (cloudsync_payload_info *info, int index, int col, sqlite3_context *ctx);
 
 // used by core
 typedef bool (*cloudsync_payload_apply_callback_t)(void **xdata, cloudsync_pk_decode_bind_context *decoded_change, sqlite3 *db, cloudsync_context *data, int step, int rc);
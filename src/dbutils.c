@@ -497,6 +497,26 @@ finalize:
     return rc;
 }
 
+bool dbutils_table_capture_hook (sqlite3 *db, const char *table) {
+    #if CLOUDSYNC_PREUPDATE_CAPTURE
+    char buffer[32] = {0};
+    char *value = dbutils_table_settings_get_value(db, table, "*", CLOUDSYNC_KEY_CAPTURE, buffer, sizeof(buffer));
+    bool hook = (value && strcasecmp(value, "hook") == 0);
+    if (value && value != buffer) cloudsync_memory_free(value);
+    if (!hook) return false;
+    
+    // rowid-only tables keep the triggers (the hook has no value for the implicit rowid)
+    // and so do tables with hidden columns (their cids do not match the column indexes of the hook)
+    char *sql = cloudsync_memory_mprintf("SELECT (SELECT count(*) FROM pragma_table_info('%q') WHERE pk>0) > 0 AND (SELECT count(*) FROM pragma_table_xinfo('%q') WHERE hidden<>0) = 0;", table, table);
+    if (!sql) return false;
+    hook = (dbutils_int_select(db, sql) == 1);
+    cloudsync_memory_free(sql);
+    return hook;
+    #else
+    return false;
+    #endif
+}
+
 int dbutils_check_triggers (sqlite3 *db, const char *table, table_algo algo) {
     DEBUG_DBFUNCTION("dbutils_check_triggers %s", table);
     
@@ -507,6 +527,21 @@ int dbutils_check_triggers (sqlite3 *db, const char *table, table_algo algo) {
     char *trigger_name = NULL;
     int rc = SQLITE_NOMEM;
     
+    // with the pre-update hook the AFTER INSERT and UPDATE triggers would capture each change twice, so they are dropped
+    // (the AFTER DELETE trigger is kept: the hook also sees the rows deleted by a REPLACE, which the triggers record
+    // as an update of the existing row unless recursive_triggers is enabled)
+    bool capture_hook = dbutils_table_capture_hook(db, table);
+    if (capture_hook) {
+        char buffer[2048];
+        const char *kind[] = {"insert", "update"};
+        for (int i=0; i<2; ++i) {
+            char *sql = sqlite3_snprintf((int)sizeof(buffer), buffer, "DROP TRIGGER IF EXISTS \"cloudsync_after_%s_%w\";", kind[i], table);
+            rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+            if (rc != SQLITE_OK) return rc;
+        }
+        rc = SQLITE_NOMEM;
+    }
+    
     // common part
     char *trigger_when = cloudsync_memory_mprintf("FOR EACH ROW WHEN cloudsync_is_sync('%q') = 0", table);
     if (!trigger_when) goto finalize;
@@ -516,7 +551,7 @@ int dbutils_check_triggers (sqlite3 *db, const char *table, table_algo algo) {
     trigger_name = cloudsync_memory_mprintf("cloudsync_after_insert_%s", table);
     if (!trigger_name) goto finalize;
     
-    if (!dbutils_trigger_exists(db, trigger_name)) {
+    if (!capture_hook && !dbutils_trigger_exists(db, trigger_name)) {
         rc = SQLITE_NOMEM;
         char *sql = cloudsync_memory_mprintf("SELECT group_concat('NEW.\"' || format('%%w', name) || '\"', ',') FROM pragma_table_info('%q') WHERE pk>0 ORDER BY pk;", table);
         if (!sql) goto finalize;
@@ -546,7 +581,52 @@ int dbutils_check_triggers (sqlite3 *db, const char *table, table_algo algo) {
         trigger_name = cloudsync_memory_mprintf("cloudsync_after_update_%s", table);
         if (!trigger_name) goto finalize;
         
-        if (!dbutils_trigger_exists(db, trigger_name)) {
+        // cloudsync_update_row receives the table name followed by a NEW, OLD pair for each column and compares them in place,
+        // it is used whenever all the columns fit in the arguments of a function (otherwise the cloudsync_update aggregate is used)
+        char *sql = cloudsync_memory_mprintf("SELECT 1 + 2 * count(*) FROM pragma_table_info('%q');", table);
+        if (!sql) goto finalize;
+        sqlite3_int64 nargs = dbutils_int_select(db, sql);
+        cloudsync_memory_free(sql);
+        bool update_row = (nargs > 1 && nargs <= sqlite3_limit(db, SQLITE_LIMIT_FUNCTION_ARG, -1));
+        
+        // a trigger created by a previous version with the aggregate is replaced
+        if (!capture_hook && update_row) {
+            sql = cloudsync_memory_mprintf("SELECT count(*) FROM sqlite_master WHERE type='trigger' AND name='%q' AND sql LIKE '%%cloudsync_update(%%';", trigger_name);
+            if (!sql) goto finalize;
+            bool outdated = (dbutils_int_select(db, sql) > 0);
+            cloudsync_memory_free(sql);
+            if (outdated) {
+                sql = cloudsync_memory_mprintf("DROP TRIGGER IF EXISTS \"%w\";", trigger_name);
+                if (!sql) goto finalize;
+                rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+                cloudsync_memory_free(sql);
+                if (rc != SQLITE_OK) goto finalize;
+                rc = SQLITE_NOMEM;
+            }
+        }
+        
+        if (!capture_hook && update_row && !dbutils_trigger_exists(db, trigger_name)) {
+            // NEW.prikey1, OLD.prikey1, NEW.prikey2, OLD.prikey2, NEW.col1, OLD.col1, NEW.col2, OLD.col2...
+            // same order of the aggregate below (primary keys first, then the columns in cid order)
+            sql = cloudsync_memory_mprintf(
+                "SELECT (SELECT group_concat('NEW.\"' || format('%%w', name) || '\", OLD.\"' || format('%%w', name) || '\"', ', ') FROM pragma_table_info('%q') WHERE pk>0 ORDER BY pk) || "
+                "coalesce((SELECT ', ' || group_concat('NEW.\"' || format('%%w', name) || '\", OLD.\"' || format('%%w', name) || '\"', ', ') FROM pragma_table_info('%q') WHERE pk=0 ORDER BY cid), '');",
+                table, table);
+            if (!sql) goto finalize;
+            
+            char *values_list = dbutils_text_select(db, sql);
+            cloudsync_memory_free(sql);
+            if (!values_list) goto finalize;
+            
+            sql = cloudsync_memory_mprintf("CREATE TRIGGER \"%w\" AFTER UPDATE ON \"%w\" %s BEGIN SELECT cloudsync_update_row('%q', %s); END", trigger_name, table, trigger_when, table, values_list);
+            cloudsync_memory_free(values_list);
+            if (!sql) goto finalize;
+            
+            rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+            DEBUG_SQL("\n%s", sql);
+            cloudsync_memory_free(sql);
+            if (rc != SQLITE_OK) goto finalize;
+        } else if (!capture_hook && !dbutils_trigger_exists(db, trigger_name)) {
             // Generate VALUES clause for all columns using a CTE to avoid compound SELECT limits
             // First, get all primary key columns in order
             char *pk_values_sql = cloudsync_memory_mprintf(
@@ -589,7 +669,7 @@ int dbutils_check_triggers (sqlite3 *db, const char *table, table_algo algo) {
             if (!values_query) goto finalize;
             
             // Create the trigger with aggregate function
-            char *sql = cloudsync_memory_mprintf(
+            sql = cloudsync_memory_mprintf(
                 "CREATE TRIGGER \"%w\" AFTER UPDATE ON \"%w\" %s BEGIN "
                 "SELECT cloudsync_update(table_name, new_value, old_value) FROM (%s); "
                 "END", 
@@ -1078,6 +1158,16 @@ int dbutils_settings_init (sqlite3 *db, void *cloudsync_data, sqlite3_context *c
         if (rc != SQLITE_OK) {if (context) sqlite3_result_error(context, sqlite3_errmsg(db), -1); return rc;}
     }
     
+    // check if cloudsync_outbox table exists
+    if (dbutils_table_exists(db, CLOUDSYNC_OUTBOX_NAME) == false) {
+        DEBUG_SETTINGS("cloudsync_outbox does not exist (creating a new one)");
+        
+        // encoded payload segments not yet sent, in (from_db_version, from_seq] - (to_db_version, to_seq] order
+        char *sql = "CREATE TABLE IF NOT EXISTS cloudsync_outbox (id INTEGER PRIMARY KEY, schema_hash INTEGER NOT NULL, from_db_version INTEGER NOT NULL, from_seq INTEGER NOT NULL, to_db_version INTEGER NOT NULL, to_seq INTEGER NOT NULL, payload BLOB NOT NULL);";
+        int rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {if (context) sqlite3_result_error(context, sqlite3_errmsg(db), -1); return rc;}
+    }
+    
     // cloudsync_settings table exists so load it
     dbutils_settings_load(db, data);
     
@@ -1136,6 +1226,6 @@ bool dbutils_check_schema_hash (sqlite3 *db, sqlite3_uint64 hash) {
 
 
 int dbutils_settings_cleanup (sqlite3 *db) {
-    const char *sql = "DROP TABLE IF EXISTS cloudsync_settings; DROP TABLE IF EXISTS cloudsync_site_id; DROP TABLE IF EXISTS cloudsync_table_settings; DROP TABLE IF EXISTS cloudsync_schema_versions; ";
+    const char *sql = "DROP TABLE IF EXISTS cloudsync_settings; DROP TABLE IF EXISTS cloudsync_site_id; DROP TABLE IF EXISTS cloudsync_table_settings; DROP TABLE IF EXISTS cloudsync_schema_versions; DROP TABLE IF EXISTS cloudsync_outbox; ";
     return sqlite3_exec(db, sql, NULL, NULL, NULL);
 }
@@ -16,6 +16,7 @@
 #define CLOUDSYNC_SITEID_NAME               "cloudsync_site_id"
 #define CLOUDSYNC_TABLE_SETTINGS_NAME       "cloudsync_table_settings"
 #define CLOUDSYNC_SCHEMA_VERSIONS_NAME      "cloudsync_schema_versions"
+#define CLOUDSYNC_OUTBOX_NAME               "cloudsync_outbox"
 
 #define CLOUDSYNC_KEY_LIBVERSION            "version"
 #define CLOUDSYNC_KEY_SCHEMAVERSION         "schemaversion"
@@ -25,6 +26,24 @@
 #define CLOUDSYNC_KEY_SEND_SEQ              "send_seq"
 #define CLOUDSYNC_KEY_DEBUG                 "debug"
 #define CLOUDSYNC_KEY_ALGO                  "algo"
+#define CLOUDSYNC_KEY_PAYLOAD_VERSION       "payload_version"
+#define CLOUDSYNC_KEY_PAYLOAD_CODEC         "payload_codec"
+#define CLOUDSYNC_KEY_PAYLOAD_SAMPLE_CHECK  "payload_sample_check"
+#define CLOUDSYNC_KEY_PAYLOAD_THREADS       "payload_threads"
+#define CLOUDSYNC_KEY_PAYLOAD_LOCALITY      "payload_apply_locality"
+#define CLOUDSYNC_KEY_PAYLOAD_BATCH         "payload_apply_batch"
+#define CLOUDSYNC_KEY_PAYLOAD_PARALLEL      "payload_apply_parallel"
+#define CLOUDSYNC_KEY_APPLY_CHECKPOINT      "apply_checkpoint"
+#define CLOUDSYNC_KEY_VALUE_DIGEST          "value_digest"
+#define CLOUDSYNC_KEY_CAPTURE               "capture"
+
+// local changes can be captured by the pre-update hook (instead of the AFTER triggers) only when the extension
+// is linked with an SQLite built with SQLITE_ENABLE_PREUPDATE_HOOK (the hook is not part of the loadable extension API)
+#if defined(SQLITE_CORE) && defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+#define CLOUDSYNC_PREUPDATE_CAPTURE         1
+#else
+#define CLOUDSYNC_PREUPDATE_CAPTURE         0
+#endif
 
 // general
 int dbutils_write_simple (sqlite3 *db, const char *sql);
@@ -52,6 +71,7 @@ bool dbutils_is_star_table (const char *table_name);
 
 int dbutils_delete_triggers (sqlite3 *db, const char *table);
 int dbutils_check_triggers (sqlite3 *db, const char *table, table_algo algo);
+bool dbutils_table_capture_hook (sqlite3 *db, const char *table);
 int dbutils_check_metatable (sqlite3 *db, const char *table, table_algo algo);
 sqlite3_int64 dbutils_schema_version (sqlite3 *db);
 
@@ -687,21 +687,17 @@ void cloudsync_network_has_unsent_changes (sqlite3_context *context, int argc, s
     sqlite3_result_int(context, (sent_db_version < last_local_change));
 }
 
-int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc, sqlite3_value **argv) {
-    DEBUG_FUNCTION("cloudsync_network_send_changes");
-    
-    network_data *data = (network_data *)cloudsync_get_auxdata(context);
-    if (!data) {sqlite3_result_error(context, "Unable to retrieve CloudSync context.", -1); return SQLITE_ERROR;}
-    
-    // retrieve payload
+int cloudsync_network_send_payload (sqlite3_context *context, network_data *data, bool *done) {
+    // retrieve the oldest payload segment not yet sent
     char *blob = NULL;
     int blob_size = 0, db_version = 0, seq = 0;
     sqlite3_int64 new_db_version = 0, new_seq = 0;
-    int rc = cloudsync_payload_get(context, &blob, &blob_size, &db_version, &seq, &new_db_version, &new_seq);
+    int rc = cloudsync_payload_get(context, false, &blob, &blob_size, &db_version, &seq, &new_db_version, &new_seq);
     if (rc != SQLITE_OK) return rc;
     
     // exit if there is no data to send
-    if (blob == NULL || blob_size == 0) return SQLITE_OK;
+    *done = (blob == NULL || blob_size == 0);
+    if (*done) return SQLITE_OK;
     
     NETWORK_RESULT res = network_receive_buffer(data, data->upload_endpoint, data->authentication, true, false, NULL, CLOUDSYNC_HEADER_SQLITECLOUD);
     if (res.code != CLOUDSYNC_NETWORK_BUFFER) {
@@ -733,19 +729,35 @@ int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc,
         return SQLITE_ERROR;
     }
     
-    // update db_version and seq
+    // update db_version and seq (the segment is removed from the outbox on the next call)
     char buf[256];
     sqlite3 *db = sqlite3_context_db_handle(context);
     if (new_db_version != db_version) {
         snprintf(buf, sizeof(buf), "%lld", new_db_version);
-        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_DBVERSION, buf);
+        rc = dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_DBVERSION, buf);
     }
-    if (new_seq != seq) {
+    if (rc == SQLITE_OK && new_seq != seq) {
         snprintf(buf, sizeof(buf), "%lld", new_seq);
-        dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_SEQ, buf);
+        rc = dbutils_settings_set_key_value(db, context, CLOUDSYNC_KEY_SEND_SEQ, buf);
     }
     
     network_result_cleanup(&res);
+    return rc;
+}
+
+int cloudsync_network_send_changes_internal (sqlite3_context *context, int argc, sqlite3_value **argv) {
+    DEBUG_FUNCTION("cloudsync_network_send_changes");
+    
+    network_data *data = (network_data *)cloudsync_get_auxdata(context);
+    if (!data) {sqlite3_result_error(context, "Unable to retrieve CloudSync context.", -1); return SQLITE_ERROR;}
+    
+    // upload the outbox one segment at a time, so a failure does not invalidate the segments already encoded
+    bool done = false;
+    while (!done) {
+        int rc = cloudsync_network_send_payload(context, data, &done);
+        if (rc != SQLITE_OK) return rc;
+    }
+    
     return SQLITE_OK;
 }
 
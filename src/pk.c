@@ -223,6 +223,21 @@ int pk_decode(char *buffer, size_t blen, int count, size_t *seek, int (*cb) (voi
     return count;
 }
 
+uint64_t pk_decode_varint (char *buffer, size_t blen, size_t *bseek, bool *error) {
+    // LEB128 decoding (7 bits per byte, least significant group first)
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*bseek >= blen) break;
+        uint8_t byte = (uint8_t)buffer[*bseek];
+        *bseek += 1;
+        value |= ((uint64_t)(byte & 0x7F)) << shift;
+        if ((byte & 0x80) == 0) return value;
+    }
+    
+    if (error) *error = true;
+    return 0;
+}
+
 int pk_decode_prikey (char *buffer, size_t blen, int (*cb) (void *xdata, int index, int type, int64_t ival, double dval, char *pval), void *xdata) {
     size_t bseek = 0;
     uint8_t count = pk_decode_u8(buffer, &bseek);
@@ -290,6 +305,16 @@ size_t pk_encode_int64 (char *buffer, size_t bseek, int64_t value, size_t nbytes
     return bseek;
 }
 
+size_t pk_encode_varint (char *buffer, size_t bseek, uint64_t value) {
+    // LEB128 encoding, at most 10 bytes for a 64bit value
+    while (value >= 0x80) {
+        buffer[bseek++] = (uint8_t)((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    buffer[bseek++] = (uint8_t)value;
+    return bseek;
+}
+
 size_t pk_encode_data (char *buffer, size_t bseek, char *data, size_t datalen) {
     memcpy(buffer + bseek, data, datalen);
     return bseek + datalen;
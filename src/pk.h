@@ -27,4 +27,7 @@ int pk_decode_bind_callback (void *xdata, int index, int type, int64_t ival, dou
 int pk_decode_print_callback (void *xdata, int index, int type, int64_t ival, double dval, char *pval);
 size_t pk_encode_size (sqlite3_value **argv, int argc, int reserved);
 
+size_t pk_encode_varint (char *buffer, size_t bseek, uint64_t value);
+uint64_t pk_decode_varint (char *buffer, size_t blen, size_t *bseek, bool *error);
+
 #endif
@@ -26,6 +26,10 @@
 #define file_close      close
 #endif
 
+#if defined(CLOUDSYNC_HAS_THREADS) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
 #ifdef CLOUDSYNC_DESKTOP_OS
 #include <fcntl.h>
 #include <errno.h>
@@ -57,6 +61,32 @@ SQLITE_EXTENSION_INIT3
     https://www.rfc-editor.org/rfc/rfc9562.html#name-uuid-version-7
  */
 
+int cloudsync_time_ms (uint64_t *ms) {
+    // wall clock time in milliseconds
+    struct timespec ts;
+    #ifdef __ANDROID__
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) return -1;
+    #else
+    if (timespec_get(&ts, TIME_UTC) == 0) return -1;
+    #endif
+    
+    *ms = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    return 0;
+}
+
+int cloudsync_time_us (uint64_t *us) {
+    // wall clock time in microseconds
+    struct timespec ts;
+    #ifdef __ANDROID__
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) return -1;
+    #else
+    if (timespec_get(&ts, TIME_UTC) == 0) return -1;
+    #endif
+    
+    *us = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    return 0;
+}
+
 int cloudsync_uuid_v7 (uint8_t value[UUID_LEN]) {
     // fill the buffer with high-quality random data
     #ifdef _WIN32
@@ -72,15 +102,10 @@ int cloudsync_uuid_v7 (uint8_t value[UUID_LEN]) {
     #endif
     
     // get current timestamp in ms
-    struct timespec ts;
-    #ifdef __ANDROID__
-    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) return -1;
-    #else
-    if (timespec_get(&ts, TIME_UTC) == 0) return -1;
-    #endif
+    uint64_t timestamp;
+    if (cloudsync_time_ms(&timestamp) != 0) return -1;
     
     // add timestamp part to UUID
-    uint64_t timestamp = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
     value[0] = (timestamp >> 40) & 0xFF;
     value[1] = (timestamp >> 32) & 0xFF;
     value[2] = (timestamp >> 24) & 0xFF;
@@ -291,6 +316,168 @@ uint64_t fnv1a_hash (const char *data, size_t len) {
     return h_final;
 }
 
+// MARK: - SHA-256 -
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA256_ROTR(_x, _n)     (((_x) >> (_n)) | ((_x) << (32 - (_n))))
+
+static void cloudsync_sha256_block (cloudsync_sha256_ctx *ctx, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i=0; i<16; ++i) {
+        w[i] = ((uint32_t)block[i*4] << 24) | ((uint32_t)block[i*4+1] << 16) | ((uint32_t)block[i*4+2] << 8) | (uint32_t)block[i*4+3];
+    }
+    for (int i=16; i<64; ++i) {
+        uint32_t s0 = SHA256_ROTR(w[i-15], 7) ^ SHA256_ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i-2], 17) ^ SHA256_ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    
+    uint32_t a = ctx->state[0], b = ctx->state[1], c = ctx->state[2], d = ctx->state[3];
+    uint32_t e = ctx->state[4], f = ctx->state[5], g = ctx->state[6], h = ctx->state[7];
+    for (int i=0; i<64; ++i) {
+        uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+    ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void cloudsync_sha256_init (cloudsync_sha256_ctx *ctx) {
+    static const uint32_t h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, h0, sizeof(h0));
+    ctx->count = 0;
+}
+
+void cloudsync_sha256_update (cloudsync_sha256_ctx *ctx, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t used = (size_t)(ctx->count % 64);
+    ctx->count += len;
+    
+    // complete a partial block first, then hash the full blocks directly from data
+    if (used > 0) {
+        size_t n = (len < 64 - used) ? len : 64 - used;
+        memcpy(ctx->buffer + used, p, n);
+        p += n; len -= n; used += n;
+        if (used < 64) return;
+        cloudsync_sha256_block(ctx, ctx->buffer);
+    }
+    for (; len >= 64; p += 64, len -= 64) cloudsync_sha256_block(ctx, p);
+    if (len > 0) memcpy(ctx->buffer, p, len);
+}
+
+void cloudsync_sha256_final (cloudsync_sha256_ctx *ctx, uint8_t digest[CLOUDSYNC_SHA256_LEN]) {
+    uint64_t bits = ctx->count * 8;
+    uint8_t pad[72] = {0x80};
+    size_t used = (size_t)(ctx->count % 64);
+    size_t npad = (used < 56) ? 56 - used : 120 - used;
+    for (int i=0; i<8; ++i) pad[npad + i] = (uint8_t)(bits >> (56 - i * 8));
+    cloudsync_sha256_update(ctx, pad, npad + 8);
+    
+    for (int i=0; i<8; ++i) {
+        digest[i*4] = (uint8_t)(ctx->state[i] >> 24);
+        digest[i*4+1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[i*4+2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[i*4+3] = (uint8_t)ctx->state[i];
+    }
+}
+
+// MARK: - Threads -
+
+typedef struct {
+    cloudsync_task_callback callback;
+    void                    *ctx;
+    int                     ntasks;
+    int                     nworkers;
+    int                     index;
+} cloudsync_worker;
+
+static void cloudsync_worker_run (cloudsync_worker *worker) {
+    // tasks are expected to have a similar cost, so a static interleaved split is enough
+    for (int i=worker->index; i<worker->ntasks; i+=worker->nworkers) {
+        worker->callback(worker->ctx, i);
+    }
+}
+
+#ifdef CLOUDSYNC_HAS_THREADS
+#ifdef _WIN32
+static DWORD WINAPI cloudsync_worker_thread (LPVOID arg) {
+    cloudsync_worker_run((cloudsync_worker *)arg);
+    return 0;
+}
+#else
+static void *cloudsync_worker_thread (void *arg) {
+    cloudsync_worker_run((cloudsync_worker *)arg);
+    return NULL;
+}
+#endif
+#endif
+
+void cloudsync_parallel_run (int nthreads, int ntasks, cloudsync_task_callback callback, void *ctx) {
+    if (nthreads > CLOUDSYNC_MAX_THREADS) nthreads = CLOUDSYNC_MAX_THREADS;
+    if (nthreads > ntasks) nthreads = ntasks;
+    
+    #ifndef CLOUDSYNC_HAS_THREADS
+    nthreads = 1;
+    #endif
+    
+    if (nthreads <= 1) {
+        for (int i=0; i<ntasks; ++i) callback(ctx, i);
+        return;
+    }
+    
+    cloudsync_worker workers[CLOUDSYNC_MAX_THREADS];
+    bool started[CLOUDSYNC_MAX_THREADS] = {false};
+    for (int i=0; i<nthreads; ++i) {
+        workers[i] = (cloudsync_worker){.callback = callback, .ctx = ctx, .ntasks = ntasks, .nworkers = nthreads, .index = i};
+    }
+    
+    #ifdef CLOUDSYNC_HAS_THREADS
+    #ifdef _WIN32
+    HANDLE threads[CLOUDSYNC_MAX_THREADS];
+    for (int i=1; i<nthreads; ++i) {
+        threads[i] = CreateThread(NULL, 0, cloudsync_worker_thread, &workers[i], 0, NULL);
+        started[i] = (threads[i] != NULL);
+    }
+    #else
+    pthread_t threads[CLOUDSYNC_MAX_THREADS];
+    for (int i=1; i<nthreads; ++i) {
+        started[i] = (pthread_create(&threads[i], NULL, cloudsync_worker_thread, &workers[i]) == 0);
+    }
+    #endif
+    #endif
+    
+    // the caller is the first worker
+    cloudsync_worker_run(&workers[0]);
+    
+    for (int i=1; i<nthreads; ++i) {
+        // a worker that could not be started runs in the calling thread
+        if (!started[i]) {
+            cloudsync_worker_run(&workers[i]);
+            continue;
+        }
+        #ifdef CLOUDSYNC_HAS_THREADS
+        #ifdef _WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+        #else
+        pthread_join(threads[i], NULL);
+        #endif
+        #endif
+    }
+}
+
 // MARK: - Files -
 
 #ifdef CLOUDSYNC_DESKTOP_OS
@@ -28,6 +28,13 @@
     #define CLOUDSYNC_DESKTOP_OS 1
 #endif
 
+// CLOUDSYNC_HAS_THREADS = 1 if worker threads can be used to parallelize CPU bound tasks
+#if !defined(__EMSCRIPTEN__) && !defined(CLOUDSYNC_OMIT_THREADS)
+    #define CLOUDSYNC_HAS_THREADS 1
+#endif
+
+#define CLOUDSYNC_MAX_THREADS               16
+
 #ifndef SQLITE_CORE
 #include "sqlite3ext.h"
 #else
@@ -134,6 +141,8 @@ typedef enum {
 table_algo crdt_algo_from_name (const char *name);
 const char *crdt_algo_name (table_algo algo);
 
+int cloudsync_time_ms (uint64_t *ms);
+int cloudsync_time_us (uint64_t *us);
 int cloudsync_uuid_v7 (uint8_t value[UUID_LEN]);
 int cloudsync_uuid_v7_compare (uint8_t value1[UUID_LEN], uint8_t value2[UUID_LEN]);
 char *cloudsync_uuid_v7_string (char value[UUID_STR_MAXLEN], bool dash_format);
@@ -141,6 +150,18 @@ char *cloudsync_uuid_v7_stringify (uint8_t uuid[UUID_LEN], char value[UUID_STR_M
 char *cloudsync_string_replace_prefix(const char *input, char *prefix, char *replacement);
 uint64_t fnv1a_hash(const char *data, size_t len);
 
+#define CLOUDSYNC_SHA256_LEN                32
+
+typedef struct {
+    uint32_t    state[8];
+    uint64_t    count;          // bytes hashed so far
+    uint8_t     buffer[64];     // partial block
+} cloudsync_sha256_ctx;
+
+void cloudsync_sha256_init (cloudsync_sha256_ctx *ctx);
+void cloudsync_sha256_update (cloudsync_sha256_ctx *ctx, const void *data, size_t len);
+void cloudsync_sha256_final (cloudsync_sha256_ctx *ctx, uint8_t digest[CLOUDSYNC_SHA256_LEN]);
+
 void *cloudsync_memory_zeroalloc (uint64_t size);
 char *cloudsync_string_ndup (const char *str, size_t len, bool lowercase);
 char *cloudsync_string_dup (const char *str, bool lowercase);
@@ -148,6 +169,10 @@ int cloudsync_blob_compare(const char *blob1, size_t size1, const char *blob2, s
 
 void cloudsync_rowid_decode (sqlite3_int64 rowid, sqlite3_int64 *db_version, sqlite3_int64 *seq);
 
+// runs callback(ctx, index) for each index in [0, ntasks) using up to nthreads threads (the caller included)
+typedef void (*cloudsync_task_callback)(void *ctx, int index);
+void cloudsync_parallel_run (int nthreads, int ntasks, cloudsync_task_callback callback, void *ctx);
+
 // available only on Desktop OS
 #ifdef CLOUDSYNC_DESKTOP_OS
 bool cloudsync_file_delete (const char *path);
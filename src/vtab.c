@@ -40,6 +40,58 @@ char *cloudsync_changes_columns[] = {"tbl", "pk", "col_name", "col_value", "col_
 #define COL_CL_INDEX                7
 #define COL_SEQ_INDEX               8
 
+typedef struct cloudsync_chunks_cursor {
+    sqlite3_vtab_cursor     base;       // base class, must be first
+    cloudsync_changes_vtab  *vtab;
+    sqlite3_stmt            *vm;        // changes statement, positioned on the next row to encode
+    cloudsync_data_payload  *payload;   // reusable frame buffer
+    sqlite3_int64           max_bytes;
+    sqlite3_int64           since_db_version;
+    sqlite3_int64           since_seq;
+    char                    *frame;     // current encoded frame
+    int                     frame_size;
+    int                     frame_nrows;
+    sqlite3_int64           db_version; // db_version of the last row in the current frame
+    sqlite3_int64           seq;        // seq of the last row in the current frame
+    sqlite3_int64           boundary_db_version;    // position of the last row before the db_version of the last row
+    sqlite3_int64           boundary_seq;
+    sqlite3_value           **group;    // copies of the rows read for the db_version of the last row (CHUNKS_ROW_VALUES each)
+    int                     group_count;
+    int                     group_capacity;
+    int                     group_first;    // first row of the group in the current frame
+    int                     group_next;     // next row of the group to append (group_count if they are all in a frame)
+    sqlite3_int64           rowid;
+} cloudsync_chunks_cursor;
+
+#define CHUNKS_ROW_VALUES           9
+
+#define CHUNKS_COL_PAYLOAD          0
+#define CHUNKS_COL_NROWS            1
+#define CHUNKS_COL_DBVERSION        2
+#define CHUNKS_COL_SEQ              3
+#define CHUNKS_COL_MAXBYTES         4
+#define CHUNKS_COL_SINCE_DBVERSION  5
+#define CHUNKS_COL_SINCE_SEQ        6
+#define CHUNKS_DEFAULT_MAXBYTES     1024*1024
+
+typedef struct cloudsync_stats_cursor {
+    sqlite3_vtab_cursor     base;       // base class, must be first
+    cloudsync_changes_vtab  *vtab;
+    int                     index;      // 0 is the totals row, then one row for each table
+    int                     count;
+} cloudsync_stats_cursor;
+
+typedef struct cloudsync_payload_cursor {
+    sqlite3_vtab_cursor     base;       // base class, must be first
+    cloudsync_changes_vtab  *vtab;
+    cloudsync_payload_reader *reader;   // cloudsync_payload_rows, NULL at the end of the payload
+    cloudsync_payload_info  *info;      // cloudsync_payload_info
+    int                     index;      // 0 is the header row, then one row for each table
+    int                     count;
+} cloudsync_payload_cursor;
+
+#define PAYLOAD_COL_ARGUMENT        10  // hidden payload column of both cloudsync_payload_rows and cloudsync_payload_info
+
 #if CLOUDSYNC_UNITTEST
 bool force_vtab_filter_abort = false;
 #define CHECK_VFILTERTEST_ABORT()   if (force_vtab_filter_abort) rc = SQLITE_ERROR
@@ -113,6 +165,9 @@ char *build_changes_sql (sqlite3 *db, const char *idxs) {
      *    for resolving the site ID and performing a LEFT JOIN with itself to
      *    identify columns with NULL values in `t2.col_name`.
      *
+     *    The rows of a grow-only set table are tracked by a single sentinel, which is exported
+     *    as one change for each column unless the v2 payload format is enabled (cloudsync_gos_expand).
+     *
      * 3. `union_query` CTE: Combines all the constructed SELECT statements
      *    from `changes_query` into a single query using `UNION ALL`.
      *
@@ -130,7 +185,8 @@ char *build_changes_sql (sqlite3 *db, const char *idxs) {
     
     const char *query =
     "WITH table_names AS ( "
-    "    SELECT format('%q',SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS table_name_literal, format('%w',SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS table_name_identifier, format('%w',tbl_name) AS table_meta "
+    "    SELECT format('%q',SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS table_name_literal, format('%w',SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS table_name_identifier, format('%w',tbl_name) AS table_meta, "
+    "    cloudsync_gos_expand(SUBSTR(tbl_name, 1, LENGTH(tbl_name) - 10)) AS gos_expand "
     "    FROM sqlite_master "
     "    WHERE type = 'table' AND tbl_name LIKE '%_cloudsync' "
     "), "
@@ -150,6 +206,22 @@ char *build_changes_sql (sqlite3 *db, const char *idxs) {
     "     LEFT JOIN cloudsync_site_id AS site_tbl ON t1.site_id = site_tbl.rowid "
     "     LEFT JOIN \"' || \"table_meta\" || '\" AS t2 ON t1.pk = t2.pk AND t2.col_name = ''" CLOUDSYNC_TOMBSTONE_VALUE "'' "
     "     WHERE col_value IS NOT ''" CLOUDSYNC_RLS_RESTRICTED_VALUE "''' "
+    "    || CASE WHEN gos_expand THEN "
+    "        ' AND t1.col_name IS NOT ''" CLOUDSYNC_TOMBSTONE_VALUE "'' UNION ALL SELECT "
+    "        ''' || \"table_name_literal\" || ''' AS tbl, "
+    "        t1.pk AS pk, "
+    "        c.name AS col_name, "
+    "        cloudsync_col_value(''' || \"table_name_literal\" || ''', c.name, t1.pk) AS col_value, "
+    "        t1.col_version AS col_version, "
+    "        t1.db_version AS db_version, "
+    "        site_tbl.site_id AS site_id, "
+    "        t1.seq + c.idx AS seq, "
+    "        t1.col_version AS cl "
+    "     FROM \"' || \"table_meta\" || '\" AS t1 "
+    "     JOIN (SELECT name, row_number() OVER (ORDER BY cid) - 1 AS idx FROM pragma_table_info(''' || \"table_name_literal\" || ''') WHERE pk = 0) AS c "
+    "     LEFT JOIN cloudsync_site_id AS site_tbl ON t1.site_id = site_tbl.rowid "
+    "     WHERE t1.col_name = ''" CLOUDSYNC_TOMBSTONE_VALUE "'' AND col_value IS NOT ''" CLOUDSYNC_RLS_RESTRICTED_VALUE "''' "
+    "    ELSE '' END "
     "    AS query_string FROM table_names "
     "), "
     "union_query AS ( "
@@ -488,6 +560,602 @@ int cloudsync_changesvtab_update (sqlite3_vtab *vtab, int argc, sqlite3_value **
     return cloudsync_merge_insert(vtab, argc-2, &argv[2], rowid);
 }
 
+// MARK: - Payload Chunks -
+
+int cloudsync_chunksvtab_connect (sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+    DEBUG_VTAB("cloudsync_chunksvtab_connect");
+    
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x (payload BLOB, nrows INTEGER, db_version INTEGER, seq INTEGER, "
+                                  "max_bytes HIDDEN, since_db_version HIDDEN, since_seq HIDDEN);");
+    if (rc == SQLITE_OK) {
+        // memory internally managed by SQLite, so I cannot use memory_alloc here
+        cloudsync_changes_vtab *vnew = sqlite3_malloc64(sizeof(cloudsync_changes_vtab));
+        if (vnew == NULL) return SQLITE_NOMEM;
+        
+        memset(vnew, 0, sizeof(cloudsync_changes_vtab));
+        vnew->db = db;
+        vnew->aux = aux;
+        
+        *vtab = (sqlite3_vtab *)vnew;
+    }
+    
+    return rc;
+}
+
+int cloudsync_chunksvtab_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **pcursor) {
+    DEBUG_VTAB("cloudsync_chunksvtab_open");
+    
+    cloudsync_chunks_cursor *cursor = cloudsync_memory_zeroalloc(sizeof(cloudsync_chunks_cursor));
+    if (cursor == NULL) return SQLITE_NOMEM;
+    
+    cursor->payload = cloudsync_payload_chunk_create();
+    if (cursor->payload == NULL) {
+        cloudsync_memory_free(cursor);
+        return SQLITE_NOMEM;
+    }
+    
+    cursor->vtab = (cloudsync_changes_vtab *)vtab;
+    *pcursor = (sqlite3_vtab_cursor *)cursor;
+    return SQLITE_OK;
+}
+
+void cloudsync_chunksvtab_group_drop (cloudsync_chunks_cursor *c, int nrows) {
+    // removes the first nrows rows of the group
+    for (int i=0; i<nrows * CHUNKS_ROW_VALUES; ++i) sqlite3_value_free(c->group[i]);
+    int nleft = c->group_count - nrows;
+    if (nleft > 0) memmove(c->group, c->group + nrows * CHUNKS_ROW_VALUES, sizeof(sqlite3_value *) * nleft * CHUNKS_ROW_VALUES);
+    c->group_count = nleft;
+    c->group_first = (c->group_first > nrows) ? c->group_first - nrows : 0;
+    c->group_next = (c->group_next > nrows) ? c->group_next - nrows : 0;
+}
+
+int cloudsync_chunksvtab_group_add (cloudsync_chunks_cursor *c, sqlite3_value **values) {
+    if (c->group_count == c->group_capacity) {
+        int capacity = (c->group_capacity) ? c->group_capacity * 2 : 32;
+        sqlite3_value **group = (sqlite3_value **)cloudsync_memory_realloc(c->group, sizeof(sqlite3_value *) * capacity * CHUNKS_ROW_VALUES);
+        if (!group) return SQLITE_NOMEM;
+        c->group = group;
+        c->group_capacity = capacity;
+    }
+    
+    sqlite3_value **row = c->group + c->group_count * CHUNKS_ROW_VALUES;
+    for (int i=0; i<CHUNKS_ROW_VALUES; ++i) {
+        row[i] = sqlite3_value_dup(values[i]);
+        if (!row[i]) {
+            while (--i >= 0) sqlite3_value_free(row[i]);
+            return SQLITE_NOMEM;
+        }
+    }
+    c->group_count++;
+    c->group_next = c->group_count;
+    return SQLITE_OK;
+}
+
+void cloudsync_chunksvtab_reset (cloudsync_chunks_cursor *c) {
+    if (c->vm) sqlite3_finalize(c->vm);
+    c->vm = NULL;
+    
+    cloudsync_chunksvtab_group_drop(c, c->group_count);
+    if (c->group) cloudsync_memory_free(c->group);
+    c->group = NULL;
+    c->group_capacity = 0;
+    
+    if (c->frame) cloudsync_memory_free(c->frame);
+    c->frame = NULL;
+    c->frame_size = 0;
+    c->frame_nrows = 0;
+}
+
+int cloudsync_chunksvtab_close (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_chunksvtab_close");
+    
+    cloudsync_chunks_cursor *c = (cloudsync_chunks_cursor *)cursor;
+    cloudsync_chunksvtab_reset(c);
+    cloudsync_payload_chunk_free(c->payload);
+    cloudsync_memory_free(cursor);
+    return SQLITE_OK;
+}
+
+int cloudsync_chunksvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *idxinfo) {
+    DEBUG_VTAB("cloudsync_chunksvtab_best_index");
+    
+    // hidden columns are the arguments of the table-valued function:
+    // cloudsync_payload_chunks(max_bytes [, since_db_version [, since_seq]])
+    int index[3] = {-1, -1, -1};
+    int idxnum = 0;
+    
+    for (int i=0; i<idxinfo->nConstraint; ++i) {
+        struct sqlite3_index_constraint *constraint = &idxinfo->aConstraint[i];
+        int col = constraint->iColumn - CHUNKS_COL_MAXBYTES;
+        if (col < 0 || col > 2) continue;
+        if (constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (constraint->usable == false) return SQLITE_CONSTRAINT;
+        
+        index[col] = i;
+        idxnum |= (1 << col);
+    }
+    
+    // arguments are passed to xFilter in column order
+    int arg_index = 1;
+    for (int i=0; i<3; ++i) {
+        if (index[i] < 0) continue;
+        idxinfo->aConstraintUsage[index[i]].argvIndex = arg_index++;
+        idxinfo->aConstraintUsage[index[i]].omit = 1;
+    }
+    
+    idxinfo->idxNum = idxnum;
+    idxinfo->estimatedCost = (idxnum & 2) ? 10.0 : 1000.0;
+    idxinfo->estimatedRows = (idxnum & 2) ? 10 : 1000;
+    
+    return SQLITE_OK;
+}
+
+int cloudsync_chunksvtab_next_frame (cloudsync_chunks_cursor *c) {
+    // encode rows until the frame is full or there are no more rows: the rows of the group removed from the previous frame
+    // come first, then the rows of the changes statement (that is never executed again)
+    sqlite3_value *columns[CHUNKS_ROW_VALUES];
+    int rc = SQLITE_OK;
+    
+    if (c->frame) cloudsync_memory_free(c->frame);
+    c->frame = NULL;
+    c->frame_size = 0;
+    c->frame_nrows = 0;
+    
+    cloudsync_context *data = (cloudsync_context *)c->vtab->aux;
+    while (c->group_next < c->group_count || c->vm) {
+        bool from_group = (c->group_next < c->group_count);
+        sqlite3_value **values = columns;
+        if (from_group) values = c->group + c->group_next * CHUNKS_ROW_VALUES;
+        else for (int i=0; i<CHUNKS_ROW_VALUES; ++i) columns[i] = sqlite3_column_value(c->vm, i);
+        
+        bool rewound = false;
+        int res = cloudsync_payload_chunk_append(c->payload, data, CHUNKS_ROW_VALUES, values, (size_t)c->max_bytes, &rewound);
+        if (res < 0) return SQLITE_NOMEM;
+        if (res == 0) {
+            // the frame ends before the db_version of its last rows, they are appended again to the next frame
+            if (rewound) {
+                c->db_version = c->boundary_db_version;
+                c->seq = c->boundary_seq;
+                c->group_next = c->group_first;
+            }
+            
+            // the rows of the group already in a frame are no longer needed
+            c->group_first = c->group_next;
+            cloudsync_chunksvtab_group_drop(c, c->group_first);
+            break;
+        }
+        
+        sqlite3_int64 db_version = sqlite3_value_int64(values[COL_DBVERSION_INDEX]);
+        if (db_version != c->db_version) {
+            c->boundary_db_version = c->db_version;
+            c->boundary_seq = c->seq;
+        }
+        c->db_version = db_version;
+        c->seq = sqlite3_value_int64(values[COL_SEQ_INDEX]);
+        
+        if (from_group) {
+            c->group_next++;
+            continue;
+        }
+        
+        // a row of a new db_version starts a new group
+        if (c->group_count > 0 && sqlite3_value_int64(c->group[COL_DBVERSION_INDEX]) != db_version) cloudsync_chunksvtab_group_drop(c, c->group_count);
+        rc = cloudsync_chunksvtab_group_add(c, values);
+        if (rc != SQLITE_OK) return rc;
+        
+        rc = sqlite3_step(c->vm);
+        if (rc == SQLITE_DONE) {
+            sqlite3_finalize(c->vm);
+            c->vm = NULL;
+        } else if (rc != SQLITE_ROW) {
+            return rc;
+        }
+    }
+    
+    rc = cloudsync_payload_chunk_flush(c->payload, data, &c->frame, &c->frame_size, &c->frame_nrows);
+    if (rc == SQLITE_OK) ++c->rowid;
+    return rc;
+}
+
+int cloudsync_chunksvtab_filter (sqlite3_vtab_cursor *cursor, int idxn, const char *idxs, int argc, sqlite3_value **argv) {
+    DEBUG_VTAB("cloudsync_chunksvtab_filter");
+    
+    cloudsync_chunks_cursor *c = (cloudsync_chunks_cursor *)cursor;
+    sqlite3 *db = c->vtab->db;
+    cloudsync_chunksvtab_reset(c);
+    
+    int i = 0;
+    c->max_bytes = (idxn & 1) ? sqlite3_value_int64(argv[i++]) : CHUNKS_DEFAULT_MAXBYTES;
+    c->since_db_version = (idxn & 2) ? sqlite3_value_int64(argv[i++]) : -1;
+    c->since_seq = (idxn & 4) ? sqlite3_value_int64(argv[i++]) : -1;
+    c->db_version = c->boundary_db_version = c->since_db_version;
+    c->seq = c->boundary_seq = c->since_seq;
+    c->rowid = 0;
+    if (c->max_bytes <= 0) {
+        cloudsync_vtab_set_error(cursor->pVtab, "max_bytes must be greater than zero");
+        return SQLITE_MISUSE;
+    }
+    
+    const char *sql = "SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM cloudsync_changes "
+                      "WHERE site_id=cloudsync_siteid() AND (db_version>?1 OR (db_version=?1 AND seq>?2));";
+    int rc = sqlite3_prepare_v2(db, sql, -1, &c->vm, NULL);
+    if (rc != SQLITE_OK) goto abort_filter;
+    
+    rc = sqlite3_bind_int64(c->vm, 1, c->since_db_version);
+    if (rc != SQLITE_OK) goto abort_filter;
+    
+    rc = sqlite3_bind_int64(c->vm, 2, c->since_seq);
+    if (rc != SQLITE_OK) goto abort_filter;
+    
+    rc = sqlite3_step(c->vm);
+    if (rc == SQLITE_DONE) {
+        sqlite3_finalize(c->vm);
+        c->vm = NULL;
+    } else if (rc != SQLITE_ROW) {
+        goto abort_filter;
+    }
+    
+    rc = cloudsync_chunksvtab_next_frame(c);
+    if (rc != SQLITE_OK) goto abort_filter;
+    
+    return SQLITE_OK;
+    
+abort_filter:
+    DEBUG_VTAB("cloudsync_chunksvtab_filter: %s\n", sqlite3_errmsg(db));
+    cloudsync_chunksvtab_reset(c);
+    return rc;
+}
+
+int cloudsync_chunksvtab_next (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_chunksvtab_next");
+    
+    cloudsync_chunks_cursor *c = (cloudsync_chunks_cursor *)cursor;
+    int rc = cloudsync_chunksvtab_next_frame(c);
+    if (rc != SQLITE_OK) {
+        DEBUG_VTAB("cloudsync_chunksvtab_next: %s\n", sqlite3_errmsg(c->vtab->db));
+        cloudsync_chunksvtab_reset(c);
+    }
+    return rc;
+}
+
+int cloudsync_chunksvtab_eof (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_chunksvtab_eof");
+    
+    cloudsync_chunks_cursor *c = (cloudsync_chunks_cursor *)cursor;
+    return (c->frame_nrows > 0) ? 0 : 1;
+}
+
+int cloudsync_chunksvtab_column (sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    DEBUG_VTAB("cloudsync_chunksvtab_column %d\n", col);
+    
+    cloudsync_chunks_cursor *c = (cloudsync_chunks_cursor *)cursor;
+    switch (col) {
+        case CHUNKS_COL_PAYLOAD: sqlite3_result_blob(ctx, c->frame, c->frame_size, SQLITE_TRANSIENT); break;
+        case CHUNKS_COL_NROWS: sqlite3_result_int(ctx, c->frame_nrows); break;
+        case CHUNKS_COL_DBVERSION: sqlite3_result_int64(ctx, c->db_version); break;
+        case CHUNKS_COL_SEQ: sqlite3_result_int64(ctx, c->seq); break;
+        case CHUNKS_COL_MAXBYTES: sqlite3_result_int64(ctx, c->max_bytes); break;
+        case CHUNKS_COL_SINCE_DBVERSION: sqlite3_result_int64(ctx, c->since_db_version); break;
+        case CHUNKS_COL_SINCE_SEQ: sqlite3_result_int64(ctx, c->since_seq); break;
+    }
+    
+    return SQLITE_OK;
+}
+
+int cloudsync_chunksvtab_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    DEBUG_VTAB("cloudsync_chunksvtab_rowid");
+    
+    cloudsync_chunks_cursor *c = (cloudsync_chunks_cursor *)cursor;
+    *rowid = c->rowid;
+    return SQLITE_OK;
+}
+
+// MARK: - Apply Stats -
+
+int cloudsync_statsvtab_connect (sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+    DEBUG_VTAB("cloudsync_statsvtab_connect");
+    
+    // columns are in CLOUDSYNC_APPLY_STATS_COLUMN order
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x (tbl TEXT, seen INTEGER, applied INTEGER, lost INTEGER, equal INTEGER, resurrected INTEGER, "
+                                  "deleted INTEGER, rejected INTEGER, failed INTEGER, decompress_us INTEGER, decode_us INTEGER, merge_us INTEGER, "
+                                  "savepoints INTEGER, errors TEXT);");
+    if (rc == SQLITE_OK) {
+        // memory internally managed by SQLite, so I cannot use memory_alloc here
+        cloudsync_changes_vtab *vnew = sqlite3_malloc64(sizeof(cloudsync_changes_vtab));
+        if (vnew == NULL) return SQLITE_NOMEM;
+        
+        memset(vnew, 0, sizeof(cloudsync_changes_vtab));
+        vnew->db = db;
+        vnew->aux = aux;
+        
+        *vtab = (sqlite3_vtab *)vnew;
+    }
+    
+    return rc;
+}
+
+int cloudsync_statsvtab_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **pcursor) {
+    DEBUG_VTAB("cloudsync_statsvtab_open");
+    
+    cloudsync_stats_cursor *cursor = cloudsync_memory_zeroalloc(sizeof(cloudsync_stats_cursor));
+    if (cursor == NULL) return SQLITE_NOMEM;
+    
+    cursor->vtab = (cloudsync_changes_vtab *)vtab;
+    *pcursor = (sqlite3_vtab_cursor *)cursor;
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_close (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_statsvtab_close");
+    
+    cloudsync_memory_free(cursor);
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *idxinfo) {
+    DEBUG_VTAB("cloudsync_statsvtab_best_index");
+    
+    idxinfo->estimatedCost = 10.0;
+    idxinfo->estimatedRows = 10;
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_filter (sqlite3_vtab_cursor *cursor, int idxn, const char *idxs, int argc, sqlite3_value **argv) {
+    DEBUG_VTAB("cloudsync_statsvtab_filter");
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    cloudsync_context *data = (cloudsync_context *)c->vtab->aux;
+    c->index = 0;
+    c->count = (data) ? cloudsync_apply_stats_count(data) : 0;
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_next (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_statsvtab_next");
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    c->index += 1;
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_eof (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_statsvtab_eof");
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    return (c->index < c->count) ? 0 : 1;
+}
+
+int cloudsync_statsvtab_column (sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    DEBUG_VTAB("cloudsync_statsvtab_column %d\n", col);
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    cloudsync_apply_stats_result((cloudsync_context *)c->vtab->aux, c->index, col, ctx);
+    return SQLITE_OK;
+}
+
+int cloudsync_statsvtab_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    DEBUG_VTAB("cloudsync_statsvtab_rowid");
+    
+    cloudsync_stats_cursor *c = (cloudsync_stats_cursor *)cursor;
+    *rowid = c->index;
+    return SQLITE_OK;
+}
+
+// MARK: - Payload Inspection -
+
+int cloudsync_payloadvtab_create (sqlite3 *db, void *aux, sqlite3_vtab **vtab) {
+    // memory internally managed by SQLite, so I cannot use memory_alloc here
+    cloudsync_changes_vtab *vnew = sqlite3_malloc64(sizeof(cloudsync_changes_vtab));
+    if (vnew == NULL) return SQLITE_NOMEM;
+    
+    memset(vnew, 0, sizeof(cloudsync_changes_vtab));
+    vnew->db = db;
+    vnew->aux = aux;
+    
+    *vtab = (sqlite3_vtab *)vnew;
+    return SQLITE_OK;
+}
+
+int cloudsync_rowsvtab_connect (sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+    DEBUG_VTAB("cloudsync_rowsvtab_connect");
+    
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x (tbl TEXT, pk BLOB, col_name TEXT, col_value ANY, col_version INTEGER, db_version INTEGER, "
+                                  "site_id BLOB, cl INTEGER, seq INTEGER, nbytes INTEGER, payload HIDDEN);");
+    return (rc == SQLITE_OK) ? cloudsync_payloadvtab_create(db, aux, vtab) : rc;
+}
+
+int cloudsync_infovtab_connect (sqlite3 *db, void *aux, int argc, const char *const *argv, sqlite3_vtab **vtab, char **err) {
+    DEBUG_VTAB("cloudsync_infovtab_connect");
+    
+    // columns are in CLOUDSYNC_PAYLOAD_INFO_COLUMN order
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x (tbl TEXT, nrows INTEGER, nbytes INTEGER, version INTEGER, libversion TEXT, codec INTEGER, "
+                                  "size INTEGER, expanded_size INTEGER, ncols INTEGER, schema_hash INTEGER, payload HIDDEN);");
+    return (rc == SQLITE_OK) ? cloudsync_payloadvtab_create(db, aux, vtab) : rc;
+}
+
+int cloudsync_payloadvtab_open (sqlite3_vtab *vtab, sqlite3_vtab_cursor **pcursor) {
+    DEBUG_VTAB("cloudsync_payloadvtab_open");
+    
+    cloudsync_payload_cursor *cursor = cloudsync_memory_zeroalloc(sizeof(cloudsync_payload_cursor));
+    if (cursor == NULL) return SQLITE_NOMEM;
+    
+    cursor->vtab = (cloudsync_changes_vtab *)vtab;
+    *pcursor = (sqlite3_vtab_cursor *)cursor;
+    return SQLITE_OK;
+}
+
+void cloudsync_payloadvtab_reset (cloudsync_payload_cursor *c) {
+    if (c->reader) cloudsync_payload_reader_free(c->reader);
+    c->reader = NULL;
+    
+    if (c->info) cloudsync_payload_info_free(c->info);
+    c->info = NULL;
+    
+    c->index = 0;
+    c->count = 0;
+}
+
+int cloudsync_payloadvtab_close (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_payloadvtab_close");
+    
+    cloudsync_payloadvtab_reset((cloudsync_payload_cursor *)cursor);
+    cloudsync_memory_free(cursor);
+    return SQLITE_OK;
+}
+
+int cloudsync_payloadvtab_best_index (sqlite3_vtab *vtab, sqlite3_index_info *idxinfo) {
+    DEBUG_VTAB("cloudsync_payloadvtab_best_index");
+    
+    // the hidden payload column is the argument of the table-valued function:
+    // cloudsync_payload_rows(payload) and cloudsync_payload_info(payload)
+    idxinfo->idxNum = 0;
+    for (int i=0; i<idxinfo->nConstraint; ++i) {
+        struct sqlite3_index_constraint *constraint = &idxinfo->aConstraint[i];
+        if (constraint->iColumn != PAYLOAD_COL_ARGUMENT || constraint->op != SQLITE_INDEX_CONSTRAINT_EQ) continue;
+        if (constraint->usable == false) return SQLITE_CONSTRAINT;
+        
+        idxinfo->aConstraintUsage[i].argvIndex = 1;
+        idxinfo->aConstraintUsage[i].omit = 1;
+        idxinfo->idxNum = 1;
+        break;
+    }
+    
+    idxinfo->estimatedCost = (idxinfo->idxNum) ? 1000.0 : 1.0;
+    idxinfo->estimatedRows = (idxinfo->idxNum) ? 1000 : 1;
+    return SQLITE_OK;
+}
+
+const char *cloudsync_payloadvtab_argument (sqlite3_vtab_cursor *cursor, int idxn, int argc, sqlite3_value **argv, int *size) {
+    // returns NULL if the payload is not a BLOB (an error has been set) or if there is no payload (no rows)
+    *size = 0;
+    if (idxn == 0 || argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL) return NULL;
+    
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        cloudsync_vtab_set_error(cursor->pVtab, "payload must be a BLOB");
+        *size = -1;
+        return NULL;
+    }
+    
+    *size = sqlite3_value_bytes(argv[0]);
+    return (const char *)sqlite3_value_blob(argv[0]);
+}
+
+int cloudsync_rowsvtab_next (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_rowsvtab_next");
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    int rc = cloudsync_payload_reader_next(c->reader);
+    if (rc == SQLITE_ROW) return SQLITE_OK;
+    
+    int64_t index = cloudsync_payload_reader_rowid(c->reader);
+    cloudsync_payloadvtab_reset(c);
+    if (rc == SQLITE_DONE) return SQLITE_OK;
+    
+    cloudsync_vtab_set_error(cursor->pVtab, "unable to decode row %lld of the payload (%d)", index + 1, rc);
+    return rc;
+}
+
+int cloudsync_rowsvtab_filter (sqlite3_vtab_cursor *cursor, int idxn, const char *idxs, int argc, sqlite3_value **argv) {
+    DEBUG_VTAB("cloudsync_rowsvtab_filter");
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    cloudsync_payloadvtab_reset(c);
+    
+    int size = 0;
+    const char *payload = cloudsync_payloadvtab_argument(cursor, idxn, argc, argv, &size);
+    if (!payload) return (size < 0) ? SQLITE_MISUSE : SQLITE_OK;
+    
+    char *errmsg = NULL;
+    c->reader = cloudsync_payload_reader_create((cloudsync_context *)c->vtab->aux, payload, size, &errmsg);
+    if (!c->reader) {
+        if (!errmsg) return SQLITE_NOMEM;
+        cloudsync_vtab_set_error(cursor->pVtab, "%s", errmsg);
+        cloudsync_memory_free(errmsg);
+        return SQLITE_MISUSE;
+    }
+    
+    return cloudsync_rowsvtab_next(cursor);
+}
+
+int cloudsync_rowsvtab_eof (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_rowsvtab_eof");
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    return (c->reader) ? 0 : 1;
+}
+
+int cloudsync_rowsvtab_column (sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    DEBUG_VTAB("cloudsync_rowsvtab_column %d\n", col);
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    if (col == PAYLOAD_COL_ARGUMENT) sqlite3_result_null(ctx);
+    else cloudsync_payload_reader_result(c->reader, col, ctx);
+    return SQLITE_OK;
+}
+
+int cloudsync_rowsvtab_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    DEBUG_VTAB("cloudsync_rowsvtab_rowid");
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    *rowid = cloudsync_payload_reader_rowid(c->reader);
+    return SQLITE_OK;
+}
+
+int cloudsync_infovtab_filter (sqlite3_vtab_cursor *cursor, int idxn, const char *idxs, int argc, sqlite3_value **argv) {
+    DEBUG_VTAB("cloudsync_infovtab_filter");
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    cloudsync_payloadvtab_reset(c);
+    
+    int size = 0;
+    const char *payload = cloudsync_payloadvtab_argument(cursor, idxn, argc, argv, &size);
+    if (!payload) return (size < 0) ? SQLITE_MISUSE : SQLITE_OK;
+    
+    char *errmsg = NULL;
+    c->info = cloudsync_payload_info_create((cloudsync_context *)c->vtab->aux, payload, size, &errmsg);
+    if (!c->info) {
+        if (!errmsg) return SQLITE_NOMEM;
+        cloudsync_vtab_set_error(cursor->pVtab, "%s", errmsg);
+        cloudsync_memory_free(errmsg);
+        return SQLITE_MISUSE;
+    }
+    
+    c->count = cloudsync_payload_info_count(c->info);
+    return SQLITE_OK;
+}
+
+int cloudsync_infovtab_next (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_infovtab_next");
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    c->index += 1;
+    return SQLITE_OK;
+}
+
+int cloudsync_infovtab_eof (sqlite3_vtab_cursor *cursor) {
+    DEBUG_VTAB("cloudsync_infovtab_eof");
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    return (c->index < c->count) ? 0 : 1;
+}
+
+int cloudsync_infovtab_column (sqlite3_vtab_cursor *cursor, sqlite3_context *ctx, int col) {
+    DEBUG_VTAB("cloudsync_infovtab_column %d\n", col);
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    if (col == PAYLOAD_COL_ARGUMENT) sqlite3_result_null(ctx);
+    else cloudsync_payload_info_result(c->info, c->index, col, ctx);
+    return SQLITE_OK;
+}
+
+int cloudsync_infovtab_rowid (sqlite3_vtab_cursor *cursor, sqlite3_int64 *rowid) {
+    DEBUG_VTAB("cloudsync_infovtab_rowid");
+    
+    cloudsync_payload_cursor *c = (cloudsync_payload_cursor *)cursor;
+    *rowid = c->index;
+    return SQLITE_OK;
+}
+
 // MARK: -
 
 cloudsync_context *cloudsync_vtab_get_context (sqlite3_vtab *vtab) {
@@ -536,3 +1204,131 @@ int cloudsync_vtab_register_changes (sqlite3 *db, cloudsync_context *xdata) {
     
     return sqlite3_create_module(db, "cloudsync_changes", &cloudsync_changes_module, (void *)xdata);
 }
+
+int cloudsync_vtab_register_payload_chunks (sqlite3 *db, cloudsync_context *xdata) {
+    static sqlite3_module cloudsync_chunks_module = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0, // Eponymous only virtual table
+        /* xConnect    */ cloudsync_chunksvtab_connect,
+        /* xBestIndex  */ cloudsync_chunksvtab_best_index,
+        /* xDisconnect */ cloudsync_changesvtab_disconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ cloudsync_chunksvtab_open,
+        /* xClose      */ cloudsync_chunksvtab_close,
+        /* xFilter     */ cloudsync_chunksvtab_filter,
+        /* xNext       */ cloudsync_chunksvtab_next,
+        /* xEof        */ cloudsync_chunksvtab_eof,
+        /* xColumn     */ cloudsync_chunksvtab_column,
+        /* xRowid      */ cloudsync_chunksvtab_rowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0,
+        /* xRelease    */ 0,
+        /* xRollbackTo */ 0,
+        /* xShadowName */ 0,
+        /* xIntegrity  */ 0
+    };
+    
+    return sqlite3_create_module(db, "cloudsync_payload_chunks", &cloudsync_chunks_module, (void *)xdata);
+}
+
+int cloudsync_vtab_register_apply_stats (sqlite3 *db, cloudsync_context *xdata) {
+    static sqlite3_module cloudsync_stats_module = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0, // Eponymous only virtual table
+        /* xConnect    */ cloudsync_statsvtab_connect,
+        /* xBestIndex  */ cloudsync_statsvtab_best_index,
+        /* xDisconnect */ cloudsync_changesvtab_disconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ cloudsync_statsvtab_open,
+        /* xClose      */ cloudsync_statsvtab_close,
+        /* xFilter     */ cloudsync_statsvtab_filter,
+        /* xNext       */ cloudsync_statsvtab_next,
+        /* xEof        */ cloudsync_statsvtab_eof,
+        /* xColumn     */ cloudsync_statsvtab_column,
+        /* xRowid      */ cloudsync_statsvtab_rowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0,
+        /* xRelease    */ 0,
+        /* xRollbackTo */ 0,
+        /* xShadowName */ 0,
+        /* xIntegrity  */ 0
+    };
+    
+    return sqlite3_create_module(db, "cloudsync_last_apply_stats", &cloudsync_stats_module, (void *)xdata);
+}
+
+int cloudsync_vtab_register_payload_rows (sqlite3 *db, cloudsync_context *xdata) {
+    static sqlite3_module cloudsync_rows_module = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0, // Eponymous only virtual table
+        /* xConnect    */ cloudsync_rowsvtab_connect,
+        /* xBestIndex  */ cloudsync_payloadvtab_best_index,
+        /* xDisconnect */ cloudsync_changesvtab_disconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ cloudsync_payloadvtab_open,
+        /* xClose      */ cloudsync_payloadvtab_close,
+        /* xFilter     */ cloudsync_rowsvtab_filter,
+        /* xNext       */ cloudsync_rowsvtab_next,
+        /* xEof        */ cloudsync_rowsvtab_eof,
+        /* xColumn     */ cloudsync_rowsvtab_column,
+        /* xRowid      */ cloudsync_rowsvtab_rowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0,
+        /* xRelease    */ 0,
+        /* xRollbackTo */ 0,
+        /* xShadowName */ 0,
+        /* xIntegrity  */ 0
+    };
+    
+    return sqlite3_create_module(db, "cloudsync_payload_rows", &cloudsync_rows_module, (void *)xdata);
+}
+
+int cloudsync_vtab_register_payload_info (sqlite3 *db, cloudsync_context *xdata) {
+    static sqlite3_module cloudsync_info_module = {
+        /* iVersion    */ 0,
+        /* xCreate     */ 0, // Eponymous only virtual table
+        /* xConnect    */ cloudsync_infovtab_connect,
+        /* xBestIndex  */ cloudsync_payloadvtab_best_index,
+        /* xDisconnect */ cloudsync_changesvtab_disconnect,
+        /* xDestroy    */ 0,
+        /* xOpen       */ cloudsync_payloadvtab_open,
+        /* xClose      */ cloudsync_payloadvtab_close,
+        /* xFilter     */ cloudsync_infovtab_filter,
+        /* xNext       */ cloudsync_infovtab_next,
+        /* xEof        */ cloudsync_infovtab_eof,
+        /* xColumn     */ cloudsync_infovtab_column,
+        /* xRowid      */ cloudsync_infovtab_rowid,
+        /* xUpdate     */ 0,
+        /* xBegin      */ 0,
+        /* xSync       */ 0,
+        /* xCommit     */ 0,
+        /* xRollback   */ 0,
+        /* xFindMethod */ 0,
+        /* xRename     */ 0,
+        /* xSavepoint  */ 0,
+        /* xRelease    */ 0,
+        /* xRollbackTo */ 0,
+        /* xShadowName */ 0,
+        /* xIntegrity  */ 0
+    };
+    
+    return sqlite3_create_module(db, "cloudsync_payload_info", &cloudsync_info_module, (void *)xdata);
+}
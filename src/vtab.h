@@ -12,6 +12,10 @@
 #include "cloudsync_private.h"
 
 int cloudsync_vtab_register_changes (sqlite3 *db, cloudsync_context *xdata);
+int cloudsync_vtab_register_payload_chunks (sqlite3 *db, cloudsync_context *xdata);
+int cloudsync_vtab_register_apply_stats (sqlite3 *db, cloudsync_context *xdata);
+int cloudsync_vtab_register_payload_rows (sqlite3 *db, cloudsync_context *xdata);
+int cloudsync_vtab_register_payload_info (sqlite3 *db, cloudsync_context *xdata);
 cloudsync_context *cloudsync_vtab_get_context (sqlite3_vtab *vtab);
 int cloudsync_vtab_set_error (sqlite3_vtab *vtab, const char *format, ...);
 
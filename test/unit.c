@@ -28,6 +28,9 @@
 extern char *OUT_OF_MEMORY_BUFFER;
 extern bool force_vtab_filter_abort;
 extern bool force_uncompressed_blob;
+extern bool force_vtab_apply;
+extern bool force_stream_apply;
+extern uint32_t force_apply_interrupt_row;
 
 // private prototypes
 sqlite3_stmt *stmt_reset (sqlite3_stmt *stmt);
@@ -42,6 +45,12 @@ const char *opname_from_value (int value);
 int colname_is_legal (const char *name);
 int binary_comparison (int x, int y);
 sqlite3 *do_create_database (void);
+void *cloudsync_context_create (void);
+void cloudsync_context_free (void *ptr);
+void *table_lookup (cloudsync_context *data, const char *table_name);
+bool table_add_to_context (sqlite3 *db, cloudsync_context *data, table_algo algo, const char *table_name);
+int table_remove (cloudsync_context *data, const char *table_name);
+void table_free (void *table);
 
 static int stdout_backup = -1; // Backup file descriptor for stdout
 static int dev_null_fd = -1;   // File descriptor for /dev/null
@@ -5685,6 +5694,2238 @@ finalize:
     return result;
 }
 
+bool do_test_payload_chunks_boundaries (bool print_result) {
+    // frames end at db_version boundaries, a db_version is split only when it alone exceeds max_bytes
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *check_stmt = NULL;
+    sqlite3_stmt *apply_stmt = NULL;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE frames (id TEXT PRIMARY KEY NOT NULL, note TEXT); SELECT cloudsync_init('frames');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // 30 db_versions of 3 rows, then one db_version bigger than a frame
+    for (int i=0; i<30; ++i) {
+        char *sql = sqlite3_mprintf("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<3) "
+                                    "INSERT INTO frames (id, note) SELECT 'f%d-' || i, printf('%%.60c', 'x') FROM n;", i);
+        rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<200) "
+                             "INSERT INTO frames (id, note) SELECT 'big-' || i, printf('%.60c', 'y') FROM n;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // number of db_versions of the frame that are not complete, and number of db_versions of the frame
+    const char *check_sql = "SELECT (SELECT count(*) FROM (SELECT db_version, count(*) AS n FROM cloudsync_payload_rows(?1) GROUP BY db_version) AS f "
+                            "WHERE f.n <> (SELECT count(*) FROM cloudsync_changes AS c WHERE c.db_version = f.db_version)), "
+                            "(SELECT count(DISTINCT db_version) FROM cloudsync_payload_rows(?1));";
+    
+    // v1 frames (default) are applied to db[1], v2 frames to db[2]
+    for (int v=1; v<3; ++v) {
+        if (v == 2) {
+            rc = sqlite3_exec(db[0], "SELECT cloudsync_set('payload_version', '2');", NULL, NULL, NULL);
+            if (rc != SQLITE_OK) goto finalize;
+        }
+        
+        rc = sqlite3_prepare_v2(db[0], "SELECT payload, nrows FROM cloudsync_payload_chunks(1500);", -1, &select_stmt, NULL);
+        if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db[0], check_sql, -1, &check_stmt, NULL);
+        if (rc == SQLITE_OK) rc = sqlite3_prepare_v2(db[v], "SELECT cloudsync_payload_decode(?);", -1, &apply_stmt, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        
+        int nframes = 0, nsplit = 0;
+        sqlite3_int64 nrows = 0;
+        while ((rc = sqlite3_step(select_stmt)) == SQLITE_ROW) {
+            ++nframes;
+            nrows += sqlite3_column_int64(select_stmt, 1);
+            
+            rc = sqlite3_bind_value(check_stmt, 1, sqlite3_column_value(select_stmt, 0));
+            if (rc != SQLITE_OK) goto finalize;
+            if (sqlite3_step(check_stmt) != SQLITE_ROW) goto finalize;
+            int npartial = sqlite3_column_int(check_stmt, 0);
+            int ndbversions = sqlite3_column_int(check_stmt, 1);
+            if (print_result) printf("v%d frame %d: %lld rows, %d db_versions, %d partial\n", v, nframes, sqlite3_column_int64(select_stmt, 1), ndbversions, npartial);
+            if (npartial > 0 && ndbversions != 1) goto finalize;
+            if (npartial > 0) ++nsplit;
+            stmt_reset(check_stmt);
+            
+            rc = sqlite3_bind_value(apply_stmt, 1, sqlite3_column_value(select_stmt, 0));
+            if (rc != SQLITE_OK) goto finalize;
+            if (sqlite3_step(apply_stmt) != SQLITE_ROW) goto finalize;
+            if (sqlite3_column_int64(apply_stmt, 0) != sqlite3_column_int64(select_stmt, 1)) goto finalize;
+            stmt_reset(apply_stmt);
+        }
+        if (rc != SQLITE_DONE) goto finalize;
+        rc = SQLITE_OK;
+        
+        // only the big db_version is split
+        if (nframes < 10 || nsplit < 2 || nrows != dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;")) goto finalize;
+        if (do_compare_queries(db[0], "SELECT * FROM frames ORDER BY id;", db[v], "SELECT * FROM frames ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+        
+        sqlite3_finalize(select_stmt);
+        sqlite3_finalize(check_stmt);
+        sqlite3_finalize(apply_stmt);
+        select_stmt = check_stmt = apply_stmt = NULL;
+    }
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_chunks_boundaries error: %s\n", sqlite3_errmsg(db[0]));
+    if (select_stmt) sqlite3_finalize(select_stmt);
+    if (check_stmt) sqlite3_finalize(check_stmt);
+    if (apply_stmt) sqlite3_finalize(apply_stmt);
+    for (int i=0; i<3; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_chunks (int max_bytes, bool print_result, bool cleanup_databases) {
+    sqlite3 *db[2] = {NULL, NULL};
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *apply_stmt = NULL;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    // create databases and tables
+    int table_mask = TEST_PRIKEYS;
+    time_t timestamp = time(NULL);
+    int saved_counter = test_counter;
+    for (int i=0; i<2; ++i) {
+        db[i] = do_create_database_file(i, timestamp, test_counter++);
+        if (db[i] == NULL) return false;
+        
+        if (do_create_tables(table_mask, db[i]) == false) goto finalize;
+        if (do_augment_tables(table_mask, db[i], table_algo_crdt_cls) == false) goto finalize;
+    }
+    
+    do_insert(db[0], table_mask, 200, print_result);
+    do_update(db[0], table_mask, print_result);
+    
+    // encode all local changes as a sequence of frames and apply each frame on its own
+    rc = sqlite3_prepare_v2(db[0], "SELECT payload, nrows, length(payload) FROM cloudsync_payload_chunks(?);", -1, &select_stmt, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_bind_int(select_stmt, 1, max_bytes);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rc = sqlite3_prepare_v2(db[1], "SELECT cloudsync_payload_decode(?);", -1, &apply_stmt, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    int nframes = 0;
+    sqlite3_int64 nrows = 0;
+    while ((rc = sqlite3_step(select_stmt)) == SQLITE_ROW) {
+        ++nframes;
+        nrows += sqlite3_column_int64(select_stmt, 1);
+        
+        rc = sqlite3_bind_value(apply_stmt, 1, sqlite3_column_value(select_stmt, 0));
+        if (rc != SQLITE_OK) goto finalize;
+        rc = sqlite3_step(apply_stmt);
+        if (rc != SQLITE_ROW) goto finalize;
+        if (sqlite3_column_int64(apply_stmt, 0) != sqlite3_column_int64(select_stmt, 1)) goto finalize;
+        stmt_reset(apply_stmt);
+    }
+    if (rc != SQLITE_DONE) goto finalize;
+    rc = SQLITE_OK;
+    
+    // the whole changeset must be split in more than one frame
+    sqlite3_int64 nchanges = dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE site_id=cloudsync_siteid();");
+    if (nframes < 2 || nrows != nchanges) goto finalize;
+    
+    // compare results
+    char *sql = sqlite3_mprintf("SELECT * FROM \"%w\" ORDER BY first_name, \"" CUSTOMERS_TABLE_COLUMN_LASTNAME "\";", CUSTOMERS_TABLE);
+    bool cmp = do_compare_queries(db[0], sql, db[1], sql, -1, -1, print_result);
+    sqlite3_free(sql);
+    if (cmp == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_chunks error: %s - %s\n", sqlite3_errmsg(db[0]), (db[1]) ? sqlite3_errmsg(db[1]) : "N/A");
+    if (select_stmt) sqlite3_finalize(select_stmt);
+    if (apply_stmt) sqlite3_finalize(apply_stmt);
+    for (int i=0; i<2; ++i) {
+        if (db[i]) close_db(db[i]);
+        if (cleanup_databases) {
+            char buf[256];
+            do_build_database_path(buf, i, timestamp, saved_counter++);
+            file_delete_internal(buf);
+        }
+    }
+    return result;
+}
+
+bool do_test_payload_versions (bool print_result, bool cleanup_databases) {
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *blob[2] = {NULL, NULL};
+    int blob_size[2] = {0, 0};
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    // create databases and tables
+    int table_mask = TEST_PRIKEYS | TEST_NOCOLS;
+    time_t timestamp = time(NULL);
+    int saved_counter = test_counter;
+    for (int i=0; i<3; ++i) {
+        db[i] = do_create_database_file(i, timestamp, test_counter++);
+        if (db[i] == NULL) goto finalize;
+        
+        if (do_create_tables(table_mask, db[i]) == false) goto finalize;
+        if (do_augment_tables(table_mask, db[i], table_algo_crdt_cls) == false) goto finalize;
+    }
+    
+    do_insert(db[0], table_mask, 50, print_result);
+    do_update(db[0], table_mask, print_result);
+    do_delete(db[0], table_mask, print_result);
+    
+    // encode the same changes with the v1 (default) and the v2 (opt-in) format (uncompressed, so sizes can be compared)
+    const char *src_sql = "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;";
+    force_uncompressed_blob = true;
+    for (int i=0; i<2; ++i) {
+        if (i == 1) rc = sqlite3_exec(db[0], "SELECT cloudsync_set('payload_version', '2');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) break;
+        blob[i] = dbutils_blob_select(db[0], src_sql, &blob_size[i], NULL, &rc);
+        if (!blob[i]) break;
+    }
+    force_uncompressed_blob = false;
+    if (!blob[0] || !blob[1]) goto finalize;
+    
+    // check header version and size
+    if (blob[0][4] != 1 || blob[1][4] != 2) goto finalize;
+    if (blob_size[1] >= blob_size[0]) goto finalize;
+    if (print_result) printf("Payload v1: %d bytes, v2: %d bytes\n", blob_size[0], blob_size[1]);
+    
+    // apply each payload to a different database
+    const char *dest_sql = "SELECT cloudsync_payload_decode(?);";
+    for (int i=0; i<2; ++i) {
+        const char *values[] = {blob[i]};
+        int types[] = {SQLITE_BLOB};
+        int len[] = {blob_size[i]};
+        if (dbutils_select(db[i+1], dest_sql, values, types, len, 1, SQLITE_INTEGER) <= 0) goto finalize;
+    }
+    
+    // a truncated v2 payload must be rejected
+    sqlite3_stmt *vm = NULL;
+    rc = sqlite3_prepare_v2(db[2], dest_sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_bind_blob(vm, 1, blob[1], blob_size[1] - 8, SQLITE_STATIC);
+    rc = sqlite3_step(vm);
+    sqlite3_finalize(vm);
+    if (rc == SQLITE_ROW) goto finalize;
+    rc = SQLITE_OK;
+    
+    // compare results
+    for (int i=1; i<3; ++i) {
+        char *sql = sqlite3_mprintf("SELECT * FROM \"%w\" ORDER BY first_name, \"" CUSTOMERS_TABLE_COLUMN_LASTNAME "\";", CUSTOMERS_TABLE);
+        bool cmp = do_compare_queries(db[0], sql, db[i], sql, -1, -1, print_result);
+        sqlite3_free(sql);
+        if (cmp == false) goto finalize;
+        
+        const char *sql2 = "SELECT * FROM \"" CUSTOMERS_NOCOLS_TABLE "\" ORDER BY first_name, \"" CUSTOMERS_TABLE_COLUMN_LASTNAME "\";";
+        if (do_compare_queries(db[0], sql2, db[i], sql2, -1, -1, print_result) == false) goto finalize;
+    }
+    
+    result = true;
+    
+finalize:
+    for (int i=0; i<2; ++i) if (blob[i]) cloudsync_memory_free(blob[i]);
+    for (int i=0; i<3; ++i) {
+        if (db[i]) close_db(db[i]);
+        if (cleanup_databases) {
+            char buf[256];
+            do_build_database_path(buf, i, timestamp, saved_counter++);
+            file_delete_internal(buf);
+        }
+    }
+    return result;
+}
+
+bool do_test_payload_codecs (bool print_result) {
+    sqlite3 *db[2] = {NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE codec_test (id TEXT PRIMARY KEY NOT NULL, name TEXT);"
+                                 "CREATE TABLE codec_blob (id TEXT PRIMARY KEY NOT NULL, data BLOB);"
+                                 "SELECT cloudsync_init('codec_test'); SELECT cloudsync_init('codec_blob');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    const char *encode_sql = "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes WHERE +tbl='codec_test';";
+    const char *decode_sql = "SELECT cloudsync_payload_decode(?);";
+    
+    // text only rows are compressible
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<2000) "
+                             "INSERT INTO codec_test (id, name) SELECT 'id' || i, 'name of the row number ' || i FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    const char *codecs[] = {"lz4", "lz4:16", "none"};
+    uint32_t expanded_size[3];
+    for (int i=0; i<3; ++i) {
+        char *sql = sqlite3_mprintf("SELECT cloudsync_set('payload_codec', '%q');", codecs[i]);
+        rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+        
+        blob = dbutils_blob_select(db[0], encode_sql, &blob_size, NULL, &rc);
+        if (!blob) goto finalize;
+        
+        // codec byte is right after the schema hash
+        memcpy(&expanded_size[i], blob + 8, sizeof(uint32_t));
+        uint8_t codec = (uint8_t)blob[26];
+        if (print_result) printf("codec %s: %d bytes\n", codecs[i], blob_size);
+        if ((i < 2 && (codec != 0 || expanded_size[i] == 0)) || (i == 2 && (codec != 1 || expanded_size[i] != 0))) goto finalize;
+        
+        const char *values[] = {blob};
+        int types[] = {SQLITE_BLOB};
+        int len[] = {blob_size};
+        if (dbutils_select(db[1], decode_sql, values, types, len, 1, SQLITE_INTEGER) != 2000) goto finalize;
+        
+        // an unknown codec must be rejected
+        if (i == 0) {
+            sqlite3_stmt *vm = NULL;
+            blob[26] = 99;
+            rc = sqlite3_prepare_v2(db[1], decode_sql, -1, &vm, NULL);
+            if (rc != SQLITE_OK) goto finalize;
+            sqlite3_bind_blob(vm, 1, blob, blob_size, SQLITE_STATIC);
+            rc = sqlite3_step(vm);
+            sqlite3_finalize(vm);
+            if (rc == SQLITE_ROW) goto finalize;
+        }
+        
+        cloudsync_memory_free(blob);
+        blob = NULL;
+    }
+    
+    // the codec of a single payload can be selected by cloudsync_payload_encode_with (the setting is still "none")
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode_with('lz4:4', tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes WHERE +tbl='codec_test';", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    if (blob[26] != 0) goto finalize;
+    {
+        uint32_t expanded = 0;
+        memcpy(&expanded, blob + 8, sizeof(uint32_t));
+        if (expanded == 0) goto finalize;
+        
+        const char *values[] = {blob};
+        int types[] = {SQLITE_BLOB};
+        int len[] = {blob_size};
+        if (dbutils_select(db[1], decode_sql, values, types, len, 1, SQLITE_INTEGER) != 2000) goto finalize;
+    }
+    cloudsync_memory_free(blob);
+    blob = dbutils_blob_select(db[0], encode_sql, &blob_size, NULL, &rc);
+    if (!blob || blob[26] != 1) goto finalize;
+    cloudsync_memory_free(blob);
+    blob = NULL;
+    
+    // random BLOBs are not compressible, so the sampling pre-check must skip compression
+    rc = sqlite3_exec(db[0], "SELECT cloudsync_set('payload_codec', 'lz4');"
+                             "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<64) "
+                             "INSERT INTO codec_blob (id, data) SELECT 'blob' || i, randomblob(16384) FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes WHERE +tbl='codec_blob';", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    if (blob[26] != 1) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    if (dbutils_select(db[1], decode_sql, values, types, len, 1, SQLITE_INTEGER) <= 0) goto finalize;
+    
+    if (do_compare_queries(db[0], "SELECT * FROM codec_test ORDER BY id;", db[1], "SELECT * FROM codec_test ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM codec_blob ORDER BY id;", db[1], "SELECT * FROM codec_blob ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    rc = SQLITE_OK;
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_codecs error: %s - %s\n", sqlite3_errmsg(db[0]), (db[1]) ? sqlite3_errmsg(db[1]) : "N/A");
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_blocks (int nthreads, bool print_result) {
+    sqlite3 *db[2] = {NULL, NULL};
+    char *blob = NULL;
+    char *blob2 = NULL;
+    int blob_size = 0;
+    int blob2_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        char *sql = sqlite3_mprintf("CREATE TABLE blocks_test (id TEXT PRIMARY KEY NOT NULL, name TEXT, note TEXT);"
+                                    "SELECT cloudsync_init('blocks_test'); SELECT cloudsync_set('payload_threads', '%d'); SELECT cloudsync_set('payload_version', '2');", nthreads);
+        rc = sqlite3_exec(db[i], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // a few MB of compressible rows, so that the payload is split into blocks
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<20000) "
+                             "INSERT INTO blocks_test (id, name, note) SELECT 'id' || i, 'name of the row number ' || i, printf('%.100c', char(65 + (i % 26))) || i FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    const char *encode_sql = "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;";
+    blob = dbutils_blob_select(db[0], encode_sql, &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    if (blob[26] != 2) goto finalize;
+    if (print_result) printf("blocks payload: %d bytes\n", blob_size);
+    
+    // the output must not depend on the number of threads
+    rc = sqlite3_exec(db[0], "SELECT cloudsync_set('payload_threads', '1');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    blob2 = dbutils_blob_select(db[0], encode_sql, &blob2_size, NULL, &rc);
+    if (!blob2 || blob_size != blob2_size || memcmp(blob, blob2, blob_size) != 0) goto finalize;
+    
+    // blocks are part of the v2 opt-in, the v1 payload of the same rows is a single LZ4 block
+    rc = sqlite3_exec(db[0], "SELECT cloudsync_set('payload_version', '1');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    int v1_size = 0;
+    char *v1_blob = dbutils_blob_select(db[0], encode_sql, &v1_size, NULL, &rc);
+    if (!v1_blob) goto finalize;
+    bool v1_single = (v1_blob[4] == 1 && v1_blob[26] == 0);
+    cloudsync_memory_free(v1_blob);
+    if (!v1_single) goto finalize;
+    
+    // a corrupted block table must be rejected
+    sqlite3_stmt *vm = NULL;
+    const char *decode_sql = "SELECT cloudsync_payload_decode(?);";
+    blob2[32 + 8] ^= 0x7F;
+    rc = sqlite3_prepare_v2(db[1], decode_sql, -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_bind_blob(vm, 1, blob2, blob2_size, SQLITE_STATIC);
+    rc = sqlite3_step(vm);
+    sqlite3_finalize(vm);
+    if (rc == SQLITE_ROW) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    if (dbutils_select(db[1], decode_sql, values, types, len, 1, SQLITE_INTEGER) != 20000 * 2) goto finalize;
+    
+    if (do_compare_queries(db[0], "SELECT * FROM blocks_test ORDER BY id;", db[1], "SELECT * FROM blocks_test ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    rc = SQLITE_OK;
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_blocks error: %s - %s\n", sqlite3_errmsg(db[0]), (db[1]) ? sqlite3_errmsg(db[1]) : "N/A");
+    if (blob) cloudsync_memory_free(blob);
+    if (blob2) cloudsync_memory_free(blob2);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_outbox (bool print_result) {
+    sqlite3 *db[2] = {NULL, NULL};
+    const char *path = "cloudsync_outbox_test.payload";
+    char *sql = NULL;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE outbox_test (id TEXT PRIMARY KEY NOT NULL, name TEXT);"
+                                 "SELECT cloudsync_init('outbox_test');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // first save encodes a new segment and advances the send position
+    rc = sqlite3_exec(db[0], "INSERT INTO outbox_test VALUES ('id1', 'name1'), ('id2', 'name2');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    sql = sqlite3_mprintf("SELECT cloudsync_payload_save('%q');", path);
+    rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT COUNT(*) FROM cloudsync_outbox;") != 1) goto finalize;
+    sqlite3_int64 segment_id = dbutils_int_select(db[0], "SELECT id FROM cloudsync_outbox;");
+    
+    // simulate a failed upload: the send position does not move, so the same segment is reused
+    rc = sqlite3_exec(db[0], "UPDATE cloudsync_settings SET value='0' WHERE key IN ('send_dbversion', 'send_seq');", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT id FROM cloudsync_outbox;") != segment_id) goto finalize;
+    
+    // new changes after a failed upload: pending segments are merged into a single payload
+    rc = sqlite3_exec(db[0], "UPDATE cloudsync_settings SET value='0' WHERE key IN ('send_dbversion', 'send_seq');"
+                             "INSERT INTO outbox_test VALUES ('id3', 'name3'); UPDATE outbox_test SET name='name1b' WHERE id='id1';", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT COUNT(*) FROM cloudsync_outbox;") != 1) goto finalize;
+    
+    char *load_sql = sqlite3_mprintf("SELECT cloudsync_payload_load('%q');", path);
+    rc = sqlite3_exec(db[1], load_sql, NULL, NULL, NULL);
+    sqlite3_free(load_sql);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM outbox_test ORDER BY id;", db[1], "SELECT * FROM outbox_test ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    // acknowledged segments are removed and only the new changes are encoded
+    rc = sqlite3_exec(db[0], "INSERT INTO outbox_test VALUES ('id4', 'name4');", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT COUNT(*) FROM cloudsync_outbox;") != 1) goto finalize;
+    
+    // the new segment contains only the last row
+    sqlite3_stmt *vm = NULL;
+    rc = sqlite3_prepare_v2(db[0], "SELECT payload FROM cloudsync_outbox;", -1, &vm, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (sqlite3_step(vm) == SQLITE_ROW) {
+        const char *values[] = {(const char *)sqlite3_column_blob(vm, 0)};
+        int types[] = {SQLITE_BLOB};
+        int len[] = {sqlite3_column_bytes(vm, 0)};
+        if (dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER) != 1) {
+            sqlite3_finalize(vm);
+            goto finalize;
+        }
+    }
+    sqlite3_finalize(vm);
+    if (do_compare_queries(db[0], "SELECT * FROM outbox_test ORDER BY id;", db[1], "SELECT * FROM outbox_test ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_outbox error: %s - %s\n", sqlite3_errmsg(db[0]), (db[1]) ? sqlite3_errmsg(db[1]) : "N/A");
+    if (sql) sqlite3_free(sql);
+    cloudsync_file_delete(path);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_table_lookup_bench (double lookups_per_sec[3], bool print_result) {
+    // time table_lookup with 1, 50 and 500 registered tables: the cost must not grow with the number of tables
+    #define LOOKUP_NTABLES  500
+    #define LOOKUP_COUNT    1000000
+    const int ntables[3] = {1, 50, LOOKUP_NTABLES};
+    char names[2][LOOKUP_NTABLES][32];
+    cloudsync_context *data = NULL;
+    sqlite3 *db = NULL;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    rc = sqlite3_open(":memory:", &db);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db, NULL, NULL);
+    
+    // the db_version query of cloudsync_init unions all the augmented tables (at most 500 terms in a compound SELECT),
+    // table_lookup needs only the meta tables, so the following ones are copies of the first one
+    for (int i=0; i<LOOKUP_NTABLES; ++i) {
+        snprintf(names[0][i], sizeof(names[0][i]), "lookup_%d", i);
+        snprintf(names[1][i], sizeof(names[1][i]), "LOOKUP_%d", i);
+        char *sql = sqlite3_mprintf("CREATE TABLE %s (id TEXT PRIMARY KEY NOT NULL, v);%s", names[0][i], (i == 0) ? " SELECT cloudsync_init('lookup_0');" : "");
+        rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+        if (i == 0) continue;
+        
+        sql = sqlite3_mprintf("SELECT replace(sql, '\"lookup_0_cloudsync\"', '\"%s_cloudsync\"') FROM sqlite_master WHERE name = 'lookup_0_cloudsync';", names[0][i]);
+        char *meta = dbutils_text_select(db, sql);
+        sqlite3_free(sql);
+        if (!meta) goto finalize;
+        rc = sqlite3_exec(db, meta, NULL, NULL, NULL);
+        cloudsync_memory_free(meta);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    for (int n=0; n<3; ++n) {
+        data = (cloudsync_context *)cloudsync_context_create();
+        if (!data) goto finalize;
+        for (int i=0; i<ntables[n]; ++i) {
+            if (table_add_to_context(db, data, table_algo_crdt_cls, names[0][i]) == false) goto finalize;
+        }
+        
+        // walk all the registered tables with mixed case names, so the last-hit cache does not help
+        int nfound = 0;
+        clock_t start = clock();
+        for (int i=0; i<LOOKUP_COUNT; ++i) {
+            if (table_lookup(data, names[i & 1][i % ntables[n]])) ++nfound;
+        }
+        double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+        if (nfound != LOOKUP_COUNT) goto finalize;
+        if (table_lookup(data, "lookup_missing")) goto finalize;
+        
+        lookups_per_sec[n] = (elapsed > 0) ? LOOKUP_COUNT / elapsed : 0;
+        if (print_result) printf("%d tables: %d lookups in %.3fs\n", ntables[n], LOOKUP_COUNT, elapsed);
+        
+        // removed tables must not be found anymore
+        void *table = table_lookup(data, names[1][0]);
+        if (table_remove(data, names[0][0]) != 0) goto finalize;
+        table_free(table);
+        if (table_lookup(data, names[0][0])) goto finalize;
+        
+        for (int i=1; i<ntables[n]; ++i) {
+            table = table_lookup(data, names[0][i]);
+            table_remove(data, names[0][i]);
+            table_free(table);
+        }
+        cloudsync_context_free(data);
+        data = NULL;
+    }
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db) printf("do_test_table_lookup_bench error: %s\n", sqlite3_errmsg(db));
+    if (data) {
+        for (int i=0; i<LOOKUP_NTABLES; ++i) {
+            void *table = table_lookup(data, names[0][i]);
+            if (!table) continue;
+            table_remove(data, names[0][i]);
+            table_free(table);
+        }
+        cloudsync_context_free(data);
+    }
+    if (db) close_db(db);
+    return result;
+    #undef LOOKUP_NTABLES
+    #undef LOOKUP_COUNT
+}
+
+bool do_test_payload_apply_bench (int nrows, double rows_per_sec[2], bool print_result) {
+    // apply the same payload through INSERT INTO cloudsync_changes (index 0) and through the direct path (index 1)
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE bench (id TEXT PRIMARY KEY NOT NULL, name TEXT, age INTEGER, score REAL);"
+                                 "SELECT cloudsync_init('bench');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    char *sql = sqlite3_mprintf("WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<%d) "
+                                "INSERT INTO bench (id, name, age, score) SELECT 'id' || i, 'name' || i, i %% 100, i * 0.5 FROM c;", nrows);
+    rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    for (int i=0; i<2; ++i) {
+        force_vtab_apply = (i == 0);
+        clock_t start = clock();
+        sqlite3_int64 napplied = dbutils_select(db[i+1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+        double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+        force_vtab_apply = false;
+        
+        if (napplied != nrows * 3) goto finalize;
+        rows_per_sec[i] = (elapsed > 0) ? napplied / elapsed : 0;
+        if (print_result) printf("apply %s: %lld rows in %.3fs\n", (i == 0) ? "vtab" : "direct", napplied, elapsed);
+        
+        if (do_compare_queries(db[0], "SELECT * FROM bench ORDER BY id;", db[i+1], "SELECT * FROM bench ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    }
+    
+    // both paths must produce the same metadata
+    if (do_compare_queries(db[1], "SELECT * FROM bench_cloudsync ORDER BY pk, col_name;", db[2], "SELECT * FROM bench_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_bench error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<3; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_apply_locality (bool print_result) {
+    // apply the same interleaved payload change by change (db[1]) and decoded first in a single savepoint (db[2])
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE loc1 (id INTEGER NOT NULL, part TEXT NOT NULL DEFAULT 'a', name TEXT, qty INTEGER, PRIMARY KEY (id, part));"
+                                 "CREATE TABLE loc2 (code TEXT PRIMARY KEY NOT NULL, label TEXT);"
+                                 "SELECT cloudsync_init('loc1'); SELECT cloudsync_init('loc2');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    rc = sqlite3_exec(db[2], "SELECT cloudsync_set('payload_apply_locality', '1');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // changes of the same rows spread across many transactions and both tables
+    for (int i=0; i<20; ++i) {
+        char *sql = sqlite3_mprintf("INSERT INTO loc1 (id, name, qty) VALUES (%d, 'name%d', %d) ON CONFLICT (id, part) DO UPDATE SET qty=qty+1;"
+                                    "INSERT INTO loc2 (code, label) VALUES ('c%d', 'label%d') ON CONFLICT DO UPDATE SET label=label || '+';"
+                                    "UPDATE loc1 SET name='upd%d' WHERE id=%d;", i % 7, i, i, i % 5, i, i, (i + 3) % 7);
+        rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+        
+        if (i == 10) rc = sqlite3_exec(db[0], "DELETE FROM loc1 WHERE id=2; DELETE FROM loc2 WHERE code='c3';", NULL, NULL, NULL);
+        if (i == 15) rc = sqlite3_exec(db[0], "INSERT INTO loc1 (id, name, qty) VALUES (2, 'back', 0);", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    for (int i=1; i<3; ++i) {
+        // the second apply must be a no-op
+        for (int j=0; j<2; ++j) {
+            sqlite3_int64 napplied = dbutils_select(db[i], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+            if (napplied <= 0) goto finalize;
+        }
+        
+        if (do_compare_queries(db[0], "SELECT * FROM loc1 ORDER BY id;", db[i], "SELECT * FROM loc1 ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+        if (do_compare_queries(db[0], "SELECT * FROM loc2 ORDER BY code;", db[i], "SELECT * FROM loc2 ORDER BY code;", -1, -1, print_result) == false) goto finalize;
+    }
+    
+    // local db_version values depend on the savepoints used during the apply, clocks must not
+    if (do_compare_queries(db[1], "SELECT pk, col_name, col_version FROM loc1_cloudsync ORDER BY pk, col_name;", db[2], "SELECT pk, col_name, col_version FROM loc1_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[1], "SELECT pk, col_name, col_version FROM loc2_cloudsync ORDER BY pk, col_name;", db[2], "SELECT pk, col_name, col_version FROM loc2_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    
+    // the check position must refer to the last change of the payload in both cases
+    if (do_compare_queries(db[1], "SELECT value FROM cloudsync_settings WHERE key='check_dbversion' OR key='check_seq' ORDER BY key;", db[2], "SELECT value FROM cloudsync_settings WHERE key='check_dbversion' OR key='check_seq' ORDER BY key;", -1, -1, print_result) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_locality error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<3; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_apply_locality_fk (bool print_result) {
+    // the locality apply keeps the payload order: items sorts before orders by name and its foreign key requires
+    // the rows of orders to be applied first, the children of nodes sort before their parents by primary key
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "PRAGMA foreign_keys = ON;"
+                                 "CREATE TABLE orders (id TEXT PRIMARY KEY NOT NULL, note TEXT);"
+                                 "CREATE TABLE items (id TEXT PRIMARY KEY NOT NULL, order_id TEXT REFERENCES orders(id), qty INTEGER);"
+                                 "CREATE TABLE nodes (id TEXT PRIMARY KEY NOT NULL, parent TEXT REFERENCES nodes(id));"
+                                 "SELECT cloudsync_init('orders'); SELECT cloudsync_init('items'); SELECT cloudsync_init('nodes');"
+                                 "SELECT cloudsync_set('payload_apply_locality', '1');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<5) INSERT INTO orders (id, note) SELECT 'o' || i, 'order' || i FROM n;"
+                             "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<20) INSERT INTO items (id, order_id, qty) SELECT 'i' || i, 'o' || (1 + i % 5), i FROM n;"
+                             "INSERT INTO nodes (id, parent) VALUES ('z', NULL), ('m', 'z'), ('a', 'm');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    const char *check_sql = "SELECT count(*) FROM cloudsync_settings WHERE key='check_dbversion';";
+    
+    // the target refuses one of the items, a rejected change is skipped and the check position advances anyway
+    rc = sqlite3_exec(db[2], "CREATE TRIGGER items_reject BEFORE INSERT ON items WHEN NEW.id = 'i7' BEGIN SELECT RAISE(ABORT, 'item rejected'); END;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    dbutils_select(db[2], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    if (dbutils_int_select(db[2], check_sql) != 1) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM items;") != 19) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM nodes;") != 3) goto finalize;
+    
+    // every change is applied, the check position advances
+    if (dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER) <= 0) goto finalize;
+    if (dbutils_int_select(db[1], "PRAGMA foreign_key_check;") != 0) goto finalize;
+    if (dbutils_int_select(db[1], check_sql) != 1) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM items ORDER BY id;", db[1], "SELECT * FROM items ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM orders ORDER BY id;", db[1], "SELECT * FROM orders ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM nodes ORDER BY id;", db[1], "SELECT * FROM nodes ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    // deletes follow the same rule: the items of an order are deleted before the order, the children before their parent
+    rc = sqlite3_exec(db[0], "DELETE FROM items WHERE order_id = 'o2'; DELETE FROM orders WHERE id = 'o2'; DELETE FROM nodes WHERE id = 'a'; DELETE FROM nodes WHERE id = 'm';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (do_merge_using_payload(db[0], db[1], true, true) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM items ORDER BY id;", db[1], "SELECT * FROM items ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM orders ORDER BY id;", db[1], "SELECT * FROM orders ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM nodes ORDER BY id;", db[1], "SELECT * FROM nodes ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_locality_fk error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<3; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_merge_clock (bool print_result) {
+    // db[1] applies the payloads directly (clock snapshot), db[2] through INSERT INTO cloudsync_changes
+    // the remote changes of db[0] and db[3] conflict on the same columns and rows
+    sqlite3 *db[4] = {NULL, NULL, NULL, NULL};
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<4; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE clk (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER, c REAL, d BLOB);"
+                                 "SELECT cloudsync_init('clk');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<30) "
+                             "INSERT INTO clk (id, a, b, c, d) SELECT 'k' || i, 'a' || i, i, i * 0.25, randomblob(8) FROM n;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // every database starts from the same rows
+    for (int i=1; i<4; ++i) {
+        if (do_merge_using_payload(db[0], db[i], false, true) == false) goto finalize;
+    }
+    
+    rc = sqlite3_exec(db[0], "UPDATE clk SET a = 'zero' || b WHERE b % 2 = 0; UPDATE clk SET b = b + 100 WHERE b % 3 = 0;"
+                             "DELETE FROM clk WHERE b IN (5, 7, 11);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rc = sqlite3_exec(db[3], "UPDATE clk SET a = 'three' || b WHERE b % 4 = 0; UPDATE clk SET c = -c, d = NULL WHERE b < 15;"
+                             "DELETE FROM clk WHERE b IN (7, 20); INSERT INTO clk (id, a, b) VALUES ('k20', 'back', 20);"
+                             "UPDATE clk SET a = 'again' WHERE id = 'k20';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    for (int i=1; i<3; ++i) {
+        force_vtab_apply = (i == 2);
+        bool merged = do_merge_using_payload(db[3], db[i], false, true) && do_merge_using_payload(db[0], db[i], false, true);
+        force_vtab_apply = false;
+        if (!merged) goto finalize;
+    }
+    
+    if (do_compare_queries(db[1], "SELECT * FROM clk ORDER BY id;", db[2], "SELECT * FROM clk ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[1], "SELECT * FROM clk_cloudsync ORDER BY pk, col_name;", db[2], "SELECT * FROM clk_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    force_vtab_apply = false;
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_merge_clock error: %s\n", sqlite3_errmsg(db[0]));
+    for (int i=0; i<4; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+int do_test_count_release (unsigned int type, void *ctx, void *p, void *x) {
+    // count the savepoints released by cloudsync_payload_apply
+    const char *sql = sqlite3_sql((sqlite3_stmt *)p);
+    if (sql && strcmp(sql, "RELEASE cloudsync_payload_apply;") == 0) *(int *)ctx += 1;
+    return 0;
+}
+
+bool do_test_payload_apply_batch (bool print_result) {
+    // apply the same payload with the different batching policies
+    const char *policies[] = {"version", "rows:50", "ms:600000", "payload"};
+    int npolicies = sizeof(policies) / sizeof(policies[0]);
+    sqlite3 *db[5] = {NULL, NULL, NULL, NULL, NULL};
+    int nreleases[5] = {0};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<=npolicies; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE batch (id TEXT PRIMARY KEY NOT NULL, value INTEGER);"
+                                 "SELECT cloudsync_init('batch');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        if (i == 0) continue;
+        
+        char *sql = sqlite3_mprintf("SELECT cloudsync_set('payload_apply_batch', '%q');", policies[i-1]);
+        rc = sqlite3_exec(db[i], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+        
+        sqlite3_trace_v2(db[i], SQLITE_TRACE_STMT, do_test_count_release, &nreleases[i]);
+    }
+    
+    // 200 small transactions (one db_version each)
+    for (int i=0; i<200; ++i) {
+        char *sql = sqlite3_mprintf("INSERT INTO batch (id, value) VALUES ('id%d', %d) ON CONFLICT DO UPDATE SET value=excluded.value;", i % 120, i);
+        rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    for (int i=1; i<=npolicies; ++i) {
+        sqlite3_int64 napplied = dbutils_select(db[i], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+        if (napplied <= 0) goto finalize;
+        if (print_result) printf("%s: %d savepoints\n", policies[i-1], nreleases[i]);
+        
+        if (do_compare_queries(db[0], "SELECT * FROM batch ORDER BY id;", db[i], "SELECT * FROM batch ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+        if (do_compare_queries(db[1], "SELECT value FROM cloudsync_settings WHERE key='check_dbversion' OR key='check_seq' ORDER BY key;", db[i], "SELECT value FROM cloudsync_settings WHERE key='check_dbversion' OR key='check_seq' ORDER BY key;", -1, -1, print_result) == false) goto finalize;
+    }
+    
+    // the last 120 changes have distinct db_versions
+    if (nreleases[1] < 120) goto finalize;
+    if (nreleases[2] >= nreleases[1] || nreleases[2] < 2) goto finalize;
+    if (nreleases[3] != 1 || nreleases[4] != 1) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_batch error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<=npolicies; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_load_pipeline (bool print_result) {
+    // load several payload files with a single call (pipelined) and one at a time
+    const char *paths[] = {"cloudsync_pipeline_test0.payload", "cloudsync_pipeline_test1.payload", "cloudsync_pipeline_test2.payload"};
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE pipeline (id TEXT PRIMARY KEY NOT NULL, body TEXT);"
+                                 "SELECT cloudsync_init('pipeline'); SELECT cloudsync_set('payload_version', '2');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // one payload file for each db_version range, the second one is large enough to be split in blocks
+    for (int i=0; i<3; ++i) {
+        sqlite3_int64 from_version = dbutils_int_select(db[0], "SELECT cloudsync_db_version();");
+        char *sql = sqlite3_mprintf("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<%d) "
+                                    "INSERT OR REPLACE INTO pipeline (id, body) SELECT 'id' || (i %% 500), printf('%d-%%d-%%.*c', i, %d, 'x') FROM n;",
+                                    (i == 1) ? 3000 : 200, i, (i == 1) ? 1500 : 10);
+        rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+        
+        int blob_size = 0;
+        sql = sqlite3_mprintf("SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes WHERE db_version > %lld;", from_version);
+        char *blob = dbutils_blob_select(db[0], sql, &blob_size, NULL, &rc);
+        sqlite3_free(sql);
+        if (!blob) goto finalize;
+        
+        bool written = cloudsync_file_write(paths[i], blob, (size_t)blob_size);
+        cloudsync_memory_free(blob);
+        if (!written) goto finalize;
+    }
+    
+    char *sql = sqlite3_mprintf("SELECT cloudsync_payload_load('%q', '%q', '%q');", paths[0], paths[1], paths[2]);
+    sqlite3_int64 nrows = dbutils_int_select(db[1], sql);
+    sqlite3_free(sql);
+    
+    sqlite3_int64 nrows2 = 0;
+    for (int i=0; i<3; ++i) {
+        sql = sqlite3_mprintf("SELECT cloudsync_payload_load('%q');", paths[i]);
+        nrows2 += dbutils_int_select(db[2], sql);
+        sqlite3_free(sql);
+    }
+    if (print_result) printf("pipelined load: %lld rows, sequential load: %lld rows\n", nrows, nrows2);
+    if (nrows <= 0 || nrows != nrows2) goto finalize;
+    
+    for (int i=1; i<3; ++i) {
+        if (do_compare_queries(db[0], "SELECT * FROM pipeline ORDER BY id;", db[i], "SELECT * FROM pipeline ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    }
+    
+    // a missing file stops the load with an error
+    sql = sqlite3_mprintf("SELECT cloudsync_payload_load('%q', 'cloudsync_pipeline_missing.payload', '%q');", paths[0], paths[1]);
+    rc = sqlite3_exec(db[1], sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    if (rc == SQLITE_OK) goto finalize;
+    
+    rc = SQLITE_OK;
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_load_pipeline error: %s\n", sqlite3_errmsg(db[0]));
+    for (int i=0; i<3; ++i) {
+        cloudsync_file_delete(paths[i]);
+        if (db[i]) close_db(db[i]);
+    }
+    return result;
+}
+
+bool do_test_payload_stream (int nthreads, bool print_result) {
+    // apply a large block payload decompressed while its rows are decoded (db[1]) and fully expanded (db[2])
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        char *sql = sqlite3_mprintf("CREATE TABLE stream1 (id TEXT PRIMARY KEY NOT NULL, body TEXT, data BLOB);"
+                                    "CREATE TABLE stream2 (id TEXT PRIMARY KEY NOT NULL, value INTEGER);"
+                                    "SELECT cloudsync_init('stream1'); SELECT cloudsync_init('stream2'); SELECT cloudsync_set('payload_threads', '%d');"
+                                    "SELECT cloudsync_set('payload_version', '2');", nthreads);
+        rc = sqlite3_exec(db[i], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // rows of both tables are interleaved, so new dictionary entries and pks cross the block boundaries,
+    // and a single value larger than a block forces the window to grow
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<4000) "
+                             "INSERT INTO stream1 (id, body) SELECT 'id' || i, printf('%d-%.*c', i, 900, 'x') FROM n;"
+                             "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<4000) "
+                             "INSERT INTO stream2 (id, value) SELECT 'id' || i, i * 7 FROM n;"
+                             "UPDATE stream1 SET data = randomblob(1500000) WHERE id = 'id2000';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes ORDER BY db_version, seq, pk;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    for (int i=1; i<3; ++i) {
+        force_stream_apply = (i == 1);
+        sqlite3_int64 napplied = dbutils_select(db[i], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+        force_stream_apply = false;
+        if (print_result) printf("stream %d: %lld rows\n", i, napplied);
+        if (napplied <= 0) goto finalize;
+        
+        if (do_compare_queries(db[0], "SELECT * FROM stream1 ORDER BY id;", db[i], "SELECT * FROM stream1 ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+        if (do_compare_queries(db[0], "SELECT * FROM stream2 ORDER BY id;", db[i], "SELECT * FROM stream2 ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    }
+    if (do_compare_queries(db[1], "SELECT * FROM stream1_cloudsync ORDER BY pk, col_name;", db[2], "SELECT * FROM stream1_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    
+    // a truncated payload is rejected
+    len[0] = blob_size - 100;
+    force_stream_apply = true;
+    sqlite3_int64 napplied = dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    force_stream_apply = false;
+    if (napplied > 0) goto finalize;
+    
+    rc = SQLITE_OK;
+    result = true;
+    
+finalize:
+    force_stream_apply = false;
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_stream error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<3; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+int do_test_count_begin_immediate (unsigned int type, void *ctx, void *p, void *x) {
+    // count the write transactions opened by the parallel apply
+    const char *sql = sqlite3_sql((sqlite3_stmt *)p);
+    if (sql && strcmp(sql, "BEGIN IMMEDIATE;") == 0) *(int *)ctx += 1;
+    return 0;
+}
+
+bool do_test_payload_inspection (bool print_result) {
+    // payloads are decoded by cloudsync_payload_rows and cloudsync_payload_info without applying them,
+    // the second payload is large enough to use compressed blocks and it is decoded while decompressed
+    sqlite3 *db[2] = {NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+    }
+    
+    // db[1] has no synced tables, payloads are inspected without checking the schema
+    rc = sqlite3_exec(db[0], "CREATE TABLE insp1 (id TEXT PRIMARY KEY NOT NULL, body TEXT, score REAL, data BLOB);"
+                             "CREATE TABLE insp2 (id TEXT PRIMARY KEY NOT NULL, value INTEGER);"
+                             "SELECT cloudsync_init('insp1'); SELECT cloudsync_init('insp2'); SELECT cloudsync_set('payload_version', '2');"
+                             "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<50) "
+                             "INSERT INTO insp1 (id, body, score, data) SELECT 'id' || i, 'body' || i, i / 3.0, randomblob(8) FROM n;"
+                             "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<20) INSERT INTO insp2 (id, value) SELECT 'id' || i, i * 7 FROM n;"
+                             "DELETE FROM insp1 WHERE id IN ('id1', 'id2', 'id3');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    for (int step=0; step<2; ++step) {
+        if (step == 1) {
+            rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<3000) "
+                                     "INSERT INTO insp1 (id, body) SELECT 'big' || i, printf('%d-%.*c', i, 900, 'x') FROM n;", NULL, NULL, NULL);
+            if (rc != SQLITE_OK) goto finalize;
+        }
+        
+        if (blob) cloudsync_memory_free(blob);
+        blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+        if (!blob) goto finalize;
+        sqlite3_int64 nchanges = dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;");
+        
+        const char *values[] = {blob};
+        int types[] = {SQLITE_BLOB};
+        int len[] = {blob_size};
+        force_stream_apply = (step == 1);
+        
+        // every change is decoded with the same values returned by cloudsync_changes
+        sqlite3_int64 nrows = dbutils_select(db[1], "SELECT count(*) FROM cloudsync_payload_rows(?);", values, types, len, 1, SQLITE_INTEGER);
+        sqlite3_int64 nmissing = dbutils_select(db[0], "SELECT count(*) FROM (SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM cloudsync_changes "
+                                                       "EXCEPT SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM cloudsync_payload_rows(?));", values, types, len, 1, SQLITE_INTEGER);
+        
+        // the header row contains the totals, the table rows the same counts of cloudsync_changes
+        sqlite3_int64 nheader = dbutils_select(db[1], "SELECT count(*) FROM cloudsync_payload_info(?1) WHERE tbl IS NULL AND version = 2 AND ncols = 9 AND size = length(?1) "
+                                                      "AND nbytes = expanded_size AND nbytes = (SELECT sum(nbytes) FROM cloudsync_payload_rows(?1));", values, types, len, 1, SQLITE_INTEGER);
+        sqlite3_int64 codec = dbutils_select(db[1], "SELECT codec FROM cloudsync_payload_info(?) WHERE tbl IS NULL;", values, types, len, 1, SQLITE_INTEGER);
+        sqlite3_int64 ntables = dbutils_select(db[0], "WITH c AS MATERIALIZED (SELECT tbl, count(*) AS n FROM cloudsync_changes GROUP BY tbl) "
+                                                      "SELECT count(*) FROM cloudsync_payload_info(?) AS i JOIN c ON c.tbl = i.tbl WHERE i.version IS NULL AND i.nrows = c.n;", values, types, len, 1, SQLITE_INTEGER);
+        force_stream_apply = false;
+        
+        if (print_result) printf("inspection %d: %lld/%lld rows, %lld missing, codec %lld, %lld tables\n", step, nrows, nchanges, nmissing, codec, ntables);
+        if (nrows != nchanges || nmissing != 0 || nheader != 1 || ntables != 2) goto finalize;
+        if (codec != ((step == 0) ? 0 : 2)) goto finalize;
+    }
+    
+    // payloads that cannot be decoded are reported as errors
+    if (sqlite3_exec(db[1], "SELECT * FROM cloudsync_payload_rows('not a payload');", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    if (sqlite3_exec(db[1], "SELECT * FROM cloudsync_payload_info(zeroblob(64));", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_payload_rows(NULL);") != 0) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_inspection error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_apply_stats_callback (void **xdata, cloudsync_pk_decode_bind_context *d, sqlite3 *db, cloudsync_context *data, int step, int rc) {
+    // reject every change of the st2 table
+    if (step != CLOUDSYNC_PAYLOAD_APPLY_WILL_APPLY) return true;
+    int64_t tbl_len = 0;
+    char *tbl = cloudsync_pk_context_tbl(d, &tbl_len);
+    return !(tbl_len == 3 && strncmp(tbl, "st2", 3) == 0);
+}
+
+bool do_test_payload_apply_stats_check (sqlite3 *db, const char *tbl, int64_t expected[], int nexpected, bool print_result) {
+    // compare the counters (seen...failed) of a row of cloudsync_last_apply_stats with the expected values, -1 means any value
+    sqlite3_stmt *stmt = NULL;
+    bool result = false;
+    
+    const char *sql = (tbl) ? "SELECT seen, applied, lost, equal, resurrected, deleted, rejected, failed FROM cloudsync_last_apply_stats() WHERE tbl=?;" :
+                              "SELECT seen, applied, lost, equal, resurrected, deleted, rejected, failed FROM cloudsync_last_apply_stats() WHERE tbl IS NULL;";
+    int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (tbl) sqlite3_bind_text(stmt, 1, tbl, -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) != SQLITE_ROW) goto finalize;
+    
+    result = true;
+    for (int i=0; i<nexpected; ++i) {
+        int64_t value = sqlite3_column_int64(stmt, i);
+        if (print_result) printf("%s%lld", (i) ? ", " : "stats: ", (long long)value);
+        if (expected[i] >= 0 && expected[i] != value) result = false;
+    }
+    if (print_result) printf(" (%s)\n", (tbl) ? tbl : "totals");
+    
+finalize:
+    if (stmt) sqlite3_finalize(stmt);
+    return result;
+}
+
+bool do_test_payload_apply_stats (bool print_result) {
+    sqlite3 *db[2] = {NULL, NULL};
+    char *blob[2] = {NULL, NULL};
+    int blob_size[2] = {0, 0};
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE st1 (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER); CREATE TABLE st2 (id TEXT PRIMARY KEY NOT NULL, v TEXT);"
+                                 "SELECT cloudsync_init('st1'); SELECT cloudsync_init('st2');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // the target rejects the insert of one row, the error must be collected instead of aborting the apply
+    rc = sqlite3_exec(db[1], "CREATE TRIGGER st2_reject BEFORE INSERT ON st2 WHEN NEW.id = 'v3' BEGIN SELECT RAISE(ABORT, 'st2 row rejected'); END;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<20) INSERT INTO st1 (id, a, b) SELECT 'k' || i, 'a' || i, i FROM n;"
+                             "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<10) INSERT INTO st2 (id, v) SELECT 'v' || i, 'value' || i FROM n;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    blob[0] = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size[0], NULL, &rc);
+    if (!blob[0]) goto finalize;
+    sqlite3_int64 db_version = dbutils_int_select(db[0], "SELECT cloudsync_db_version();");
+    
+    const char *values[] = {blob[0]};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size[0]};
+    
+    // nothing has been applied yet
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_last_apply_stats() WHERE tbl IS NOT NULL;") != 0) goto finalize;
+    
+    // initial apply: 40 st1 changes and 10 st2 changes, one of them fails
+    dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    int64_t initial_st1[] = {40, 40, 0, 0, 0, 0, 0, 0};
+    int64_t initial_st2[] = {10, 9, 0, 0, 0, 0, 0, 1};
+    int64_t initial_totals[] = {50, 49, 0, 0, 0, 0, 0, 1};
+    if (!do_test_payload_apply_stats_check(db[1], "st1", initial_st1, 8, print_result)) goto finalize;
+    if (!do_test_payload_apply_stats_check(db[1], "st2", initial_st2, 8, print_result)) goto finalize;
+    if (!do_test_payload_apply_stats_check(db[1], NULL, initial_totals, 8, print_result)) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_last_apply_stats() WHERE tbl IS NULL AND savepoints >= 1 AND decode_us >= 0 AND merge_us >= 0 AND errors LIKE '%st2 row rejected%';") != 1) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_last_apply_stats() WHERE tbl IS NOT NULL AND decode_us IS NULL AND errors IS NULL;") != 2) goto finalize;
+    
+    // the same payload again: everything is equal except the failed row
+    dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    int64_t equal_totals[] = {50, -1, 0, 49, 0, 0, 0, 1};
+    if (!do_test_payload_apply_stats_check(db[1], NULL, equal_totals, 8, print_result)) goto finalize;
+    
+    // remote updates and deletes, two of the updates lose against newer local changes
+    rc = sqlite3_exec(db[0], "UPDATE st1 SET a = 'remote' WHERE b <= 5; DELETE FROM st1 WHERE b > 17;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "UPDATE st1 SET a = 'local1' WHERE b <= 2; UPDATE st1 SET a = 'local2' WHERE b <= 2;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    char *sql = sqlite3_mprintf("SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes WHERE db_version > %lld;", db_version);
+    blob[1] = dbutils_blob_select(db[0], sql, &blob_size[1], NULL, &rc);
+    sqlite3_free(sql);
+    if (!blob[1]) goto finalize;
+    
+    values[0] = blob[1];
+    len[0] = blob_size[1];
+    dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    int64_t update_st1[] = {8, 6, 2, 0, 0, 3, 0, 0};
+    if (!do_test_payload_apply_stats_check(db[1], "st1", update_st1, 8, print_result)) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_last_apply_stats() WHERE tbl IS NULL AND errors IS NULL;") != 1) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_last_apply_stats() WHERE tbl = 'st2';") != 0) goto finalize;
+    
+    // changes refused by the payload apply callback are counted as rejected
+    cloudsync_set_payload_apply_callback(db[1], do_test_payload_apply_stats_callback);
+    values[0] = blob[0];
+    len[0] = blob_size[0];
+    dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    int64_t rejected_st2[] = {10, 0, 0, 0, 0, 0, 10, 0};
+    if (!do_test_payload_apply_stats_check(db[1], "st2", rejected_st2, 8, print_result)) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_stats error: %s\n", sqlite3_errmsg(db[0]));
+    for (int i=0; i<2; ++i) if (blob[i]) cloudsync_memory_free(blob[i]);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_apply_checkpoint (bool print_result) {
+    // an apply interrupted after a checkpoint restarts from the first row not yet applied
+    sqlite3 *db[2] = {NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE ck (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER); SELECT cloudsync_init('ck');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // 100 db_versions of 60 changes each
+    for (int i=0; i<100; ++i) {
+        char *sql = sqlite3_mprintf("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<30) "
+                                    "INSERT INTO ck (id, a, b) SELECT 'k%d-' || i, 'a' || i, i FROM n;", i);
+        rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    
+    // the first checkpoint is written after 4096 rows, at the end of the db_version (row 4140),
+    // the following db_versions are committed without a checkpoint and the one interrupted at row 5000 is rolled back
+    force_apply_interrupt_row = 5000;
+    sqlite3_int64 napplied = dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    force_apply_interrupt_row = 0;
+    if (napplied > 0) goto finalize;
+    
+    sqlite3_int64 nrows = dbutils_int_select(db[1], "SELECT count(*) FROM ck;");
+    sqlite3_int64 ncheckpoints = dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_settings WHERE key='apply_checkpoint' AND value LIKE '%:4140';");
+    if (print_result) printf("checkpoint: %lld rows applied, %lld checkpoints\n", nrows, ncheckpoints);
+    if (nrows != 2490 || ncheckpoints != 1) goto finalize;
+    
+    // the retry merges only the rows after the checkpoint, the ones committed after it are equal
+    napplied = dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    if (napplied != 6000) goto finalize;
+    
+    int64_t expected[] = {1860, 1020, 0, 840, 0, 0, 0, 0};
+    if (!do_test_payload_apply_stats_check(db[1], NULL, expected, 8, print_result)) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_settings WHERE key='apply_checkpoint';") != 0) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM ck ORDER BY id;", db[1], "SELECT * FROM ck ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT CAST(value AS INTEGER) FROM cloudsync_settings WHERE key='check_dbversion';") != dbutils_int_select(db[0], "SELECT cloudsync_db_version();")) goto finalize;
+    
+    result = true;
+    
+finalize:
+    force_apply_interrupt_row = 0;
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_checkpoint error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_apply_step (bool print_result) {
+    // a payload applied in time-sliced steps, local writes are interleaved between the steps
+    sqlite3 *db[4] = {NULL, NULL, NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<4; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE steps (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER); SELECT cloudsync_init('steps');"
+                                 "CREATE TABLE local_writes (id INTEGER PRIMARY KEY, value TEXT);", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // 100 db_versions of 60 changes each
+    for (int i=0; i<100; ++i) {
+        char *sql = sqlite3_mprintf("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<30) "
+                                    "INSERT INTO steps (id, a, b) SELECT 's%d-' || i, 'a' || i, i FROM n;", i);
+        rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    
+    // a budget of 1000 rows stops at the end of the following db_version,
+    // also when the batching policy never releases the savepoint by itself (db[3])
+    rc = sqlite3_exec(db[3], "SELECT cloudsync_set('payload_apply_batch', 'payload');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    int nsteps = 0;
+    sqlite3_int64 token = 0;
+    for (int i=1; i<4; i+=2) {
+        nsteps = 0;
+        do {
+            token = dbutils_select(db[i], "SELECT cloudsync_payload_apply_step(?, 0, 1000);", values, types, len, 1, SQLITE_INTEGER);
+            if (print_result) printf("db%d step %d: token %lld\n", i, nsteps, token);
+            if (token != ((nsteps < 5) ? (nsteps + 1) * 1020 : 0)) goto finalize;
+            if (token && dbutils_int_select(db[i], "SELECT count(*) FROM steps;") != token / 2) goto finalize;
+            
+            // the write lock is not held between the steps
+            if (sqlite3_get_autocommit(db[i]) == 0) goto finalize;
+            rc = sqlite3_exec(db[i], "INSERT INTO local_writes (value) VALUES ('interleaved');", NULL, NULL, NULL);
+            if (rc != SQLITE_OK) goto finalize;
+            ++nsteps;
+        } while (token > 0 && nsteps < 100);
+        if (nsteps != 6) goto finalize;
+    }
+    
+    // time budget (the last step always returns 0)
+    nsteps = 0;
+    do {
+        token = dbutils_select(db[2], "SELECT cloudsync_payload_apply_step(?, 1);", values, types, len, 1, SQLITE_INTEGER);
+        ++nsteps;
+    } while (token > 0 && nsteps < 10000);
+    if (print_result) printf("time budget: %d steps\n", nsteps);
+    if (token != 0) goto finalize;
+    
+    for (int i=1; i<4; ++i) {
+        if (do_compare_queries(db[0], "SELECT * FROM steps ORDER BY id;", db[i], "SELECT * FROM steps ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+        if (dbutils_int_select(db[i], "SELECT count(*) FROM cloudsync_settings WHERE key='apply_checkpoint';") != 0) goto finalize;
+        if (dbutils_int_select(db[i], "SELECT CAST(value AS INTEGER) FROM cloudsync_settings WHERE key='check_dbversion';") != 100) goto finalize;
+    }
+    
+    // a step of an already applied payload applies it again (all the changes are equal)
+    if (dbutils_select(db[1], "SELECT cloudsync_payload_apply_step(?, 0);", values, types, len, 1, SQLITE_INTEGER) != 0) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT equal FROM cloudsync_last_apply_stats() WHERE tbl IS NULL;") != 6000) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_step error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<4; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_merge_wide_table (bool print_result) {
+    // merge a 180 columns table into a schema that declares the same columns with a different case
+    #define WIDE_NCOLS  180
+    sqlite3 *db[2] = {NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        char *sql = sqlite3_mprintf("CREATE TABLE wide (id TEXT PRIMARY KEY NOT NULL");
+        for (int j=0; j<WIDE_NCOLS; ++j) {
+            char *tmp = sqlite3_mprintf((i == 0) ? "%s, col_%d" : "%s, COL_%d", sql, j);
+            sqlite3_free(sql);
+            sql = tmp;
+        }
+        char *tmp = sqlite3_mprintf("%s); SELECT cloudsync_init('wide');", sql);
+        sqlite3_free(sql);
+        rc = sqlite3_exec(db[i], tmp, NULL, NULL, NULL);
+        sqlite3_free(tmp);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // one insert with all the columns, then an update of every other column
+    char *sql = sqlite3_mprintf("INSERT INTO wide (id) VALUES ('row1')");
+    for (int j=0; j<WIDE_NCOLS; j+=2) {
+        char *tmp = sqlite3_mprintf("%s; UPDATE wide SET col_%d = %d * 10 WHERE id='row1'", sql, j, j);
+        sqlite3_free(sql);
+        sql = tmp;
+    }
+    rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    sqlite3_int64 nchanges = dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;");
+    sqlite3_int64 napplied = dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    if (napplied != nchanges || nchanges < WIDE_NCOLS) {
+        if (print_result) printf("do_test_merge_wide_table: %lld changes applied, expected %lld\n", napplied, nchanges);
+        goto finalize;
+    }
+    
+    if (do_compare_queries(db[0], "SELECT * FROM wide ORDER BY id;", db[1], "SELECT * FROM wide ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT pk, lower(col_name), col_version FROM wide_cloudsync ORDER BY pk, lower(col_name);", db[1], "SELECT pk, lower(col_name), col_version FROM wide_cloudsync ORDER BY pk, lower(col_name);", -1, -1, print_result) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_merge_wide_table error: %s - %s\n", sqlite3_errmsg(db[0]), (db[1]) ? sqlite3_errmsg(db[1]) : "N/A");
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+    #undef WIDE_NCOLS
+}
+
+bool do_test_merge_siteid_cache (bool print_result) {
+    // winner clocks of known sites must not write cloudsync_site_id, and an ordinal undone by a ROLLBACK TO must not be reused
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *blob[2] = {NULL, NULL};
+    int blob_size[2] = {0};
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE sites (id TEXT PRIMARY KEY NOT NULL, v);"
+                                 "SELECT cloudsync_init('sites');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // count the writes to the site table of the receiving database
+    rc = sqlite3_exec(db[2], "CREATE TEMP TABLE site_writes (n INTEGER);"
+                             "CREATE TEMP TRIGGER site_update AFTER UPDATE ON cloudsync_site_id BEGIN INSERT INTO site_writes VALUES (1); END;"
+                             "CREATE TEMP TRIGGER site_insert AFTER INSERT ON cloudsync_site_id BEGIN INSERT INTO site_writes VALUES (1); END;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<50) INSERT INTO sites SELECT 'a' || i, i FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[1], "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<50) INSERT INTO sites SELECT 'b' || i, i FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    for (int i=0; i<2; ++i) {
+        blob[i] = dbutils_blob_select(db[i], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size[i], NULL, &rc);
+        if (!blob[i]) goto finalize;
+    }
+    
+    // first apply: one new site, a single write
+    const char *values[] = {blob[0]};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size[0]};
+    sqlite3_int64 napplied = dbutils_select(db[2], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    sqlite3_int64 nwrites = dbutils_int_select(db[2], "SELECT count(*) FROM site_writes;");
+    if (print_result) printf("first apply: %lld changes, %lld site writes\n", napplied, nwrites);
+    if (napplied != 50 || nwrites != 1) goto finalize;
+    
+    // the same site again (newer values), no writes at all
+    rc = sqlite3_exec(db[0], "UPDATE sites SET v = v + 1000;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    cloudsync_memory_free(blob[0]);
+    blob[0] = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes WHERE db_version > 1;", &blob_size[0], NULL, &rc);
+    if (!blob[0]) goto finalize;
+    values[0] = blob[0];
+    len[0] = blob_size[0];
+    napplied = dbutils_select(db[2], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    nwrites = dbutils_int_select(db[2], "SELECT count(*) FROM site_writes;");
+    if (print_result) printf("second apply: %lld changes, %lld site writes\n", napplied, nwrites);
+    if (napplied != 50 || nwrites != 1) goto finalize;
+    
+    // a new site applied inside a savepoint that is rolled back, then applied again in the same transaction
+    values[0] = blob[1];
+    len[0] = blob_size[1];
+    rc = sqlite3_exec(db[2], "BEGIN; SAVEPOINT s1;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_select(db[2], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER) != 50) goto finalize;
+    rc = sqlite3_exec(db[2], "ROLLBACK TO s1; RELEASE s1;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_select(db[2], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER) != 50) goto finalize;
+    rc = sqlite3_exec(db[2], "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // every winner clock must reference an existing site
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM sites_cloudsync WHERE site_id NOT IN (SELECT rowid FROM cloudsync_site_id);") != 0) goto finalize;
+    if (do_compare_queries(db[1], "SELECT * FROM sites WHERE id LIKE 'b%' ORDER BY id;", db[2], "SELECT * FROM sites WHERE id LIKE 'b%' ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM sites ORDER BY id;", db[2], "SELECT * FROM sites WHERE id LIKE 'a%' ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[2]) printf("do_test_merge_siteid_cache error: %s\n", sqlite3_errmsg(db[2]));
+    for (int i=0; i<2; ++i) if (blob[i]) cloudsync_memory_free(blob[i]);
+    for (int i=0; i<3; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_merge_writer (bool print_result) {
+    // winning columns of the same row are written with a single statement: db[1] uses the direct apply,
+    // db[2] uses INSERT INTO cloudsync_changes (one write for each column) and must end up in the same state
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE writer (id TEXT PRIMARY KEY NOT NULL, c1, c2, c3, c4 TEXT, c5 BLOB);"
+                                 "SELECT cloudsync_init('writer');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        
+        // the receivers count the writes and reject a value of c3
+        if (i == 0) continue;
+        rc = sqlite3_exec(db[i], "CREATE TEMP TABLE writes (op TEXT);"
+                                 "CREATE TEMP TRIGGER writer_insert AFTER INSERT ON writer BEGIN INSERT INTO writes VALUES ('insert'); END;"
+                                 "CREATE TEMP TRIGGER writer_update AFTER UPDATE ON writer BEGIN INSERT INTO writes VALUES ('update'); END;"
+                                 "CREATE TEMP TRIGGER writer_check_insert BEFORE INSERT ON writer WHEN NEW.c3 = 13 BEGIN SELECT RAISE(ABORT, 'c3 rejected'); END;"
+                                 "CREATE TEMP TRIGGER writer_check_update BEFORE UPDATE ON writer WHEN NEW.c3 = 13 BEGIN SELECT RAISE(ABORT, 'c3 rejected'); END;", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // 20 new rows, then an update of 3 columns of each row
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<20) "
+                             "INSERT INTO writer SELECT 'id' || i, i, i * 0.5, i, 'text' || i, randomblob(16) FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    for (int step=0; step<2; ++step) {
+        if (step == 1) {
+            rc = sqlite3_exec(db[0], "UPDATE writer SET c1 = c1 * 100, c3 = c3 + 10, c4 = c4 || '-updated';", NULL, NULL, NULL);
+            if (rc != SQLITE_OK) goto finalize;
+        }
+        
+        const char *sql = (step == 0) ? "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;" :
+                                        "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes WHERE db_version > 1;";
+        blob = dbutils_blob_select(db[0], sql, &blob_size, NULL, &rc);
+        if (!blob) goto finalize;
+        
+        const char *values[] = {blob};
+        int types[] = {SQLITE_BLOB};
+        int len[] = {blob_size};
+        for (int i=1; i<3; ++i) {
+            rc = sqlite3_exec(db[i], "DELETE FROM writes;", NULL, NULL, NULL);
+            if (rc != SQLITE_OK) goto finalize;
+            force_vtab_apply = (i == 2);
+            dbutils_select(db[i], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+            force_vtab_apply = false;
+        }
+        cloudsync_memory_free(blob);
+        blob = NULL;
+        
+        // new rows are a single INSERT and updated rows a single UPDATE, except the row with the rejected value
+        // (id13 at the first step, id3 at the second one) whose columns are written one at a time
+        sqlite3_int64 ninserts = dbutils_int_select(db[1], "SELECT count(*) FROM writes WHERE op='insert';");
+        sqlite3_int64 nupdates = dbutils_int_select(db[1], "SELECT count(*) FROM writes WHERE op='update';");
+        if (print_result) printf("step %d: %lld inserts, %lld updates\n", step, ninserts, nupdates);
+        if (step == 0 && (ninserts != 20 || nupdates != 3)) goto finalize;
+        if (step == 1 && (ninserts != 0 || nupdates != 19 + 2)) goto finalize;
+        
+        if (do_compare_queries(db[1], "SELECT * FROM writer ORDER BY id;", db[2], "SELECT * FROM writer ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+        if (do_compare_queries(db[1], "SELECT pk, col_name, col_version, db_version, site_id FROM writer_cloudsync ORDER BY pk, col_name;", db[2], "SELECT pk, col_name, col_version, db_version, site_id FROM writer_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    }
+    
+    // the rejected column is reported by the apply statistics, the other columns of its row are merged
+    if (dbutils_int_select(db[1], "SELECT failed FROM cloudsync_last_apply_stats() WHERE tbl='writer';") != 1) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM writer WHERE id='id3' AND c3 = 3 AND c1 = 300 AND c4 = 'text3-updated';") != 1) goto finalize;
+    
+    result = true;
+    
+finalize:
+    force_vtab_apply = false;
+    if (rc != SQLITE_OK && db[0]) printf("do_test_merge_writer error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<3; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_merge_value_digest (bool print_result) {
+    // db[1] stores value digests: a tie with an equal value must be resolved without reading the base table,
+    // so a value changed behind the extension is detected only by db[2] (which compares the values)
+    sqlite3 *db[3] = {NULL, NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<3; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE docs (id TEXT PRIMARY KEY NOT NULL, body TEXT, data BLOB, n INTEGER, r REAL);"
+                                 "SELECT cloudsync_init('docs');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // enabled on a table already in the context
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_set_table('docs', 'value_digest', '1');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<20) "
+                             "INSERT INTO docs SELECT 'id' || i, hex(randomblob(2000)), randomblob(4000), i, i * 0.5 FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    for (int i=1; i<3; ++i) {
+        if (dbutils_select(db[i], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER) != 80) goto finalize;
+    }
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM docs_cloudsync WHERE col_name IN ('body', 'data', 'n', 'r') AND length(value_digest) = 32;") != 80) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM pragma_table_info('docs_cloudsync') WHERE name='value_digest';") != 0) goto finalize;
+    
+    // change a value without updating its metadata, then apply the same payload again (all ties)
+    for (int i=1; i<3; ++i) {
+        rc = sqlite3_exec(db[i], "SELECT cloudsync_disable('docs'); UPDATE docs SET body = 'changed' WHERE id = 'id1'; SELECT cloudsync_enable('docs');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        dbutils_select(db[i], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    }
+    sqlite3_int64 nequal = dbutils_int_select(db[1], "SELECT equal FROM cloudsync_last_apply_stats() WHERE tbl='docs';");
+    sqlite3_int64 nlost = dbutils_int_select(db[2], "SELECT lost FROM cloudsync_last_apply_stats() WHERE tbl='docs';");
+    if (print_result) printf("digest: %lld equal, no digest: %lld lost\n", nequal, nlost);
+    if (nequal != 80 || nlost != 1) goto finalize;
+    
+    // a tie with a different value still compares the values
+    rc = sqlite3_exec(db[0], "UPDATE docs SET body = 'aaa' WHERE id = 'id2';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    cloudsync_memory_free(blob);
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes WHERE db_version > 1;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    values[0] = blob;
+    len[0] = blob_size;
+    for (int i=1; i<3; ++i) {
+        rc = sqlite3_exec(db[i], "UPDATE docs SET body = 'zzz' WHERE id = 'id2';", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+        dbutils_select(db[i], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    }
+    
+    // a local write clears the digest of the column
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM docs_cloudsync WHERE col_name = 'body' AND value_digest IS NULL;") != 1) goto finalize;
+    if (do_compare_queries(db[1], "SELECT * FROM docs ORDER BY id;", db[2], "SELECT * FROM docs ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[1], "SELECT pk, col_name, col_version, db_version, site_id FROM docs_cloudsync ORDER BY pk, col_name;", db[2], "SELECT pk, col_name, col_version, db_version, site_id FROM docs_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    
+    // disabling drops the column, enabling again starts without digests
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_set_table('docs', 'value_digest', '0');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM pragma_table_info('docs_cloudsync') WHERE name='value_digest';") != 0) goto finalize;
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_set_table('docs', 'value_digest', '1');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM docs_cloudsync WHERE value_digest IS NOT NULL;") != 0) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[1]) printf("do_test_merge_value_digest error: %s\n", sqlite3_errmsg(db[1]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<3; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_gos_sentinel_rows (bool print_result) {
+    // grow-only set rows are tracked by a single sentinel: by default it is exported as one change for each column
+    // (db[1]), with the v2 payload format it carries all the values: db[2] applies the payload of db[0] directly,
+    // db[3] receives the changes of db[2] through INSERT INTO cloudsync_changes
+    sqlite3 *db[4] = {NULL, NULL, NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<4; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE events (id TEXT PRIMARY KEY NOT NULL, kind TEXT, payload BLOB, n REAL, note);"
+                                 "SELECT cloudsync_init('events', 'gos');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<100) "
+                             "INSERT INTO events SELECT 'ev' || i, 'kind' || (i % 7), randomblob(32), i * 0.25, CASE WHEN i % 3 = 0 THEN NULL ELSE i END FROM c;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // one meta row for each row (not one for each column)
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM events_cloudsync;") != 100) goto finalize;
+    
+    // peers that do not know the v2 format receive one change for each column, each one with its own seq
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes;") != 400) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM cloudsync_changes WHERE col_name = '" CLOUDSYNC_TOMBSTONE_VALUE "';") != 0) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(DISTINCT db_version || '.' || seq) FROM cloudsync_changes;") != 400) goto finalize;
+    
+    const char *encode_sql = "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;";
+    blob = dbutils_blob_select(db[0], encode_sql, &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    if (dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER) != 400) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM events ORDER BY id;", db[1], "SELECT * FROM events ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    // the v2 opt-in exports the sentinel with the whole row
+    rc = sqlite3_exec(db[0], "SELECT cloudsync_set('payload_version', '2');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    cloudsync_memory_free(blob);
+    blob = dbutils_blob_select(db[0], encode_sql, &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    values[0] = blob;
+    len[0] = blob_size;
+    
+    if (dbutils_select(db[2], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER) != 100) goto finalize;
+    if (dbutils_int_select(db[2], "SELECT count(*) FROM events_cloudsync;") != 100) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM events ORDER BY id;", db[2], "SELECT * FROM events ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    // the rows are already there, nothing is written again
+    dbutils_select(db[2], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    sqlite3_int64 nequal = dbutils_int_select(db[2], "SELECT equal FROM cloudsync_last_apply_stats() WHERE tbl='events';");
+    sqlite3_int64 napplied = dbutils_int_select(db[2], "SELECT applied FROM cloudsync_last_apply_stats() WHERE tbl='events';");
+    if (print_result) printf("second apply: %lld equal, %lld applied\n", nequal, napplied);
+    if (nequal != 100 || napplied != 0) goto finalize;
+    
+    // the changes of db[0] are forwarded by db[2] with their original site_id
+    rc = sqlite3_exec(db[2], "SELECT cloudsync_set('payload_version', '2');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_exec(db[3], "SELECT cloudsync_set('payload_version', '2');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    cloudsync_memory_free(blob);
+    blob = dbutils_blob_select(db[2], encode_sql, &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    values[0] = blob;
+    len[0] = blob_size;
+    force_vtab_apply = true;
+    sqlite3_int64 nchanges = dbutils_select(db[3], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    force_vtab_apply = false;
+    if (nchanges != 100) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM events ORDER BY id;", db[3], "SELECT * FROM events ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT pk, col_name, col_value, col_version, site_id FROM cloudsync_changes ORDER BY pk;", db[3], "SELECT pk, col_name, col_value, col_version, site_id FROM cloudsync_changes ORDER BY pk;", -1, -1, print_result) == false) goto finalize;
+    
+    // updates are still rejected
+    if (sqlite3_exec(db[3], "UPDATE events SET kind = 'changed';", NULL, NULL, NULL) == SQLITE_OK) goto finalize;
+    
+    result = true;
+    
+finalize:
+    force_vtab_apply = false;
+    if (rc != SQLITE_OK && db[0]) printf("do_test_gos_sentinel_rows error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<4; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_capture_preupdate_hook (bool print_result) {
+    // the same writes on db[0] (captured by the triggers) and on db[1] (captured by the pre-update hook) must produce the same metadata
+    sqlite3 *db[2] = {NULL, NULL};
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        // primary keys are not in cid order
+        rc = sqlite3_exec(db[i], "CREATE TABLE items (name TEXT, id2 INTEGER NOT NULL, qty INTEGER, id1 TEXT NOT NULL, price REAL, PRIMARY KEY (id1, id2));"
+                                 "SELECT cloudsync_init('items');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // switching an augmented table to the hook drops its AFTER INSERT and UPDATE triggers
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_set_table('items', 'capture', 'hook');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM sqlite_master WHERE type='trigger' AND name LIKE 'cloudsync_after_%';") != 3) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM sqlite_master WHERE type='trigger' AND name LIKE 'cloudsync_after_%';") != 1) goto finalize;
+    
+    const char *sql = "WITH RECURSIVE c(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM c WHERE i<50) "
+                      "INSERT INTO items SELECT 'name' || i, i % 5, i, 'id' || (i / 5), i * 1.5 FROM c;"
+                      "UPDATE items SET qty = qty + 100 WHERE id2 = 1;"
+                      "UPDATE items SET name = 'same', price = price WHERE id1 = 'id3';"
+                      "UPDATE items SET qty = qty WHERE id1 = 'id4';"
+                      "UPDATE items SET id1 = 'moved' WHERE id1 = 'id5' AND id2 = 2;"
+                      "BEGIN; DELETE FROM items WHERE id2 = 3; INSERT INTO items VALUES ('back', 3, 0, 'id7', NULL); COMMIT;"
+                      "DELETE FROM items WHERE id1 = 'id8';"
+                      // a REPLACE of an existing row is an update, unless recursive_triggers also records the delete
+                      "INSERT OR REPLACE INTO items VALUES ('replaced', 4, 7, 'id6', 1.0);"
+                      "UPDATE OR REPLACE items SET id2 = 1 WHERE id1 = 'id6' AND id2 = 0;"
+                      "PRAGMA recursive_triggers = ON; REPLACE INTO items VALUES ('recursive', 2, 8, 'id7', 2.0); PRAGMA recursive_triggers = OFF;";
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_exec(db[i], sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    if (do_compare_queries(db[0], "SELECT * FROM items ORDER BY id1, id2;", db[1], "SELECT * FROM items ORDER BY id1, id2;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT pk, col_name, col_version, db_version, seq FROM items_cloudsync ORDER BY pk, col_name;", db[1], "SELECT pk, col_name, col_version, db_version, seq FROM items_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT tbl, pk, col_name, col_value, col_version, db_version, cl, seq FROM cloudsync_changes ORDER BY db_version, seq;", db[1], "SELECT tbl, pk, col_name, col_value, col_version, db_version, cl, seq FROM cloudsync_changes ORDER BY db_version, seq;", -1, -1, print_result) == false) goto finalize;
+    
+    // a disabled table is not captured
+    sqlite3_int64 db_version = dbutils_int_select(db[1], "SELECT max(db_version) FROM items_cloudsync;");
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_disable('items'); UPDATE items SET qty = -1; SELECT cloudsync_enable('items');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT max(db_version) FROM items_cloudsync;") != db_version) goto finalize;
+    
+    // back to the triggers
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_set_table('items', 'capture', 'trigger');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM sqlite_master WHERE type='trigger' AND name LIKE 'cloudsync_after_%';") != 3) goto finalize;
+    rc = sqlite3_exec(db[1], "UPDATE items SET qty = -2 WHERE id2 = 4;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM items_cloudsync WHERE col_name = 'qty' AND db_version > (SELECT max(db_version) - 1 FROM items_cloudsync);") != dbutils_int_select(db[1], "SELECT count(*) FROM items WHERE id2 = 4;")) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_capture_preupdate_hook error: %s %s\n", sqlite3_errmsg(db[0]), sqlite3_errmsg(db[1]));
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+void do_test_app_preupdate_hook (void *ctx, sqlite3 *db, int op, const char *zdb, const char *zname, sqlite3_int64 key1, sqlite3_int64 key2) {
+    int *counter = (int *)ctx;
+    *counter += 1;
+}
+
+bool do_test_capture_preupdate_hook_owner (bool print_result) {
+    // the pre-update hook of the application is kept until a table opts in to the hook capture,
+    // a hook that replaces ours afterwards makes the commit fail (the changes would have no metadata)
+    sqlite3 *db = NULL;
+    bool result = false;
+    int counter = 0;
+    
+    int rc = sqlite3_open(":memory:", &db);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_preupdate_hook(db, do_test_app_preupdate_hook, &counter);
+    sqlite3_cloudsync_init(db, NULL, NULL);
+    
+    rc = sqlite3_exec(db, "CREATE TABLE items (id TEXT PRIMARY KEY NOT NULL, qty INTEGER);"
+                          "SELECT cloudsync_init('items');"
+                          "INSERT INTO items VALUES ('a', 1);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (counter == 0) goto finalize;
+    
+    rc = sqlite3_exec(db, "SELECT cloudsync_set_table('items', 'capture', 'hook');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    counter = 0;
+    rc = sqlite3_exec(db, "INSERT INTO items VALUES ('b', 2);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (counter != 0) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM items_cloudsync WHERE pk = cloudsync_pk_encode('b');") == 0) goto finalize;
+    
+    // the write without metadata is rolled back, then the hook of the extension is in place again
+    sqlite3_preupdate_hook(db, do_test_app_preupdate_hook, &counter);
+    rc = sqlite3_exec(db, "INSERT INTO items VALUES ('c', 3);", NULL, NULL, NULL);
+    if (rc != SQLITE_CONSTRAINT) goto finalize;
+    if (counter == 0) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM items WHERE id = 'c';") != 0) goto finalize;
+    
+    rc = sqlite3_exec(db, "INSERT INTO items VALUES ('c', 3);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM items_cloudsync WHERE pk = cloudsync_pk_encode('c');") == 0) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db) printf("do_test_capture_preupdate_hook_owner error: %s\n", sqlite3_errmsg(db));
+    if (db) close_db(db);
+    return result;
+}
+
+bool do_test_update_row_trigger (bool print_result) {
+    // tables whose columns fit in the arguments of a function are captured by cloudsync_update_row,
+    // wider tables keep the cloudsync_update aggregate
+    sqlite3 *db = NULL;
+    char *sql = NULL;
+    bool result = false;
+    
+    int rc = sqlite3_open(":memory:", &db);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_cloudsync_init(db, NULL, NULL);
+    
+    rc = sqlite3_exec(db, "CREATE TABLE narrow (a TEXT, id TEXT PRIMARY KEY NOT NULL, b TEXT, c INTEGER);"
+                          "SELECT cloudsync_init('narrow');"
+                          "INSERT INTO narrow VALUES ('a1', 'r1', 'b1', 1), ('a2', 'r2', 'b2', 2);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM sqlite_master WHERE name='cloudsync_after_update_narrow' AND sql LIKE '%cloudsync_update_row(%';") != 1) goto finalize;
+    
+    // 70 columns need 141 arguments
+    sql = sqlite3_mprintf("CREATE TABLE wide (id TEXT PRIMARY KEY NOT NULL");
+    for (int i=0; i<70 && sql; ++i) {
+        char *tmp = sqlite3_mprintf("%s, c%d TEXT", sql, i);
+        sqlite3_free(sql);
+        sql = tmp;
+    }
+    char *tmp = (sql) ? sqlite3_mprintf("%s); SELECT cloudsync_init('wide'); INSERT INTO wide (id, c0, c69) VALUES ('w1', 'x', 'y');", sql) : NULL;
+    sqlite3_free(sql);
+    sql = tmp;
+    if (!sql) goto finalize;
+    rc = sqlite3_exec(db, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM sqlite_master WHERE name='cloudsync_after_update_wide' AND sql LIKE '%cloudsync_update(%';") != 1) goto finalize;
+    
+    // only the changed columns are marked, a pk change moves the metadata
+    rc = sqlite3_exec(db, "UPDATE narrow SET b = 'changed', c = c WHERE id = 'r1';"
+                          "UPDATE narrow SET id = 'r3' WHERE id = 'r2';"
+                          "UPDATE wide SET c69 = 'changed';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    char *versions = dbutils_text_select(db, "SELECT group_concat(col_name || col_version, ',') FROM (SELECT col_name, col_version FROM narrow_cloudsync WHERE pk = cloudsync_pk_encode('r1') ORDER BY col_name);");
+    bool ok = (versions && strcmp(versions, "a1,b2,c1") == 0);
+    if (print_result) printf("narrow r1: %s\n", versions);
+    if (versions) cloudsync_memory_free(versions);
+    if (!ok) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM narrow_cloudsync WHERE pk = cloudsync_pk_encode('r2') AND col_name <> '__[RIP]__';") != 0) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM narrow_cloudsync WHERE pk = cloudsync_pk_encode('r3');") != 4) goto finalize;
+    if (dbutils_int_select(db, "SELECT col_version FROM wide_cloudsync WHERE col_name = 'c69';") != 2) goto finalize;
+    if (dbutils_int_select(db, "SELECT col_version FROM wide_cloudsync WHERE col_name = 'c0';") != 1) goto finalize;
+    
+    // a trigger created by a previous version is replaced
+    rc = sqlite3_exec(db, "DROP TRIGGER cloudsync_after_update_narrow;"
+                          "CREATE TRIGGER cloudsync_after_update_narrow AFTER UPDATE ON narrow FOR EACH ROW WHEN cloudsync_is_sync('narrow') = 0 BEGIN "
+                          "SELECT cloudsync_update(table_name, new_value, old_value) FROM (WITH column_data(table_name, new_value, old_value) AS "
+                          "(VALUES ('narrow', NEW.id, OLD.id), ('narrow', NEW.a, OLD.a), ('narrow', NEW.b, OLD.b), ('narrow', NEW.c, OLD.c)) "
+                          "SELECT table_name, new_value, old_value FROM column_data); END;"
+                          "SELECT cloudsync_init('narrow');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT count(*) FROM sqlite_master WHERE name='cloudsync_after_update_narrow' AND sql LIKE '%cloudsync_update_row(%';") != 1) goto finalize;
+    rc = sqlite3_exec(db, "UPDATE narrow SET a = 'again' WHERE id = 'r1';", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    if (dbutils_int_select(db, "SELECT col_version FROM narrow_cloudsync WHERE pk = cloudsync_pk_encode('r1') AND col_name = 'a';") != 2) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK) printf("do_test_update_row_trigger error: %s\n", sqlite3_errmsg(db));
+    if (sql) sqlite3_free(sql);
+    if (db) close_db(db);
+    return result;
+}
+
+bool do_test_txn_column_versions (bool print_result) {
+    // every write of a column increments its col_version, also when a transaction writes it many times (as on older peers)
+    sqlite3 *db[2] = {NULL, NULL};
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE docs (id TEXT PRIMARY KEY NOT NULL, a TEXT, b TEXT);"
+                                 "SELECT cloudsync_init('docs');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    rc = sqlite3_exec(db[0], "INSERT INTO docs VALUES ('r1', 'a0', 'b0'), ('r2', 'a0', 'b0');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rc = sqlite3_exec(db[0], "BEGIN;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    for (int i=0; i<50; ++i) {
+        char sql[256];
+        snprintf(sql, sizeof(sql), "UPDATE docs SET a = 'a%d' WHERE id = 'r1';", i + 1);
+        rc = sqlite3_exec(db[0], sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    rc = sqlite3_exec(db[0], "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    sqlite3_int64 db_version = dbutils_int_select(db[0], "SELECT cloudsync_db_version();");
+    if (dbutils_int_select(db[0], "SELECT col_version FROM docs_cloudsync WHERE pk = cloudsync_pk_encode('r1') AND col_name = 'a';") != 51) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT col_version FROM docs_cloudsync WHERE pk = cloudsync_pk_encode('r1') AND col_name = 'b';") != 1) goto finalize;
+    
+    // the write of b undone by the ROLLBACK TO is not counted, the delete of r1 restarts the clocks of its columns
+    rc = sqlite3_exec(db[0], "BEGIN;"
+                             "SAVEPOINT s1; UPDATE docs SET b = 'b1' WHERE id = 'r2'; ROLLBACK TO s1; RELEASE s1;"
+                             "UPDATE docs SET b = 'b2' WHERE id = 'r2';"
+                             "UPDATE docs SET a = 'a1' WHERE id = 'r1';"
+                             "DELETE FROM docs WHERE id = 'r1';"
+                             "INSERT INTO docs VALUES ('r1', 'again', 'b0');"
+                             "UPDATE docs SET a = 'again2' WHERE id = 'r1';"
+                             "COMMIT;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    if (print_result) dbutils_debug_stmt(db[0], true);
+    if (dbutils_int_select(db[0], "SELECT db_version FROM docs_cloudsync WHERE pk = cloudsync_pk_encode('r2') AND col_name = 'b';") != db_version + 1) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT db_version FROM docs_cloudsync WHERE pk = cloudsync_pk_encode('r1') AND col_name = 'a';") != db_version + 1) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT col_version FROM docs_cloudsync WHERE pk = cloudsync_pk_encode('r2') AND col_name = 'b';") != 2) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT col_version FROM docs_cloudsync WHERE pk = cloudsync_pk_encode('r1') AND col_name = 'a';") != 2) goto finalize;
+    if (dbutils_int_select(db[0], "SELECT count(*) FROM docs_cloudsync WHERE pk = cloudsync_pk_encode('r1');") != 3) goto finalize;
+    
+    // the other database receives the final values
+    if (do_merge_using_payload(db[0], db[1], false, true) == false) goto finalize;
+    if (do_compare_queries(db[0], "SELECT * FROM docs ORDER BY id;", db[1], "SELECT * FROM docs ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_txn_column_versions error: %s\n", sqlite3_errmsg(db[0]));
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_apply_atomic_change (bool print_result) {
+    sqlite3 *db[2] = {NULL, NULL};
+    char *blob = NULL;
+    int blob_size = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<2; ++i) {
+        rc = sqlite3_open(":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE at1 (id TEXT PRIMARY KEY NOT NULL, v TEXT); SELECT cloudsync_init('at1');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // the target writes the column values but refuses their clocks, so each column change fails after its first write
+    rc = sqlite3_exec(db[1], "CREATE TRIGGER at1_reject BEFORE INSERT ON at1_cloudsync WHEN NEW.col_name = 'v' BEGIN SELECT RAISE(ABORT, 'at1 clock rejected'); END;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<5) INSERT INTO at1 (id, v) SELECT 'k' || i, 'value' || i FROM n;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM cloudsync_changes;", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    
+    // the failed column changes must not leave a row without its clock
+    dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM at1;") != 0) goto finalize;
+    if (dbutils_int_select(db[1], "SELECT count(*) FROM cloudsync_last_apply_stats() WHERE tbl IS NULL AND errors LIKE '%at1 clock rejected%';") != 1) goto finalize;
+    
+    // the same payload is applied once the clocks are accepted
+    rc = sqlite3_exec(db[1], "DROP TRIGGER at1_reject;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    dbutils_select(db[1], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+    if (!do_compare_queries(db[0], "SELECT * FROM at1 ORDER BY id;", db[1], "SELECT * FROM at1 ORDER BY id;", -1, -1, print_result)) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_atomic_change error: %s\n", sqlite3_errmsg(db[0]));
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<2; ++i) if (db[i]) close_db(db[i]);
+    return result;
+}
+
+bool do_test_payload_apply_parallel (bool print_result) {
+    // db[1] (database file) resolves the conflicts in parallel, db[2] applies the same payloads serially
+    // the payload mixes the changes of db[0] and db[3], so the same columns of a row appear more than once
+    const char *paths[] = {"cloudsync_parallel_test1.sqlite", "cloudsync_parallel_test2.sqlite"};
+    sqlite3 *db[4] = {NULL, NULL, NULL, NULL};
+    sqlite3_stmt *select_stmt = NULL;
+    sqlite3_stmt *insert_stmt = NULL;
+    char *blob = NULL;
+    int blob_size = 0;
+    int nbegin = 0;
+    bool result = false;
+    int rc = SQLITE_OK;
+    
+    for (int i=0; i<4; ++i) {
+        if (i == 1 || i == 2) file_delete_internal(paths[i-1]);
+        rc = sqlite3_open((i == 1 || i == 2) ? paths[i-1] : ":memory:", &db[i]);
+        if (rc != SQLITE_OK) goto finalize;
+        sqlite3_cloudsync_init(db[i], NULL, NULL);
+        
+        rc = sqlite3_exec(db[i], "CREATE TABLE par (id TEXT PRIMARY KEY NOT NULL, a TEXT, b INTEGER, c BLOB);"
+                                 "SELECT cloudsync_init('par');", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    rc = sqlite3_exec(db[1], "SELECT cloudsync_set('payload_apply_parallel', '1'); SELECT cloudsync_set('payload_threads', '4');", NULL, NULL, NULL);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(db[2], "SELECT cloudsync_set('payload_apply_locality', '1');", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    sqlite3_trace_v2(db[1], SQLITE_TRACE_STMT, do_test_count_begin_immediate, &nbegin);
+    
+    rc = sqlite3_exec(db[0], "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<2000) "
+                             "INSERT INTO par (id, a, b, c) SELECT 'k' || i, 'a' || i, i, randomblob(4) FROM n;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // every database starts from the same rows
+    for (int i=1; i<4; ++i) {
+        if (do_merge_using_payload(db[0], db[i], false, true) == false) goto finalize;
+    }
+    
+    // concurrent changes (equal col_versions with different values, deletes and resurrections)
+    rc = sqlite3_exec(db[0], "UPDATE par SET a = 'zero' || b WHERE b % 2 = 0; UPDATE par SET b = b + 10000 WHERE b % 3 = 0;"
+                             "DELETE FROM par WHERE b % 17 = 0;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    rc = sqlite3_exec(db[3], "UPDATE par SET a = 'three' || b WHERE b % 4 = 0; UPDATE par SET c = NULL WHERE b % 5 = 0;"
+                             "DELETE FROM par WHERE b % 7 = 0;"
+                             "WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i+1 FROM n WHERE i<100) "
+                             "INSERT INTO par (id, a, b) SELECT 'k' || (i * 7), 'back', i FROM n;", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    
+    // the same local changes in both the target databases
+    for (int i=1; i<3; ++i) {
+        rc = sqlite3_exec(db[i], "UPDATE par SET a = 'local' || b WHERE b % 6 = 0; DELETE FROM par WHERE b % 11 = 0;", NULL, NULL, NULL);
+        if (rc != SQLITE_OK) goto finalize;
+    }
+    
+    // copy the changes of db[3] into db[0] and encode them together with the changes of db[0]
+    rc = sqlite3_exec(db[0], "CREATE TEMP TABLE remote (tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq);", NULL, NULL, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_prepare_v2(db[3], "SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM cloudsync_changes;", -1, &select_stmt, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    rc = sqlite3_prepare_v2(db[0], "INSERT INTO temp.remote VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);", -1, &insert_stmt, NULL);
+    if (rc != SQLITE_OK) goto finalize;
+    while ((rc = sqlite3_step(select_stmt)) == SQLITE_ROW) {
+        for (int i=0; i<9; ++i) sqlite3_bind_value(insert_stmt, i+1, sqlite3_column_value(select_stmt, i));
+        rc = sqlite3_step(insert_stmt);
+        sqlite3_reset(insert_stmt);
+        if (rc != SQLITE_DONE) goto finalize;
+    }
+    if (rc != SQLITE_DONE) goto finalize;
+    rc = SQLITE_OK;
+    
+    blob = dbutils_blob_select(db[0], "SELECT cloudsync_payload_encode(tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq) FROM "
+                                      "(SELECT tbl, pk, col_name, col_value, col_version, db_version, site_id, cl, seq FROM cloudsync_changes UNION ALL SELECT * FROM temp.remote);", &blob_size, NULL, &rc);
+    if (!blob) goto finalize;
+    
+    const char *values[] = {blob};
+    int types[] = {SQLITE_BLOB};
+    int len[] = {blob_size};
+    for (int i=1; i<3; ++i) {
+        sqlite3_int64 napplied = dbutils_select(db[i], "SELECT cloudsync_payload_decode(?);", values, types, len, 1, SQLITE_INTEGER);
+        if (print_result) printf("parallel %d: %lld rows\n", i, napplied);
+        if (napplied < 1024) goto finalize;
+    }
+    
+    // the initial rows and the mixed payload
+    if (print_result) printf("parallel: %d write transactions\n", nbegin);
+    if (nbegin != 2) goto finalize;
+    
+    if (do_compare_queries(db[1], "SELECT * FROM par ORDER BY id;", db[2], "SELECT * FROM par ORDER BY id;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[1], "SELECT * FROM par_cloudsync ORDER BY pk, col_name;", db[2], "SELECT * FROM par_cloudsync ORDER BY pk, col_name;", -1, -1, print_result) == false) goto finalize;
+    if (do_compare_queries(db[1], "SELECT value FROM cloudsync_settings WHERE key='check_dbversion' OR key='check_seq' ORDER BY key;", db[2], "SELECT value FROM cloudsync_settings WHERE key='check_dbversion' OR key='check_seq' ORDER BY key;", -1, -1, print_result) == false) goto finalize;
+    if (sqlite3_get_autocommit(db[1]) == 0) goto finalize;
+    
+    result = true;
+    
+finalize:
+    if (rc != SQLITE_OK && db[0]) printf("do_test_payload_apply_parallel error: %s\n", sqlite3_errmsg(db[0]));
+    if (select_stmt) sqlite3_finalize(select_stmt);
+    if (insert_stmt) sqlite3_finalize(insert_stmt);
+    if (blob) cloudsync_memory_free(blob);
+    for (int i=0; i<4; ++i) if (db[i]) close_db(db[i]);
+    for (int i=0; i<2; ++i) file_delete_internal(paths[i]);
+    return result;
+}
+
 // MARK: -
 
 bool do_test_fill_initial_data(int nclients, bool print_result, bool cleanup_databases) {
@@ -6108,6 +8349,40 @@ int main(int argc, const char * argv[]) {
     result += test_report("Test GrowOnlySet:", do_test_gos(6, print_result, cleanup_databases));
     result += test_report("Test Network Enc/Dec:", do_test_network_encode_decode(2, print_result, cleanup_databases, false));
     result += test_report("Test Network Enc/Dec 2:", do_test_network_encode_decode(2, print_result, cleanup_databases, true));
+    result += test_report("Test Payload Chunks:", do_test_payload_chunks(4096, print_result, cleanup_databases));
+    result += test_report("Test Payload Chunks Boundaries:", do_test_payload_chunks_boundaries(print_result));
+    result += test_report("Test Payload Versions:", do_test_payload_versions(print_result, cleanup_databases));
+    result += test_report("Test Payload Codecs:", do_test_payload_codecs(print_result));
+    result += test_report("Test Payload Blocks:", do_test_payload_blocks(4, print_result));
+    result += test_report("Test Payload Outbox:", do_test_payload_outbox(print_result));
+    double rows_per_sec[2] = {0};
+    result += test_report("Test Payload Apply Locality:", do_test_payload_apply_locality(print_result));
+    result += test_report("Test Payload Merge Clock:", do_test_payload_merge_clock(print_result));
+    result += test_report("Test Payload Apply Batch:", do_test_payload_apply_batch(print_result));
+    result += test_report("Test Payload Load Pipeline:", do_test_payload_load_pipeline(print_result));
+    result += test_report("Test Payload Inspection:", do_test_payload_inspection(print_result));
+    result += test_report("Test Payload Apply Stats:", do_test_payload_apply_stats(print_result));
+    result += test_report("Test Payload Apply Checkpoint:", do_test_payload_apply_checkpoint(print_result));
+    result += test_report("Test Payload Apply Step:", do_test_payload_apply_step(print_result));
+    result += test_report("Test Merge Wide Table:", do_test_merge_wide_table(print_result));
+    result += test_report("Test Merge Site ID Cache:", do_test_merge_siteid_cache(print_result));
+    result += test_report("Test Merge Writer:", do_test_merge_writer(print_result));
+    result += test_report("Test Merge Value Digest:", do_test_merge_value_digest(print_result));
+    result += test_report("Test GOS Sentinel Rows:", do_test_gos_sentinel_rows(print_result));
+    result += test_report("Test Capture Preupdate Hook:", do_test_capture_preupdate_hook(print_result));
+    result += test_report("Test Capture Preupdate Hook Owner:", do_test_capture_preupdate_hook_owner(print_result));
+    result += test_report("Test Update Row Trigger:", do_test_update_row_trigger(print_result));
+    result += test_report("Test Transaction Column Versions:", do_test_txn_column_versions(print_result));
+    result += test_report("Test Payload Apply Locality FK:", do_test_payload_apply_locality_fk(print_result));
+    result += test_report("Test Payload Apply Atomic Change:", do_test_payload_apply_atomic_change(print_result));
+    result += test_report("Test Payload Apply Parallel:", do_test_payload_apply_parallel(print_result));
+    result += test_report("Test Payload Stream:", do_test_payload_stream(1, print_result));
+    result += test_report("Test Payload Stream (threads):", do_test_payload_stream(4, print_result));
+    double lookups_per_sec[3] = {0};
+    result += test_report("Test Table Lookup Bench:", do_test_table_lookup_bench(lookups_per_sec, print_result));
+    printf("    table lookup: %.0f/sec (1 table), %.0f/sec (50 tables), %.0f/sec (500 tables)\n", lookups_per_sec[0], lookups_per_sec[1], lookups_per_sec[2]);
+    result += test_report("Test Payload Apply Bench:", do_test_payload_apply_bench(20000, rows_per_sec, print_result));
+    printf("    vtab apply: %.0f rows/sec, direct apply: %.0f rows/sec\n", rows_per_sec[0], rows_per_sec[1]);
     result += test_report("Test Fill Initial Data:", do_test_fill_initial_data(3, print_result, cleanup_databases));
     result += test_report("Test Alter Table 1:", do_test_alter(3, 1, print_result, cleanup_databases));
     result += test_report("Test Alter Table 2:", do_test_alter(3, 2, print_result, cleanup_databases));